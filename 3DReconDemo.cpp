@@ -118,7 +118,7 @@ int main(int argc, char **argv)
 			saveFrame->frameWrite(imRGB, imDepth, transform, frame->frameId_);
 		});
 	
-		slam.AddKeyFrameAvailableHandler(saveFrameHandler, "saveframe");
+		slam.AddKeyFrameAvailableHandler(saveFrameHandler, "saveframe", DispatchPolicy::MustDeliver);
 	}
 
 	cv::namedWindow("image");
@@ -174,6 +174,14 @@ int main(int argc, char **argv)
 	slam.getActiveFrames(active_frames);
 	saveFrame->writeActiveFrames(active_frames);
 
+	SegmentedMesh::IntegrationStats integration = mesh->GetIntegrationStats();
+	std::cout << "integrated " << integration.integrated << " of " << integration.offered << " frames ("
+		<< integration.skipped << " skipped by the stride, " << integration.queue.dropped << " dropped), "
+		<< integration.meanIntegrationMs << " ms per frame" << std::endl;
+	MeshBlockCache::Stats blocks = mesh->GetBlockCacheStats();
+	std::cout << blocks.resident << " block meshes in memory (" << blocks.residentBytes / (1024 * 1024) << " MB), "
+		<< blocks.cached << " in the disk cache (" << blocks.spills << " spills, " << blocks.loads << " loads)" << std::endl;
+
 	mesh->WriteMeshes();
 
 	printf("\nTerminate...\n");
@@ -0,0 +1,154 @@
+#include "stdafx.h"
+#include "CompactKeyframeFeatures.h"
+
+#include <cstring>
+
+namespace ark {
+
+    namespace {
+        /** Fixed point scale of keypoint position and size */
+        const float kPixelScale = 8.0f;
+        /** Fixed point scale of keypoint angle */
+        const float kAngleScale = 100.0f;
+        const uint16_t kNoAngle = 0xFFFF;
+
+        uint32_t align8(uint32_t offset) {
+            return (offset + 7) & ~(uint32_t)7;
+        }
+
+        uint16_t quantize(float value, float scale) {
+            const float q = std::round(value * scale);
+            return (uint16_t)std::min(std::max(q, 0.0f), 65535.0f);
+        }
+    }
+
+    CompactKeyframeFeatures::CompactKeyframeFeatures() {
+    }
+
+    void CompactKeyframeFeatures::pack(const std::vector<std::vector<cv::KeyPoint>> & keypoints,
+                                       const std::vector<cv::Mat> & descriptors,
+                                       const std::vector<std::vector<cv::Vec3f>> & points) {
+        const size_t numCameras = std::max(keypoints.size(), descriptors.size());
+        if (numCameras == 0) {
+            clear();
+            return;
+        }
+
+        // lay out the section table, then each camera's arrays
+        std::vector<Section> sections(numCameras);
+        uint32_t offset = align8(sizeof(uint32_t) + numCameras * sizeof(Section));
+        for (size_t c = 0; c < numCameras; c++) {
+            Section & s = sections[c];
+            const bool hasDescriptors = c < descriptors.size() && !descriptors[c].empty();
+            s.numKeypoints = (uint32_t)(c < keypoints.size() ? keypoints[c].size() : descriptors[c].rows);
+            s.descriptorBytes = hasDescriptors ? (uint32_t)(descriptors[c].cols * descriptors[c].elemSize()) : 0;
+            s.descriptorOffset = offset;
+            offset = align8(offset + s.numKeypoints * s.descriptorBytes);
+            s.pointOffset = offset;
+            offset = align8(offset + s.numKeypoints * 3 * sizeof(float));
+            s.keypointOffset = offset;
+            offset = align8(offset + s.numKeypoints * 4 * sizeof(uint16_t));
+            s.octaveOffset = offset;
+            offset = align8(offset + s.numKeypoints * sizeof(int8_t));
+        }
+
+        cv::Mat storage(1, (int)offset, CV_8U);
+        uint8_t * data = storage.data;
+        const uint32_t count = (uint32_t)numCameras;
+        std::memcpy(data, &count, sizeof(count));
+        std::memcpy(data + sizeof(count), sections.data(), numCameras * sizeof(Section));
+
+        for (size_t c = 0; c < numCameras; c++) {
+            const Section & s = sections[c];
+            const size_t n = s.numKeypoints;
+            for (size_t i = 0; s.descriptorBytes > 0 && i < n; i++) {
+                uint8_t * descriptor = data + s.descriptorOffset + i * s.descriptorBytes;
+                if ((int)i < descriptors[c].rows)
+                    std::memcpy(descriptor, descriptors[c].ptr((int)i), s.descriptorBytes);
+                else
+                    std::memset(descriptor, 0, s.descriptorBytes);
+            }
+
+            float * point = reinterpret_cast<float *>(data + s.pointOffset);
+            for (size_t i = 0; i < n; i++, point += 3) {
+                if (c < points.size() && i < points[c].size() && points[c][i][2] > 0) {
+                    point[0] = points[c][i][0];
+                    point[1] = points[c][i][1];
+                    point[2] = points[c][i][2];
+                } else {
+                    point[0] = point[1] = point[2] = 0.0f;
+                }
+            }
+
+            uint16_t * kp = reinterpret_cast<uint16_t *>(data + s.keypointOffset);
+            int8_t * octave = reinterpret_cast<int8_t *>(data + s.octaveOffset);
+            for (size_t i = 0; i < n; i++, kp += 4) {
+                if (c >= keypoints.size()) {
+                    kp[0] = kp[1] = kp[2] = 0;
+                    kp[3] = kNoAngle;
+                    octave[i] = 0;
+                    continue;
+                }
+                const cv::KeyPoint & k = keypoints[c][i];
+                kp[0] = quantize(k.pt.x, kPixelScale);
+                kp[1] = quantize(k.pt.y, kPixelScale);
+                kp[2] = quantize(k.size, kPixelScale);
+                kp[3] = k.angle < 0 ? kNoAngle : (uint16_t)(quantize(k.angle, kAngleScale) % 36000);
+                octave[i] = (int8_t)std::min(std::max(k.octave, -128), 127);
+            }
+        }
+        storage_ = storage;
+    }
+
+    void CompactKeyframeFeatures::clear() {
+        storage_.release();
+    }
+
+    int CompactKeyframeFeatures::numCameras() const {
+        if (storage_.empty())
+            return 0;
+        uint32_t count;
+        std::memcpy(&count, storage_.data, sizeof(count));
+        return (int)count;
+    }
+
+    const CompactKeyframeFeatures::Section & CompactKeyframeFeatures::section(int cameraIdx) const {
+        return at<Section>(sizeof(uint32_t))[cameraIdx];
+    }
+
+    int CompactKeyframeFeatures::numKeypoints(int cameraIdx) const {
+        if (cameraIdx < 0 || cameraIdx >= numCameras())
+            return 0;
+        return (int)section(cameraIdx).numKeypoints;
+    }
+
+    cv::KeyPoint CompactKeyframeFeatures::keypoint(int cameraIdx, int i) const {
+        const Section & s = section(cameraIdx);
+        const uint16_t * kp = at<uint16_t>(s.keypointOffset) + 4 * i;
+        return cv::KeyPoint(kp[0] / kPixelScale, kp[1] / kPixelScale, kp[2] / kPixelScale,
+                            kp[3] == kNoAngle ? -1.0f : kp[3] / kAngleScale, 0.0f,
+                            at<int8_t>(s.octaveOffset)[i]);
+    }
+
+    void CompactKeyframeFeatures::keypoints(int cameraIdx, std::vector<cv::KeyPoint> & out) const {
+        const int n = numKeypoints(cameraIdx);
+        out.resize(n);
+        for (int i = 0; i < n; i++)
+            out[i] = keypoint(cameraIdx, i);
+    }
+
+    cv::Mat CompactKeyframeFeatures::descriptors(int cameraIdx) const {
+        if (numKeypoints(cameraIdx) == 0 || section(cameraIdx).descriptorBytes == 0)
+            return cv::Mat();
+        const Section & s = section(cameraIdx);
+        return storage_.colRange(s.descriptorOffset, s.descriptorOffset + s.numKeypoints * s.descriptorBytes)
+                       .reshape(1, (int)s.numKeypoints);
+    }
+
+    Eigen::Vector4d CompactKeyframeFeatures::homogeneousPoint(int cameraIdx, int i) const {
+        const float * p = at<float>(section(cameraIdx).pointOffset) + 3 * i;
+        if (p[2] <= 0)
+            return Eigen::Vector4d(0, 0, 0, 0);
+        return Eigen::Vector4d(p[0], p[1], p[2], 1);
+    }
+}
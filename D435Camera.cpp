@@ -2,6 +2,7 @@
 #include "Version.h"
 #include "D435Camera.h"
 #include "Visualizer.h"
+#include "Instrumentation.h"
 
 #include <librealsense2/rs.hpp>
 #include <librealsense2/rsutil.h>
@@ -68,6 +69,7 @@ namespace ark {
     }
 
     void D435Camera::update(MultiCameraFrame & frame) {
+        Instrumentation::ScopedTimer timer(Instrumentation::Stage::CameraUpdate);
 
         try {
             // Ensure the frame has space for all images
@@ -83,15 +85,12 @@ namespace ark {
             frame.frameId_ = infrared.get_frame_number();
 
             // Convert infrared frame to opencv
-            if (frame.images_[0].empty()) frame.images_[0] = cv::Mat(cv::Size(width,height), CV_8UC1);
-            std::memcpy( frame.images_[0].data, infrared.get_data(),width * height);
+            const cv::Size size(width, height);
+            std::memcpy( frame.allocateImage(0, size, CV_8UC1).data, infrared.get_data(),width * height);
+            std::memcpy( frame.allocateImage(1, size, CV_8UC1).data, infrared2.get_data(),width * height);
 
-            if (frame.images_[1].empty()) frame.images_[1] = cv::Mat(cv::Size(width,height), CV_8UC1);
-            std::memcpy( frame.images_[1].data, infrared2.get_data(),width * height);
-
-            if (frame.images_[2].empty()) frame.images_[2] = cv::Mat(cv::Size(width,height), CV_32FC3);
-            project(depth, frame.images_[2]);
-            frame.images_[2] = frame.images_[2]*scale; //depth is in mm by default
+            // project scales depth to meters while deprojecting (depth is in mm by default)
+            project(depth, frame.allocateImage(2, size, CV_32FC3));
 
 
         } catch (std::runtime_error e) {
@@ -130,7 +129,7 @@ namespace ark {
                     continue;
                 }
                 srcPixel[0] = c;
-                rs2_deproject_pixel_to_point(destXYZ, dIntrin, srcPixel, srcPtr[c]);
+                rs2_deproject_pixel_to_point(destXYZ, dIntrin, srcPixel, srcPtr[c] * scale);
                 memcpy(&destPtr[c], destXYZ, 3 * sizeof(float));
             }
         }
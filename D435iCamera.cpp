@@ -2,6 +2,8 @@
 #include "Version.h"
 #include "D435iCamera.h"
 #include "Visualizer.h"
+#include "RS2Deprojection.h"
+#include "Instrumentation.h"
 
 #include <librealsense2/rs.h>
 #include <librealsense2/rs.hpp>
@@ -179,6 +181,7 @@ namespace ark {
     }
 
     void D435iCamera::update(MultiCameraFrame & frame) {
+        Instrumentation::ScopedTimer timer(Instrumentation::Stage::CameraUpdate);
 
         try {
             // Ensure the frame has space for all images
@@ -201,25 +204,24 @@ namespace ark {
                 std::cout << "No Metadata" << std::endl;
             }
 
-            // Convert infrared frame to opencv
-            if (frame.images_[0].empty()) frame.images_[0] = cv::Mat(cv::Size(width,height), CV_8UC1);
-            std::memcpy( frame.images_[0].data, infrared.get_data(),width * height);
+            // Convert frames to opencv, into pooled buffers
+            const cv::Size size(width, height);
+            std::memcpy( frame.allocateImage(0, size, CV_8UC1).data, infrared.get_data(),width * height);
+            std::memcpy( frame.allocateImage(1, size, CV_8UC1).data, infrared2.get_data(),width * height);
 
-            if (frame.images_[1].empty()) frame.images_[1] = cv::Mat(cv::Size(width,height), CV_8UC1);
-            std::memcpy( frame.images_[1].data, infrared2.get_data(),width * height);
-
-
-            if (frame.images_[2].empty()) frame.images_[2] = cv::Mat(cv::Size(width,height), CV_32FC3);
-            project(depth, frame.images_[2]);
-            frame.images_[2] = frame.images_[2]*scale; //depth is in mm by default
+            // the XYZ map is only built when a consumer asks for it; keyframe construction
+            // deprojects just the keypoints through the frame's deprojector
+            cv::Mat rawDepth = FramePool::instance().acquire(size, CV_16UC1);
+            std::memcpy( rawDepth.data, depth.get_data(), 2 * width * height);
+            rs2util::attachLazyXYZMap(frame, 2, rawDepth, depthIntrinsics, scale); //depth is in mm by default
 
 			auto aligned_frames = align_to_color->process(frames);
 			auto aligned_depth = aligned_frames.get_depth_frame();
 			
-			if (frame.images_[4].empty()) frame.images_[4] = cv::Mat(cv::Size(width, height), CV_16UC1, (void*)aligned_depth.get_data(), cv::Mat::AUTO_STEP);
+			// copied rather than wrapped: the librealsense frame is recycled once it goes out of scope
+			std::memcpy( frame.allocateImage(4, size, CV_16UC1).data, aligned_depth.get_data(), 2 * width * height);
 
-            if (frame.images_[3].empty()) frame.images_[3] = cv::Mat(cv::Size(width,height), CV_8UC3);
-            std::memcpy( frame.images_[3].data, color.get_data(),3 * width * height);
+            std::memcpy( frame.allocateImage(3, size, CV_8UC3).data, color.get_data(),3 * width * height);
 
 			//FILTER OUT ALL POINTS CLOSER THAN min_dist AND FARTHER THAN max_dist
 			int min_dist = 200;
@@ -245,35 +247,6 @@ namespace ark {
         }
     }
 
-    // project depth map to xyz coordinates directly (faster and minimizes distortion, but will not be aligned to RGB/IR)
-    void D435iCamera::project(const rs2::frame & depth_frame, cv::Mat & xyz_map) {
-        const uint16_t * depth_data = (const uint16_t *)depth_frame.get_data();
-
-        rs2_intrinsics * dIntrin = &depthIntrinsics;
-
-        const uint16_t * srcPtr;
-        cv::Vec3f * destPtr;
-        float srcPixel[2], destXYZ[3];
-
-        for (int r = 0; r < height; ++r)
-        {
-            srcPtr = depth_data + r * dIntrin->width;
-            destPtr = xyz_map.ptr<Vec3f>(r);
-            srcPixel[1] = r;
-
-            for (int c = 0; c < width; ++c)
-            {
-                if (srcPtr[c] == 0) {
-                    memset(&destPtr[c], 0, 3 * sizeof(float));
-                    continue;
-                }
-                srcPixel[0] = c;
-                rs2_deproject_pixel_to_point(destXYZ, dIntrin, srcPixel, srcPtr[c]);
-                memcpy(&destPtr[c], destXYZ, 3 * sizeof(float));
-            }
-        }
-    }
-
     const rs2_intrinsics &D435iCamera::getDepthIntrinsics() {
         return depthIntrinsics;
     }
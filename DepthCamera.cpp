@@ -3,6 +3,8 @@
 #include "DepthCamera.h"
 #include "Hand.h"
 #include "FrameObject.h"
+#include "FramePool.h"
+#include "Instrumentation.h"
 
 namespace ark {
 
@@ -42,7 +44,10 @@ namespace ark {
         initializeImages();
 
         // call update with back buffer images (to allow continued operation on front end)
-        update(xyzMapBuf, rgbMapBuf, irMapBuf, ampMapBuf, flagMapBuf);
+        {
+            Instrumentation::ScopedTimer timer(Instrumentation::Stage::CameraUpdate);
+            update(xyzMapBuf, rgbMapBuf, irMapBuf, ampMapBuf, flagMapBuf);
+        }
 
         if (!badInput() && xyzMapBuf.data) {
             if (removeNoise) {
@@ -139,29 +144,26 @@ namespace ark {
     void DepthCamera::initializeImages()
     {
         cv::Size sz = getImageSize();
+        FramePool & pool = FramePool::instance();
 
-        // initialize back buffers, if necessary
-        xyzMapBuf.release();
-        xyzMapBuf.create(sz, CV_32FC3);
+        // take fresh back buffers from the pool: the front buffers may still be held by
+        // consumers, and return to the pool once they are done with them
+        xyzMapBuf = pool.acquire(sz, CV_32FC3);
 
         if (hasRGBMap()) {
-            rgbMapBuf.release();
-            rgbMapBuf.create(sz, CV_8UC3);
+            rgbMapBuf = pool.acquire(sz, CV_8UC3);
         }
 
         if (hasIRMap()) {
-            irMapBuf.release();
-            irMapBuf.create(sz, CV_8U);
+            irMapBuf = pool.acquire(sz, CV_8U);
         }
 
         if (hasAmpMap()) {
-            ampMapBuf.release();
-            ampMapBuf.create(sz, CV_32F);
+            ampMapBuf = pool.acquire(sz, CV_32F);
         }
 
         if (hasFlagMap()) {
-            flagMapBuf.release();
-            flagMapBuf.create(sz, CV_8U);
+            flagMapBuf = pool.acquire(sz, CV_8U);
         }
     }
 
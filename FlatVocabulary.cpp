@@ -0,0 +1,337 @@
+#include "stdafx.h"
+#include "FlatVocabulary.h"
+#include "HammingMatcher.h"
+
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+
+namespace ark {
+
+    namespace {
+        const char kMagic[8] = { 'O', 'A', 'R', 'K', 'V', 'O', 'C', '\0' };
+        const uint32_t kEndianTag = 0x01020304;
+
+        uint64_t align8(uint64_t offset) {
+            return (offset + 7) & ~(uint64_t)7;
+        }
+
+        bool fail(const std::string & path, const char * reason) {
+            std::cerr << "FlatVocabulary: " << path << ": " << reason << std::endl;
+            return false;
+        }
+    }
+
+    struct FlatVocabulary::Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t endianTag;
+        int32_t k;
+        int32_t L;
+        int32_t weighting;
+        int32_t scoring;
+        uint32_t numNodes;
+        uint32_t numWords;
+        uint32_t descriptorBytes;
+        /** bytes between consecutive descriptors (descriptorBytes rounded up to 8) */
+        uint32_t descriptorStride;
+        uint64_t nodeOffset;
+        uint64_t descriptorOffset;
+        uint64_t fileSize;
+    };
+
+    /** One tree node; node 0 is the root, children are numChildren records from firstChild */
+    struct FlatVocabulary::Node {
+        uint32_t firstChild;
+        uint32_t numChildren;
+        /** id of the node in the DBoW2 vocabulary (used for feature vectors) */
+        uint32_t id;
+        /** word id of a leaf, -1 for inner nodes */
+        int32_t wordId;
+        double weight;
+    };
+
+    /**
+     * Reaches the protected tree of a DBoW2 vocabulary through pointers to members, which
+     * may be applied to any Vocabulary object. Never instantiated.
+     */
+    class FlatVocabulary::Access : public Vocabulary {
+    public:
+        typedef Vocabulary::Node DNode;
+
+        static std::vector<DNode> & nodes(Vocabulary & v) { return v.*(&Access::m_nodes); }
+        static const std::vector<DNode> & nodes(const Vocabulary & v) { return v.*(&Access::m_nodes); }
+        static std::vector<DNode *> & words(Vocabulary & v) { return v.*(&Access::m_words); }
+        static int & k(Vocabulary & v) { return v.*(&Access::m_k); }
+        static int & L(Vocabulary & v) { return v.*(&Access::m_L); }
+        static DBoW2::WeightingType & weighting(Vocabulary & v) { return v.*(&Access::m_weighting); }
+        static DBoW2::ScoringType & scoring(Vocabulary & v) { return v.*(&Access::m_scoring); }
+        static void initScoring(Vocabulary & v) { (v.*(&Access::createScoringObject))(); }
+    };
+
+    FlatVocabulary::FlatVocabulary(std::unique_ptr<MappedFile> file) :
+        file_(std::move(file)), header_(nullptr), nodes_(nullptr), descriptors_(nullptr) {
+        header_ = file_->at<Header>(0);
+        nodes_ = file_->at<Node>(header_->nodeOffset, header_->numNodes);
+        descriptors_ = file_->at<uint8_t>(header_->descriptorOffset, (uint64_t)header_->numNodes * header_->descriptorStride);
+    }
+
+    bool FlatVocabulary::isFlatFile(const std::string & path) {
+        std::ifstream file(path, std::ios::binary);
+        char magic[sizeof(kMagic)];
+        return file.read(magic, sizeof(magic)) && std::memcmp(magic, kMagic, sizeof(kMagic)) == 0;
+    }
+
+    FlatVocabulary::Ptr FlatVocabulary::load(const std::string & path) {
+        std::unique_ptr<MappedFile> file(new MappedFile(path));
+        if (!file->valid()) {
+            fail(path, "could not open");
+            return nullptr;
+        }
+        const Header * header = file->at<Header>(0);
+        if (header == nullptr || std::memcmp(header->magic, kMagic, sizeof(kMagic)) != 0) {
+            fail(path, "not a flat vocabulary file");
+            return nullptr;
+        }
+        if (header->endianTag != kEndianTag || header->version != kVersion) {
+            fail(path, "unsupported version or byte order");
+            return nullptr;
+        }
+        if (header->numNodes == 0 || header->descriptorStride < header->descriptorBytes ||
+                file->at<Node>(header->nodeOffset, header->numNodes) == nullptr ||
+                file->at<uint8_t>(header->descriptorOffset, (uint64_t)header->numNodes * header->descriptorStride) == nullptr) {
+            fail(path, "truncated");
+            return nullptr;
+        }
+        // the traversal trusts child ranges and toVocabulary indexes by node id, check them once here
+        const Node * nodes = file->at<Node>(header->nodeOffset, header->numNodes);
+        for (uint32_t i = 0; i < header->numNodes; ++i) {
+            if (nodes[i].id >= header->numNodes ||
+                    (uint64_t)nodes[i].firstChild + nodes[i].numChildren > header->numNodes ||
+                    (nodes[i].numChildren > 0 && nodes[i].firstChild <= i) ||
+                    (nodes[i].numChildren == 0 && (nodes[i].wordId < 0 || (uint32_t)nodes[i].wordId >= header->numWords))) {
+                fail(path, "corrupt node table");
+                return nullptr;
+            }
+        }
+        return Ptr(new FlatVocabulary(std::move(file)));
+    }
+
+    bool FlatVocabulary::save(const Vocabulary & vocabulary, const std::string & path) {
+        const std::vector<Access::DNode> & dnodes = Access::nodes(vocabulary);
+        if (dnodes.empty()) return fail(path, "empty vocabulary");
+
+        // breadth first order keeps the children of every node next to each other
+        std::vector<uint32_t> order;
+        std::vector<uint32_t> flatIndex(dnodes.size(), 0);
+        order.reserve(dnodes.size());
+        order.push_back(0);
+        for (size_t i = 0; i < order.size(); ++i) {
+            const Access::DNode & node = dnodes[order[i]];
+            for (size_t c = 0; c < node.children.size(); ++c) {
+                flatIndex[node.children[c]] = (uint32_t)order.size();
+                order.push_back(node.children[c]);
+            }
+        }
+
+        uint32_t descriptorBytes = 0;
+        for (size_t i = 0; i < dnodes.size() && descriptorBytes == 0; ++i) {
+            descriptorBytes = (uint32_t)(dnodes[i].descriptor.cols * dnodes[i].descriptor.elemSize());
+        }
+
+        Header header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, kMagic, sizeof(kMagic));
+        header.version = kVersion;
+        header.endianTag = kEndianTag;
+        header.k = vocabulary.getBranchingFactor();
+        header.L = vocabulary.getDepthLevels();
+        header.weighting = (int32_t)vocabulary.getWeightingType();
+        header.scoring = (int32_t)vocabulary.getScoringType();
+        header.numNodes = (uint32_t)order.size();
+        header.numWords = vocabulary.size();
+        header.descriptorBytes = descriptorBytes;
+        header.descriptorStride = (uint32_t)align8(descriptorBytes);
+        header.nodeOffset = sizeof(Header);
+        header.descriptorOffset = align8(header.nodeOffset + (uint64_t)header.numNodes * sizeof(Node));
+        header.fileSize = header.descriptorOffset + (uint64_t)header.numNodes * header.descriptorStride;
+
+        const std::string tmpPath = path + ".tmp";
+        std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) return fail(tmpPath, "could not open for writing");
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+        for (size_t i = 0; i < order.size(); ++i) {
+            const Access::DNode & dnode = dnodes[order[i]];
+            Node node;
+            node.firstChild = dnode.children.empty() ? 0 : flatIndex[dnode.children[0]];
+            node.numChildren = (uint32_t)dnode.children.size();
+            node.id = dnode.id;
+            node.wordId = dnode.children.empty() ? (int32_t)dnode.word_id : -1;
+            node.weight = dnode.weight;
+            file.write(reinterpret_cast<const char *>(&node), sizeof(node));
+        }
+        const char zeros[8] = { 0 };
+        file.write(zeros, header.descriptorOffset - (header.nodeOffset + (uint64_t)header.numNodes * sizeof(Node)));
+
+        std::vector<char> row(header.descriptorStride, 0);
+        for (size_t i = 0; i < order.size(); ++i) {
+            // the root has no descriptor
+            const cv::Mat & descriptor = dnodes[order[i]].descriptor;
+            std::fill(row.begin(), row.end(), 0);
+            if (!descriptor.empty() && (uint32_t)(descriptor.cols * descriptor.elemSize()) == descriptorBytes)
+                std::memcpy(row.data(), descriptor.ptr<uint8_t>(0), descriptorBytes);
+            file.write(row.data(), row.size());
+        }
+
+        file.close();
+        if (!file) return fail(tmpPath, "write failed");
+#ifdef _WIN32
+        // Windows rename fails on an existing file
+        std::remove(path.c_str());
+#endif
+        if (std::rename(tmpPath.c_str(), path.c_str()) != 0) return fail(path, "could not replace file");
+        return true;
+    }
+
+    void FlatVocabulary::toVocabulary(Vocabulary & out) const {
+        std::vector<Access::DNode> & dnodes = Access::nodes(out);
+        std::vector<Access::DNode *> & words = Access::words(out);
+        dnodes.clear();
+        dnodes.resize(header_->numNodes);
+        words.assign(header_->numWords, nullptr);
+
+        for (uint32_t i = 0; i < header_->numNodes; ++i) {
+            const Node & node = nodes_[i];
+            Access::DNode & dnode = dnodes[node.id];
+            dnode.id = node.id;
+            dnode.weight = node.weight;
+            dnode.word_id = node.wordId >= 0 ? (DBoW2::WordId)node.wordId : 0;
+            if (i > 0) {
+                dnode.descriptor.create(1, header_->descriptorBytes, CV_8U);
+                std::memcpy(dnode.descriptor.data, descriptors_ + (size_t)i * header_->descriptorStride, header_->descriptorBytes);
+            }
+            dnode.children.resize(node.numChildren);
+            for (uint32_t c = 0; c < node.numChildren; ++c) {
+                const uint32_t childId = nodes_[node.firstChild + c].id;
+                dnode.children[c] = childId;
+                dnodes[childId].parent = node.id;
+            }
+            if (node.wordId >= 0) words[node.wordId] = &dnode;
+        }
+
+        Access::k(out) = header_->k;
+        Access::L(out) = header_->L;
+        Access::weighting(out) = (DBoW2::WeightingType)header_->weighting;
+        Access::scoring(out) = (DBoW2::ScoringType)header_->scoring;
+        Access::initScoring(out);
+    }
+
+    void FlatVocabulary::transform(const uint8_t * feature, DBoW2::WordId & id, DBoW2::WordValue & weight,
+            DBoW2::NodeId * nid, int levelsup) const {
+        const int nidLevel = header_->L - levelsup;
+        if (nid != nullptr && nidLevel <= 0) *nid = 0; // root
+
+        const uint32_t bytes = header_->descriptorBytes, stride = header_->descriptorStride;
+        uint32_t current = 0;
+        int level = 0;
+        do {
+            ++level;
+            const Node & node = nodes_[current];
+            // children are contiguous, so are their descriptors
+            const uint8_t * childDescriptor = descriptors_ + (size_t)node.firstChild * stride;
+            uint32_t best = node.firstChild;
+            int bestDistance = HammingMatcher::distance(feature, childDescriptor, bytes);
+            for (uint32_t c = 1; c < node.numChildren; ++c) {
+                childDescriptor += stride;
+                const int d = HammingMatcher::distance(feature, childDescriptor, bytes);
+                if (d < bestDistance) {
+                    bestDistance = d;
+                    best = node.firstChild + c;
+                }
+            }
+            current = best;
+            if (nid != nullptr && level == nidLevel) *nid = nodes_[current].id;
+        } while (nodes_[current].numChildren > 0);
+
+        id = (DBoW2::WordId)nodes_[current].wordId;
+        weight = nodes_[current].weight;
+    }
+
+    void FlatVocabulary::transform(const std::vector<cv::Mat> & features, DBoW2::BowVector & v,
+            DBoW2::FeatureVector & fv, int levelsup) const {
+        v.clear();
+        fv.clear();
+        if (empty()) return;
+
+        const bool accumulate = header_->weighting == DBoW2::TF || header_->weighting == DBoW2::TF_IDF;
+        for (unsigned int i = 0; i < features.size(); ++i) {
+            CV_Assert((uint32_t)(features[i].cols * features[i].elemSize()) == header_->descriptorBytes);
+            DBoW2::WordId id;
+            DBoW2::WordValue w;
+            DBoW2::NodeId nid;
+            transform(features[i].ptr<uint8_t>(0), id, w, &nid, levelsup);
+            if (w > 0) {
+                if (accumulate) v.addWeight(id, w);
+                else v.addIfNotExist(id, w);
+                fv.addFeature(nid, i);
+            }
+        }
+        finishBowVector(v);
+    }
+
+    void FlatVocabulary::transform(const std::vector<cv::Mat> & features, DBoW2::BowVector & v) const {
+        v.clear();
+        if (empty()) return;
+
+        const bool accumulate = header_->weighting == DBoW2::TF || header_->weighting == DBoW2::TF_IDF;
+        for (size_t i = 0; i < features.size(); ++i) {
+            CV_Assert((uint32_t)(features[i].cols * features[i].elemSize()) == header_->descriptorBytes);
+            DBoW2::WordId id;
+            DBoW2::WordValue w;
+            transform(features[i].ptr<uint8_t>(0), id, w);
+            if (w > 0) {
+                if (accumulate) v.addWeight(id, w);
+                else v.addIfNotExist(id, w);
+            }
+        }
+        finishBowVector(v);
+    }
+
+    void FlatVocabulary::finishBowVector(DBoW2::BowVector & v) const {
+        // the scoring object of each DBoW2 scoring type decides whether vectors are normalized
+        bool normalize = true;
+        DBoW2::LNorm norm = DBoW2::L1;
+        switch ((DBoW2::ScoringType)header_->scoring) {
+        case DBoW2::L2_NORM: norm = DBoW2::L2; break;
+        case DBoW2::DOT_PRODUCT: normalize = false; break;
+        default: break;
+        }
+
+        const bool accumulate = header_->weighting == DBoW2::TF || header_->weighting == DBoW2::TF_IDF;
+        if (accumulate && !v.empty() && !normalize) {
+            // term frequency
+            const double nd = v.size();
+            for (DBoW2::BowVector::iterator it = v.begin(); it != v.end(); ++it) it->second /= nd;
+        }
+        if (normalize) v.normalize(norm);
+    }
+
+    unsigned int FlatVocabulary::size() const {
+        return header_->numWords;
+    }
+
+    int FlatVocabulary::getBranchingFactor() const {
+        return header_->k;
+    }
+
+    int FlatVocabulary::getDepthLevels() const {
+        return header_->L;
+    }
+
+    int FlatVocabulary::getDescriptorBytes() const {
+        return (int)header_->descriptorBytes;
+    }
+}
@@ -0,0 +1,149 @@
+#include "stdafx.h"
+#include "FramePool.h"
+
+#include <algorithm>
+
+namespace ark {
+
+#if CV_VERSION_MAJOR >= 4
+    typedef cv::AccessFlag PoolAccessFlags;
+#else
+    typedef int PoolAccessFlags;
+#endif
+
+    /** Same layout rules as OpenCV's default allocator, with memory taken from the pool */
+    class FramePool::Allocator : public cv::MatAllocator {
+    public:
+        explicit Allocator(FramePool & pool) : pool_(pool) {}
+
+        cv::UMatData * allocate(int dims, const int * sizes, int type, void * data0, size_t * step,
+                PoolAccessFlags /*flags*/, cv::UMatUsageFlags /*usageFlags*/) const override {
+            size_t total = CV_ELEM_SIZE(type);
+            for (int i = dims - 1; i >= 0; i--) {
+                if (step) {
+                    if (data0 && step[i] != CV_AUTOSTEP) {
+                        CV_Assert(total <= step[i]);
+                        total = step[i];
+                    } else {
+                        step[i] = total;
+                    }
+                }
+                total *= sizes[i];
+            }
+            unsigned char * data = data0 ? (unsigned char *)data0 : pool_.take(total);
+            cv::UMatData * u = new cv::UMatData(this);
+            u->data = u->origdata = data;
+            u->size = total;
+            if (data0) u->flags |= cv::UMatData::USER_ALLOCATED;
+            return u;
+        }
+
+        bool allocate(cv::UMatData * u, PoolAccessFlags /*accessFlags*/, cv::UMatUsageFlags /*usageFlags*/) const override {
+            return u != nullptr;
+        }
+
+        void deallocate(cv::UMatData * u) const override {
+            if (!u) return;
+            CV_Assert(u->urefcount == 0 && u->refcount == 0);
+            if (!(u->flags & cv::UMatData::USER_ALLOCATED)) {
+                pool_.give(u->origdata, u->size);
+                u->origdata = nullptr;
+            }
+            delete u;
+        }
+
+    private:
+        FramePool & pool_;
+    };
+
+    FramePool & FramePool::instance() {
+        static FramePool * pool = new FramePool();
+        return *pool;
+    }
+
+    FramePool::FramePool() : maxFreePerSize_(8), stats_(), allocator_(new Allocator(*this)) {
+    }
+
+    FramePool::~FramePool() {
+        trim();
+    }
+
+    cv::Mat FramePool::acquire(cv::Size size, int type) {
+        cv::Mat image;
+        image.allocator = allocator_.get();
+        image.create(size, type);
+        return image;
+    }
+
+    cv::MatAllocator * FramePool::allocator() const {
+        return allocator_.get();
+    }
+
+    void FramePool::reserve(cv::Size size, int type, int count) {
+        std::vector<cv::Mat> images;
+        for (int i = 0; i < count; ++i) {
+            images.push_back(acquire(size, type));
+        }
+        // released here, into the free list
+    }
+
+    void FramePool::setMaxFreePerSize(size_t count) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        maxFreePerSize_ = count;
+        for (auto & entry : free_) {
+            while (entry.second.size() > maxFreePerSize_) {
+                cv::fastFree(entry.second.back());
+                entry.second.pop_back();
+                --stats_.cachedBuffers;
+                stats_.cachedBytes -= entry.first;
+            }
+        }
+    }
+
+    void FramePool::trim() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto & entry : free_) {
+            for (unsigned char * data : entry.second) cv::fastFree(data);
+        }
+        free_.clear();
+        stats_.cachedBuffers = stats_.cachedBytes = 0;
+    }
+
+    FramePool::Stats FramePool::getStats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+    unsigned char * FramePool::take(size_t bytes) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++stats_.outstanding;
+            auto it = free_.find(bytes);
+            if (it != free_.end() && !it->second.empty()) {
+                unsigned char * data = it->second.back();
+                it->second.pop_back();
+                ++stats_.reuses;
+                --stats_.cachedBuffers;
+                stats_.cachedBytes -= bytes;
+                return data;
+            }
+            ++stats_.allocations;
+        }
+        return (unsigned char *)cv::fastMalloc(bytes);
+    }
+
+    void FramePool::give(unsigned char * data, size_t bytes) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            --stats_.outstanding;
+            std::vector<unsigned char *> & list = free_[bytes];
+            if (list.size() < maxFreePerSize_) {
+                list.push_back(data);
+                ++stats_.cachedBuffers;
+                stats_.cachedBytes += bytes;
+                return;
+            }
+        }
+        cv::fastFree(data);
+    }
+}
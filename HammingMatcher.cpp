@@ -0,0 +1,260 @@
+#include "stdafx.h"
+#include "HammingMatcher.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#ifdef USE_OPENMP
+#include <omp.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define ARK_HAMMING_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define ARK_TARGET_AVX2
+#define ARK_TARGET_POPCNT
+#else
+#define ARK_TARGET_AVX2 __attribute__((target("avx2")))
+#define ARK_TARGET_POPCNT __attribute__((target("popcnt")))
+#endif
+#endif
+
+namespace ark {
+
+    namespace {
+        typedef void(*RowKernel)(const uint64_t * query, const uint64_t * train, int n, int words, uint16_t * out);
+
+        inline int popcount64(uint64_t x) {
+            x = x - ((x >> 1) & 0x5555555555555555ULL);
+            x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+            x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+            return (int)((x * 0x0101010101010101ULL) >> 56);
+        }
+
+        void rowDistancesScalar(const uint64_t * query, const uint64_t * train, int n, int words, uint16_t * out) {
+            for (int j = 0; j < n; ++j) {
+                const uint64_t * t = train + (size_t)j * words;
+                int d = 0;
+                for (int w = 0; w < words; ++w) d += popcount64(query[w] ^ t[w]);
+                out[j] = (uint16_t)d;
+            }
+        }
+
+#ifdef ARK_HAMMING_X86
+        ARK_TARGET_POPCNT
+        void rowDistancesPopcnt(const uint64_t * query, const uint64_t * train, int n, int words, uint16_t * out) {
+            for (int j = 0; j < n; ++j) {
+                const uint64_t * t = train + (size_t)j * words;
+                int d = 0;
+                for (int w = 0; w < words; ++w) {
+#if defined(_M_X64) || defined(__x86_64__)
+                    d += (int)_mm_popcnt_u64(query[w] ^ t[w]);
+#else
+                    const uint64_t x = query[w] ^ t[w];
+                    d += _mm_popcnt_u32((uint32_t)x) + _mm_popcnt_u32((uint32_t)(x >> 32));
+#endif
+                }
+                out[j] = (uint16_t)d;
+            }
+        }
+
+        /** Nibble lookup popcount (Mula): 32 bytes per step, byte counts summed with vpsadbw */
+        ARK_TARGET_AVX2
+        void rowDistancesAVX2(const uint64_t * query, const uint64_t * train, int n, int words, uint16_t * out) {
+            const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                                 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+            const __m256i lowMask = _mm256_set1_epi8(0x0f);
+            const __m256i zero = _mm256_setzero_si256();
+            const int lanes = words / 4;
+            // BRISK descriptors fit in two lanes, keep the query in registers for that case
+            const __m256i q0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(query));
+            const __m256i q1 = lanes > 1 ? _mm256_loadu_si256(reinterpret_cast<const __m256i *>(query + 4)) : zero;
+            alignas(32) uint64_t sums[4];
+            for (int j = 0; j < n; ++j) {
+                const uint64_t * t = train + (size_t)j * words;
+                __m256i acc = zero;
+                for (int l = 0; l < lanes; ++l) {
+                    const __m256i q = l == 0 ? q0 : (l == 1 ? q1 :
+                        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(query + 4 * l)));
+                    const __m256i x = _mm256_xor_si256(q, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(t + 4 * l)));
+                    const __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(x, lowMask));
+                    const __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), lowMask));
+                    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), zero));
+                }
+                _mm256_store_si256(reinterpret_cast<__m256i *>(sums), acc);
+                out[j] = (uint16_t)(sums[0] + sums[1] + sums[2] + sums[3]);
+            }
+        }
+
+        bool cpuSupports(HammingMatcher::Kernel kernel) {
+#ifdef _MSC_VER
+            int info[4];
+            __cpuid(info, 1);
+            const bool popcnt = (info[2] & (1 << 23)) != 0;
+            const bool osxsave = (info[2] & (1 << 27)) != 0;
+            if (kernel == HammingMatcher::Kernel::Popcnt) return popcnt;
+            if (!osxsave || (_xgetbv(0) & 0x6) != 0x6) return false;
+            __cpuidex(info, 7, 0);
+            return (info[1] & (1 << 5)) != 0;
+#else
+            __builtin_cpu_init();
+            if (kernel == HammingMatcher::Kernel::Popcnt) return __builtin_cpu_supports("popcnt");
+            return __builtin_cpu_supports("avx2");
+#endif
+        }
+#endif
+
+        RowKernel rowKernel(HammingMatcher::Kernel kernel) {
+#ifdef ARK_HAMMING_X86
+            switch (kernel) {
+            case HammingMatcher::Kernel::AVX2: return rowDistancesAVX2;
+            case HammingMatcher::Kernel::Popcnt: return rowDistancesPopcnt;
+            default: break;
+            }
+#endif
+            return rowDistancesScalar;
+        }
+
+        int threadCount(int requested) {
+#ifdef USE_OPENMP
+            return requested > 0 ? requested : omp_get_max_threads();
+#else
+            return 1;
+#endif
+        }
+    }
+
+    HammingMatcher::HammingMatcher(const Params & params) : params(params), kernel_(bestKernel()) {
+    }
+
+    HammingMatcher::Kernel HammingMatcher::bestKernel() {
+#ifdef ARK_HAMMING_X86
+        static const Kernel best = cpuSupports(Kernel::AVX2) ? Kernel::AVX2 :
+            (cpuSupports(Kernel::Popcnt) ? Kernel::Popcnt : Kernel::Scalar);
+        return best;
+#else
+        return Kernel::Scalar;
+#endif
+    }
+
+    void HammingMatcher::setKernel(Kernel kernel) {
+        kernel_ = (int)kernel <= (int)bestKernel() ? kernel : bestKernel();
+    }
+
+    int HammingMatcher::distance(const uint8_t * a, const uint8_t * b, int bytes) {
+        int d = 0, i = 0;
+        for (; i + 8 <= bytes; i += 8) {
+            uint64_t x, y;
+            std::memcpy(&x, a + i, 8);
+            std::memcpy(&y, b + i, 8);
+            d += popcount64(x ^ y);
+        }
+        for (; i < bytes; ++i) d += popcount64((uint64_t)(a[i] ^ b[i]));
+        return d;
+    }
+
+    int HammingMatcher::packedWords(int bytes) {
+        return ((bytes + 31) / 32) * 4;
+    }
+
+    void HammingMatcher::pack(const cv::Mat & descriptors, int words, std::vector<uint64_t> & out) {
+        out.assign((size_t)descriptors.rows * words, 0);
+        const size_t bytes = descriptors.cols * descriptors.elemSize();
+        for (int i = 0; i < descriptors.rows; ++i) {
+            std::memcpy(&out[(size_t)i * words], descriptors.ptr<uint8_t>(i), bytes);
+        }
+    }
+
+    void HammingMatcher::computeDistances(const cv::Mat & query, const cv::Mat & train,
+            std::vector<uint16_t> & table) const {
+        CV_Assert(query.depth() == CV_8U && train.depth() == CV_8U);
+        CV_Assert(query.cols * query.elemSize() == train.cols * train.elemSize());
+        const int words = packedWords((int)(query.cols * query.elemSize()));
+        std::vector<uint64_t> q, t;
+        pack(query, words, q);
+        pack(train, words, t);
+
+        const int rows = query.rows, cols = train.rows;
+        table.resize((size_t)rows * cols);
+        const RowKernel kernel = rowKernel(kernel_);
+        const int threads = threadCount(params.numThreads);
+#ifdef USE_OPENMP
+#pragma omp parallel for num_threads(threads) if(threads > 1 && rows >= 64) schedule(static)
+#endif
+        for (int i = 0; i < rows; ++i) {
+            kernel(&q[(size_t)i * words], t.data(), cols, words, &table[(size_t)i * cols]);
+        }
+        (void)threads;
+    }
+
+    void HammingMatcher::match(const cv::Mat & query, const cv::Mat & train,
+            std::vector<cv::DMatch> & matches) const {
+        matches.clear();
+        if (query.empty() || train.empty()) return;
+        std::vector<uint16_t> table;
+        computeDistances(query, train, table);
+        const int rows = query.rows, cols = train.rows;
+
+        // best query for every train descriptor, for the mutual check
+        std::vector<int> bestQuery;
+        if (params.mutual) {
+            std::vector<uint16_t> bestDist(cols, std::numeric_limits<uint16_t>::max());
+            bestQuery.assign(cols, -1);
+            for (int i = 0; i < rows; ++i) {
+                const uint16_t * row = &table[(size_t)i * cols];
+                for (int j = 0; j < cols; ++j) {
+                    if (row[j] < bestDist[j]) {
+                        bestDist[j] = row[j];
+                        bestQuery[j] = i;
+                    }
+                }
+            }
+        }
+
+        matches.reserve(rows);
+        for (int i = 0; i < rows; ++i) {
+            const uint16_t * row = &table[(size_t)i * cols];
+            int best = std::numeric_limits<int>::max(), second = std::numeric_limits<int>::max(), bestIdx = -1;
+            for (int j = 0; j < cols; ++j) {
+                const int d = row[j];
+                if (d < best) {
+                    second = best;
+                    best = d;
+                    bestIdx = j;
+                } else if (d < second) {
+                    second = d;
+                }
+            }
+            if (bestIdx < 0) continue;
+            if (params.maxDistance >= 0 && best > params.maxDistance) continue;
+            if (params.ratio < 1.0f && cols > 1 && best >= params.ratio * second) continue;
+            if (params.mutual && bestQuery[bestIdx] != i) continue;
+            matches.push_back(cv::DMatch(i, bestIdx, (float)best));
+        }
+    }
+
+    void HammingMatcher::knnMatch(const cv::Mat & query, const cv::Mat & train,
+            std::vector<std::vector<cv::DMatch> > & matches, int k) const {
+        matches.assign(query.rows, std::vector<cv::DMatch>());
+        if (query.empty() || train.empty() || k <= 0) return;
+        std::vector<uint16_t> table;
+        computeDistances(query, train, table);
+        const int rows = query.rows, cols = train.rows;
+        const int kk = std::min(k, cols);
+
+        std::vector<int> order(cols);
+        for (int i = 0; i < rows; ++i) {
+            const uint16_t * row = &table[(size_t)i * cols];
+            for (int j = 0; j < cols; ++j) order[j] = j;
+            std::partial_sort(order.begin(), order.begin() + kk, order.end(),
+                [row](int a, int b) { return row[a] < row[b]; });
+            matches[i].reserve(kk);
+            for (int n = 0; n < kk; ++n) {
+                matches[i].push_back(cv::DMatch(i, order[n], (float)row[order[n]]));
+            }
+        }
+    }
+}
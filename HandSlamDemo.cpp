@@ -98,6 +98,8 @@ int main(int argc, char **argv)
                 Eigen::Affine3d T_KS(frame->T_KS_);
                 T_K_cubes.push_back((T_KS*finger_pos).matrix());
                 K_cubes.push_back(frame->keyframe_);
+                // the cube follows its keyframe, keep it from being culled
+                if (frame->keyframe_ != nullptr) frame->keyframe_->pin();
                 std::cout << "Adding cube " << cube_name << std::endl;
                 ar_win.add_object(obj); //NOTE: this is bad, should change objects to shared_ptr
             }
@@ -111,6 +113,8 @@ int main(int argc, char **argv)
             cubes.push_back(obj);
             T_K_cubes.push_back(frame->T_KS_);
             K_cubes.push_back(frame->keyframe_);
+            // the cube follows its keyframe, keep it from being culled
+            if (frame->keyframe_ != nullptr) frame->keyframe_->pin();
             std::cout << "Adding cube " << cube_name << std::endl;
             ar_win.add_object(obj); //NOTE: this is bad, should change objects to shared_ptr
         }
@@ -125,15 +129,15 @@ int main(int argc, char **argv)
     //slam.AddKeyFrameAvailableHandler(kfHandler, "saving");
 
     LoopClosureDetectedHandler loopHandler([&slam, &path1, &cubes, &T_K_cubes, &K_cubes](void) {
-        std::vector<Eigen::Matrix4d> traj;
-        slam.getTrajectory(traj);
+        TrajectorySnapshot::ConstPtr traj = slam.getTrajectorySnapshot();
         path1.clear();
-        for(size_t i=0; i<traj.size(); i++){
-            path1.add_node(traj[i].block<3,1>(0,3));
+        for(size_t i=0; i<traj->size(); i++){
+            path1.add_node(traj->T_WS(i).block<3,1>(0,3));
         }
         for(size_t i=0; i<cubes.size(); i++){
-            if(K_cubes[i]!=nullptr)
-                cubes[i]->set_transform(Eigen::Affine3d(K_cubes[i]->T_WS()*T_K_cubes[i]));
+            const int k = K_cubes[i]!=nullptr ? traj->find(K_cubes[i]->frameId_) : -1;
+            if(k>=0)
+                cubes[i]->set_transform(Eigen::Affine3d(traj->T_WS(k)*T_K_cubes[i]));
 
         }
 
@@ -151,7 +155,8 @@ int main(int argc, char **argv)
         MultiCameraFrame::Ptr frame(new MultiCameraFrame);
         camera.update(*frame);
 
-        cv::Mat xyzMap = frame->images_[2];
+        cv::Mat xyzMap;
+        frame->getImage(xyzMap, 2);
 
         planeDetector->update(xyzMap);
         frame->planes_ = planeDetector->getPlanes();
@@ -0,0 +1,276 @@
+#include "stdafx.h"
+#include "IncrementalTSDFVolume.h"
+
+#include "Open3D/Integration/UniformTSDFVolume.h"
+#include "Open3D/Integration/MarchingCubesConst.h"
+#include "Open3D/geometry/PointCloud.h"
+
+namespace ark {
+
+	IncrementalTSDFVolume::IncrementalTSDFVolume(double voxel_length, double sdf_trunc,
+		open3d::integration::TSDFVolumeColorType color_type,
+		int volume_unit_resolution, int depth_sampling_stride) :
+		open3d::integration::ScalableTSDFVolume(voxel_length, sdf_trunc, color_type,
+			volume_unit_resolution, depth_sampling_stride) {
+	}
+
+	void IncrementalTSDFVolume::Reset() {
+		for (auto &unit : volume_units_) {
+			if (unit_pool_.size() >= max_pooled_units_) {
+				break;
+			}
+			// a unit still referenced elsewhere can't be handed out again
+			if (unit.second.volume_ && unit.second.volume_.use_count() == 1) {
+				unit_pool_.push_back(std::move(unit.second.volume_));
+			}
+		}
+		ScalableTSDFVolume::Reset();
+		dirty_units_.clear();
+		unit_meshes_.clear();
+		mesh_generation_++;
+	}
+
+	void IncrementalTSDFVolume::SetUnitPoolSize(size_t max_units) {
+		max_pooled_units_ = max_units;
+		if (unit_pool_.size() > max_units) {
+			unit_pool_.resize(max_units);
+		}
+	}
+
+	std::shared_ptr<open3d::integration::UniformTSDFVolume> IncrementalTSDFVolume::OpenUnit(const Eigen::Vector3i &index) {
+		VolumeUnit &unit = volume_units_[index];
+		if (!unit.volume_) {
+			const Eigen::Vector3d origin = index.cast<double>() * volume_unit_length_;
+			if (!unit_pool_.empty()) {
+				unit.volume_ = std::move(unit_pool_.back());
+				unit_pool_.pop_back();
+				unit.volume_->Reset();
+				unit.volume_->origin_ = origin;
+			} else {
+				unit.volume_.reset(new open3d::integration::UniformTSDFVolume(volume_unit_length_,
+					volume_unit_resolution_, sdf_trunc_, color_type_, origin));
+			}
+			unit.index_ = index;
+		}
+		return unit.volume_;
+	}
+
+	void IncrementalTSDFVolume::Integrate(const open3d::geometry::RGBDImage &image,
+		const open3d::camera::PinholeCameraIntrinsic &intrinsic,
+		const Eigen::Matrix4d &extrinsic) {
+
+		const bool depth_ok = image.depth_.num_of_channels_ == 1 && image.depth_.bytes_per_channel_ == 4 &&
+			image.depth_.width_ == intrinsic.width_ && image.depth_.height_ == intrinsic.height_;
+		bool color_ok = true;
+		if (color_type_ == open3d::integration::TSDFVolumeColorType::RGB8) {
+			color_ok = image.color_.num_of_channels_ == 3 && image.color_.bytes_per_channel_ == 1;
+		} else if (color_type_ == open3d::integration::TSDFVolumeColorType::Gray32) {
+			color_ok = image.color_.num_of_channels_ == 1 && image.color_.bytes_per_channel_ == 4;
+		}
+		if (color_type_ != open3d::integration::TSDFVolumeColorType::NoColor) {
+			color_ok = color_ok && image.color_.width_ == intrinsic.width_ && image.color_.height_ == intrinsic.height_;
+		}
+		if (!depth_ok || !color_ok) {
+			std::cerr << "IncrementalTSDFVolume::Integrate: unsupported image format" << std::endl;
+			return;
+		}
+
+		if (!depth_to_camera_distance_ || cached_width_ != intrinsic.width_ || cached_height_ != intrinsic.height_ ||
+			cached_intrinsic_matrix_ != intrinsic.intrinsic_matrix_) {
+			depth_to_camera_distance_ = open3d::geometry::Image::CreateDepthToCameraDistanceMultiplierFloatImage(intrinsic);
+			cached_width_ = intrinsic.width_;
+			cached_height_ = intrinsic.height_;
+			cached_intrinsic_matrix_ = intrinsic.intrinsic_matrix_;
+		}
+
+		// every unit within sdf_trunc of a (subsampled) depth point, as ScalableTSDFVolume does
+		auto pointcloud = open3d::geometry::PointCloud::CreateFromDepthImage(image.depth_, intrinsic, extrinsic,
+			1000.0, 1000.0, depth_sampling_stride_);
+		const Eigen::Vector3d trunc(sdf_trunc_, sdf_trunc_, sdf_trunc_);
+		UnitSet touched;
+		for (const auto &point : pointcloud->points_) {
+			const Eigen::Vector3i min_bound = LocateUnit(point - trunc);
+			const Eigen::Vector3i max_bound = LocateUnit(point + trunc);
+			for (int x = min_bound(0); x <= max_bound(0); x++) {
+				for (int y = min_bound(1); y <= max_bound(1); y++) {
+					for (int z = min_bound(2); z <= max_bound(2); z++) {
+						touched.insert(Eigen::Vector3i(x, y, z));
+					}
+				}
+			}
+		}
+
+		for (const auto &index : touched) {
+			OpenUnit(index)->IntegrateWithDepthToCameraDistanceMultiplier(image, intrinsic, extrinsic,
+				*depth_to_camera_distance_);
+			// cubes along the upper faces of the units below read this unit's voxels
+			for (int dx = -1; dx <= 0; dx++) {
+				for (int dy = -1; dy <= 0; dy++) {
+					for (int dz = -1; dz <= 0; dz++) {
+						dirty_units_.insert(index + Eigen::Vector3i(dx, dy, dz));
+					}
+				}
+			}
+		}
+	}
+
+	size_t IncrementalTSDFVolume::UpdateUnitMeshes() {
+		std::vector<Eigen::Vector3i> dirty;
+		dirty.reserve(dirty_units_.size());
+		for (const auto &index : dirty_units_) {
+			if (volume_units_.count(index)) {
+				dirty.push_back(index);
+			} else {
+				unit_meshes_.erase(index);
+			}
+		}
+		if (!dirty_units_.empty()) {
+			mesh_generation_++;
+		}
+		dirty_units_.clear();
+
+		// units are meshed independently; only reads the volumes
+		std::vector<std::shared_ptr<open3d::geometry::TriangleMesh>> meshes(dirty.size());
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+		for (int i = 0; i < (int)dirty.size(); i++) {
+			meshes[i] = ExtractUnitMesh(dirty[i]);
+		}
+
+		for (size_t i = 0; i < dirty.size(); i++) {
+			if (meshes[i]->triangles_.empty()) {
+				unit_meshes_.erase(dirty[i]);
+			} else {
+				unit_meshes_[dirty[i]] = meshes[i];
+			}
+		}
+		return dirty.size();
+	}
+
+	std::shared_ptr<open3d::geometry::TriangleMesh> IncrementalTSDFVolume::ExtractTriangleMesh() {
+		UpdateUnitMeshes();
+
+		auto mesh = std::make_shared<open3d::geometry::TriangleMesh>();
+		size_t num_vertices = 0, num_triangles = 0;
+		for (const auto &unit_mesh : unit_meshes_) {
+			num_vertices += unit_mesh.second->vertices_.size();
+			num_triangles += unit_mesh.second->triangles_.size();
+		}
+		mesh->vertices_.reserve(num_vertices);
+		if (color_type_ != open3d::integration::TSDFVolumeColorType::NoColor) {
+			mesh->vertex_colors_.reserve(num_vertices);
+		}
+		mesh->triangles_.reserve(num_triangles);
+
+		for (const auto &unit_mesh : unit_meshes_) {
+			const open3d::geometry::TriangleMesh &part = *unit_mesh.second;
+			const Eigen::Vector3i offset = Eigen::Vector3i::Constant((int)mesh->vertices_.size());
+			mesh->vertices_.insert(mesh->vertices_.end(), part.vertices_.begin(), part.vertices_.end());
+			mesh->vertex_colors_.insert(mesh->vertex_colors_.end(), part.vertex_colors_.begin(), part.vertex_colors_.end());
+			for (const auto &triangle : part.triangles_) {
+				mesh->triangles_.push_back(triangle + offset);
+			}
+		}
+		return mesh;
+	}
+
+	std::shared_ptr<open3d::geometry::TriangleMesh> IncrementalTSDFVolume::ExtractUnitMesh(const Eigen::Vector3i &index0) const {
+		using namespace open3d::integration;
+		auto mesh = std::make_shared<open3d::geometry::TriangleMesh>();
+		const auto unit0 = volume_units_.find(index0);
+		if (unit0 == volume_units_.end() || !unit0->second.volume_) {
+			return mesh;
+		}
+		const UniformTSDFVolume &volume0 = *unit0->second.volume_;
+		const int res = volume_unit_resolution_;
+		const double half_voxel_length = voxel_length_ * 0.5;
+
+		// the unit itself and the neighbors in +x, +y, +z that the last cubes reach into,
+		// indexed by a bit per axis that crosses into the neighbor
+		const UniformTSDFVolume *units[8];
+		units[0] = &volume0;
+		for (int n = 1; n < 8; n++) {
+			const auto unit1 = volume_units_.find(index0 + Eigen::Vector3i(n & 1, (n >> 1) & 1, (n >> 2) & 1));
+			units[n] = unit1 == volume_units_.end() ? nullptr : unit1->second.volume_.get();
+		}
+
+		// vertex of each edge of the unit's cubes: (res + 1)^3 corners, 3 edge directions each
+		std::vector<int> edge_vertex((size_t)(res + 1) * (res + 1) * (res + 1) * 3, -1);
+		int edge_to_index[12];
+		for (int x = 0; x < res; x++) {
+			for (int y = 0; y < res; y++) {
+				for (int z = 0; z < res; z++) {
+					const Eigen::Vector3i idx0(x, y, z);
+					int cube_index = 0;
+					float f[8];
+					Eigen::Vector3d c[8];
+					for (int i = 0; i < 8; i++) {
+						Eigen::Vector3i idx1 = idx0 + shift[i];
+						int neighbor = 0;
+						for (int j = 0; j < 3; j++) {
+							if (idx1(j) >= res) {
+								idx1(j) -= res;
+								neighbor |= 1 << j;
+							}
+						}
+						const UniformTSDFVolume *volume1 = units[neighbor];
+						float w = 0.0f;
+						f[i] = 0.0f;
+						if (volume1 != nullptr) {
+							const int voxel = (idx1(0) * res + idx1(1)) * res + idx1(2);
+							w = volume1->weight_[voxel];
+							f[i] = volume1->tsdf_[voxel];
+							if (color_type_ == TSDFVolumeColorType::RGB8) {
+								c[i] = volume1->color_[voxel].cast<double>() / 255.0;
+							} else if (color_type_ == TSDFVolumeColorType::Gray32) {
+								c[i] = volume1->color_[voxel].cast<double>();
+							}
+						}
+						if (w == 0.0f) {
+							cube_index = 0;
+							break;
+						}
+						if (f[i] < 0.0f) {
+							cube_index |= (1 << i);
+						}
+					}
+					if (cube_index == 0 || cube_index == 255) {
+						continue;
+					}
+
+					for (int i = 0; i < 12; i++) {
+						if (!(edge_table[cube_index] & (1 << i))) {
+							continue;
+						}
+						const Eigen::Vector4i local = Eigen::Vector4i(x, y, z, 0) + edge_shift[i];
+						int &vertex = edge_vertex[(((size_t)local(0) * (res + 1) + local(1)) * (res + 1) + local(2)) * 3 + local(3)];
+						if (vertex < 0) {
+							vertex = (int)mesh->vertices_.size();
+							const Eigen::Vector4i edge_index = Eigen::Vector4i(index0(0), index0(1), index0(2), 0) * res + local;
+							Eigen::Vector3d pt(half_voxel_length + voxel_length_ * edge_index(0),
+								half_voxel_length + voxel_length_ * edge_index(1),
+								half_voxel_length + voxel_length_ * edge_index(2));
+							const double f0 = std::abs((double)f[edge_to_vert[i][0]]);
+							const double f1 = std::abs((double)f[edge_to_vert[i][1]]);
+							pt(edge_index(3)) += f0 * voxel_length_ / (f0 + f1);
+							mesh->vertices_.push_back(pt);
+							if (color_type_ != TSDFVolumeColorType::NoColor) {
+								const Eigen::Vector3d &c0 = c[edge_to_vert[i][0]];
+								const Eigen::Vector3d &c1 = c[edge_to_vert[i][1]];
+								mesh->vertex_colors_.push_back((f1 * c0 + f0 * c1) / (f0 + f1));
+							}
+						}
+						edge_to_index[i] = vertex;
+					}
+					for (int i = 0; tri_table[cube_index][i] != -1; i += 3) {
+						mesh->triangles_.push_back(Eigen::Vector3i(edge_to_index[tri_table[cube_index][i]],
+							edge_to_index[tri_table[cube_index][i + 2]],
+							edge_to_index[tri_table[cube_index][i + 1]]));
+					}
+				}
+			}
+		}
+		return mesh;
+	}
+}
@@ -0,0 +1,264 @@
+#include "stdafx.h"
+#include "Instrumentation.h"
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <thread>
+
+namespace ark {
+
+    namespace {
+        const int kNumStages = (int)Instrumentation::Stage::NumStages;
+        const int kNumQueues = (int)Instrumentation::Queue::NumQueues;
+
+        const char * const kStageNames[] = {
+            "camera_update", "push_frame", "estimator_output", "keyframe_construction",
+            "loop_detection", "map_update", "pose_graph_optimization", "handler_execution",
+            "tsdf_integration"
+        };
+        const char * const kQueueNames[] = {
+            "frames", "estimator_output", "loop_candidates", "loop_results", "pending_constraints",
+            "tsdf_integration"
+        };
+
+        struct Histogram {
+            std::atomic<uint64_t> count{ 0 };
+            std::atomic<uint64_t> sumUs{ 0 };
+            std::atomic<uint64_t> maxUs{ 0 };
+            std::atomic<uint64_t> buckets[Instrumentation::kNumBuckets];
+        };
+
+        struct Gauge {
+            std::atomic<uint64_t> samples{ 0 };
+            std::atomic<uint64_t> sum{ 0 };
+            std::atomic<uint64_t> max{ 0 };
+            std::atomic<uint64_t> last{ 0 };
+        };
+
+        Histogram histograms[kNumStages];
+        Gauge gauges[kNumQueues];
+
+        void atomicMax(std::atomic<uint64_t> & target, uint64_t value) {
+            uint64_t current = target.load(std::memory_order_relaxed);
+            while (current < value &&
+                !target.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+            }
+        }
+
+        /** Index of the log2 bucket holding a latency: bucket i holds [2^i, 2^(i+1)) us, bucket 0 also 0us */
+        int bucketIndex(uint64_t us) {
+            int index = 0;
+            while (us > 1 && index < Instrumentation::kNumBuckets - 1) {
+                us >>= 1;
+                ++index;
+            }
+            return index;
+        }
+
+        double percentileMs(const Instrumentation::StageSummary & summary, double q) {
+            if (summary.count == 0) return 0.0;
+            const uint64_t rank = (uint64_t)std::ceil(q * summary.count);
+            uint64_t seen = 0;
+            for (int i = 0; i < Instrumentation::kNumBuckets; ++i) {
+                seen += summary.buckets[i];
+                if (seen >= rank) {
+                    // upper edge of the bucket, never above the largest sample
+                    return std::min((double)(1ULL << (i + 1)) * 1e-3, summary.maxMs);
+                }
+            }
+            return summary.maxMs;
+        }
+
+        std::mutex reporterMutex;
+        std::condition_variable reporterCv;
+        bool reporterStop = false;
+
+        /** Stops the reporter at static destruction, where destroying a joinable std::thread would
+         *  call std::terminate; declared after the mutex and condition variable it still uses */
+        struct Reporter {
+            std::thread thread;
+            ~Reporter() {
+                Instrumentation::stopPeriodicLog();
+            }
+        };
+        Reporter reporter;
+    }
+
+    std::atomic<bool> Instrumentation::enabled_(false);
+
+    void Instrumentation::setEnabled(bool enabled) {
+        enabled_.store(enabled, std::memory_order_relaxed);
+    }
+
+    void Instrumentation::record(Stage stage, std::chrono::steady_clock::duration latency) {
+        const int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+        const uint64_t value = us > 0 ? (uint64_t)us : 0;
+        Histogram & h = histograms[(int)stage];
+        h.count.fetch_add(1, std::memory_order_relaxed);
+        h.sumUs.fetch_add(value, std::memory_order_relaxed);
+        h.buckets[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+        atomicMax(h.maxUs, value);
+    }
+
+    void Instrumentation::record(Queue queue, size_t depth) {
+        Gauge & g = gauges[(int)queue];
+        g.samples.fetch_add(1, std::memory_order_relaxed);
+        g.sum.fetch_add(depth, std::memory_order_relaxed);
+        g.last.store(depth, std::memory_order_relaxed);
+        atomicMax(g.max, depth);
+    }
+
+    Instrumentation::StageSummary Instrumentation::getStageSummary(Stage stage) {
+        const Histogram & h = histograms[(int)stage];
+        StageSummary summary;
+        summary.count = h.count.load(std::memory_order_relaxed);
+        const uint64_t sumUs = h.sumUs.load(std::memory_order_relaxed);
+        summary.meanMs = summary.count ? sumUs * 1e-3 / summary.count : 0.0;
+        summary.maxMs = h.maxUs.load(std::memory_order_relaxed) * 1e-3;
+        for (int i = 0; i < kNumBuckets; ++i) {
+            summary.buckets[i] = h.buckets[i].load(std::memory_order_relaxed);
+        }
+        summary.p50Ms = percentileMs(summary, 0.5);
+        summary.p90Ms = percentileMs(summary, 0.9);
+        summary.p99Ms = percentileMs(summary, 0.99);
+        return summary;
+    }
+
+    Instrumentation::QueueSummary Instrumentation::getQueueSummary(Queue queue) {
+        const Gauge & g = gauges[(int)queue];
+        QueueSummary summary;
+        summary.samples = g.samples.load(std::memory_order_relaxed);
+        summary.mean = summary.samples ? (double)g.sum.load(std::memory_order_relaxed) / summary.samples : 0.0;
+        summary.max = g.max.load(std::memory_order_relaxed);
+        summary.last = g.last.load(std::memory_order_relaxed);
+        return summary;
+    }
+
+    const char * Instrumentation::stageName(Stage stage) {
+        return kStageNames[(int)stage];
+    }
+
+    const char * Instrumentation::queueName(Queue queue) {
+        return kQueueNames[(int)queue];
+    }
+
+    void Instrumentation::reset() {
+        for (Histogram & h : histograms) {
+            h.count = 0;
+            h.sumUs = 0;
+            h.maxUs = 0;
+            for (std::atomic<uint64_t> & bucket : h.buckets) bucket = 0;
+        }
+        for (Gauge & g : gauges) {
+            g.samples = 0;
+            g.sum = 0;
+            g.max = 0;
+            g.last = 0;
+        }
+    }
+
+    bool Instrumentation::writeCSV(const std::string & path) {
+        std::ofstream file(path);
+        if (!file.is_open()) {
+            std::cerr << "Instrumentation: could not open " << path << std::endl;
+            return false;
+        }
+        file << "stage,count,mean_ms,max_ms,p50_ms,p90_ms,p99_ms";
+        for (int i = 0; i < kNumBuckets; ++i) file << ",lt_" << (1ULL << (i + 1)) << "us";
+        file << "\n";
+        for (int s = 0; s < kNumStages; ++s) {
+            const StageSummary summary = getStageSummary((Stage)s);
+            file << kStageNames[s] << "," << summary.count << "," << summary.meanMs << "," << summary.maxMs
+                 << "," << summary.p50Ms << "," << summary.p90Ms << "," << summary.p99Ms;
+            for (int i = 0; i < kNumBuckets; ++i) file << "," << summary.buckets[i];
+            file << "\n";
+        }
+        file << "\nqueue,samples,mean_depth,max_depth,last_depth\n";
+        for (int q = 0; q < kNumQueues; ++q) {
+            const QueueSummary summary = getQueueSummary((Queue)q);
+            file << kQueueNames[q] << "," << summary.samples << "," << summary.mean
+                 << "," << summary.max << "," << summary.last << "\n";
+        }
+        return true;
+    }
+
+    bool Instrumentation::writeJSON(const std::string & path) {
+        std::ofstream file(path);
+        if (!file.is_open()) {
+            std::cerr << "Instrumentation: could not open " << path << std::endl;
+            return false;
+        }
+        file << "{\n  \"stages\": {\n";
+        for (int s = 0; s < kNumStages; ++s) {
+            const StageSummary summary = getStageSummary((Stage)s);
+            file << "    \"" << kStageNames[s] << "\": { \"count\": " << summary.count
+                 << ", \"mean_ms\": " << summary.meanMs << ", \"max_ms\": " << summary.maxMs
+                 << ", \"p50_ms\": " << summary.p50Ms << ", \"p90_ms\": " << summary.p90Ms
+                 << ", \"p99_ms\": " << summary.p99Ms << ", \"buckets_us\": [";
+            for (int i = 0; i < kNumBuckets; ++i) file << (i ? ", " : "") << summary.buckets[i];
+            file << "] }" << (s + 1 < kNumStages ? "," : "") << "\n";
+        }
+        file << "  },\n  \"queues\": {\n";
+        for (int q = 0; q < kNumQueues; ++q) {
+            const QueueSummary summary = getQueueSummary((Queue)q);
+            file << "    \"" << kQueueNames[q] << "\": { \"samples\": " << summary.samples
+                 << ", \"mean_depth\": " << summary.mean << ", \"max_depth\": " << summary.max
+                 << ", \"last_depth\": " << summary.last << " }" << (q + 1 < kNumQueues ? "," : "") << "\n";
+        }
+        file << "  }\n}\n";
+        return true;
+    }
+
+    void Instrumentation::logSummary(std::ostream & os) {
+        const std::ios::fmtflags flags = os.flags();
+        const std::streamsize precision = os.precision();
+        os << std::fixed << std::setprecision(2);
+        os << std::left << std::setw(26) << "stage" << std::right << std::setw(10) << "count"
+           << std::setw(10) << "mean ms" << std::setw(10) << "p50 ms" << std::setw(10) << "p99 ms"
+           << std::setw(10) << "max ms" << "\n";
+        for (int s = 0; s < kNumStages; ++s) {
+            const StageSummary summary = getStageSummary((Stage)s);
+            if (summary.count == 0) continue;
+            os << std::left << std::setw(26) << kStageNames[s] << std::right << std::setw(10) << summary.count
+               << std::setw(10) << summary.meanMs << std::setw(10) << summary.p50Ms
+               << std::setw(10) << summary.p99Ms << std::setw(10) << summary.maxMs << "\n";
+        }
+        for (int q = 0; q < kNumQueues; ++q) {
+            const QueueSummary summary = getQueueSummary((Queue)q);
+            if (summary.samples == 0) continue;
+            os << std::left << std::setw(26) << (std::string("queue ") + kQueueNames[q]) << std::right
+               << " mean depth " << summary.mean << ", max " << summary.max << ", last " << summary.last << "\n";
+        }
+        os.flush();
+        os.flags(flags);
+        os.precision(precision);
+    }
+
+    void Instrumentation::startPeriodicLog(double intervalSeconds, const std::string & jsonPath) {
+        stopPeriodicLog();
+        setEnabled(true);
+        std::lock_guard<std::mutex> lock(reporterMutex);
+        reporterStop = false;
+        reporter.thread = std::thread([intervalSeconds, jsonPath]() {
+            const std::chrono::duration<double> interval(intervalSeconds);
+            std::unique_lock<std::mutex> lock(reporterMutex);
+            while (!reporterCv.wait_for(lock, interval, []() { return reporterStop; })) {
+                logSummary(std::cout);
+                if (!jsonPath.empty()) writeJSON(jsonPath);
+            }
+        });
+    }
+
+    void Instrumentation::stopPeriodicLog() {
+        {
+            std::lock_guard<std::mutex> lock(reporterMutex);
+            reporterStop = true;
+        }
+        reporterCv.notify_all();
+        if (reporter.thread.joinable()) reporter.thread.join();
+    }
+}
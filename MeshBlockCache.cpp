@@ -0,0 +1,153 @@
+#include "stdafx.h"
+#include "MeshBlockCache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace ark {
+
+	namespace {
+		const char kMagic[8] = { 'O', 'A', 'R', 'K', 'M', 'S', 'H', '\0' };
+		const uint32_t kEndianTag = 0x01020304;
+
+		struct BlockHeader {
+			char magic[8];
+			uint32_t version;
+			uint32_t endianTag;
+			uint64_t numVertices;
+			uint64_t numColors;
+			uint64_t numTriangles;
+		};
+
+		static_assert(sizeof(BlockHeader) == 40, "MeshBlockCache: unexpected BlockHeader layout");
+		static_assert(sizeof(Eigen::Vector3d) == 3 * sizeof(double), "MeshBlockCache: Vector3d is not 3 packed doubles");
+		static_assert(sizeof(Eigen::Vector3i) == 3 * sizeof(int32_t), "MeshBlockCache: Vector3i is not 3 packed int32");
+
+		template <class T>
+		bool writeArray(std::ofstream & out, const std::vector<T> & array) {
+			out.write(reinterpret_cast<const char *>(array.data()), (std::streamsize)(array.size() * sizeof(T)));
+			return out.good();
+		}
+
+		template <class T>
+		bool readArray(std::ifstream & in, std::vector<T> & array, uint64_t size) {
+			array.resize((size_t)size);
+			in.read(reinterpret_cast<char *>(array.data()), (std::streamsize)(array.size() * sizeof(T)));
+			return in.good();
+		}
+	}
+
+	MeshBlockCache::MeshBlockCache(const std::string & directory, size_t budget_bytes) :
+		directory_(directory), budget_bytes_(budget_bytes) {
+	}
+
+	MeshBlockCache::~MeshBlockCache() {
+		for (int id : cached_) {
+			std::remove(PathOf(id).c_str());
+		}
+	}
+
+	size_t MeshBlockCache::MeshBytes(const open3d::geometry::TriangleMesh & mesh) {
+		return mesh.vertices_.capacity() * sizeof(Eigen::Vector3d) +
+			mesh.vertex_colors_.capacity() * sizeof(Eigen::Vector3d) +
+			mesh.triangles_.capacity() * sizeof(Eigen::Vector3i);
+	}
+
+	void MeshBlockCache::SetResident(int id, const open3d::geometry::TriangleMesh & mesh) {
+		const size_t bytes = MeshBytes(mesh);
+		auto it = resident_.find(id);
+		if (it != resident_.end()) {
+			resident_bytes_ -= it->second.bytes;
+			it->second.bytes = bytes;
+			lru_.splice(lru_.begin(), lru_, it->second.position);
+		} else {
+			lru_.push_front(id);
+			resident_[id] = Entry{ lru_.begin(), bytes };
+		}
+		resident_bytes_ += bytes;
+	}
+
+	void MeshBlockCache::Touch(int id) {
+		auto it = resident_.find(id);
+		if (it != resident_.end()) {
+			lru_.splice(lru_.begin(), lru_, it->second.position);
+		}
+	}
+
+	bool MeshBlockCache::Spill(int id, const open3d::geometry::TriangleMesh & mesh) {
+		if (!cached_.count(id)) {
+			boost::system::error_code error;
+			boost::filesystem::create_directories(directory_, error);
+
+			const std::string path = PathOf(id);
+			const std::string temp_path = path + ".tmp";
+			std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+			BlockHeader header;
+			std::memcpy(header.magic, kMagic, sizeof(kMagic));
+			header.version = kVersion;
+			header.endianTag = kEndianTag;
+			header.numVertices = mesh.vertices_.size();
+			header.numColors = mesh.vertex_colors_.size();
+			header.numTriangles = mesh.triangles_.size();
+			out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+			const bool written = out.good() && writeArray(out, mesh.vertices_) &&
+				writeArray(out, mesh.vertex_colors_) && writeArray(out, mesh.triangles_);
+			out.close();
+			if (!written || out.fail() || std::rename(temp_path.c_str(), path.c_str()) != 0) {
+				std::cerr << "MeshBlockCache: could not write " << path << ", keeping block " << id << " in memory" << std::endl;
+				std::remove(temp_path.c_str());
+				return false;
+			}
+			cached_.insert(id);
+		}
+
+		auto it = resident_.find(id);
+		if (it != resident_.end()) {
+			resident_bytes_ -= it->second.bytes;
+			lru_.erase(it->second.position);
+			resident_.erase(it);
+		}
+		spills_++;
+		return true;
+	}
+
+	std::shared_ptr<open3d::geometry::TriangleMesh> MeshBlockCache::Load(int id) const {
+		if (!cached_.count(id)) {
+			std::cerr << "MeshBlockCache: block " << id << " was never spilled" << std::endl;
+			return nullptr;
+		}
+		const std::string path = PathOf(id);
+		std::ifstream in(path, std::ios::binary);
+		BlockHeader header;
+		in.read(reinterpret_cast<char *>(&header), sizeof(header));
+		if (!in.good() || std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+			header.version != kVersion || header.endianTag != kEndianTag) {
+			std::cerr << "MeshBlockCache: " << path << " is not a mesh block of version " << kVersion << std::endl;
+			return nullptr;
+		}
+		auto mesh = std::make_shared<open3d::geometry::TriangleMesh>();
+		if (!readArray(in, mesh->vertices_, header.numVertices) || !readArray(in, mesh->vertex_colors_, header.numColors) ||
+			!readArray(in, mesh->triangles_, header.numTriangles)) {
+			std::cerr << "MeshBlockCache: " << path << " is truncated" << std::endl;
+			return nullptr;
+		}
+		loads_++;
+		return mesh;
+	}
+
+	MeshBlockCache::Stats MeshBlockCache::GetStats() const {
+		Stats stats;
+		stats.resident = resident_.size();
+		stats.residentBytes = resident_bytes_;
+		stats.cached = cached_.size();
+		stats.spills = spills_;
+		stats.loads = loads_;
+		return stats;
+	}
+
+	std::string MeshBlockCache::PathOf(int id) const {
+		return (boost::filesystem::path(directory_) / ("block" + std::to_string(id) + ".bin")).string();
+	}
+}
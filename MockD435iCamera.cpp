@@ -2,6 +2,7 @@
 #include "Version.h"
 #include "MockD435iCamera.h"
 #include "Visualizer.h"
+#include "RS2Deprojection.h"
 #include <librealsense2/rs.hpp>
 #include <librealsense2/rsutil.h>
 #include <librealsense2/hpp/rs_pipeline.hpp>
@@ -99,36 +100,6 @@ cv::Mat MockD435iCamera::loadImg(path filename)
     return imread(filename.string(), cv::IMREAD_COLOR);
 }
 
-void MockD435iCamera::project(const cv::Mat &depth_frame, cv::Mat &xyz_map)
-{
-    const uint16_t *depth_data = (const uint16_t *)depth_frame.data;
-
-    rs2_intrinsics *dIntrin = &depthIntrinsics;
-
-    const uint16_t *srcPtr;
-    cv::Vec3f *destPtr;
-    float srcPixel[2], destXYZ[3];
-
-    for (int r = 0; r < height; ++r)
-    {
-        srcPtr = depth_data + r * dIntrin->width;
-        destPtr = xyz_map.ptr<Vec3f>(r);
-        srcPixel[1] = r;
-
-        for (int c = 0; c < width; ++c)
-        {
-            if (srcPtr[c] == 0)
-            {
-                memset(&destPtr[c], 0, 3 * sizeof(float));
-                continue;
-            }
-            srcPixel[0] = c;
-            rs2_deproject_pixel_to_point(destXYZ, dIntrin, srcPixel, srcPtr[c]);
-            memcpy(&destPtr[c], destXYZ, 3 * sizeof(float));
-        }
-    }
-}
-
 void MockD435iCamera::update(MultiCameraFrame &frame)
 {
     std::string line;
@@ -176,9 +147,8 @@ void MockD435iCamera::update(MultiCameraFrame &frame)
     // std::cout << "RGB Size: " << frame.images_[3].total() << " type: " << frame.images_[3].type() << "\n";
     // std::cout << "DEPTH Size: " << frame.images_[4].total() << " type: " << frame.images_[4].type() << "\n";
 
-    frame.images_[2] = cv::Mat(cv::Size(width,height), CV_32FC3);
-    project(frame.images_[4], frame.images_[2]);
-    frame.images_[2] = frame.images_[2]*scale;
+    // built on demand from the depth image at 4
+    rs2util::attachLazyXYZMap(frame, 2, frame.images_[4], depthIntrinsics, scale);
 
     // std::cout << "Depth cloud: " << frame.images_[2].total() << "\n";
 }
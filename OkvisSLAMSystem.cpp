@@ -1,12 +1,19 @@
 #include "stdafx.h"
 #include "OkvisSLAMSystem.h"
+#include "Instrumentation.h"
+#include "FlatVocabulary.h"
 
 namespace ark {
 
     OkvisSLAMSystem::OkvisSLAMSystem(const std::string & strVocFile, const std::string & strSettingsFile) :
-        start_(0.0), t_imu_(0.0), deltaT_(1.0), num_frames_(0), kill(false), 
+        start_(0.0), t_imu_(0.0), deltaT_(1.0), num_frames_(0), kill(false),
+        frame_queue_(kFrameQueueCapacity_, OverflowPolicy::DropOldest),
+        frame_data_queue_(kFrameDataQueueCapacity_, OverflowPolicy::Block),
+        loop_candidate_queue_(kLoopCandidateQueueCapacity_, OverflowPolicy::DropOldest),
+        loop_result_queue_(kLoopResultQueueCapacity_, OverflowPolicy::Block),
         sparse_maps_(), active_map_index(-1), map_id_counter_(0), new_map_checker(false),map_timer(0),
-        strVocFile(strVocFile), matcher_(nullptr), bowId_(0), lastLoopClosureTimestamp_(0) {
+        strVocFile(strVocFile), matcher_(nullptr), bowId_(0), frameIdOffset_(0), framesPushed_(false), lastLoopClosureTimestamp_(0),
+        loopVerificationsSkipped_(0), loopClosuresImplausible_(0), loopMatchesCulled_(0), loopClosuresVerified_(0), loopClosuresRejected_(0) {
 
         okvis::VioParametersReader vio_parameters_reader;
         try {
@@ -20,7 +27,8 @@ namespace ark {
         //okvis::VioParameters parameters;
         vio_parameters_reader.getParameters(parameters_);
 
-        setEnableLoopClosure(parameters_.loopClosureParameters.enabled,strVocFile,true, new brisk::BruteForceMatcher());
+        //no cv matcher given: descriptors are matched with the SIMD HammingMatcher
+        setEnableLoopClosure(parameters_.loopClosureParameters.enabled,strVocFile,true, nullptr);
         createNewMap();
 
         //initialize Visual odometry
@@ -29,13 +37,15 @@ namespace ark {
 
         //Okvis's outframe is our inframe
         auto frame_callback = [this](const okvis::Time& timestamp, okvis::OutFrameData::Ptr frame_data) {
-            frame_data_queue_.enqueue({ frame_data,timestamp });
+            frame_data_queue_.enqueue({ frame_data, timestamp, std::chrono::steady_clock::now() },
+                    static_cast<int64_t>(timestamp.toNSec()));
         };
 
         okvis_estimator_->setFrameCallback(frame_callback);
 
         //at thread to pull from queue and call our own callbacks
         frameConsumerThread_ = std::thread(&OkvisSLAMSystem::FrameConsumerLoop, this);
+        loopClosureThread_ = std::thread(&OkvisSLAMSystem::LoopClosureLoop, this);
 
         frame_data_queue_.clear();
         frame_queue_.clear();
@@ -46,63 +56,84 @@ namespace ark {
         //Do nothing, starts automatically
     }
 
+    bool OkvisSLAMSystem::checkEstimatorReset(bool haveFrameData) {
+        const bool isReset = okvis_estimator_->isReset();
+        if (isReset && !new_map_checker) {
+            if (map_timer >= kMapCreationCooldownFrames_) {
+                cout << "Created new map" << endl;
+                new_map_checker = true;
+                createNewMap();
+            }
+            map_timer = 0;
+        } else if (!isReset && new_map_checker) {
+            // estimator recovered: anything still queued belongs to the old map,
+            // unless we are already holding fresh output
+            if (!haveFrameData) {
+                frame_queue_.clear();
+                frame_data_queue_.clear();
+            }
+            new_map_checker = false;
+        }
+
+        if (isReset) {
+            frame_queue_.clear();
+            frame_data_queue_.clear();
+        } else if (haveFrameData && map_timer <= kMapCreationCooldownFrames_) {
+            map_timer++;
+        }
+        return isReset;
+    }
+
+    void OkvisSLAMSystem::recordQueueWait(const std::chrono::steady_clock::time_point& published) {
+        const std::chrono::steady_clock::duration wait = std::chrono::steady_clock::now() - published;
+        Instrumentation::recordLatency(Instrumentation::Stage::EstimatorOutput, wait);
+        Instrumentation::recordQueueDepth(Instrumentation::Queue::EstimatorOutput, frame_data_queue_.size());
+        const double waitMs = std::chrono::duration<double, std::milli>(wait).count();
+        std::lock_guard<std::mutex> lock(queueWaitMutex_);
+        queueWaitStats_.count++;
+        queueWaitStats_.lastMs = waitMs;
+        queueWaitStats_.meanMs += (waitMs - queueWaitStats_.meanMs) / queueWaitStats_.count;
+        queueWaitStats_.maxMs = std::max(queueWaitStats_.maxMs, waitMs);
+    }
+
+    OkvisSLAMSystem::QueueWaitStats OkvisSLAMSystem::getQueueWaitStats() {
+        std::lock_guard<std::mutex> lock(queueWaitMutex_);
+        return queueWaitStats_;
+    }
+
     void OkvisSLAMSystem::FrameConsumerLoop() {
         while (!kill) {
              
-            //Get processed frame data from OKVIS
+            //Get processed frame data from OKVIS, blocks until OKVIS publishes output or we shut down
             StampedFrameData frame_data;
-            while (!frame_data_queue_.try_dequeue(&frame_data)) {
-                if (okvis_estimator_->isReset() && !new_map_checker) {
-                    if(map_timer >= kMapCreationCooldownFrames_)
-                    {
-                        cout<<"Created new map"<<endl;
-                        new_map_checker = true;
-                        createNewMap();
-                    }
-                    map_timer=0;
-                    
-                } else if (!okvis_estimator_->isReset() && new_map_checker) {
-                    frame_queue_.clear();
-                    frame_data_queue_.clear();
-                    new_map_checker = false;
-                }
-                if (okvis_estimator_->isReset()) {
-                    frame_queue_.clear();
-                    frame_data_queue_.clear();
-                }
-                else
-                {
-                    if(map_timer<=kMapCreationCooldownFrames_)
-                        map_timer++;
-                }
-                
-                if(kill)
-                    return;
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
-            }
-            //Get the corresponding frame from queue
-            WrappedMultiCameraFrame wrapped_frame;
-            bool frame_found = false;
-            do {
-                if (!(frame_found = frame_queue_.try_dequeue(&wrapped_frame))) {
-                    break;
-                } 
-            } while (okvis::Time(wrapped_frame.frame->timestamp_) < frame_data.timestamp);
-            if (!frame_found){
+            const bool haveFrameData = frame_data_queue_.waitDequeue(&frame_data,
+                    std::chrono::milliseconds(kResetCheckIntervalMs_));
+            if (kill)
+                return;
+            if (haveFrameData)
+                recordQueueWait(frame_data.published);
+            // held while the maps are updated, released before the handlers run (they may call SaveMap)
+            std::unique_lock<std::mutex> mapsLock(mapsMutex_);
+            if (checkEstimatorReset(haveFrameData) || !haveFrameData)
+                continue;
+
+            //Look up the corresponding frame directly by timestamp, dropping older frames OKVIS skipped
+            MultiCameraFrame::Ptr out_frame;
+            if (!frame_queue_.dequeueKey(static_cast<int64_t>(frame_data.timestamp.toNSec()),
+                        kTimestampToleranceNs_, &out_frame)) {
                 std::cout << "ERROR, FRAME NOT FOUND, THIS SHOULDN'T HAPPEN\n";
                 continue;
             }
 
             //construct output frame
-            MultiCameraFrame::Ptr out_frame = wrapped_frame.frame;
-            out_frame->frameId_ = frame_data.data->id;
+            out_frame->frameId_ = frame_data.data->id + frameIdOffset_;
             out_frame->T_KS_ = frame_data.data->T_KS.T();
-            out_frame->keyframeId_ = frame_data.data->keyframe_id;
+            out_frame->keyframeId_ = frame_data.data->keyframe_id + frameIdOffset_;
 
             //add sensor transforms
             //Note: this could potentially just be done once for the system
             //Including here for now in case we switch to optimized results
-            for (size_t i = 0; i <  wrapped_frame.frame->images_.size(); i++) {
+            for (size_t i = 0; i < out_frame->images_.size(); i++) {
                 okvis::kinematics::Transformation T_SC;
                 if (i < parameters_.nCameraSystem.numCameras()) {
                     T_SC = (*parameters_.nCameraSystem.T_SC(i));
@@ -117,11 +148,11 @@ namespace ark {
                 out_frame->T_SC_.push_back(T_SC.T());
             }
 
-            bool loopClosureDetected = false;
             bool mapsMerged = false;
             int deleted_map_index = -1;
             //check if keyframe
             if(frame_data.data->is_keyframe){
+                Instrumentation::ScopedTimer keyframeTimer(Instrumentation::Stage::KeyframeConstruction);
                 if(out_frame->keyframeId_!=out_frame->frameId_){
                     std::cout << "ERROR, KEYFRAME ID INCORRECT, THIS SHOULDN'T HAPPEN\n";
                     continue;
@@ -131,71 +162,53 @@ namespace ark {
                 keyframe->T_WS_ = frame_data.data->T_WS.T();
                 keyframe->T_SC_ = out_frame->T_SC_;
                 keyframe->timestamp_ = out_frame->timestamp_;
-                //copy keypoints and descriptors to output
-                keyframe->keypoints_.resize(frame_data.data->keypoints.size());
-                keyframe->keypoints3dh_C.resize(frame_data.data->keypoints.size());
-                keyframe->descriptors_.resize(frame_data.data->descriptors.size());
+                //pack keypoints, descriptors and 3d points into the keyframe; copying releases
+                //OKVIS' descriptor buffers
+                std::vector<std::vector<cv::Vec3f>> keypointPoints(frame_data.data->keypoints.size());
+                std::vector<cv::Point2f> keypointPixels;
                 for(size_t cam_idx=0 ; cam_idx<frame_data.data->keypoints.size() ; cam_idx++){
-                    keyframe->keypoints_[cam_idx].resize(frame_data.data->keypoints[cam_idx].size());  
-
-                    keyframe->keypoints3dh_C[cam_idx].resize(frame_data.data->keypoints[cam_idx].size());
-                    //get transform of the camera
+                    //get estimated 3d position of the keypoints in current camera frame,
+                    //deprojecting only these pixels instead of the whole XYZ map
+                    keypointPixels.resize(frame_data.data->keypoints[cam_idx].size());
                     for(int i=0; i<frame_data.data->keypoints[cam_idx].size(); i++){
-                        //copy keypoint
-                        keyframe->keypoints_[cam_idx][i] = frame_data.data->keypoints[cam_idx][i];
-                        //get estimated 3d position of keypoint in current camera frame
-                        cv::Vec3f pt3d = out_frame->images_[2].at<cv::Vec3f>(
-                            std::round(keyframe->keypoints_[cam_idx][i].pt.y),
-                            std::round(keyframe->keypoints_[cam_idx][i].pt.x));
-                        if(pt3d[2] >0)
-                            keyframe->keypoints3dh_C[cam_idx][i] = Eigen::Vector4d(pt3d[0],pt3d[1],pt3d[2],1);
-                        else
-                            keyframe->keypoints3dh_C[cam_idx][i] = Eigen::Vector4d(0,0,0,0);
+                        keypointPixels[i] = frame_data.data->keypoints[cam_idx][i].pt;
                     }
-                    keyframe->descriptors_[cam_idx]=frame_data.data->descriptors[cam_idx];
+                    out_frame->deprojectPixels(keypointPixels, keypointPoints[cam_idx]);
                 }
+                keyframe->features_.pack(frame_data.data->keypoints, frame_data.data->descriptors, keypointPoints);
 
                 // apply correction
                 keyframe->T_WS_ = correction_ * keyframe->T_WS_;
                 MapKeyFrame::Ptr loop_kf = nullptr;
                 Eigen::Affine3d transformEstimate;
-                if (getActiveMap()->getNumKeyframes() >= kMinimumKeyframes_
-                        && detectLoopClosure(keyframe, loop_kf, transformEstimate)) {
-                    //cout << "Loop closure detected" << endl;
-                    loopClosureDetected = true;
-                    for (auto it = sparse_maps_.begin(); it != sparse_maps_.end(); it++) {
-                        int mapId = it->first;
-                        auto sparseMap = it->second;
-                        if (mapId == active_map_index)
-                            continue;
-                        
-                        if (sparseMap->getKeyframe(loop_kf->frameId_) != nullptr) {
-                            cout << "MapMerge: maps " << mapId << " with " << active_map_index <<
-                                    " and frames " << keyframe->frameId_ << " with " << loop_kf->frameId_ << endl;
-                            auto mergedMap = mergeMaps(sparseMap, getActiveMap(), keyframe, loop_kf, transformEstimate);
-                            if (mergedMap == sparseMap) {
-                                sparse_maps_.erase(active_map_index);
-                                deleted_map_index = active_map_index;
-                                active_map_index = mapId;
-                            } else {
-                                sparse_maps_.erase(mapId);
-                                deleted_map_index = mapId;
-                            }
-                            
-                            mapsMerged = true;
-                            break;
-                        }
-                    }
-                }
-                
-                if (!mapsMerged) {
-                    getActiveMap()->addKeyframe(keyframe, loop_kf, transformEstimate);
+                const bool detectLoops = useLoopClosures_ && getActiveMap()->getNumKeyframes() >= kMinimumKeyframes_;
+                getActiveMap()->addKeyframe(keyframe, loop_kf, transformEstimate);
+                KeyframeCullingOptions cullingOptions;
+                {
+                    std::lock_guard<std::mutex> lock(cullingMutex_);
+                    cullingOptions = cullingOptions_;
                 }
+                std::vector<int> culled;
+                if (getActiveMap()->cullKeyframes(cullingOptions, culled) > 0)
+                    forgetCulledKeyframes(culled);
+                // loop detection runs on the loop closure thread; when it falls behind the oldest
+                // candidates are dropped so the keyframe path never waits on verification
+                if (detectLoops)
+                    loop_candidate_queue_.enqueue({ keyframe, getActiveMap() });
             }
 
+            // apply loop closures verified since the last frame
+            Instrumentation::recordQueueDepth(Instrumentation::Queue::LoopResults, loop_result_queue_.size());
+            mapsMerged = applyLoopClosureResults(deleted_map_index);
+
+            // pick up pose graph solutions the optimizer thread finished since the last frame
+            bool trajectoryUpdated = getActiveMap()->applyOptimizedPoses() || mapsMerged;
+
             out_frame->keyframe_ = getActiveMap()->getKeyframe(out_frame->keyframeId_);
+            mapsLock.unlock();
 
             //Notify callbacks
+            Instrumentation::ScopedTimer handlerTimer(Instrumentation::Stage::HandlerExecution);
             if (mapsMerged) {
                 for (MapSparseMapMergeHandler::const_iterator callback_iter = mMapSparseMapMergeHandler.begin();
                         callback_iter != mMapSparseMapMergeHandler.end(); ++callback_iter) {
@@ -218,7 +231,7 @@ namespace ark {
                 pair.second(out_frame);
             }
 
-            if (loopClosureDetected) {
+            if (trajectoryUpdated) {
                 for (MapLoopClosureDetectedHandler::const_iterator callback_iter = mMapLoopClosureHandler.begin();
                     callback_iter != mMapLoopClosureHandler.end(); ++callback_iter) {
                     const MapLoopClosureDetectedHandler::value_type& pair = *callback_iter;
@@ -272,6 +285,8 @@ namespace ark {
     void OkvisSLAMSystem::PushFrame(MultiCameraFrame::Ptr frame){
         if (okvis_estimator_ == nullptr)
             return;
+        framesPushed_ = true;
+        Instrumentation::ScopedTimer timer(Instrumentation::Stage::PushFrame);
         okvis::Time t_image(frame->timestamp_ / 1e9);
         if (start_ == okvis::Time(0.0)) {
             start_ = t_image;
@@ -279,7 +294,8 @@ namespace ark {
 
         if (t_image - start_ > deltaT_) {
             if(mMapFrameAvailableHandler.size()>0){
-                frame_queue_.enqueue({ frame});
+                frame_queue_.enqueue(frame, static_cast<int64_t>(t_image.toNSec()));
+                Instrumentation::recordQueueDepth(Instrumentation::Queue::Frames, frame_queue_.size());
             }
             num_frames_++;
             for (size_t i = 0; i < frame->images_.size(); i++) {
@@ -326,6 +342,7 @@ namespace ark {
         sparse_maps_[map_id_counter_] = newMap;
         active_map_index = map_id_counter_;
         map_id_counter_ ++;
+        std::atomic_store(&publishedActiveMap_, newMap);
         correction_ = Eigen::Matrix4d::Identity();
         for (MapSparseMapCreationHandler::const_iterator callback_iter = mMapSparseMapCreationHandler.begin();
             callback_iter != mMapSparseMapCreationHandler.end(); ++callback_iter) {
@@ -341,7 +358,12 @@ namespace ark {
         if(useLoopClosures_){
             std::cout << "Loading Vocabulary From: " << vocabPath << std::endl;
             vocab_.reset(new DBoW2::TemplatedVocabulary<DBoW2::FBRISK::TDescriptor, DBoW2::FBRISK>());
-            if(!binaryVocab){
+            if(FlatVocabulary::isFlatFile(vocabPath)){
+                // precompiled by OpenARK_vocab_converter: mapped instead of parsed, then copied node
+                // by node into vocab_ since DLoopDetector needs a TemplatedVocabulary
+                FlatVocabulary::Ptr flatVocab = FlatVocabulary::load(vocabPath);
+                if (flatVocab) flatVocab->toVocabulary(*vocab_);
+            }else if(!binaryVocab){
                 vocab_->load(vocabPath);
             }else{
                 vocab_->binaryLoad(vocabPath); //Note: Binary Loading only supported for ORB/BRISK vocabularies
@@ -362,7 +384,190 @@ namespace ark {
         }
     }
 
-    bool OkvisSLAMSystem::detectLoopClosure(MapKeyFrame::Ptr kf, MapKeyFrame::Ptr &loop_kf, Eigen::Affine3d &transformEstimate) {
+    void OkvisSLAMSystem::LoopClosureLoop() {
+        while (!kill) {
+            replayLoadedKeyframes();
+            LoopCandidate candidate;
+            if (!loop_candidate_queue_.waitDequeue(&candidate, std::chrono::milliseconds(kResetCheckIntervalMs_)))
+                continue;
+
+            // when keyframes pile up, keep the BoW database fed but skip the expensive verification
+            const size_t waiting = loop_candidate_queue_.size();
+            Instrumentation::recordQueueDepth(Instrumentation::Queue::LoopCandidates, waiting);
+            const bool verify = waiting < kLoopCandidateSaturation_;
+            MapKeyFrame::Ptr loop_kf = nullptr;
+            Eigen::Affine3d transformEstimate;
+            bool detected;
+            {
+                Instrumentation::ScopedTimer timer(Instrumentation::Stage::LoopDetection);
+                detected = detectLoopClosure(candidate, loop_kf, transformEstimate, verify);
+            }
+            if (detected) {
+                LoopClosureResult result;
+                result.kf = candidate.kf;
+                result.loop_kf = loop_kf;
+                result.transformEstimate = transformEstimate;
+                loop_result_queue_.enqueue(result);
+            }
+        }
+    }
+
+    void OkvisSLAMSystem::setKeyframeCulling(const KeyframeCullingOptions& options) {
+        std::lock_guard<std::mutex> lock(cullingMutex_);
+        cullingOptions_ = options;
+    }
+
+    void OkvisSLAMSystem::forgetCulledKeyframes(const std::vector<int>& frameIds) {
+        std::lock_guard<std::mutex> lock(bowMutex_);
+        for (size_t i = 0; i < frameIds.size(); i++) {
+            std::unordered_map<int, int>::iterator entry = bowIdOfFrame_.find(frameIds[i]);
+            if (entry == bowIdOfFrame_.end())
+                continue;
+            bowFrameMap_.erase(entry->second);
+            bowIdOfFrame_.erase(entry);
+        }
+    }
+
+    void OkvisSLAMSystem::replayLoadedKeyframes() {
+        std::deque<MapKeyFrame::Ptr> keyframes;
+        {
+            std::lock_guard<std::mutex> lock(bowMutex_);
+            keyframes.swap(bowReplay_);
+        }
+        if (keyframes.empty() || !useLoopClosures_ || detector_ == nullptr)
+            return;
+
+        // same bookkeeping as detectLoopClosure, without verification
+        for (size_t i = 0; i < keyframes.size() && !kill; i++) {
+            MapKeyFrame::Ptr kf = keyframes[i];
+            if (kf->numKeypoints(0) == 0)
+                continue;
+            std::vector<cv::Mat> bowDesc;
+            kf->descriptorsAsVec(0, bowDesc);
+            DLoopDetector::DetectionResult result;
+            auto keypoints = kf->keypoints(0);
+            detector_->detectLoop(keypoints, bowDesc, result);
+            if (!result.detection()) {
+                std::lock_guard<std::mutex> lock(bowMutex_);
+                bowFrameMap_[bowId_] = kf;
+                bowIdOfFrame_[kf->frameId_] = bowId_;
+                bowId_++;
+            }
+        }
+        std::cout << "Added " << keyframes.size() << " preloaded keyframes to the BoW database\n";
+    }
+
+    bool OkvisSLAMSystem::SaveMap(const std::string& path, int mapIndex) {
+        std::lock_guard<std::mutex> mapsLock(mapsMutex_);
+        auto map = getMap(mapIndex < 0 ? active_map_index : mapIndex);
+        if (map == nullptr)
+            return false;
+        std::vector<int> bowFrameIds;
+        {
+            std::lock_guard<std::mutex> lock(bowMutex_);
+            for (auto it = bowFrameMap_.begin(); it != bowFrameMap_.end(); it++) {
+                if (map->getKeyframe(it->second->frameId_) == it->second)
+                    bowFrameIds.push_back(it->second->frameId_);
+            }
+            // preloaded keyframes the loop closure thread has not reached yet
+            for (size_t i = 0; i < bowReplay_.size(); i++) {
+                if (map->getKeyframe(bowReplay_[i]->frameId_) == bowReplay_[i])
+                    bowFrameIds.push_back(bowReplay_[i]->frameId_);
+            }
+        }
+        if (!map->save(path, bowFrameIds))
+            return false;
+        std::cout << "Saved map " << (mapIndex < 0 ? active_map_index : mapIndex) << " (" << map->getNumKeyframes()
+                  << " keyframes) to " << path << std::endl;
+        return true;
+    }
+
+    bool OkvisSLAMSystem::LoadMap(const std::string& path) {
+        // frame ids are offset past the loaded keyframes, which cannot change under a running session
+        if (framesPushed_) {
+            std::cerr << "LoadMap: frames were already pushed, load maps before the first PushFrame" << std::endl;
+            return false;
+        }
+        std::lock_guard<std::mutex> mapsLock(mapsMutex_);
+        const auto map = std::make_shared<SparseMap<DBoW2::FBRISK::TDescriptor, DBoW2::FBRISK>>();
+        std::vector<int> bowFrameIds;
+        if (!map->load(path, bowFrameIds))
+            return false;
+
+        // OKVIS numbers frames from zero every session, keep new keyframes clear of the loaded ids
+        if (!map->frameMap_.empty())
+            frameIdOffset_ = std::max(frameIdOffset_, map->frameMap_.rbegin()->first + 1);
+
+        const int mapId = map_id_counter_++;
+        sparse_maps_[mapId] = map;
+        {
+            std::lock_guard<std::mutex> lock(bowMutex_);
+            for (size_t i = 0; i < bowFrameIds.size(); i++) {
+                MapKeyFrame::Ptr kf = map->getKeyframe(bowFrameIds[i]);
+                if (kf != nullptr)
+                    bowReplay_.push_back(kf);
+            }
+        }
+        std::cout << "Loaded map " << mapId << " (" << map->getNumKeyframes() << " keyframes) from " << path << std::endl;
+        return true;
+    }
+
+    bool OkvisSLAMSystem::applyLoopClosureResults(int& deleted_map_index) {
+        bool mapsMerged = false;
+        LoopClosureResult result;
+        while (loop_result_queue_.tryDequeue(&result)) {
+            Eigen::Affine3d transformEstimate(result.transformEstimate.matrix());
+            MapKeyFrame::Ptr keyframe = result.kf;
+            MapKeyFrame::Ptr loop_kf = result.loop_kf;
+            if (getActiveMap()->getKeyframe(keyframe->frameId_) == nullptr) {
+                // a new map was started while the closure was being verified
+                continue;
+            }
+            if (getActiveMap()->addLoopClosure(keyframe, loop_kf, transformEstimate)) {
+                continue;
+            }
+
+            for (auto it = sparse_maps_.begin(); it != sparse_maps_.end(); it++) {
+                int mapId = it->first;
+                auto sparseMap = it->second;
+                if (mapId == active_map_index)
+                    continue;
+
+                if (sparseMap->getKeyframe(loop_kf->frameId_) != nullptr) {
+                    cout << "MapMerge: maps " << mapId << " with " << active_map_index <<
+                            " and frames " << keyframe->frameId_ << " with " << loop_kf->frameId_ << endl;
+                    auto mergedMap = mergeMaps(sparseMap, getActiveMap(), keyframe, loop_kf, transformEstimate);
+                    if (mergedMap == sparseMap) {
+                        sparse_maps_.erase(active_map_index);
+                        deleted_map_index = active_map_index;
+                        active_map_index = mapId;
+                    } else {
+                        sparse_maps_.erase(mapId);
+                        deleted_map_index = mapId;
+                    }
+
+                    std::atomic_store(&publishedActiveMap_, mergedMap);
+                    mapsMerged = true;
+                    break;
+                }
+            }
+        }
+        return mapsMerged;
+    }
+
+    OkvisSLAMSystem::LoopClosureStats OkvisSLAMSystem::getLoopClosureStats() const {
+        LoopClosureStats stats;
+        stats.candidates = loop_candidate_queue_.stats();
+        stats.skippedVerifications = loopVerificationsSkipped_;
+        stats.implausible = loopClosuresImplausible_;
+        stats.culledMatches = loopMatchesCulled_;
+        stats.verified = loopClosuresVerified_;
+        stats.rejected = loopClosuresRejected_;
+        return stats;
+    }
+
+    bool OkvisSLAMSystem::detectLoopClosure(const LoopCandidate &candidate, MapKeyFrame::Ptr &loop_kf, Eigen::Affine3d &transformEstimate, bool verify) {
+        MapKeyFrame::Ptr kf = candidate.kf;
         bool shouldDetectLoopClosure = kf->timestamp_-lastLoopClosureTimestamp_>0.2*1e9;
         if(!(useLoopClosures_ && shouldDetectLoopClosure)) {
             return false;
@@ -374,11 +579,33 @@ namespace ark {
         auto local_keypoints = kf->keypoints(0);
         detector_->detectLoop(local_keypoints,bowDesc,result);
         if(result.detection()){
-            loop_kf = bowFrameMap_[result.match];
+            if (!verify) {
+                loopVerificationsSkipped_++;
+                return false;
+            }
+            {
+                std::lock_guard<std::mutex> lock(bowMutex_);
+                std::map<int, MapKeyFrame::Ptr>::iterator match = bowFrameMap_.find(result.match);
+                if (match != bowFrameMap_.end())
+                    loop_kf = match->second;
+            }
+            if (loop_kf == nullptr) {
+                // DBoW2 cannot delete entries, culled keyframes are only unmapped
+                loopMatchesCulled_++;
+                return false;
+            }
+            // the odometry cannot have drifted far enough for this match to be the same place
+            if (!candidate.map->isPlausibleLoopClosure(kf, loop_kf)) {
+                loop_kf = nullptr;
+                loopClosuresImplausible_++;
+                return false;
+            }
         }else{
             //We only want to record a frame if it is not matched with another image
             //no need to duplicate
+            std::lock_guard<std::mutex> lock(bowMutex_);
             bowFrameMap_[bowId_]=kf;
+            bowIdOfFrame_[kf->frameId_]=bowId_;
             bowId_++;
             return false; //pose added to graph, no loop detected, nothing left to do
         }
@@ -386,32 +613,46 @@ namespace ark {
         //transform estimation
         //TODO: should move to function to be set as one of a variety of methods
 
-        //brute force matching
+        //brute force matching (ratio test and mutual check when using the HammingMatcher)
         std::vector<cv::DMatch> matches; 
         //query,train
-        matcher_->match(kf->descriptors(0),loop_kf->descriptors(0), matches);
+        if (matcher_ != nullptr)
+            matcher_->match(kf->descriptors(0),loop_kf->descriptors(0), matches);
+        else
+            hammingMatcher_.match(kf->descriptors(0),loop_kf->descriptors(0), matches);
         std::cout << "detectLoopClosure: " << "sizes: kf: " << kf->descriptors(0).rows << " loop_kf: "
             << loop_kf->descriptors(0).rows << " matches: " << matches.size() << " loop_kf id: " << loop_kf->frameId_ << std::endl;
 
         //get feature point clouds
         typename pcl::PointCloud<pcl::PointXYZ>::Ptr kf_feat_cloud(new pcl::PointCloud<pcl::PointXYZ>());
-        for(int i=0; i<kf->keypoints(0).size(); i++){
-            Eigen::Vector4d kp3dh_C = kf->homogeneousKeypoints3d(0)[i];
+        for(int i=0; i<kf->numKeypoints(0); i++){
+            Eigen::Vector4d kp3dh_C = kf->homogeneousKeypoint3d(0, i);
             kf_feat_cloud->points.push_back(pcl::PointXYZ(kp3dh_C[0],kp3dh_C[1],kp3dh_C[2]));
         } 
         typename pcl::PointCloud<pcl::PointXYZ>::Ptr loop_kf_feat_cloud(new pcl::PointCloud<pcl::PointXYZ>());
-        for(int i=0; i<loop_kf->keypoints(0).size(); i++){
-            Eigen::Vector4d kp3dh_C = loop_kf->homogeneousKeypoints3d(0)[i];
+        for(int i=0; i<loop_kf->numKeypoints(0); i++){
+            Eigen::Vector4d kp3dh_C = loop_kf->homogeneousKeypoint3d(0, i);
             loop_kf_feat_cloud->points.push_back(pcl::PointXYZ(kp3dh_C[0],kp3dh_C[1],kp3dh_C[2]));
         }
 
-        //convert DMatch to correspondence
-        std::vector<int> correspondences(matches.size());
+        //convert DMatch to correspondence, one entry per kf keypoint (-1 if unmatched)
+        std::vector<int> correspondences(kf->numKeypoints(0), -1);
+        int numCorrespondences = 0;
         for(int i=0; i<matches.size(); i++){
-            if(loop_kf->homogeneousKeypoints3d(0)[matches[i].queryIdx][3]!=0 && loop_kf->homogeneousKeypoints3d(0)[matches[i].trainIdx][3]!=0)
+            if(kf->homogeneousKeypoint3d(0, matches[i].queryIdx)[3]!=0 && loop_kf->homogeneousKeypoint3d(0, matches[i].trainIdx)[3]!=0){
                 correspondences[matches[i].queryIdx]=matches[i].trainIdx;
-            else
-                correspondences[matches[i].queryIdx]=-1;;
+                numCorrespondences++;
+            }
+        }
+        //the matches are already filtered (ratio test, mutual check), so the inlier fraction is taken
+        //over the matched keypoints with depth rather than all keypoints, with a floor on the inlier count
+        //so a handful of lucky matches cannot pass
+        const float minInlierRatio = 0.5f;
+        const int minInliers = 15;
+        if(numCorrespondences < minInliers) {
+            loop_kf = nullptr;
+            loopClosuresRejected_++;
+            return false;
         }
         int numInliers;
         std::vector<bool> inliers;
@@ -419,8 +660,9 @@ namespace ark {
         CorrespondenceRansac<pcl::PointXYZ>::getInliersWithTransform(
                 kf_feat_cloud, loop_kf_feat_cloud, correspondences,
                 3, 0.2, 50, numInliers, inliers, transformEstimate);
-        if(((float)numInliers)/correspondences.size()<0.3) {
+        if(numInliers < minInliers || ((float)numInliers)/numCorrespondences < minInlierRatio) {
             loop_kf = nullptr;
+            loopClosuresRejected_++;
             return false; 
         }
 
@@ -429,6 +671,7 @@ namespace ark {
 
         //std::cout << transformEstimate.matrix() << std::endl;
 
+        loopClosuresVerified_++;
         return true;
     }
 
@@ -442,14 +685,12 @@ namespace ark {
         std::shared_ptr<SparseMap<DBoW2::FBRISK::TDescriptor, DBoW2::FBRISK>> mapA;
         std::shared_ptr<SparseMap<DBoW2::FBRISK::TDescriptor, DBoW2::FBRISK>> mapB;
         Eigen::Matrix4d correction;
-        Eigen::Matrix4d kfCorrection;
         Eigen::Matrix4d T_KfKloop = kf->T_SC_[2]*transformEstimate.inverse().matrix()*kf->T_SC_[2].inverse();
         if (olderMap->getNumKeyframes() > currentMap->getNumKeyframes()) {
             //merge current map into older map
             mapA = currentMap;
             mapB = olderMap;
             correction = loop_kf->T_WS() * (kf->T_WS() * T_KfKloop).inverse();
-            kfCorrection = correction;
             correction_ = correction * correction_;
             mapB->currentKeyframeId = mapA->currentKeyframeId;
         } else {
@@ -457,35 +698,15 @@ namespace ark {
             mapA = olderMap;
             mapB = currentMap;
             correction = kf->T_WS() * T_KfKloop * loop_kf->T_WS().inverse();
-            kfCorrection = Eigen::Matrix4d::Identity();
-        }
-
-        //adding keyframes from mapA to mapB
-        for (auto framePair = mapA->frameMap_.begin(); framePair != mapA->frameMap_.end(); framePair++) {
-            auto frame = framePair->second;
-            frame->setOptimizedTransform(correction * frame->T_WS());
-            frame->T_WS_ = correction * frame->T_WS_;
-            mapB->frameMap_[frame->frameId_] = frame;
-		}
-
-        //adding constraints and poses to mapB's pose graph
-        mapB->graph_.constraintMutex.lock();
-        mapA->graph_.constraintMutex.lock();
-        mapB->graph_.constraints_.insert(
-            mapB->graph_.constraints_.end(),
-            mapA->graph_.constraints_.begin(),
-            mapA->graph_.constraints_.end()
-        );
-        mapA->graph_.constraintMutex.unlock();
-        for (auto framePair = mapA->frameMap_.begin(); framePair != mapA->frameMap_.end(); framePair++) {
-            mapB->graph_.poses_.insert(std::pair<int,GraphPose>(
-                framePair->first,framePair->second->T_WS()));
-		}
-        mapB->graph_.constraintMutex.unlock();
-
-        //adding current keyframe to mapB and optimizing pose graph
-        kf->T_WS_ = kfCorrection * kf->T_WS_;
-        mapB->addKeyframe(kf, loop_kf, transformEstimate);
+        }
+
+        //mapA's keyframes and pose graph stay where they are; mapB composes mapA's frame on read
+        //and joins mapA's pose graph on its optimizer thread
+        mapB->merge(mapA, correction);
+
+        //kf was already added to the current map (and moved with its anchor if that map was merged),
+        //so only the loop constraint is left to add before optimizing the merged pose graph
+        mapB->addLoopClosure(kf, loop_kf, transformEstimate);
 
         return mapB;
     }
@@ -501,7 +722,13 @@ namespace ark {
         frame_queue_.clear();
         frame_data_queue_.clear();
         kill=true;
-        frameConsumerThread_.join();
+        frame_data_queue_.close();
+        loop_candidate_queue_.close();
+        loop_result_queue_.close();
+        if (frameConsumerThread_.joinable())
+            frameConsumerThread_.join();
+        if (loopClosureThread_.joinable())
+            loopClosureThread_.join();
         okvis_estimator_.reset();
     }
 
@@ -509,6 +736,13 @@ namespace ark {
         frame_queue_.clear();
         frame_data_queue_.clear();
         kill=true;
+        frame_data_queue_.close();
+        loop_candidate_queue_.close();
+        loop_result_queue_.close();
+        if (frameConsumerThread_.joinable())
+            frameConsumerThread_.join();
+        if (loopClosureThread_.joinable())
+            loopClosureThread_.join();
     }
 
     void OkvisSLAMSystem::RequestStop()
@@ -529,6 +763,12 @@ namespace ark {
         getActiveMap()->getTrajectory(trajOut);
     }
 
+    TrajectorySnapshot::ConstPtr OkvisSLAMSystem::getTrajectorySnapshot(){
+        static const TrajectorySnapshot::ConstPtr empty = std::make_shared<const TrajectorySnapshot>();
+        const auto activeMap = std::atomic_load(&publishedActiveMap_);
+        return activeMap == nullptr ? empty : activeMap->getTrajectorySnapshot();
+    }
+
     std::shared_ptr<SparseMap<DBoW2::FBRISK::TDescriptor, DBoW2::FBRISK>> OkvisSLAMSystem:: getActiveMap() {
         if (sparse_maps_.find(active_map_index) == sparse_maps_.end()) {
             std::cout << "Null map returned \n";
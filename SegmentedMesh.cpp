@@ -1,39 +1,57 @@
 #include "SegmentedMesh.h"
+#include "Instrumentation.h"
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <limits>
 
 namespace ark {
 
-	std::shared_ptr<open3d::geometry::RGBDImage> generateRGBDImageFromCV(cv::Mat color_mat, cv::Mat depth_mat, double max_depth, int width, int height) {
-
-		auto color_im = std::make_shared<open3d::geometry::Image>();
-		color_im->Prepare(width, height, 3, sizeof(uint8_t));
-
-		uint8_t *pi = (uint8_t *)(color_im->data_.data());
-
-		for (int i = 0; i < height; i++) {
-			for (int k = 0; k < width; k++) {
+	bool generateRGBDImageFromCV(const cv::Mat& color_mat, const cv::Mat& depth_mat, double max_depth,
+		open3d::geometry::RGBDImage& rgbd_image) {
 
-				cv::Vec3b pixel = color_mat.at<cv::Vec3b>(i, k);
-
-				*pi++ = pixel[0];
-				*pi++ = pixel[1];
-				*pi++ = pixel[2];
+		if (color_mat.type() != CV_8UC3 || depth_mat.type() != CV_16UC1 || color_mat.size() != depth_mat.size()) {
+			std::cerr << "generateRGBDImageFromCV: expected 8-bit 3 channel color and 16-bit depth of the same size" << std::endl;
+			return false;
+		}
+		const int width = color_mat.cols, height = color_mat.rows;
+
+		// Prepare only reallocates when the size changes
+		open3d::geometry::Image& color_im = rgbd_image.color_;
+		color_im.Prepare(width, height, 3, sizeof(uint8_t));
+		const size_t color_row_bytes = (size_t)width * 3;
+		if (color_mat.isContinuous()) {
+			std::memcpy(color_im.data_.data(), color_mat.data, color_row_bytes * height);
+		} else {
+			for (int i = 0; i < height; i++) {
+				std::memcpy(color_im.data_.data() + i * color_row_bytes, color_mat.ptr<uint8_t>(i), color_row_bytes);
 			}
 		}
 
-
-		auto depth_im = std::make_shared<open3d::geometry::Image>();
-		depth_im->Prepare(width, height, 1, sizeof(uint16_t));
-
-		uint16_t * p = (uint16_t *)depth_im->data_.data();
-
+		// same result as RGBDImage::CreateFromColorAndDepth with depth scale 1000:
+		// meters as float, zero at or beyond max_depth
+		open3d::geometry::Image& depth_im = rgbd_image.depth_;
+		depth_im.Prepare(width, height, 1, sizeof(float));
+		float truncation = (float)max_depth;
+		if ((double)truncation < max_depth) {
+			truncation = std::nextafter(truncation, std::numeric_limits<float>::infinity());
+		}
+		const float depth_scale = 1000.0f;
 		for (int i = 0; i < height; i++) {
+			const uint16_t * src = depth_mat.ptr<uint16_t>(i);
+			float * dst = (float *)depth_im.data_.data() + (size_t)i * width;
 			for (int k = 0; k < width; k++) {
-				*p++ = depth_mat.at<uint16_t>(i, k);
+				const float d = (float)src[k] / depth_scale;
+				dst[k] = d >= truncation ? 0.0f : d;
 			}
 		}
+		return true;
+	}
 
-		//change the second-to-last parameter here to set maximum distance
-		auto rgbd_image = open3d::geometry::RGBDImage::CreateFromColorAndDepth(*color_im, *depth_im, 1000.0, max_depth, false);
+	std::shared_ptr<open3d::geometry::RGBDImage> generateRGBDImageFromCV(cv::Mat color_mat, cv::Mat depth_mat, double max_depth, int width, int height) {
+		auto rgbd_image = std::make_shared<open3d::geometry::RGBDImage>();
+		const cv::Rect roi(0, 0, width, height);
+		generateRGBDImageFromCV(color_mat(roi), depth_mat(roi), max_depth, *rgbd_image);
 		return rgbd_image;
 	}
 
@@ -77,11 +95,33 @@ namespace ark {
 			std::cout << "option <Recon_MaxDepth> not found, setting to default 2.5" << std::endl;
 			max_depth_ = 2.5;
 		}
+
+		if (file["Recon_MeshMemoryBudgetMB"].isReal()) {
+			file["Recon_MeshMemoryBudgetMB"] >> mesh_memory_budget_mb_;
+		} else {
+			std::cout << "option <Recon_MeshMemoryBudgetMB> not found, setting to default 512.0" << std::endl;
+			mesh_memory_budget_mb_ = 512.0;
+		}
+
+		if (file["Recon_MeshCacheDir"].isString()) {
+			file["Recon_MeshCacheDir"] >> mesh_cache_dir_;
+		} else {
+			std::cout << "option <Recon_MeshCacheDir> not found, setting to default mesh_cache" << std::endl;
+			mesh_cache_dir_ = "mesh_cache";
+		}
+
+		if (file["Recon_VolumePoolUnits"].isInt()) {
+			file["Recon_VolumePoolUnits"] >> volume_pool_units_;
+		} else {
+			std::cout << "option <Recon_VolumePoolUnits> not found, setting to default 512" << std::endl;
+			volume_pool_units_ = 512;
+		}
 	}
 
 	SegmentedMesh::SegmentedMesh(std::string& recon_config, OkvisSLAMSystem& slam, CameraSetup* camera, bool blocking/*= true*/) {
 		this->Setup(slam, camera);
 		Initialize(recon_config, blocking);
+		integration_thread_ = std::thread(&SegmentedMesh::IntegrationLoop, this);
 	}
 
 	SegmentedMesh::SegmentedMesh(std::string& recon_config) {
@@ -92,6 +132,25 @@ namespace ark {
 		Initialize(std::string(""), false);
 	}
 
+	SegmentedMesh::~SegmentedMesh() {
+		stop_integration_ = true;
+		integration_queue_.close();
+		if (integration_thread_.joinable()) {
+			integration_thread_.join();
+		}
+		SetActiveVolumeKeyframe(nullptr);
+	}
+
+	void SegmentedMesh::SetActiveVolumeKeyframe(MapKeyFrame::Ptr kf) {
+		if (kf) {
+			kf->pin();
+		}
+		if (active_volume_keyframe) {
+			active_volume_keyframe->unpin();
+		}
+		active_volume_keyframe = kf;
+	}
+
 	void SegmentedMesh::Initialize(std::string& recon_config, bool blocking) {
 		readConfig(recon_config);
 		blocking_ = blocking;
@@ -99,23 +158,12 @@ namespace ark {
 			Eigen::Vector3i * temp = &current_block;
 			temp = NULL;
 		}
-		active_volume = new open3d::integration::ScalableTSDFVolume(voxel_length_,
+		active_volume.reset(new IncrementalTSDFVolume(voxel_length_,
                sdf_trunc_,      
-				color_type_);
+				color_type_));
+		active_volume->SetUnitPoolSize(volume_pool_units_);
+		block_cache_.reset(new MeshBlockCache(mesh_cache_dir_, (size_t)(mesh_memory_budget_mb_ * 1024 * 1024)));
 		do_integration_ = true;
-
-		std::vector<std::vector<Eigen::Vector3d>> mesh_vertices_vec;
-		std::vector<std::vector<Eigen::Vector3d>> mesh_colors_vec;
-		std::vector<std::vector<Eigen::Vector3i>> mesh_triangles_vec;
-		std::vector<Eigen::Matrix4d> mesh_transforms_vec;
-		std::vector<int> mesh_enabled_vec;
-
-		this->mesh_vertices = std::make_shared<std::vector<std::vector<Eigen::Vector3d>>>(mesh_vertices_vec);
-		this->mesh_colors = std::make_shared<std::vector<std::vector<Eigen::Vector3d>>>(mesh_colors_vec);
-		this->mesh_triangles = std::make_shared<std::vector<std::vector<Eigen::Vector3i>>>(mesh_triangles_vec);
-		this->mesh_transforms = std::make_shared<std::vector<Eigen::Matrix4d>>(mesh_transforms_vec);
-		this->mesh_enabled = std::make_shared<std::vector<int>>(mesh_enabled_vec);
-
 	}
 
 	void SegmentedMesh::Setup(OkvisSLAMSystem& slam, CameraSetup* camera) {
@@ -127,7 +175,8 @@ namespace ark {
 			this->frame_counter_++;
 
 			if (this->do_integration_ && this->frame_counter_ % this->extraction_frame_stride_ == 0) {
-				this->UpdateOutputVectors();
+				// served by the integration worker
+				this->extraction_requested_ = true;
 			}
 		});
 
@@ -149,9 +198,12 @@ namespace ark {
 		slam.AddSparseMapCreationHandler(spcHandler, "mesh sp creation");
 
 		SparseMapMergeHandler spmHandler([&, this](int deleted_map_index, int merged_map_index) {
-			for (auto completed_mesh : completed_meshes) {
-				if (completed_mesh->mesh_map_index == deleted_map_index) {
-					completed_mesh->mesh_map_index = merged_map_index;
+			{
+				std::lock_guard<std::mutex> guard(this->meshLock);
+				for (auto completed_mesh : completed_meshes) {
+					if (completed_mesh->mesh_map_index == deleted_map_index) {
+						completed_mesh->mesh_map_index = merged_map_index;
+					}
 				}
 			}
 			this->SetActiveMapIndex(merged_map_index);
@@ -167,31 +219,111 @@ namespace ark {
 
 		this->camera_width_ = size.width;
 		this->camera_height_ = size.height;
+		this->intrinsic_ = intr;
+		this->integration_stride_ = this->integration_frame_stride_;
+		this->rate_window_start_ = std::chrono::steady_clock::now();
 
-		FrameAvailableHandler tsdfFrameHandler([&, this, intr](MultiCameraFrame::Ptr frame) {
-			if (!this->do_integration_ || this->frame_counter_ % this->integration_frame_stride_ != 0) {
+		FrameAvailableHandler tsdfFrameHandler([&, this](MultiCameraFrame::Ptr frame) {
+			if (!this->do_integration_) {
 				return;
 			}
+			this->QueueFrame(frame);
+		});
 
-			std::cout << "Integrating frame number: " << frame->frameId_ << std::endl;
-
-			cv::Mat color_mat;
-			cv::Mat depth_mat;
-
+		slam.AddFrameAvailableHandler(tsdfFrameHandler, "tsdfframe");
+	}
 
-			frame->getImage(color_mat, 3);
-			frame->getImage(depth_mat, 4);
+	void SegmentedMesh::QueueFrame(MultiCameraFrame::Ptr frame) {
+		{
+			std::lock_guard<std::mutex> guard(stats_mutex_);
+			stats_.offered++;
+		}
+		if (++frames_since_queued_ < integration_stride_) {
+			std::lock_guard<std::mutex> guard(stats_mutex_);
+			stats_.skipped++;
+			return;
+		}
+		frames_since_queued_ = 0;
+
+		// a frame still waiting when the next one is queued means the worker is falling behind;
+		// an empty queue and an idle worker means it can take more
+		int stride = integration_stride_;
+		if (!integration_queue_.empty()) {
+			stride = std::min(stride + 1, integration_max_stride_);
+		} else if (!integration_busy_) {
+			stride = std::max(stride - 1, integration_min_stride_);
+		}
+		integration_stride_ = stride;
+
+		IntegrationItem item;
+		frame->getImage(item.color, 3);
+		frame->getImage(item.depth, 4);
+		item.extrinsic = frame->T_WC(3).inverse();
+		item.frame_id = frame->frameId_;
+		item.queued = std::chrono::steady_clock::now();
+		integration_queue_.enqueue(item);
+	}
 
-			auto rgbd_image = generateRGBDImageFromCV(color_mat, depth_mat, this->max_depth_, this->camera_width_, this->camera_height_);
+	void SegmentedMesh::IntegrationLoop() {
+		IntegrationItem item;
+		while (!stop_integration_) {
+			if (integration_queue_.waitDequeue(&item, std::chrono::milliseconds(50))) {
+				integration_busy_ = true;
+				Instrumentation::recordQueueDepth(Instrumentation::Queue::TSDFIntegration, integration_queue_.size());
+				const auto start = std::chrono::steady_clock::now();
+				std::cout << "Integrating frame number: " << item.frame_id << std::endl;
+				{
+					Instrumentation::ScopedTimer timer(Instrumentation::Stage::TSDFIntegration);
+					// only this thread converts, so the buffers of rgbd_image_ are reused for every frame
+					if (generateRGBDImageFromCV(item.color, item.depth, max_depth_, rgbd_image_)) {
+						Integrate(rgbd_image_, intrinsic_, item.extrinsic);
+					}
+				}
+				const auto end = std::chrono::steady_clock::now();
+				const auto queued = item.queued;
+				// release the images before waiting for the next frame
+				item = IntegrationItem();
+
+				std::lock_guard<std::mutex> guard(stats_mutex_);
+				const double ms = std::chrono::duration<double, std::milli>(end - start).count();
+				stats_.integrated++;
+				stats_.meanIntegrationMs += (ms - stats_.meanIntegrationMs) / stats_.integrated;
+				stats_.maxIntegrationMs = std::max(stats_.maxIntegrationMs, ms);
+				stats_.lastLatencyMs = std::chrono::duration<double, std::milli>(end - queued).count();
+				rate_window_count_++;
+				const double window = std::chrono::duration<double>(end - rate_window_start_).count();
+				if (window >= 1.0) {
+					stats_.integrationRate = rate_window_count_ / window;
+					rate_window_count_ = 0;
+					rate_window_start_ = end;
+				}
+			}
 
-			this->Integrate(*rgbd_image, intr, frame->T_WC(3).inverse());
-		});
+			if (extraction_requested_.exchange(false)) {
+				integration_busy_ = true;
+				{
+					std::lock_guard<std::mutex> guard(meshLock);
+					PublishMeshSnapshot();
+				}
+				std::lock_guard<std::mutex> guard(stats_mutex_);
+				stats_.extractions++;
+			}
+			integration_busy_ = false;
+		}
+	}
 
-		slam.AddFrameAvailableHandler(tsdfFrameHandler, "tsdfframe");
+	SegmentedMesh::IntegrationStats SegmentedMesh::GetIntegrationStats() {
+		std::lock_guard<std::mutex> guard(stats_mutex_);
+		IntegrationStats stats = stats_;
+		stats.queue = integration_queue_.stats();
+		stats.stride = integration_stride_;
+		return stats;
 	}
 
 	void SegmentedMesh::Reset() {
+		std::lock_guard<std::mutex> guard(meshLock);
 		active_volume->Reset();
+		active_mesh_.reset();
 	}
 
 	void SegmentedMesh::SetIntegrationEnabled(bool enabled) {
@@ -199,6 +331,14 @@ namespace ark {
 	}
 
 	void SegmentedMesh::Integrate(
+		const open3d::geometry::RGBDImage &image,
+		const open3d::camera::PinholeCameraIntrinsic &intrinsic,
+		const Eigen::Matrix4d &extrinsic) {
+		std::lock_guard<std::mutex> guard(meshLock);
+		IntegrateLocked(image, intrinsic, extrinsic);
+	}
+
+	void SegmentedMesh::IntegrateLocked(
 		const open3d::geometry::RGBDImage &image,
 		const open3d::camera::PinholeCameraIntrinsic &intrinsic,
 		const Eigen::Matrix4d &extrinsic) { //T_WS.inverse()
@@ -227,6 +367,7 @@ namespace ark {
 	}
 
 	void SegmentedMesh::StartNewBlock() {
+		std::lock_guard<std::mutex> guard(meshLock);
 
 		if (!blocking_) {
 			std::cout << "Error: Attempted to start new block but blocking was disabled" << std::endl;
@@ -238,6 +379,7 @@ namespace ark {
 
 
 	void SegmentedMesh::SetActiveMapIndex(int map_index) {
+		std::lock_guard<std::mutex> guard(meshLock);
 
 		if (!blocking_) {
 			std::cout << "Error: Attempted to set active map index but blocking was disabled" << std::endl;
@@ -272,30 +414,85 @@ namespace ark {
 
 		printf("EXITED BLOCK, NEW BLOCK\n");
 
-		auto completed_mesh = std::make_shared<MeshUnit>();
+		AddCompletedBlock(active_volume->ExtractTriangleMesh());
 
-		auto mesh = active_volume->ExtractTriangleMesh();
+		//recycle the volume (and its units) for the new block
+		active_volume->Reset();
+		SetActiveVolumeKeyframe(latest_keyframe);
+		active_volume_map_index = active_map_index;
+		active_mesh_.reset();
+
+		current_block = block_loc;
+
+		PageInBlocks(block_loc);
+		EnforceMeshBudget();
+
+		PublishMeshSnapshot();
+	}
+
+	void SegmentedMesh::AddCompletedBlock(std::shared_ptr<open3d::geometry::TriangleMesh> mesh) {
+		auto completed_mesh = std::make_shared<MeshUnit>();
 		completed_mesh->mesh = mesh;
 		completed_mesh->keyframe = active_volume_keyframe;
+		if (completed_mesh->keyframe) {
+			completed_mesh->keyframe->pin();
+		}
 		completed_mesh->block_loc = current_block;
 		completed_mesh->mesh_map_index = active_volume_map_index;
 		completed_meshes.push_back(completed_mesh);
 
+		block_cache_->SetResident((int)completed_meshes.size() - 1, *mesh);
+		EnforceMeshBudget();
+	}
 
-		active_volume = new open3d::integration::ScalableTSDFVolume(voxel_length_, sdf_trunc_, color_type_);
-		active_volume_keyframe = latest_keyframe;
-		active_volume_map_index = active_map_index;
+	void SegmentedMesh::PageInBlocks(const Eigen::Vector3i &block_loc) {
+		for (size_t i = 0; i < completed_meshes.size(); i++) {
+			MeshUnit &mesh_unit = *completed_meshes[i];
+			if ((mesh_unit.block_loc - block_loc).cwiseAbs().maxCoeff() > 1) {
+				continue;
+			}
+			if (!mesh_unit.mesh) {
+				mesh_unit.mesh = block_cache_->Load((int)i);
+				if (!mesh_unit.mesh) {
+					continue;
+				}
+				block_cache_->SetResident((int)i, *mesh_unit.mesh);
+			} else {
+				block_cache_->Touch((int)i);
+			}
+		}
+	}
 
-		current_block = block_loc;
+	void SegmentedMesh::EnforceMeshBudget() {
+		if (!block_cache_->OverBudget()) {
+			return;
+		}
+		for (int id : block_cache_->LeastRecentlyUsed()) {
+			MeshUnit &mesh_unit = *completed_meshes[id];
+			//blocks around the camera stay, even over the budget
+			if ((mesh_unit.block_loc - current_block).cwiseAbs().maxCoeff() <= 1) {
+				continue;
+			}
+			if (block_cache_->Spill(id, *mesh_unit.mesh)) {
+				//freed once the published snapshots drop it
+				mesh_unit.mesh.reset();
+			}
+			if (!block_cache_->OverBudget()) {
+				break;
+			}
+		}
+	}
 
-		UpdateOutputVectors();
+	std::shared_ptr<open3d::geometry::TriangleMesh> SegmentedMesh::BlockMesh(size_t i) {
+		if (completed_meshes[i]->mesh) {
+			return completed_meshes[i]->mesh;
+		}
+		return block_cache_->Load((int)i);
 	}
 
-	std::tuple<std::shared_ptr<std::vector<std::vector<Eigen::Vector3d>>>, 
-			std::shared_ptr<std::vector<std::vector<Eigen::Vector3d>>>,
-			std::shared_ptr<std::vector<std::vector<Eigen::Vector3i>>>, 
-			std::shared_ptr<std::vector<Eigen::Matrix4d>>, std::shared_ptr<std::vector<int>>> SegmentedMesh::GetOutputVectors() {
-		return std::make_tuple(mesh_vertices, mesh_colors, mesh_triangles, mesh_transforms, mesh_enabled);
+	MeshBlockCache::Stats SegmentedMesh::GetBlockCacheStats() {
+		std::lock_guard<std::mutex> guard(meshLock);
+		return block_cache_->GetStats();
 	}
 
 	//combines 2 meshes, places in mesh 1
@@ -320,6 +517,7 @@ namespace ark {
 
 	// running pointer of current keyframe
 	void SegmentedMesh::SetLatestKeyFrame(MapKeyFrame::Ptr frame) {
+		std::lock_guard<std::mutex> guard(meshLock);
 
 		if (!blocking_) {
 			std::cout << "Error: Attempted to update latest keyframe but blocking was disabled" << std::endl;
@@ -330,23 +528,27 @@ namespace ark {
 
 		if (active_volume_keyframe == NULL) {
 			printf("init first keyframe\n");
-			active_volume_keyframe = latest_keyframe;
+			SetActiveVolumeKeyframe(latest_keyframe);
 		}
 	}
 
 	//returns a vector of mesh in its own local coords and associated viewing transform (including active volume)
 	std::vector<std::pair<std::shared_ptr<open3d::geometry::TriangleMesh>, Eigen::Matrix4d>> SegmentedMesh::GetTriangleMeshes() {
+		std::lock_guard<std::mutex> guard(meshLock);
 		std::vector<std::pair<std::shared_ptr<open3d::geometry::TriangleMesh>, Eigen::Matrix4d>> ret;
 		if (blocking_) {
 			
-			for (auto completed_mesh : completed_meshes) {
-				ret.push_back(std::pair<std::shared_ptr<open3d::geometry::TriangleMesh>, Eigen::Matrix4d>(completed_mesh->mesh, completed_mesh->keyframe->T_WC(3)));
+			for (size_t i = 0; i < completed_meshes.size(); i++) {
+				auto mesh = BlockMesh(i);
+				if (mesh) {
+					ret.push_back(std::pair<std::shared_ptr<open3d::geometry::TriangleMesh>, Eigen::Matrix4d>(mesh, completed_meshes[i]->keyframe->T_WC(3)));
+				}
 			}
 
-			ret.push_back(std::pair<std::shared_ptr<open3d::geometry::TriangleMesh>, Eigen::Matrix4d>(ExtractCurrentTriangleMesh(), active_volume_keyframe->T_WC(3)));
+			ret.push_back(std::pair<std::shared_ptr<open3d::geometry::TriangleMesh>, Eigen::Matrix4d>(active_volume->ExtractTriangleMesh(), active_volume_keyframe->T_WC(3)));
 			
 		} else {
-			ret.push_back(std::pair<std::shared_ptr<open3d::geometry::TriangleMesh>, Eigen::Matrix4d>(ExtractCurrentTriangleMesh(), Eigen::Matrix4d::Identity()));
+			ret.push_back(std::pair<std::shared_ptr<open3d::geometry::TriangleMesh>, Eigen::Matrix4d>(active_volume->ExtractTriangleMesh(), Eigen::Matrix4d::Identity()));
 		}
 
 		return ret;
@@ -359,17 +561,22 @@ namespace ark {
 	//returns all meshes placed into one TriangleMesh (vertices, vertex colors, triangles)
 	std::shared_ptr<open3d::geometry::TriangleMesh>
 		SegmentedMesh::ExtractTotalTriangleMesh() {
+			std::lock_guard<std::mutex> guard(meshLock);
 
 			printf("extracting triangle meshes\n");
 
 			if (blocking_) {
 				auto mesh_output = std::make_shared<open3d::geometry::TriangleMesh>();
 
-				for (auto mesh_unit : completed_meshes) {
+				for (size_t i = 0; i < completed_meshes.size(); i++) {
 					
 					//printf("adding a mesh\n");
 
-					auto completed_mesh = mesh_unit->mesh;
+					auto mesh_unit = completed_meshes[i];
+					auto completed_mesh = BlockMesh(i);
+					if (!completed_mesh) {
+						continue;
+					}
 					auto transformed_mesh = std::make_shared<open3d::geometry::TriangleMesh>();
 
 					auto vertices = completed_mesh->vertices_;
@@ -405,12 +612,13 @@ namespace ark {
 
 				return mesh_output;
 			} else {
-				return ExtractCurrentTriangleMesh();
+				return active_volume->ExtractTriangleMesh();
 			}
 	}
 
 	std::shared_ptr<open3d::geometry::TriangleMesh>
 		SegmentedMesh::ExtractCurrentTriangleMesh() {
+		std::lock_guard<std::mutex> guard(meshLock);
 		return active_volume->ExtractTriangleMesh();
 				
 				
@@ -418,10 +626,12 @@ namespace ark {
 
 	std::shared_ptr<open3d::geometry::PointCloud>
 		SegmentedMesh::ExtractCurrentVoxelPointCloud() {
+		std::lock_guard<std::mutex> guard(meshLock);
 		return active_volume->ExtractVoxelPointCloud();
 	}
 
 	std::vector<int> SegmentedMesh::get_kf_ids() {
+		std::lock_guard<std::mutex> guard(meshLock);
 
 		std::vector<int> t;
 
@@ -437,116 +647,68 @@ namespace ark {
 	}
 
 
-	void SegmentedMesh::AddRenderMutex(std::mutex* render_mutex, std::string render_mutex_key) {
-		render_mutexes.insert(std::pair<std::string, std::mutex*>(render_mutex_key, render_mutex));
-	}
+	void SegmentedMesh::PublishMeshSnapshot() {
 
-	void SegmentedMesh::RemoveRenderMutex(std::string render_mutex_key) {
-		auto iter = this->render_mutexes.find(render_mutex_key);
-		if (iter != this->render_mutexes.end()) {
-			this->render_mutexes.erase(iter);
+		//don't have any key frames, don't have any blocks
+		if (blocking_ && active_volume_keyframe == NULL) {
+			return;
 		}
-	}
-
 
-	void SegmentedMesh::UpdateOutputVectors() {
-
-		for (auto render_mutex : render_mutexes) {
-			std::lock_guard<std::mutex> guard(*(render_mutex.second));
+		if (!active_mesh_ || active_volume->NumDirtyUnits() > 0 ||
+			active_volume->MeshGeneration() != active_mesh_generation_) {
+			active_mesh_ = active_volume->ExtractTriangleMesh();
+			active_mesh_generation_ = active_volume->MeshGeneration();
 		}
 
-		if (blocking_) {
+		auto snapshot = std::make_shared<MeshSnapshot>();
+		snapshot->version = GetMeshSnapshot()->version + 1;
 
-			//don't have any key frames, don't have any blocks
-			if (active_volume_keyframe == NULL) {
-				return;
-			}
-
-			//clear out active mesh, clear mesh enabled, only run if vectors are populated
-			if (mesh_vertices->size() > 0) {
-				mesh_vertices->pop_back();
-				mesh_colors->pop_back();
-				mesh_triangles->pop_back();
-				mesh_transforms->pop_back();
-				mesh_enabled->clear();
-			}
-
-			//always update transforms in case of loop closure
-			mesh_transforms->clear();
-			for (int i = 0; i < completed_meshes.size(); i++) {
-				auto mesh_unit = completed_meshes[i];
-				mesh_transforms->push_back(mesh_unit->keyframe->T_WC(3));
-			}
-
-			//updated completed meshes not in the vectors
-			if (completed_meshes.size() > mesh_vertices->size()) {
-				for (int i = mesh_vertices->size(); i < completed_meshes.size(); i++) {
-
-					auto mesh_unit = completed_meshes[i];
-
-					mesh_vertices->push_back(mesh_unit->mesh->vertices_);
-					mesh_colors->push_back(mesh_unit->mesh->vertex_colors_);
-					mesh_triangles->push_back(mesh_unit->mesh->triangles_);
-
-				}
-			}
-
-			auto mesh = active_volume->ExtractTriangleMesh();
-
-			mesh_vertices->push_back(mesh->vertices_);
-			mesh_colors->push_back(mesh->vertex_colors_);
-			mesh_triangles->push_back(mesh->triangles_);
-			mesh_transforms->push_back(active_volume_keyframe->T_WC(3));
-
-
-			for (int i = 0; i < completed_meshes.size(); i++) {
-				if (completed_meshes[i]->mesh_map_index == active_map_index) {
-					mesh_enabled->push_back(1);
-				} else {
-					mesh_enabled->push_back(0);
+		if (blocking_) {
+			snapshot->meshes.reserve(completed_meshes.size() + 1);
+			snapshot->transforms.reserve(completed_meshes.size() + 1);
+			snapshot->enabled.reserve(completed_meshes.size() + 1);
+
+			//completed meshes are shared with the previous snapshots; transforms are always updated in case of loop closure
+			for (const auto& mesh_unit : completed_meshes) {
+				//spilled blocks are not drawn until the camera comes back to them
+				if (!mesh_unit->mesh) {
+					continue;
 				}
+				snapshot->meshes.push_back(mesh_unit->mesh);
+				snapshot->transforms.push_back(mesh_unit->keyframe->T_WC(3));
+				snapshot->enabled.push_back(mesh_unit->mesh_map_index == active_map_index ? 1 : 0);
 			}
 
 			//active volume is always visible
-			mesh_enabled->push_back(1);
+			snapshot->meshes.push_back(active_mesh_);
+			snapshot->transforms.push_back(active_volume_keyframe->T_WC(3));
+			snapshot->enabled.push_back(1);
 
 		} else {
-			auto mesh = active_volume->ExtractTriangleMesh();
-
-			//clear out active mesh, clear mesh enabled, only run if vectors are populated
-			if (mesh_vertices->size() > 0) {
-				mesh_vertices->pop_back();
-				mesh_colors->pop_back();
-				mesh_triangles->pop_back();
-				mesh_transforms->pop_back();
-				mesh_enabled->clear();
-			}
-
-			mesh_vertices->push_back(mesh->vertices_);
-			mesh_colors->push_back(mesh->vertex_colors_);
-			mesh_triangles->push_back(mesh->triangles_);
-			mesh_transforms->push_back(Eigen::Matrix4d::Identity());
-			mesh_enabled->push_back(1);
+			snapshot->meshes.push_back(active_mesh_);
+			snapshot->transforms.push_back(Eigen::Matrix4d::Identity());
+			snapshot->enabled.push_back(1);
 		}
+
+		std::atomic_store(&mesh_snapshot_, MeshSnapshot::ConstPtr(snapshot));
 	}
 
 	void SegmentedMesh::WriteMeshes() {
+		std::lock_guard<std::mutex> guard(meshLock);
 
 		if (blocking_) {
 			//extract active volume
-			auto completed_mesh = std::make_shared<MeshUnit>();
-
-			auto mesh = active_volume->ExtractTriangleMesh();
-			completed_mesh->mesh = mesh;
-			completed_mesh->keyframe = active_volume_keyframe;
-			completed_mesh->block_loc = current_block;
-			completed_mesh->mesh_map_index = active_volume_map_index;
-			completed_meshes.push_back(completed_mesh);
+			AddCompletedBlock(active_volume->ExtractTriangleMesh());
 
 			std::map<int, std::shared_ptr<open3d::geometry::TriangleMesh>> mesh_map;
 
 			for (int i = 0; i < completed_meshes.size(); i++) {
-				auto mesh = completed_meshes[i]->mesh;
+				auto block_mesh = BlockMesh(i);
+				if (!block_mesh) {
+					continue;
+				}
+				//transform a copy, completed meshes are shared with the mesh snapshots
+				auto mesh = std::make_shared<open3d::geometry::TriangleMesh>(*block_mesh);
 
 				std::vector<Eigen::Vector3d> vertices = mesh->vertices_;
 				std::vector<Eigen::Vector3d> transformed_vertices;
@@ -104,6 +104,8 @@ int main(int argc, char **argv)
             cubes.push_back(obj);
             T_K_cubes.push_back(frame->T_KS_);
             K_cubes.push_back(frame->keyframe_);
+            // the cube follows its keyframe, keep it from being culled
+            if (frame->keyframe_ != nullptr) frame->keyframe_->pin();
             std::cout << "Adding cube " << cube_name << std::endl;
             ar_win.add_object(obj); //NOTE: this is bad, should change objects to shared_ptr
         }
@@ -116,13 +118,12 @@ int main(int argc, char **argv)
     //slam.AddKeyFrameAvailableHandler(kfHandler, "saving");
 
     LoopClosureDetectedHandler loopHandler([&](void) {
-        std::vector<Eigen::Matrix4d> traj;
-        slam.getTrajectory(traj);
+        TrajectorySnapshot::ConstPtr traj = slam.getTrajectorySnapshot();
         const auto mapIndex = slam.getActiveMapIndex();
         pathMap[mapIndex]->clear();
-        for (size_t i = 0; i < traj.size(); i++)
+        for (size_t i = 0; i < traj->size(); i++)
         {
-            pathMap[mapIndex]->add_node(traj[i].block<3, 1>(0, 3));
+            pathMap[mapIndex]->add_node(traj->T_WS(i).block<3, 1>(0, 3));
         }
         std::cout << "Loop Trajectory: \n";
         /*for (const auto &node: pathMap[mapIndex]->nodes) {
@@ -130,8 +131,9 @@ int main(int argc, char **argv)
         }*/
         for (size_t i = 0; i < cubes.size(); i++)
         {
-            if (K_cubes[i] != nullptr)
-                cubes[i]->set_transform(Eigen::Affine3d(K_cubes[i]->T_WS() * T_K_cubes[i]));
+            const int k = K_cubes[i] != nullptr ? traj->find(K_cubes[i]->frameId_) : -1;
+            if (k >= 0)
+                cubes[i]->set_transform(Eigen::Affine3d(traj->T_WS(k) * T_K_cubes[i]));
         }
     });
     slam.AddLoopClosureDetectedHandler(loopHandler, "trajectoryUpdate");
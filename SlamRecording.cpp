@@ -175,6 +175,8 @@ int main(int argc, char **argv)
 
             for (auto &img : frame->images_)
             {
+                // lazily generated images (xyz map) are not built
+                if (img.empty()) continue;
                 const cv::Point STR_POS(img.cols / 2 - 50, img.rows / 2 + 7);
                 cv::Rect rect(img.cols / 2 - RECT_WID / 2,
                               img.rows / 2 - RECT_HI / 2,
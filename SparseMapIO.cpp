@@ -0,0 +1,359 @@
+#include "stdafx.h"
+#include "SparseMapIO.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include "MappedFile.h"
+
+namespace ark {
+
+    namespace {
+        const char kMagic[8] = { 'O', 'A', 'R', 'K', 'M', 'A', 'P', '\0' };
+        const uint32_t kEndianTag = 0x01020304;
+
+        struct FileHeader {
+            char magic[8];
+            uint32_t version;
+            uint32_t endianTag;
+            int32_t currentKeyframeId;
+            uint32_t reserved;
+            uint64_t numKeyframes;
+            uint64_t numConstraints;
+            uint64_t numPoses;
+            uint64_t numBowEntries;
+            uint64_t keyframeOffset;
+            uint64_t constraintOffset;
+            uint64_t poseOffset;
+            uint64_t bowOffset;
+            uint64_t blobOffset;
+            uint64_t fileSize;
+        };
+
+        struct KeyframeRecord {
+            int32_t frameId;
+            int32_t previousKeyframeId;
+            double timestamp;
+            double T_WS[16];
+            double T_WS_Optimized[16];
+            uint32_t optimized;
+            uint32_t numSensorTransforms;
+            uint32_t numImages;
+            uint32_t reserved;
+            uint64_t dataOffset;
+        };
+
+        struct ImageRecord {
+            uint32_t numKeypoints;
+            int32_t descriptorRows;
+            int32_t descriptorCols;
+            int32_t descriptorType;
+        };
+
+        struct KeypointRecord {
+            float x, y, size, angle, response;
+            int32_t octave;
+            int32_t classId;
+            uint32_t reserved;
+        };
+
+        struct ConstraintRecord {
+            int32_t idA, idB;
+            double P_AB[3];
+            double Q_AB[4];
+            double sqrtInformation[36];
+        };
+
+        struct PoseRecord {
+            int32_t id;
+            uint32_t reserved;
+            double P_WA[3];
+            double Q_WA[4];
+        };
+
+        static_assert(sizeof(FileHeader) == 104, "SparseMapIO: unexpected FileHeader layout");
+        static_assert(sizeof(KeyframeRecord) == 296, "SparseMapIO: unexpected KeyframeRecord layout");
+        static_assert(sizeof(ImageRecord) == 16, "SparseMapIO: unexpected ImageRecord layout");
+        static_assert(sizeof(KeypointRecord) == 32, "SparseMapIO: unexpected KeypointRecord layout");
+        static_assert(sizeof(ConstraintRecord) == 352, "SparseMapIO: unexpected ConstraintRecord layout");
+        static_assert(sizeof(PoseRecord) == 64, "SparseMapIO: unexpected PoseRecord layout");
+
+        uint64_t align8(uint64_t offset) {
+            return (offset + 7) & ~(uint64_t)7;
+        }
+
+        size_t descriptorBytes(const cv::Mat & descriptors) {
+            return descriptors.empty() ? 0 : (size_t)descriptors.rows * descriptors.cols * descriptors.elemSize();
+        }
+
+        /** Size in bytes of a keyframe's data in the blob (before alignment) */
+        uint64_t keyframeDataSize(const MapKeyFrame & kf) {
+            uint64_t size = kf.T_SC_.size() * 16 * sizeof(double);
+            const int numImages = kf.features_.numCameras();
+            for (int i = 0; i < numImages; ++i) {
+                const size_t n = kf.numKeypoints(i);
+                size += sizeof(ImageRecord) + n * (sizeof(KeypointRecord) + 4 * sizeof(double));
+                size += align8(descriptorBytes(kf.descriptors(i)));
+            }
+            return size;
+        }
+
+        void writePadding(std::ofstream & file, uint64_t bytes) {
+            static const char zeros[8] = { 0 };
+            file.write(zeros, (std::streamsize)bytes);
+        }
+
+        bool fail(const std::string & path, const char * reason) {
+            std::cerr << "SparseMapIO: " << path << ": " << reason << std::endl;
+            return false;
+        }
+    }
+
+    bool SparseMapIO::write(const std::string & path, const std::map<int, MapKeyFrame::Ptr> & keyframes,
+            const std::vector<PoseConstraint> & constraints, const std::map<int, GraphPose> & poses,
+            int currentKeyframeId, const std::vector<int> & bowFrameIds) {
+        FileHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, kMagic, sizeof(kMagic));
+        header.version = kVersion;
+        header.endianTag = kEndianTag;
+        header.currentKeyframeId = currentKeyframeId;
+        header.numKeyframes = keyframes.size();
+        header.numConstraints = constraints.size();
+        header.numPoses = poses.size();
+        header.numBowEntries = bowFrameIds.size();
+        header.keyframeOffset = sizeof(FileHeader);
+        header.constraintOffset = header.keyframeOffset + header.numKeyframes * sizeof(KeyframeRecord);
+        header.poseOffset = header.constraintOffset + header.numConstraints * sizeof(ConstraintRecord);
+        header.bowOffset = header.poseOffset + header.numPoses * sizeof(PoseRecord);
+        header.blobOffset = align8(header.bowOffset + header.numBowEntries * sizeof(int32_t));
+
+        // keyframe records, with their data laid out back to back in the blob
+        std::vector<KeyframeRecord> records;
+        records.reserve(keyframes.size());
+        uint64_t dataOffset = header.blobOffset;
+        for (std::map<int, MapKeyFrame::Ptr>::const_iterator it = keyframes.begin(); it != keyframes.end(); ++it) {
+            const MapKeyFrame & kf = *it->second;
+            KeyframeRecord record;
+            std::memset(&record, 0, sizeof(record));
+            record.frameId = kf.frameId_;
+            record.previousKeyframeId = kf.previousKeyframeId_;
+            record.timestamp = kf.timestamp_;
+            // keyframes of merged maps are stored relative to their map's anchor, write world poses
+            Eigen::Map<Eigen::Matrix4d>(record.T_WS) = kf.T_WS_Odometry();
+            Eigen::Map<Eigen::Matrix4d>(record.T_WS_Optimized) = kf.optimized_ ? kf.T_WS() : kf.T_WS_Optimized_;
+            record.optimized = kf.optimized_ ? 1 : 0;
+            record.numSensorTransforms = (uint32_t)kf.T_SC_.size();
+            record.numImages = (uint32_t)kf.features_.numCameras();
+            record.dataOffset = dataOffset;
+            records.push_back(record);
+            dataOffset = align8(dataOffset + keyframeDataSize(kf));
+        }
+        header.fileSize = dataOffset;
+
+        const std::string tmpPath = path + ".tmp";
+        std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) return fail(tmpPath, "could not open for writing");
+
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        if (!records.empty())
+            file.write(reinterpret_cast<const char *>(records.data()), records.size() * sizeof(KeyframeRecord));
+
+        for (size_t i = 0; i < constraints.size(); ++i) {
+            const PoseConstraint & constraint = constraints[i];
+            ConstraintRecord record;
+            record.idA = constraint.id_A;
+            record.idB = constraint.id_B;
+            Eigen::Map<Eigen::Vector3d>(record.P_AB) = constraint.P_AB;
+            Eigen::Map<Eigen::Vector4d>(record.Q_AB) = constraint.Q_AB.coeffs();
+            Eigen::Map<Eigen::Matrix<double, 6, 6>>(record.sqrtInformation) = constraint.sqrt_information;
+            file.write(reinterpret_cast<const char *>(&record), sizeof(record));
+        }
+
+        for (std::map<int, GraphPose>::const_iterator it = poses.begin(); it != poses.end(); ++it) {
+            PoseRecord record;
+            record.id = it->first;
+            record.reserved = 0;
+            Eigen::Map<Eigen::Vector3d>(record.P_WA) = it->second.P_WA;
+            Eigen::Map<Eigen::Vector4d>(record.Q_WA) = it->second.Q_WA.coeffs();
+            file.write(reinterpret_cast<const char *>(&record), sizeof(record));
+        }
+
+        for (size_t i = 0; i < bowFrameIds.size(); ++i) {
+            const int32_t id = bowFrameIds[i];
+            file.write(reinterpret_cast<const char *>(&id), sizeof(id));
+        }
+        writePadding(file, header.blobOffset - (header.bowOffset + header.numBowEntries * sizeof(int32_t)));
+
+        std::vector<KeypointRecord> keypoints;
+        size_t recordIdx = 0;
+        for (std::map<int, MapKeyFrame::Ptr>::const_iterator it = keyframes.begin(); it != keyframes.end(); ++it, ++recordIdx) {
+            const MapKeyFrame & kf = *it->second;
+            uint64_t written = 0;
+            for (size_t i = 0; i < kf.T_SC_.size(); ++i) {
+                file.write(reinterpret_cast<const char *>(kf.T_SC_[i].data()), 16 * sizeof(double));
+                written += 16 * sizeof(double);
+            }
+            for (uint32_t img = 0; img < records[recordIdx].numImages; ++img) {
+                const std::vector<cv::KeyPoint> kps = kf.keypoints(img);
+                // a continuous view of the keyframe's packed storage
+                const cv::Mat descriptors = kf.descriptors(img);
+
+                ImageRecord image;
+                image.numKeypoints = (uint32_t)kps.size();
+                image.descriptorRows = descriptors.rows;
+                image.descriptorCols = descriptors.cols;
+                image.descriptorType = descriptors.empty() ? 0 : descriptors.type();
+                file.write(reinterpret_cast<const char *>(&image), sizeof(image));
+
+                keypoints.resize(kps.size());
+                for (size_t k = 0; k < kps.size(); ++k) {
+                    const cv::KeyPoint & kp = kps[k];
+                    KeypointRecord & record = keypoints[k];
+                    record.x = kp.pt.x;
+                    record.y = kp.pt.y;
+                    record.size = kp.size;
+                    record.angle = kp.angle;
+                    record.response = kp.response;
+                    record.octave = kp.octave;
+                    record.classId = kp.class_id;
+                    record.reserved = 0;
+                }
+                if (!keypoints.empty())
+                    file.write(reinterpret_cast<const char *>(keypoints.data()), keypoints.size() * sizeof(KeypointRecord));
+
+                // 3D keypoints are written for every keypoint; missing ones as zeros (no depth)
+                for (size_t k = 0; k < kps.size(); ++k) {
+                    const Eigen::Vector4d point = kf.homogeneousKeypoint3d(img, (int)k);
+                    file.write(reinterpret_cast<const char *>(point.data()), 4 * sizeof(double));
+                }
+
+                const size_t bytes = descriptorBytes(descriptors);
+                if (bytes > 0) file.write(reinterpret_cast<const char *>(descriptors.data), bytes);
+                writePadding(file, align8(bytes) - bytes);
+                written += sizeof(ImageRecord) + kps.size() * (sizeof(KeypointRecord) + 4 * sizeof(double)) + align8(bytes);
+            }
+            writePadding(file, align8(written) - written);
+        }
+
+        file.close();
+        if (!file) return fail(tmpPath, "write failed");
+#ifdef _WIN32
+        // rename does not replace an existing file on Windows; elsewhere it replaces it atomically
+        std::remove(path.c_str());
+#endif
+        if (std::rename(tmpPath.c_str(), path.c_str()) != 0) return fail(path, "could not replace file");
+        return true;
+    }
+
+    bool SparseMapIO::read(const std::string & path, Contents & out) {
+        MappedFile file(path);
+        if (!file.valid()) return fail(path, "could not open");
+        file.adviseSequential();
+
+        const FileHeader * header = file.at<FileHeader>(0);
+        if (header == nullptr || std::memcmp(header->magic, kMagic, sizeof(kMagic)) != 0)
+            return fail(path, "not a sparse map file");
+        if (header->endianTag != kEndianTag) return fail(path, "written with another byte order");
+        if (header->version != kVersion) return fail(path, "unsupported format version");
+
+        const KeyframeRecord * records = file.at<KeyframeRecord>(header->keyframeOffset, header->numKeyframes);
+        const ConstraintRecord * constraints = file.at<ConstraintRecord>(header->constraintOffset, header->numConstraints);
+        const PoseRecord * poses = file.at<PoseRecord>(header->poseOffset, header->numPoses);
+        const int32_t * bowIds = file.at<int32_t>(header->bowOffset, header->numBowEntries);
+        if ((records == nullptr && header->numKeyframes > 0) || (constraints == nullptr && header->numConstraints > 0) ||
+                (poses == nullptr && header->numPoses > 0) || (bowIds == nullptr && header->numBowEntries > 0))
+            return fail(path, "truncated");
+
+        Contents contents;
+        contents.currentKeyframeId = header->currentKeyframeId;
+
+        for (uint64_t i = 0; i < header->numKeyframes; ++i) {
+            const KeyframeRecord & record = records[i];
+            MapKeyFrame::Ptr kf(new MapKeyFrame);
+            kf->frameId_ = record.frameId;
+            kf->previousKeyframeId_ = record.previousKeyframeId;
+            kf->timestamp_ = record.timestamp;
+            kf->T_WS_ = Eigen::Map<const Eigen::Matrix4d>(record.T_WS);
+            kf->T_WS_Optimized_ = Eigen::Map<const Eigen::Matrix4d>(record.T_WS_Optimized);
+            kf->optimized_ = record.optimized != 0;
+
+            uint64_t offset = record.dataOffset;
+            const double * T_SC = file.at<double>(offset, (uint64_t)record.numSensorTransforms * 16);
+            if (T_SC == nullptr && record.numSensorTransforms > 0) return fail(path, "truncated keyframe");
+            kf->T_SC_.resize(record.numSensorTransforms);
+            for (uint32_t t = 0; t < record.numSensorTransforms; ++t) {
+                kf->T_SC_[t] = Eigen::Map<const Eigen::Matrix4d>(T_SC + 16 * t);
+            }
+            offset += (uint64_t)record.numSensorTransforms * 16 * sizeof(double);
+
+            std::vector<std::vector<cv::KeyPoint>> keypointsOfImage(record.numImages);
+            std::vector<std::vector<cv::Vec3f>> pointsOfImage(record.numImages);
+            std::vector<cv::Mat> descriptorsOfImage(record.numImages);
+            for (uint32_t img = 0; img < record.numImages; ++img) {
+                const ImageRecord * image = file.at<ImageRecord>(offset);
+                if (image == nullptr) return fail(path, "truncated keyframe");
+                offset += sizeof(ImageRecord);
+                const uint64_t n = image->numKeypoints;
+
+                const KeypointRecord * kps = file.at<KeypointRecord>(offset, n);
+                const double * points = file.at<double>(offset + n * sizeof(KeypointRecord), n * 4);
+                if (n > 0 && (kps == nullptr || points == nullptr)) return fail(path, "truncated keyframe");
+                std::vector<cv::KeyPoint> & keypoints = keypointsOfImage[img];
+                std::vector<cv::Vec3f> & points3d = pointsOfImage[img];
+                keypoints.resize(n);
+                points3d.resize(n);
+                for (uint64_t k = 0; k < n; ++k) {
+                    keypoints[k] = cv::KeyPoint(kps[k].x, kps[k].y, kps[k].size, kps[k].angle,
+                        kps[k].response, kps[k].octave, kps[k].classId);
+                    const double * p = points + 4 * k;
+                    points3d[k] = p[3] != 0 ? cv::Vec3f((float)p[0], (float)p[1], (float)p[2]) : cv::Vec3f(0, 0, 0);
+                }
+                offset += n * (sizeof(KeypointRecord) + 4 * sizeof(double));
+
+                if (image->descriptorRows > 0 && image->descriptorCols > 0) {
+                    cv::Mat & descriptors = descriptorsOfImage[img];
+                    descriptors.create(image->descriptorRows, image->descriptorCols, image->descriptorType);
+                    const size_t bytes = descriptorBytes(descriptors);
+                    const uint8_t * data = file.at<uint8_t>(offset, bytes);
+                    if (data == nullptr) return fail(path, "truncated keyframe");
+                    std::memcpy(descriptors.data, data, bytes);
+                    offset += align8(bytes);
+                }
+            }
+            kf->features_.pack(keypointsOfImage, descriptorsOfImage, pointsOfImage);
+            contents.keyframes[kf->frameId_] = kf;
+        }
+
+        // previous keyframe pointers are not stored, relink them by id
+        for (std::map<int, MapKeyFrame::Ptr>::iterator it = contents.keyframes.begin(); it != contents.keyframes.end(); ++it) {
+            std::map<int, MapKeyFrame::Ptr>::iterator previous = contents.keyframes.find(it->second->previousKeyframeId_);
+            if (previous != contents.keyframes.end()) it->second->previousKeyframe_ = previous->second;
+        }
+
+        contents.constraints.reserve(header->numConstraints);
+        for (uint64_t i = 0; i < header->numConstraints; ++i) {
+            const ConstraintRecord & record = constraints[i];
+            Eigen::Quaterniond Q_AB;
+            Q_AB.coeffs() = Eigen::Map<const Eigen::Vector4d>(record.Q_AB);
+            contents.constraints.push_back(PoseConstraint(record.idA, record.idB,
+                Eigen::Map<const Eigen::Vector3d>(record.P_AB), Q_AB,
+                Eigen::Map<const Eigen::Matrix<double, 6, 6>>(record.sqrtInformation)));
+        }
+
+        for (uint64_t i = 0; i < header->numPoses; ++i) {
+            const PoseRecord & record = poses[i];
+            Eigen::Quaterniond Q_WA;
+            Q_WA.coeffs() = Eigen::Map<const Eigen::Vector4d>(record.Q_WA);
+            contents.poses[record.id] = GraphPose(Eigen::Map<const Eigen::Vector3d>(record.P_WA), Q_WA);
+        }
+
+        contents.bowFrameIds.assign(bowIds, bowIds + header->numBowEntries);
+
+        out = std::move(contents);
+        return true;
+    }
+}
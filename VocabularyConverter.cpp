@@ -0,0 +1,94 @@
+// Converts a DBoW2 BRISK vocabulary (the binary format read by binaryLoad, or the
+// text/yaml format with --text) into the flat memory mappable format of
+// FlatVocabulary, then checks the result: both files are loaded and timed, and
+// random descriptors must map to the same words, weights and bag of words.
+//
+// Usage: OpenARK_vocab_converter <vocabulary> <output.flat> [--text]
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cstring>
+
+#include <opencv2/core.hpp>
+
+#include "FlatVocabulary.h"
+
+using namespace ark;
+
+namespace {
+    double msSince(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    /** Compare the flat transform against DBoW2 on random descriptors, returns number of mismatches */
+    int verify(const FlatVocabulary & flat, const FlatVocabulary::Vocabulary & vocab, int numImages, int featuresPerImage) {
+        std::mt19937 rng(11);
+        std::uniform_int_distribution<int> byte(0, 255);
+        const int bytes = flat.getDescriptorBytes();
+        const int levelsup = 2;
+        int mismatches = 0;
+
+        for (int img = 0; img < numImages; img++) {
+            std::vector<cv::Mat> features(featuresPerImage);
+            for (cv::Mat & f : features) {
+                f.create(1, bytes, CV_8U);
+                for (int c = 0; c < bytes; c++) f.at<uchar>(0, c) = (uchar)byte(rng);
+            }
+
+            DBoW2::BowVector bowRef, bowFlat;
+            DBoW2::FeatureVector fvRef, fvFlat;
+            vocab.transform(features, bowRef, fvRef, levelsup);
+            flat.transform(features, bowFlat, fvFlat, levelsup);
+            if (bowRef != bowFlat || fvRef != fvFlat) mismatches++;
+        }
+        return mismatches;
+    }
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 3) {
+        std::cout << "usage: " << argv[0] << " <vocabulary> <output.flat> [--text]\n";
+        return 0;
+    }
+    const std::string inPath = argv[1], outPath = argv[2];
+    const bool text = argc > 3 && std::strcmp(argv[3], "--text") == 0;
+
+    FlatVocabulary::Vocabulary vocab;
+    auto start = std::chrono::steady_clock::now();
+    if (text) vocab.load(inPath);
+    else vocab.binaryLoad(inPath);
+    const double dbowMs = msSince(start);
+    if (vocab.empty()) {
+        std::cerr << "Could not load vocabulary " << inPath << std::endl;
+        return 1;
+    }
+    std::cout << "Loaded " << inPath << ": " << vocab.size() << " words, k=" << vocab.getBranchingFactor()
+              << " L=" << vocab.getDepthLevels() << std::endl;
+
+    if (!FlatVocabulary::save(vocab, outPath)) return 1;
+
+    start = std::chrono::steady_clock::now();
+    FlatVocabulary::Ptr flat = FlatVocabulary::load(outPath);
+    const double flatMs = msSince(start);
+    if (!flat) return 1;
+
+    FlatVocabulary::Vocabulary filled;
+    start = std::chrono::steady_clock::now();
+    flat->toVocabulary(filled);
+    const double fillMs = msSince(start);
+
+    std::cout << std::fixed << std::setprecision(2)
+              << "DBoW2 load:        " << std::setw(10) << dbowMs << " ms\n"
+              << "flat load (mmap):  " << std::setw(10) << flatMs << " ms\n"
+              << "flat to DBoW2:     " << std::setw(10) << fillMs + flatMs << " ms" << std::endl;
+
+    const int flatMismatches = verify(*flat, vocab, 200, 500);
+    const int filledMismatches = verify(*flat, filled, 200, 500);
+    std::cout << "transform mismatches: flat " << flatMismatches << ", filled vocabulary "
+              << filledMismatches << " (of 200 images)" << std::endl;
+    return flatMismatches == 0 && filledMismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,101 @@
+// Times descriptor matching between two keyframes for the matchers available to
+// loop closure verification: the brisk brute force matcher used previously and
+// HammingMatcher with each distance kernel, single and multi threaded.
+//
+// Descriptors are random; half of the query descriptors are copies of train
+// descriptors with a few bits flipped, so ratio test and mutual check have real
+// matches to keep. Sizes cover the usual 300-1000 keypoints per keyframe.
+//
+// Usage: OpenARK_hamming_benchmark [descriptor_bytes] [repetitions]
+//        (defaults to 48 bytes, i.e. a brisk descriptor, and 50 repetitions)
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+
+#include <opencv2/core.hpp>
+#include <brisk/brisk.h>
+
+#include "HammingMatcher.h"
+
+using namespace ark;
+
+namespace {
+    void makeDescriptors(int numQuery, int numTrain, int bytes, cv::Mat & query, cv::Mat & train) {
+        std::mt19937 rng(7);
+        std::uniform_int_distribution<int> byte(0, 255);
+        std::uniform_int_distribution<int> bit(0, bytes * 8 - 1);
+        train.create(numTrain, bytes, CV_8U);
+        query.create(numQuery, bytes, CV_8U);
+        for (int i = 0; i < numTrain; i++)
+            for (int c = 0; c < bytes; c++)
+                train.at<uchar>(i, c) = (uchar)byte(rng);
+        for (int i = 0; i < numQuery; i++) {
+            if (i % 2 == 0 && i < numTrain) {
+                train.row(i).copyTo(query.row(i));
+                for (int f = 0; f < bytes / 4; f++) {
+                    const int b = bit(rng);
+                    query.at<uchar>(i, b / 8) ^= (uchar)(1 << (b % 8));
+                }
+            } else {
+                for (int c = 0; c < bytes; c++)
+                    query.at<uchar>(i, c) = (uchar)byte(rng);
+            }
+        }
+    }
+
+    void time(const std::string & name, int n, int repetitions,
+            const std::function<size_t()> & run) {
+        size_t numMatches = run(); // warm up
+        const auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repetitions; r++) {
+            numMatches = run();
+        }
+        const double ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count() / repetitions;
+        std::cout << std::setw(26) << name << std::setw(8) << n
+                  << std::setw(12) << ms << std::setw(10) << numMatches << std::endl;
+    }
+}
+
+int main(int argc, char ** argv) {
+    const int bytes = argc > 1 ? std::atoi(argv[1]) : 48;
+    const int repetitions = argc > 2 ? std::atoi(argv[2]) : 50;
+    const int sizes[] = { 300, 500, 1000 };
+    const char * kernelNames[] = { "scalar", "popcnt", "avx2" };
+
+    std::cout << "descriptor bytes: " << bytes << ", best kernel: "
+              << kernelNames[(int)HammingMatcher::bestKernel()] << std::endl;
+    std::cout << std::fixed << std::setprecision(3);
+    std::cout << std::setw(26) << "matcher" << std::setw(8) << "kpts"
+              << std::setw(12) << "ms" << std::setw(10) << "matches" << std::endl;
+
+    for (int n : sizes) {
+        cv::Mat query, train;
+        makeDescriptors(n, n, bytes, query, train);
+        std::vector<cv::DMatch> matches;
+
+        brisk::BruteForceMatcher bruteForce;
+        time("brisk brute force", n, repetitions, [&]() {
+            bruteForce.match(query, train, matches);
+            return matches.size();
+        });
+
+        for (int k = 0; k <= (int)HammingMatcher::bestKernel(); k++) {
+            for (int threads : { 1, 0 }) {
+                HammingMatcher matcher(HammingMatcher::Params(0.8f, true, -1, threads));
+                matcher.setKernel((HammingMatcher::Kernel)k);
+                const std::string name = std::string(kernelNames[k]) + (threads == 1 ? " 1 thread" : " all threads");
+                time(name, n, repetitions, [&]() {
+                    matcher.match(query, train, matches);
+                    return matches.size();
+                });
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,135 @@
+// Times mesh extraction from the active TSDF volume while frames are integrated, the way
+// SegmentedMesh extracts the mesh of the active block after integrating frames.
+//
+// Synthetic depth and color frames are ray cast in a box-shaped room from a camera that turns
+// on the spot and slowly walks across it. Every frame is integrated into a plain
+// ScalableTSDFVolume ("full": marching cubes over every volume unit on each extraction) and into
+// an IncrementalTSDFVolume ("incremental": only the units integrated since the last extraction
+// are re-meshed). Both meshes are extracted every extractEvery frames and their triangle
+// counts compared.
+//
+// Usage: OpenARK_incremental_mesh_benchmark [num_frames] [extract_every]
+//        (defaults to 300 and 1)
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <limits>
+#include <Eigen/Geometry>
+
+#include "IncrementalTSDFVolume.h"
+
+using namespace ark;
+
+namespace {
+    const int kWidth = 320, kHeight = 240;
+    const double kFocal = 280.0;
+    /** room bounds in the world frame, y pointing down like the camera's */
+    const Eigen::Vector3d kRoomMin(-3.0, -1.4, -3.0), kRoomMax(3.0, 1.2, 3.0);
+
+    /** camera to world transform of frame i */
+    Eigen::Matrix4d cameraPose(int i, int numFrames) {
+        const double yaw = 4.0 * M_PI * i / numFrames;
+        const double walk = 2.0 * i / numFrames - 1.0;
+        Eigen::Matrix4d T_WC = Eigen::Matrix4d::Identity();
+        T_WC.block<3,3>(0,0) = Eigen::AngleAxisd(yaw, Eigen::Vector3d::UnitY()).toRotationMatrix();
+        T_WC.block<3,1>(0,3) = Eigen::Vector3d(1.5 * walk, 0.0, 0.5 * walk);
+        return T_WC;
+    }
+
+    /** depth (m, along the optical axis) and color of the room walls seen from T_WC */
+    void renderRoom(const Eigen::Matrix4d& T_WC, open3d::geometry::RGBDImage& image) {
+        image.depth_.Prepare(kWidth, kHeight, 1, sizeof(float));
+        image.color_.Prepare(kWidth, kHeight, 3, sizeof(uint8_t));
+        float* depth = reinterpret_cast<float*>(image.depth_.data_.data());
+        uint8_t* color = image.color_.data_.data();
+        const Eigen::Matrix3d R = T_WC.block<3,3>(0,0);
+        const Eigen::Vector3d origin = T_WC.block<3,1>(0,3);
+        for (int v = 0; v < kHeight; v++) {
+            for (int u = 0; u < kWidth; u++) {
+                const Eigen::Vector3d ray = R * Eigen::Vector3d((u - kWidth / 2) / kFocal, (v - kHeight / 2) / kFocal, 1.0);
+                // the camera is inside the box, so the nearest wall is the first exit along any axis
+                double t = std::numeric_limits<double>::max();
+                for (int j = 0; j < 3; j++) {
+                    if (ray(j) > 0.0)
+                        t = std::min(t, (kRoomMax(j) - origin(j)) / ray(j));
+                    else if (ray(j) < 0.0)
+                        t = std::min(t, (kRoomMin(j) - origin(j)) / ray(j));
+                }
+                const Eigen::Vector3d hit = origin + t * ray;
+                // ray has a unit z component in the camera frame, so t is the depth
+                depth[v * kWidth + u] = static_cast<float>(t);
+                const bool checker = ((int)std::floor(hit(0) * 2.0) + (int)std::floor(hit(1) * 2.0) +
+                    (int)std::floor(hit(2) * 2.0)) % 2 == 0;
+                uint8_t* pixel = color + 3 * (v * kWidth + u);
+                pixel[0] = checker ? 200 : 60;
+                pixel[1] = (uint8_t)(128 + 100 * std::sin(hit(1)));
+                pixel[2] = checker ? 80 : 180;
+            }
+        }
+    }
+
+    double millisecondsSince(const std::chrono::steady_clock::time_point& start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+}
+
+int main(int argc, char** argv) {
+    const int numFrames = argc > 1 ? std::atoi(argv[1]) : 300;
+    const int extractEvery = argc > 2 ? std::max(1, std::atoi(argv[2])) : 1;
+    const double voxelLength = 0.02, sdfTrunc = 0.08;
+
+    open3d::integration::ScalableTSDFVolume full(voxelLength, sdfTrunc, open3d::integration::TSDFVolumeColorType::RGB8);
+    IncrementalTSDFVolume incremental(voxelLength, sdfTrunc, open3d::integration::TSDFVolumeColorType::RGB8);
+    const open3d::camera::PinholeCameraIntrinsic intrinsic(kWidth, kHeight, kFocal, kFocal, kWidth / 2, kHeight / 2);
+
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << std::setw(8) << "frame" << std::setw(8) << "units" << std::setw(8) << "dirty"
+              << std::setw(12) << "full ms" << std::setw(16) << "incremental ms" << std::setw(12) << "triangles"
+              << std::setw(10) << "match" << std::endl;
+
+    open3d::geometry::RGBDImage image;
+    double fullTotal = 0.0, incrementalTotal = 0.0;
+    int extractions = 0;
+    bool allMatch = true;
+    for (int i = 0; i < numFrames; i++) {
+        const Eigen::Matrix4d T_WC = cameraPose(i, numFrames);
+        renderRoom(T_WC, image);
+        full.Integrate(image, intrinsic, T_WC.inverse());
+        incremental.Integrate(image, intrinsic, T_WC.inverse());
+        if ((i + 1) % extractEvery != 0)
+            continue;
+
+        const size_t dirty = incremental.NumDirtyUnits();
+        auto start = std::chrono::steady_clock::now();
+        auto fullMesh = full.ExtractTriangleMesh();
+        const double fullMs = millisecondsSince(start);
+        start = std::chrono::steady_clock::now();
+        auto incrementalMesh = incremental.ExtractTriangleMesh();
+        const double incrementalMs = millisecondsSince(start);
+
+        const bool match = fullMesh->triangles_.size() == incrementalMesh->triangles_.size();
+        allMatch = allMatch && match;
+        fullTotal += fullMs;
+        incrementalTotal += incrementalMs;
+        extractions++;
+        if (extractions % 10 == 0 || i + 1 == numFrames) {
+            std::cout << std::setw(8) << i + 1 << std::setw(8) << incremental.volume_units_.size()
+                      << std::setw(8) << dirty << std::setw(12) << fullMs << std::setw(16) << incrementalMs
+                      << std::setw(12) << incrementalMesh->triangles_.size() << std::setw(10) << (match ? "yes" : "NO")
+                      << std::endl;
+        }
+    }
+
+    if (extractions > 0) {
+        std::cout << "\nmean extraction: full " << fullTotal / extractions << " ms, incremental "
+                  << incrementalTotal / extractions << " ms (" << fullTotal / incrementalTotal << "x)" << std::endl;
+    }
+    std::cout << "triangle counts " << (allMatch ? "match" : "DIFFER") << std::endl;
+    return allMatch ? 0 : 1;
+}
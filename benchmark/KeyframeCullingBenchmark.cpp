@@ -0,0 +1,123 @@
+// Replays a long synthetic session into a SparseMap with and without keyframe
+// culling and reports how the map grows: keyframes kept, keyframe memory,
+// pose graph size and the resident memory of the process.
+//
+// The trajectory drives laps around a circle, slowing down and stopping now and
+// then so that keyframes bunch up the way they do when the camera lingers. Every
+// keyframe carries 400 keypoints with 3D points and 48 byte (brisk) descriptors.
+// Once per lap a loop closure links a keyframe to the previous lap. With a budget
+// the map should level off at the budget while the unculled map keeps growing.
+//
+// Usage: OpenARK_keyframe_culling_benchmark [num_keyframes] [max_keyframes]
+//        (defaults to 20000 keyframes and a budget of 2000)
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+#include "SparseMap.h"
+
+using namespace ark;
+
+namespace {
+    typedef SparseMap<DBoW2::FBRISK::TDescriptor, DBoW2::FBRISK> Map;
+
+    const int kKeyframesPerLap = 1000;
+    const int kKeypoints = 400;
+    const int kDescriptorBytes = 48;
+    const double kRadius = 20.0;
+    const int kReportEvery = 2000;
+
+    /** Resident set size of the process in MB (0 where unavailable) */
+    double residentMB() {
+#ifdef __linux__
+        std::ifstream statm("/proc/self/statm");
+        size_t pages = 0, resident = 0;
+        if (statm >> pages >> resident)
+            return resident * (double)sysconf(_SC_PAGESIZE) / (1024.0 * 1024.0);
+#endif
+        return 0.0;
+    }
+
+    MapKeyFrame::Ptr makeKeyframe(int id, double arc, std::mt19937& rng) {
+        std::uniform_int_distribution<int> byte(0, 255);
+        std::uniform_real_distribution<float> pixel(0.0f, 640.0f);
+        MapKeyFrame::Ptr kf(new MapKeyFrame);
+        kf->frameId_ = id;
+        kf->timestamp_ = id * 1e8;
+        const double angle = arc / kRadius;
+        kf->T_WS_ = Eigen::Matrix4d::Identity();
+        kf->T_WS_.block<3,3>(0,0) = Eigen::AngleAxisd(angle, Eigen::Vector3d::UnitZ()).toRotationMatrix();
+        kf->T_WS_.block<3,1>(0,3) = Eigen::Vector3d(kRadius * std::cos(angle), kRadius * std::sin(angle), 0.0);
+        kf->T_SC_.assign(4, Eigen::Matrix4d::Identity());
+
+        std::vector<std::vector<cv::KeyPoint>> keypoints(1, std::vector<cv::KeyPoint>(kKeypoints));
+        std::vector<std::vector<cv::Vec3f>> points(1, std::vector<cv::Vec3f>(kKeypoints, cv::Vec3f(0.0f, 0.0f, 2.0f)));
+        std::vector<cv::Mat> descriptors(1, cv::Mat(kKeypoints, kDescriptorBytes, CV_8U));
+        for (int i = 0; i < kKeypoints; i++) {
+            keypoints[0][i] = cv::KeyPoint(pixel(rng), pixel(rng), 12.0f);
+            for (int c = 0; c < kDescriptorBytes; c++)
+                descriptors[0].at<uchar>(i, c) = (uchar)byte(rng);
+        }
+        kf->features_.pack(keypoints, descriptors, points);
+        return kf;
+    }
+
+    void run(const char* name, int numKeyframes, const KeyframeCullingOptions& options) {
+        std::mt19937 rng(3);
+        // step length varies from stopped (0) to walking pace
+        std::uniform_real_distribution<double> speed(0.0, 1.0);
+        Map map;
+        std::vector<MapKeyFrame::Ptr> lastLap(kKeyframesPerLap);
+        double arc = 0.0;
+        size_t culledTotal = 0;
+        const double lapLength = 2.0 * M_PI * kRadius;
+
+        for (int id = 0; id < numKeyframes; id++) {
+            const double phase = std::fmod(arc, lapLength) / lapLength;
+            arc += (phase < 0.1 ? 0.02 : 0.2) * speed(rng);
+            MapKeyFrame::Ptr kf = makeKeyframe(id, arc, rng);
+            MapKeyFrame::Ptr loop_kf = nullptr;
+            Eigen::Affine3d transformEstimate = Eigen::Affine3d::Identity();
+            const int slot = id % kKeyframesPerLap;
+            if (slot == kKeyframesPerLap / 2 && lastLap[slot] != nullptr && map.getKeyframe(lastLap[slot]->frameId_) != nullptr)
+                loop_kf = lastLap[slot];
+            lastLap[slot] = kf;
+            map.addKeyframe(kf, loop_kf, transformEstimate);
+
+            std::vector<int> culled;
+            culledTotal += map.cullKeyframes(options, culled);
+
+            if ((id + 1) % kReportEvery == 0) {
+                size_t constraints;
+                map.graph_.constraintMutex.lock();
+                constraints = map.graph_.constraints_.size();
+                map.graph_.constraintMutex.unlock();
+                std::cout << std::setw(10) << name << std::setw(10) << id + 1
+                          << std::setw(10) << map.getNumKeyframes() << std::setw(10) << culledTotal
+                          << std::setw(14) << map.getKeyframeBytes() / (1024.0 * 1024.0)
+                          << std::setw(12) << constraints << std::setw(12) << residentMB() << std::endl;
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    const int numKeyframes = argc > 1 ? std::atoi(argv[1]) : 20000;
+    const size_t budget = argc > 2 ? (size_t)std::atoi(argv[2]) : 2000;
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << std::setw(10) << "mode" << std::setw(10) << "added" << std::setw(10) << "kept"
+              << std::setw(10) << "culled" << std::setw(14) << "keyframe MB"
+              << std::setw(12) << "constraints" << std::setw(12) << "RSS MB" << std::endl;
+    run("culled", numKeyframes, KeyframeCullingOptions(budget));
+    run("unbounded", numKeyframes, KeyframeCullingOptions());
+    return 0;
+}
@@ -0,0 +1,156 @@
+// Measures the heap memory of keyframe features stored the way MapKeyFrame used to
+// (a std::vector of cv::KeyPoint, an Eigen::Vector4d per 3D point and a cv::Mat of
+// descriptors per image) against the packed CompactKeyframeFeatures, and the error
+// the keypoint quantization introduces.
+//
+// Heap usage is read from the allocator (glibc mallinfo) before and after building
+// a batch of keyframes, so allocator overhead and cv::Mat headers are included.
+// Keyframes have a single image with brisk (48 byte) descriptors, the setup used by
+// loop closure.
+//
+// Usage: OpenARK_keyframe_storage_benchmark [keypoints_per_keyframe] [num_keyframes]
+//        (defaults to 400 keypoints and 1000 keyframes)
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <cstdlib>
+#include <memory>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include <opencv2/core.hpp>
+#include <Eigen/StdVector>
+
+#include "CompactKeyframeFeatures.h"
+
+using namespace ark;
+
+namespace {
+    const int kDescriptorBytes = 48;
+
+    /** Bytes allocated on the heap (0 where unavailable) */
+    size_t heapBytes() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+        return mallinfo2().uordblks;
+#elif defined(__GLIBC__)
+        return (size_t)(unsigned)mallinfo().uordblks;
+#else
+        return 0;
+#endif
+    }
+
+    /** MapKeyFrame's previous feature storage */
+    struct LegacyFeatures {
+        std::vector<std::vector<cv::KeyPoint>> keypoints_;
+        std::vector<cv::Mat> descriptors_;
+        std::vector<std::vector<Eigen::Vector4d, Eigen::aligned_allocator<Eigen::Vector4d>>> keypoints3dh_C;
+    };
+
+    struct Features {
+        std::vector<std::vector<cv::KeyPoint>> keypoints;
+        std::vector<cv::Mat> descriptors;
+        std::vector<std::vector<cv::Vec3f>> points;
+    };
+
+    Features makeFeatures(int numKeypoints, std::mt19937 & rng) {
+        std::uniform_int_distribution<int> byte(0, 255);
+        std::uniform_real_distribution<float> x(0.0f, 640.0f), y(0.0f, 480.0f), angle(0.0f, 360.0f);
+        std::uniform_real_distribution<float> depth(-1.0f, 5.0f);
+        Features f;
+        f.keypoints.resize(1);
+        f.points.resize(1);
+        f.descriptors.assign(1, cv::Mat(numKeypoints, kDescriptorBytes, CV_8U));
+        for (int i = 0; i < numKeypoints; i++) {
+            f.keypoints[0].push_back(cv::KeyPoint(x(rng), y(rng), 12.0f + (i % 4) * 6.0f, angle(rng), 50.0f, i % 4));
+            f.points[0].push_back(cv::Vec3f(0.5f, -0.2f, depth(rng)));
+            for (int c = 0; c < kDescriptorBytes; c++)
+                f.descriptors[0].at<uchar>(i, c) = (uchar)byte(rng);
+        }
+        return f;
+    }
+
+    std::shared_ptr<LegacyFeatures> makeLegacy(const Features & f) {
+        std::shared_ptr<LegacyFeatures> legacy = std::make_shared<LegacyFeatures>();
+        legacy->keypoints_ = f.keypoints;
+        legacy->descriptors_.push_back(f.descriptors[0].clone());
+        legacy->keypoints3dh_C.resize(1);
+        legacy->keypoints3dh_C[0].resize(f.points[0].size());
+        for (size_t i = 0; i < f.points[0].size(); i++) {
+            const cv::Vec3f & p = f.points[0][i];
+            legacy->keypoints3dh_C[0][i] = p[2] > 0 ? Eigen::Vector4d(p[0], p[1], p[2], 1) : Eigen::Vector4d(0, 0, 0, 0);
+        }
+        return legacy;
+    }
+
+    std::shared_ptr<CompactKeyframeFeatures> makeCompact(const Features & f) {
+        std::shared_ptr<CompactKeyframeFeatures> compact = std::make_shared<CompactKeyframeFeatures>();
+        compact->pack(f.keypoints, f.descriptors, f.points);
+        return compact;
+    }
+}
+
+int main(int argc, char** argv) {
+    const int numKeypoints = argc > 1 ? std::atoi(argv[1]) : 400;
+    const int numKeyframes = argc > 2 ? std::atoi(argv[2]) : 1000;
+
+    std::mt19937 rng(11);
+    std::vector<Features> features;
+    for (int k = 0; k < numKeyframes; k++)
+        features.push_back(makeFeatures(numKeypoints, rng));
+
+    size_t before = heapBytes();
+    std::vector<std::shared_ptr<LegacyFeatures>> legacy;
+    for (int k = 0; k < numKeyframes; k++)
+        legacy.push_back(makeLegacy(features[k]));
+    const double legacyBytes = (double)(heapBytes() - before) / numKeyframes;
+
+    before = heapBytes();
+    std::vector<std::shared_ptr<CompactKeyframeFeatures>> compact;
+    for (int k = 0; k < numKeyframes; k++)
+        compact.push_back(makeCompact(features[k]));
+    const double compactBytes = (double)(heapBytes() - before) / numKeyframes;
+
+    // quantization error and exactness of what loop closure uses
+    double maxPixelError = 0.0, maxAngleError = 0.0, maxPointError = 0.0;
+    size_t descriptorMismatches = 0, depthMismatches = 0;
+    for (int k = 0; k < numKeyframes; k++) {
+        std::vector<cv::KeyPoint> decoded;
+        compact[k]->keypoints(0, decoded);
+        const cv::Mat descriptors = compact[k]->descriptors(0);
+        for (int i = 0; i < numKeypoints; i++) {
+            const cv::KeyPoint & a = legacy[k]->keypoints_[0][i];
+            maxPixelError = std::max(maxPixelError, (double)std::abs(a.pt.x - decoded[i].pt.x));
+            maxPixelError = std::max(maxPixelError, (double)std::abs(a.pt.y - decoded[i].pt.y));
+            const double angleError = std::abs(a.angle - decoded[i].angle);
+            maxAngleError = std::max(maxAngleError, std::min(angleError, 360.0 - angleError));
+            const Eigen::Vector4d & p = legacy[k]->keypoints3dh_C[0][i];
+            const Eigen::Vector4d q = compact[k]->homogeneousPoint(0, i);
+            if ((p[3] != 0) != (q[3] != 0))
+                depthMismatches++;
+            maxPointError = std::max(maxPointError, (p - q).cwiseAbs().maxCoeff());
+            for (int c = 0; c < kDescriptorBytes; c++)
+                if (descriptors.at<uchar>(i, c) != legacy[k]->descriptors_[0].at<uchar>(i, c))
+                    descriptorMismatches++;
+        }
+    }
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << numKeyframes << " keyframes, " << numKeypoints << " keypoints, "
+              << kDescriptorBytes << " byte descriptors\n";
+    if (legacyBytes > 0 && compactBytes > 0) {
+        std::cout << "bytes per keyframe:  legacy " << legacyBytes << "  compact " << compactBytes
+                  << "  (" << std::setprecision(2) << legacyBytes / compactBytes << "x smaller)\n";
+    } else {
+        std::cout << "heap usage not available on this platform, packed storage: "
+                  << compact[0]->memoryUsage() << " bytes per keyframe\n";
+    }
+    std::cout << std::setprecision(4);
+    std::cout << "max keypoint position error " << maxPixelError << " px, angle error " << maxAngleError
+              << " deg, 3D point error " << maxPointError << " m\n";
+    std::cout << "descriptor mismatches " << descriptorMismatches << ", depth flag mismatches " << depthMismatches << std::endl;
+    return 0;
+}
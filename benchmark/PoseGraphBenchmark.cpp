@@ -0,0 +1,126 @@
+// Compares the full and incremental solve modes of SimplePoseGraphSolver on
+// synthetic pose graphs of growing size.
+//
+// The trajectory drives laps around a circle; odometry between consecutive
+// keyframes is perturbed with noise and every few keyframes after the first lap a
+// loop closure links the keyframe to the one at the same position on the previous
+// lap. Most of the graph is built and solved once up front, then the remaining
+// keyframes are streamed in and the solve that follows each loop closure is timed,
+// which mirrors what the SLAM system does online.
+//
+// Usage: OpenARK_pose_graph_benchmark [num_keyframes ...]
+//        (defaults to 1000 10000 50000)
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+
+#include "PoseGraphSolver.h"
+#include "SyntheticPoseGraph.h"
+
+using namespace ark;
+
+namespace {
+    const int kLoopEvery = 10;
+    const int kTimedLoops = 10;
+
+    typedef synthetic::PoseGraph SyntheticGraph;
+
+    double trajectoryRmse(const SyntheticGraph& graph, SimplePoseGraphSolver& solver) {
+        SimplePoseGraphSolver::OptimizedPoses::ConstPtr result = solver.getOptimizedPoses();
+        return synthetic::positionRmse(graph, [&](int i) { return result->poses.at(i).P_WA; });
+    }
+
+    struct RunResult {
+        double warmupMs;
+        double meanMs;
+        double maxMs;
+        double rmse;
+    };
+
+    RunResult run(const SyntheticGraph& graph, SimplePoseGraphSolver::SolveMode mode) {
+        SimplePoseGraphSolver solver;
+        solver.setSolveMode(mode);
+
+        const int numKeyframes = (int)graph.groundTruth.size();
+        // keyframes after this index are streamed in with timed solves
+        const int streamStart = std::max(1, numKeyframes - kTimedLoops * kLoopEvery);
+
+        Eigen::Matrix4d T_WS = graph.groundTruth[0];
+        size_t nextLoop = 0;
+        RunResult out;
+        std::vector<double> times;
+
+        solver.AddPose(0, T_WS);
+        for (int i = 1; i < numKeyframes; i++) {
+            T_WS = T_WS * graph.odometry[i-1];
+            solver.AddConstraint(i-1, i, graph.odometry[i-1]);
+            solver.AddPose(i, T_WS);
+
+            bool loop = false;
+            while (nextLoop < graph.loops.size() && graph.loops[nextLoop].first == i) {
+                solver.AddConstraint(i, graph.loops[nextLoop].second, graph.loopMeasurements[nextLoop]);
+                nextLoop++;
+                loop = true;
+            }
+
+            if (i + 1 == streamStart) {
+                const auto start = std::chrono::steady_clock::now();
+                solver.optimize();
+                out.warmupMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                // continue from the optimized estimate, as the SLAM system does
+                T_WS = solver.getTransformById(i);
+            } else if (i >= streamStart && loop) {
+                const auto start = std::chrono::steady_clock::now();
+                solver.optimize();
+                times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+                T_WS = solver.getTransformById(i);
+            }
+        }
+
+        out.meanMs = out.maxMs = 0.0;
+        for (size_t i = 0; i < times.size(); i++) {
+            out.meanMs += times[i] / times.size();
+            out.maxMs = std::max(out.maxMs, times[i]);
+        }
+        out.rmse = trajectoryRmse(graph, solver);
+        return out;
+    }
+
+    void print(const char* name, int numKeyframes, const RunResult& result) {
+        std::cout << std::setw(12) << name << std::setw(10) << numKeyframes
+                  << std::setw(14) << result.warmupMs
+                  << std::setw(14) << result.meanMs
+                  << std::setw(14) << result.maxMs
+                  << std::setw(12) << result.rmse << std::endl;
+    }
+}
+
+int main(int argc, char** argv) {
+    std::vector<int> sizes;
+    for (int i = 1; i < argc; i++) {
+        sizes.push_back(std::atoi(argv[i]));
+    }
+    if (sizes.empty()) {
+        sizes.push_back(1000);
+        sizes.push_back(10000);
+        sizes.push_back(50000);
+    }
+
+    std::cout << std::fixed << std::setprecision(3);
+    std::cout << std::setw(12) << "mode" << std::setw(10) << "keyframes"
+              << std::setw(14) << "warmup ms" << std::setw(14) << "mean ms/loop"
+              << std::setw(14) << "max ms/loop" << std::setw(12) << "rmse m" << std::endl;
+
+    for (size_t i = 0; i < sizes.size(); i++) {
+        SyntheticGraph graph = synthetic::circle(sizes[i], 500, kLoopEvery);
+        print("full", sizes[i], run(graph, SimplePoseGraphSolver::SolveMode::Full));
+        print("incremental", sizes[i], run(graph, SimplePoseGraphSolver::SolveMode::Incremental));
+    }
+    return 0;
+}
@@ -0,0 +1,139 @@
+// Compares SimplePoseGraphSolver configurations (Jacobians, linear solver and sparse
+// backend, trust region strategy, threads, iteration budget, robust loss) on synthetic
+// grid, sphere and corridor pose graphs.
+//
+// Each graph is initialized from dead reckoning and solved once from scratch in Full
+// mode, reporting the solve time and the RMS position error against ground truth.
+// The robust loss configurations are also run with 5% wrong loop closures added.
+//
+// Usage: OpenARK_pose_graph_solver_options_benchmark [num_keyframes]
+//        (defaults to 2000)
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+
+#include "PoseGraphSolver.h"
+#include "SyntheticPoseGraph.h"
+
+using namespace ark;
+
+namespace {
+    typedef SimplePoseGraphSolver::SolverOptions SolverOptions;
+
+    struct Configuration {
+        Configuration(const std::string& name, const SolverOptions& options):
+            name(name), options(options) {}
+        std::string name;
+        SolverOptions options;
+    };
+
+    std::vector<Configuration> configurations() {
+        std::vector<Configuration> out;
+        SolverOptions options;
+        out.push_back(Configuration("autodiff schur dogleg", options));
+        options.analyticJacobians = true;
+        out.push_back(Configuration("analytic schur dogleg", options));
+        options.linearSolver = ::ceres::SPARSE_NORMAL_CHOLESKY;
+        out.push_back(Configuration("analytic cholesky dogleg", options));
+        options.trustRegion = ::ceres::LEVENBERG_MARQUARDT;
+        out.push_back(Configuration("analytic cholesky lm", options));
+        if (::ceres::IsSparseLinearAlgebraLibraryTypeAvailable(::ceres::SUITE_SPARSE)) {
+            options.sparseLibrary = ::ceres::SUITE_SPARSE;
+            out.push_back(Configuration("  suitesparse (cholmod)", options));
+        }
+        if (::ceres::IsSparseLinearAlgebraLibraryTypeAvailable(::ceres::EIGEN_SPARSE)) {
+            options.sparseLibrary = ::ceres::EIGEN_SPARSE;
+            out.push_back(Configuration("  eigen sparse", options));
+        }
+        options = SolverOptions();
+        options.numThreads = 8;
+        out.push_back(Configuration("analytic, 8 threads", options));
+        options = SolverOptions();
+        options.maxIterations = 50;
+        out.push_back(Configuration("analytic, 50 iterations", options));
+        options.maxSolverTimeSeconds = 0.05;
+        out.push_back(Configuration("  limited to 50 ms", options));
+        return out;
+    }
+
+    std::vector<Configuration> robustConfigurations() {
+        std::vector<Configuration> out;
+        SolverOptions options;
+        options.maxIterations = 50;
+        out.push_back(Configuration("no loss", options));
+        options.loss = SimplePoseGraphSolver::Loss::Huber;
+        out.push_back(Configuration("huber", options));
+        options.loss = SimplePoseGraphSolver::Loss::Cauchy;
+        out.push_back(Configuration("cauchy", options));
+        return out;
+    }
+
+    void run(const synthetic::PoseGraph& graph, const Configuration& configuration) {
+        SimplePoseGraphSolver solver;
+        solver.setSolverOptions(configuration.options);
+
+        Eigen::Matrix4d T_WS = graph.groundTruth[0];
+        solver.AddPose(0, T_WS);
+        size_t nextLoop = 0;
+        for (size_t i = 1; i < graph.groundTruth.size(); i++) {
+            T_WS = T_WS * graph.odometry[i-1];
+            solver.AddConstraint((int)i - 1, (int)i, graph.odometry[i-1]);
+            solver.AddPose((int)i, T_WS);
+            for (; nextLoop < graph.loops.size() && graph.loops[nextLoop].first == (int)i; nextLoop++)
+                solver.AddConstraint(graph.loops[nextLoop].first, graph.loops[nextLoop].second,
+                        graph.loopMeasurements[nextLoop]);
+        }
+        const double initialRmse = synthetic::positionRmse(graph, [&](int i) {
+            return Eigen::Vector3d(solver.getTransformById(i).block<3,1>(0,3));
+        });
+
+        const auto start = std::chrono::steady_clock::now();
+        solver.optimize();
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        SimplePoseGraphSolver::OptimizedPoses::ConstPtr result = solver.getOptimizedPoses();
+        const double rmse = result == nullptr ? initialRmse :
+            synthetic::positionRmse(graph, [&](int i) { return result->poses.at(i).P_WA; });
+        std::cout << std::setw(28) << configuration.name << std::setw(12) << ms
+                  << std::setw(14) << initialRmse << std::setw(12) << rmse << std::endl;
+    }
+
+    void header(const std::string& title, const synthetic::PoseGraph& graph) {
+        std::cout << "\n" << title << ": " << graph.groundTruth.size() << " keyframes, "
+                  << graph.loops.size() << " loop closures\n";
+        std::cout << std::setw(28) << "configuration" << std::setw(12) << "ms"
+                  << std::setw(14) << "initial rmse" << std::setw(12) << "rmse m" << std::endl;
+    }
+}
+
+int main(int argc, char** argv) {
+    const int numKeyframes = argc > 1 ? std::atoi(argv[1]) : 2000;
+
+    std::vector<std::pair<std::string, synthetic::PoseGraph>> graphs;
+    graphs.push_back(std::make_pair(std::string("grid"), synthetic::grid(numKeyframes)));
+    graphs.push_back(std::make_pair(std::string("sphere"), synthetic::sphere(numKeyframes)));
+    graphs.push_back(std::make_pair(std::string("corridor"),
+        synthetic::corridor(numKeyframes, std::max(100, numKeyframes / 6), 25)));
+
+    std::cout << std::fixed << std::setprecision(3);
+    const std::vector<Configuration> all = configurations();
+    for (size_t g = 0; g < graphs.size(); g++) {
+        header(graphs[g].first, graphs[g].second);
+        for (size_t c = 0; c < all.size(); c++)
+            run(graphs[g].second, all[c]);
+    }
+
+    const std::vector<Configuration> robust = robustConfigurations();
+    for (size_t g = 0; g < graphs.size(); g++) {
+        synthetic::PoseGraph graph = graphs[g].second;
+        synthetic::addOutliers(graph, (int)graph.loops.size() / 20);
+        header(graphs[g].first + " with 5% wrong loop closures", graph);
+        for (size_t c = 0; c < robust.size(); c++)
+            run(graph, robust[c]);
+    }
+    return 0;
+}
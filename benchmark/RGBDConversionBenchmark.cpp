@@ -0,0 +1,108 @@
+// Times the conversion of a color and depth cv::Mat pair into the Open3D RGBD image
+// that is integrated into the TSDF, for every integrated frame.
+//
+// "previous" is the conversion SegmentedMesh used before: fresh Open3D color and depth
+// images filled pixel by pixel through cv::Mat::at, then RGBDImage::CreateFromColorAndDepth,
+// which copies the color image again and converts depth to float in a third image.
+// "reused buffers" is generateRGBDImageFromCV into a preallocated RGBDImage: row copies for
+// color, and a single pass from 16-bit millimeters to float meters for depth.
+// Both outputs are compared to check that they are identical.
+//
+// Usage: OpenARK_rgbd_conversion_benchmark [repetitions]
+//        (defaults to 200)
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+
+#include <opencv2/core.hpp>
+
+#include "SegmentedMesh.h"
+
+using namespace ark;
+
+namespace {
+    const double kMaxDepth = 2.5;
+
+    std::shared_ptr<open3d::geometry::RGBDImage> previousConversion(const cv::Mat& color_mat, const cv::Mat& depth_mat,
+            double max_depth, int width, int height) {
+        auto color_im = std::make_shared<open3d::geometry::Image>();
+        color_im->Prepare(width, height, 3, sizeof(uint8_t));
+        uint8_t *pi = (uint8_t *)(color_im->data_.data());
+        for (int i = 0; i < height; i++) {
+            for (int k = 0; k < width; k++) {
+                cv::Vec3b pixel = color_mat.at<cv::Vec3b>(i, k);
+                *pi++ = pixel[0];
+                *pi++ = pixel[1];
+                *pi++ = pixel[2];
+            }
+        }
+
+        auto depth_im = std::make_shared<open3d::geometry::Image>();
+        depth_im->Prepare(width, height, 1, sizeof(uint16_t));
+        uint16_t * p = (uint16_t *)depth_im->data_.data();
+        for (int i = 0; i < height; i++) {
+            for (int k = 0; k < width; k++) {
+                *p++ = depth_mat.at<uint16_t>(i, k);
+            }
+        }
+        return open3d::geometry::RGBDImage::CreateFromColorAndDepth(*color_im, *depth_im, 1000.0, max_depth, false);
+    }
+
+    bool identical(const open3d::geometry::Image& a, const open3d::geometry::Image& b) {
+        return a.width_ == b.width_ && a.height_ == b.height_ &&
+            a.num_of_channels_ == b.num_of_channels_ && a.bytes_per_channel_ == b.bytes_per_channel_ &&
+            a.data_.size() == b.data_.size() && std::memcmp(a.data_.data(), b.data_.data(), a.data_.size()) == 0;
+    }
+
+    double time(int repetitions, const std::function<void()>& convert) {
+        convert();
+        const auto start = std::chrono::high_resolution_clock::now();
+        for (int r = 0; r < repetitions; r++)
+            convert();
+        const auto end = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration<double, std::micro>(end - start).count() / repetitions;
+    }
+}
+
+int main(int argc, char** argv) {
+    const int repetitions = argc > 1 ? std::atoi(argv[1]) : 200;
+    const cv::Size sizes[] = { cv::Size(640, 480), cv::Size(1280, 720) };
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << std::setw(12) << "size" << std::setw(16) << "previous us" << std::setw(20) << "reused buffers us"
+              << std::setw(10) << "speedup" << std::setw(12) << "identical" << std::endl;
+    for (const cv::Size& size : sizes) {
+        std::mt19937 rng(5);
+        std::uniform_int_distribution<int> byte(0, 255), depth(0, 4000);
+        cv::Mat color(size, CV_8UC3), depth_mm(size, CV_16UC1);
+        for (int i = 0; i < size.height; i++) {
+            for (int k = 0; k < size.width; k++) {
+                color.at<cv::Vec3b>(i, k) = cv::Vec3b((uchar)byte(rng), (uchar)byte(rng), (uchar)byte(rng));
+                // about a tenth of the pixels have no depth
+                depth_mm.at<uint16_t>(i, k) = (uint16_t)(k % 10 == 0 ? 0 : depth(rng));
+            }
+        }
+
+        std::shared_ptr<open3d::geometry::RGBDImage> previous;
+        const double previousUs = time(repetitions, [&]() {
+            previous = previousConversion(color, depth_mm, kMaxDepth, size.width, size.height);
+        });
+        open3d::geometry::RGBDImage reused;
+        const double reusedUs = time(repetitions, [&]() {
+            generateRGBDImageFromCV(color, depth_mm, kMaxDepth, reused);
+        });
+        const bool same = identical(previous->color_, reused.color_) && identical(previous->depth_, reused.depth_);
+
+        std::cout << std::setw(12) << (std::to_string(size.width) + "x" + std::to_string(size.height))
+                  << std::setw(16) << previousUs << std::setw(20) << reusedUs
+                  << std::setw(9) << previousUs / reusedUs << "x" << std::setw(12) << (same ? "yes" : "NO") << std::endl;
+    }
+    return 0;
+}
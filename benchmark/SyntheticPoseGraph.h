@@ -0,0 +1,228 @@
+#pragma once
+
+// Synthetic pose graphs for the pose graph benchmarks: ground truth keyframe poses,
+// odometry between consecutive keyframes and loop closures between keyframes that
+// revisit a place, both perturbed with noise.
+
+#include <vector>
+#include <map>
+#include <random>
+#include <cmath>
+#include <numeric>
+#include <algorithm>
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+#include <Eigen/StdVector>
+
+namespace ark {
+namespace synthetic {
+
+    typedef std::vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d>> PoseVector;
+
+    struct PoseGraph {
+        PoseVector groundTruth;
+        /** odometry[i] is the measured transform from keyframe i to keyframe i+1 */
+        PoseVector odometry;
+        /** (keyframe, earlier keyframe at the same place), ordered by keyframe;
+         *  measured transforms in loopMeasurements */
+        std::vector<std::pair<int, int>> loops;
+        PoseVector loopMeasurements;
+    };
+
+    struct Noise {
+        Noise(double translation = 0.01, double rotation = 0.002):
+            translation(translation), rotation(rotation) {}
+        /** standard deviation per axis in m */
+        double translation;
+        /** standard deviation per axis in rad */
+        double rotation;
+    };
+
+    inline Eigen::Matrix4d perturb(const Eigen::Matrix4d& T, const Noise& noise, std::mt19937& rng) {
+        std::normal_distribution<double> translation(0.0, noise.translation);
+        std::normal_distribution<double> rotation(0.0, noise.rotation);
+        Eigen::Matrix4d N = Eigen::Matrix4d::Identity();
+        N.block<3,3>(0,0) = (Eigen::AngleAxisd(rotation(rng), Eigen::Vector3d::UnitX())
+            * Eigen::AngleAxisd(rotation(rng), Eigen::Vector3d::UnitY())
+            * Eigen::AngleAxisd(rotation(rng), Eigen::Vector3d::UnitZ())).toRotationMatrix();
+        N.block<3,1>(0,3) = Eigen::Vector3d(translation(rng), translation(rng), translation(rng));
+        return T * N;
+    }
+
+    inline Eigen::Matrix4d pose(const Eigen::Matrix3d& R, const Eigen::Vector3d& t) {
+        Eigen::Matrix4d T = Eigen::Matrix4d::Identity();
+        T.block<3,3>(0,0) = R;
+        T.block<3,1>(0,3) = t;
+        return T;
+    }
+
+    inline void addLoop(PoseGraph& graph, int i, int j, const Noise& noise, std::mt19937& rng) {
+        graph.loops.push_back(std::make_pair(i, j));
+        graph.loopMeasurements.push_back(perturb(graph.groundTruth[i].inverse() * graph.groundTruth[j], noise, rng));
+    }
+
+    /**
+     * Fill in the odometry from the ground truth, calling loopsAt(i) after the odometry
+     * into keyframe i so the measurements are drawn in the same order as a robot would make them.
+     */
+    template <class LoopsAt>
+    void measure(PoseGraph& graph, const Noise& noise, std::mt19937& rng, LoopsAt loopsAt) {
+        for (size_t i = 1; i < graph.groundTruth.size(); i++) {
+            graph.odometry.push_back(perturb(graph.groundTruth[i-1].inverse() * graph.groundTruth[i], noise, rng));
+            loopsAt((int)i);
+        }
+    }
+
+    /** Laps around a circle, slowly climbing; every loopEvery keyframes after the first lap
+     *  a loop closure links the keyframe to the one at the same position on the previous lap. */
+    inline PoseGraph circle(int numKeyframes, int keyframesPerLap = 500, int loopEvery = 10,
+            double radius = 20.0, const Noise& noise = Noise(), unsigned seed = 42) {
+        PoseGraph graph;
+        std::mt19937 rng(seed);
+        for (int i = 0; i < numKeyframes; i++) {
+            const double angle = 2.0 * M_PI * i / keyframesPerLap;
+            graph.groundTruth.push_back(pose(
+                Eigen::AngleAxisd(angle + M_PI / 2, Eigen::Vector3d::UnitZ()).toRotationMatrix(),
+                Eigen::Vector3d(radius * std::cos(angle), radius * std::sin(angle), 0.1 * i / keyframesPerLap)));
+        }
+        measure(graph, noise, rng, [&](int i) {
+            if (i >= keyframesPerLap && i % loopEvery == 0)
+                addLoop(graph, i, i - keyframesPerLap, noise, rng);
+        });
+        return graph;
+    }
+
+    /** Manhattan world: a random walk through a square grid of streets, one keyframe per
+     *  block, turning at random intersections. Revisiting an intersection closes a loop with
+     *  the latest earlier visit (at least minGap keyframes back). Many loops of all lengths. */
+    inline PoseGraph grid(int numKeyframes, double blockSize = 1.0, int minGap = 10,
+            const Noise& noise = Noise(), unsigned seed = 42) {
+        PoseGraph graph;
+        std::mt19937 rng(seed);
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        // about as many intersections as keyframes / 4, so most of them are revisited
+        const int halfSize = std::max(2, (int)std::sqrt((double)numKeyframes) / 4);
+        const int dx[4] = { 1, 0, -1, 0 }, dy[4] = { 0, 1, 0, -1 };
+        int x = 0, y = 0, heading = 0;
+        std::vector<std::pair<int, int>> cells;
+        for (int i = 0; i < numKeyframes; i++) {
+            graph.groundTruth.push_back(pose(
+                Eigen::AngleAxisd(M_PI / 2 * heading, Eigen::Vector3d::UnitZ()).toRotationMatrix(),
+                Eigen::Vector3d(blockSize * x, blockSize * y, 0.0)));
+            cells.push_back(std::make_pair(x, y));
+            const double turn = uniform(rng);
+            if (turn < 0.15)
+                heading = (heading + 1) % 4;
+            else if (turn < 0.3)
+                heading = (heading + 3) % 4;
+            // turn around at the edge of the map
+            if (std::abs(x + dx[heading]) > halfSize || std::abs(y + dy[heading]) > halfSize)
+                heading = (heading + 2) % 4;
+            x += dx[heading];
+            y += dy[heading];
+        }
+        std::map<std::pair<int, int>, int> lastVisit;
+        lastVisit[cells[0]] = 0;
+        measure(graph, noise, rng, [&](int i) {
+            std::map<std::pair<int, int>, int>::iterator visit = lastVisit.find(cells[i]);
+            if (visit != lastVisit.end() && i - visit->second >= minGap)
+                addLoop(graph, i, visit->second, noise, rng);
+            lastVisit[cells[i]] = i;
+        });
+        return graph;
+    }
+
+    /** Rings of keyframes around a sphere from the south to the north pole, climbing to the
+     *  next ring after each lap; every loopEvery keyframes a loop closure links the keyframe
+     *  to the one directly below it on the previous ring. A dense, regular graph. */
+    inline PoseGraph sphere(int numKeyframes, int keyframesPerRing = 100, int loopEvery = 2,
+            double radius = 50.0, const Noise& noise = Noise(), unsigned seed = 42) {
+        PoseGraph graph;
+        std::mt19937 rng(seed);
+        const int numRings = (numKeyframes + keyframesPerRing - 1) / keyframesPerRing;
+        for (int i = 0; i < numKeyframes; i++) {
+            const double latitude = -M_PI / 2 + M_PI * (i / keyframesPerRing + 1) / (numRings + 1);
+            const double longitude = 2.0 * M_PI * (i % keyframesPerRing) / keyframesPerRing;
+            // x along the direction of travel (east), z out of the sphere
+            const Eigen::Vector3d up(std::cos(latitude) * std::cos(longitude),
+                std::cos(latitude) * std::sin(longitude), std::sin(latitude));
+            const Eigen::Vector3d east(-std::sin(longitude), std::cos(longitude), 0.0);
+            Eigen::Matrix3d R;
+            R << east, up.cross(east), up;
+            graph.groundTruth.push_back(pose(R, radius * up));
+        }
+        measure(graph, noise, rng, [&](int i) {
+            if (i >= keyframesPerRing && i % loopEvery == 0)
+                addLoop(graph, i, i - keyframesPerRing, noise, rng);
+        });
+        return graph;
+    }
+
+    /** Back and forth along a long, straight corridor, turning around at each end; every
+     *  loopEvery keyframes a loop closure links the keyframe to the one at the same place,
+     *  facing the same way, on the previous pass in that direction. Long chains between few
+     *  loop closures, so the graph is poorly conditioned. */
+    inline PoseGraph corridor(int numKeyframes, int keyframesPerPass = 1000, int loopEvery = 50,
+            double spacing = 0.1, const Noise& noise = Noise(), unsigned seed = 42) {
+        PoseGraph graph;
+        std::mt19937 rng(seed);
+        for (int i = 0; i < numKeyframes; i++) {
+            const int pass = i / keyframesPerPass, step = i % keyframesPerPass;
+            const bool forward = pass % 2 == 0;
+            const double along = spacing * (forward ? step : keyframesPerPass - 1 - step);
+            graph.groundTruth.push_back(pose(
+                Eigen::AngleAxisd(forward ? 0.0 : M_PI, Eigen::Vector3d::UnitZ()).toRotationMatrix(),
+                // the return lane is 1 m to the side
+                Eigen::Vector3d(along, forward ? 0.0 : 1.0, 0.0)));
+        }
+        measure(graph, noise, rng, [&](int i) {
+            if (i >= 2 * keyframesPerPass && i % loopEvery == 0)
+                addLoop(graph, i, i - 2 * keyframesPerPass, noise, rng);
+        });
+        return graph;
+    }
+
+    /** Add wrong loop closures (false place recognition) between random keyframes,
+     *  measured as if they were at the same place, keeping loops ordered by keyframe */
+    inline void addOutliers(PoseGraph& graph, int count, const Noise& noise = Noise(), unsigned seed = 7) {
+        std::mt19937 rng(seed);
+        const int numKeyframes = (int)graph.groundTruth.size();
+        std::uniform_int_distribution<int> keyframe(0, numKeyframes - 1);
+        for (int k = 0; k < count && numKeyframes > 1; k++) {
+            int i = keyframe(rng), j = keyframe(rng);
+            if (i == j)
+                continue;
+            if (i < j)
+                std::swap(i, j);
+            graph.loops.push_back(std::make_pair(i, j));
+            graph.loopMeasurements.push_back(perturb(Eigen::Matrix4d::Identity(), noise, rng));
+        }
+
+        std::vector<size_t> order(graph.loops.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return graph.loops[a].first < graph.loops[b].first;
+        });
+        std::vector<std::pair<int, int>> loops;
+        PoseVector measurements;
+        for (size_t k = 0; k < order.size(); k++) {
+            loops.push_back(graph.loops[order[k]]);
+            measurements.push_back(graph.loopMeasurements[order[k]]);
+        }
+        graph.loops.swap(loops);
+        graph.loopMeasurements.swap(measurements);
+    }
+
+    /** RMS position error of the estimated keyframe positions */
+    template <class PositionOf>
+    double positionRmse(const PoseGraph& graph, PositionOf positionOf) {
+        double sum = 0.0;
+        for (size_t i = 0; i < graph.groundTruth.size(); i++) {
+            const Eigen::Vector3d estimate = positionOf((int)i);
+            sum += (estimate - graph.groundTruth[i].block<3,1>(0,3)).squaredNorm();
+        }
+        return std::sqrt(sum / graph.groundTruth.size());
+    }
+
+} // synthetic
+} // ark
@@ -576,23 +576,24 @@ void Path::draw_obj()
 void Mesh::draw_obj()
 {  
 
-    std::lock_guard<std::mutex> guard(meshLock_);
+    // immutable, so it needs no lock and is drawn in place
+    ark::MeshSnapshot::ConstPtr snapshot = mesh_->GetMeshSnapshot();
 
     Eigen::Matrix4d scene_mat;
     glGetDoublev(GL_MODELVIEW_MATRIX, scene_mat.data());
     scene_mat = scene_mat*pose.matrix().inverse();
     glLoadMatrixd(scene_mat.data());
 
-    for (int i = 0; i < mesh_vertices->size(); ++i) {
+    for (int i = 0; i < snapshot->size(); ++i) {
 
-        if (!(*mesh_enabled)[i]) {
+        if (!snapshot->enabled[i]) {
             continue;
         }
 
-        std::vector<Eigen::Vector3d> vertices = (*mesh_vertices)[i];
-        std::vector<Eigen::Vector3d> colors = (*mesh_colors)[i];
-        std::vector<Eigen::Vector3i> triangles = (*mesh_triangles)[i];
-        Eigen::Affine3d transform((*mesh_transforms)[i]);
+        const std::vector<Eigen::Vector3d>& vertices = snapshot->meshes[i]->vertices_;
+        const std::vector<Eigen::Vector3d>& colors = snapshot->meshes[i]->vertex_colors_;
+        const std::vector<Eigen::Vector3i>& triangles = snapshot->meshes[i]->triangles_;
+        Eigen::Affine3d transform(snapshot->transforms[i]);
 
         transform = pose * transform;
         //mesh_transforms[i] is c->w, we need w->c
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <Eigen/Core>
+
+namespace ark {
+    /**
+     * Features of a keyframe (keypoints, binary descriptors and 3D points in the camera frame
+     * for each camera) packed structure-of-arrays into a single contiguous allocation.
+     *
+     * Per keypoint this stores the descriptor bytes, the 3D point as 3 floats and the keypoint
+     * quantized to 9 bytes, instead of a cv::KeyPoint (28 bytes), an Eigen::Vector4d (32 bytes)
+     * and a separately allocated descriptor matrix per camera.
+     *
+     * Keypoints are quantized: position and size to 1/8 pixel (images up to 8191 pixels wide),
+     * angle to 1/100 degree, octave to 8 bits; response and class_id are not kept.
+     * Points without depth are stored as (0,0,0).
+     *
+     * The storage is a cv::Mat, so descriptor matrices returned by descriptors() share its
+     * reference count and stay valid after the keyframe is gone (e.g. rows kept by the loop detector).
+     */
+    class CompactKeyframeFeatures {
+    public:
+        CompactKeyframeFeatures();
+
+        /**
+         * Pack the features of every camera, replacing the current ones.
+         * @param keypoints keypoints of each camera
+         * @param descriptors binary descriptors of each camera (CV_8U, one row per keypoint, may be empty)
+         * @param points 3D position of each keypoint in the camera frame (z <= 0: no depth), may be empty
+         */
+        void pack(const std::vector<std::vector<cv::KeyPoint>> & keypoints,
+                  const std::vector<cv::Mat> & descriptors,
+                  const std::vector<std::vector<cv::Vec3f>> & points);
+
+        /** Release all features */
+        void clear();
+
+        bool empty() const { return storage_.empty(); }
+
+        int numCameras() const;
+
+        int numKeypoints(int cameraIdx) const;
+
+        /** Decode one keypoint */
+        cv::KeyPoint keypoint(int cameraIdx, int i) const;
+
+        /** Decode all keypoints of a camera */
+        void keypoints(int cameraIdx, std::vector<cv::KeyPoint> & out) const;
+
+        /** Descriptors of a camera, one row per keypoint; shares the packed storage (no copy) */
+        cv::Mat descriptors(int cameraIdx) const;
+
+        /** 3D point of a keypoint in the camera frame, homogeneous; w = 0 if it had no depth */
+        Eigen::Vector4d homogeneousPoint(int cameraIdx, int i) const;
+
+        /** Bytes of the packed storage */
+        size_t memoryUsage() const {
+            return storage_.total() * storage_.elemSize();
+        }
+
+    private:
+        /** Location of one camera's arrays in storage_ */
+        struct Section {
+            uint32_t numKeypoints;
+            uint32_t descriptorBytes;
+            uint32_t descriptorOffset;
+            /** float x, y, z per keypoint */
+            uint32_t pointOffset;
+            /** uint16 x, y, size, angle per keypoint */
+            uint32_t keypointOffset;
+            /** int8 octave per keypoint */
+            uint32_t octaveOffset;
+        };
+
+        const Section & section(int cameraIdx) const;
+
+        template<class T>
+        const T * at(uint32_t offset) const {
+            return reinterpret_cast<const T *>(storage_.data + offset);
+        }
+
+        /** All features: the Section table, then the arrays of each camera */
+        cv::Mat storage_;
+    };
+}
@@ -1,32 +1,81 @@
 #pragma once
 
 #include <vector>
+#include <random>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
 #include <Eigen/Core>
+#include <Eigen/Geometry>
+#include <Eigen/SVD>
 #include <pcl/point_cloud.h>
 #include <pcl/common/time.h>
 #include <pcl/registration/icp.h>
+#ifdef USE_OPENMP
+#include <omp.h>
+#endif
 
 
 namespace ark{
 
+/**
+ * RANSAC over 3D-3D feature correspondences, estimating the rigid transform from src to tgt.
+ *
+ * Only existing correspondences are sampled, and the number of hypotheses adapts to the best
+ * inlier ratio found so far: it stops once an all-inlier sample has been drawn with the requested
+ * confidence (num_iterations is an upper bound). Points are kept as float structure-of-arrays so
+ * transforming and counting vectorizes without a temporary cloud, and scoring a hypothesis stops
+ * as soon as it can no longer beat the best one. Optionally hypotheses are pre-tested on a few
+ * random correspondences (T(d,d) test) before being scored, and scored in parallel (OpenMP).
+ */
 template<typename PointT>
 class CorrespondenceRansac{
     using CloudPtr = typename pcl::PointCloud<PointT>::Ptr;
 public:
 
+    struct Params {
+        Params(double confidence = 0.99, int preemptiveTests = 0, int numThreads = 1, unsigned seed = 0) :
+            confidence(confidence), preemptiveTests(preemptiveTests), numThreads(numThreads), seed(seed) {}
+        /** stop once an all-inlier sample was drawn with this probability, given the best inlier
+         *  ratio so far (1 always runs num_iterations) */
+        double confidence;
+        /** number of random correspondences a hypothesis must all fit before it is scored on all of them (0 disables) */
+        int preemptiveTests;
+        /** threads scoring hypotheses (0: OpenMP default, 1: single threaded) */
+        int numThreads;
+        /** seed of the random generator (0: a generator per thread, seeded randomly) */
+        unsigned seed;
+    };
+
     //This function performs ransac on a set of feature
     //correspondences to determince which are inliers
     //also returns an estimate of the transform between clouds
     static void getInliersWithTransform(
-            CloudPtr src, 
+            CloudPtr src,
             CloudPtr tgt,
             const std::vector<int>& correspondences,
-            int num_samples, 
-            float inlier_threshold, 
+            int num_samples,
+            float inlier_threshold,
             int num_iterations,
             int& num_inliers_out,
             std::vector<bool>& inliers_out,
             Eigen::Affine3d& transform_out){
+        getInliersWithTransform(src, tgt, correspondences, num_samples, inlier_threshold, num_iterations,
+                num_inliers_out, inliers_out, transform_out, Params());
+    }
+
+    static void getInliersWithTransform(
+            CloudPtr src,
+            CloudPtr tgt,
+            const std::vector<int>& correspondences,
+            int num_samples,
+            float inlier_threshold,
+            int num_iterations,
+            int& num_inliers_out,
+            std::vector<bool>& inliers_out,
+            Eigen::Affine3d& transform_out,
+            const Params& params){
 
         //We need at least 3 samples to compute a transform
         if(num_samples<3){
@@ -37,139 +86,234 @@ public:
 
         //We don't know what was fed in with inliers_out so we should resize
         //and reset all values to false
-        inliers_out.resize(correspondences.size());
-        for(size_t i = 0; i<inliers_out.size(); i++){
-            inliers_out[i] = false;
-        }
+        inliers_out.assign(correspondences.size(), false);
+        transform_out = Eigen::Affine3d::Identity();
+        num_inliers_out = 0;
 
         //Ensure correspondences is same size as src cloud
         if(src->size()!=correspondences.size()){
-            std::cerr << 
+            std::cerr <<
                 "There must be correspondence for each point in src cloud\n";
-            std::cerr << 
+            std::cerr <<
                 "src->size(): " << src->size() << " corr: " << correspondences.size() << '\n';
-
-            transform_out = Eigen::Affine3d::Identity();
-            num_inliers_out = 0;
             return;
         }
 
+        //Gather the existing correspondences
+        Points points(src, tgt, correspondences);
+        const int n = points.size();
+
         //If we have less than the number of samples needed for ransac
         //just return identity transform
-        if(inliers_out.size()<num_samples){
+        if(n<num_samples){
             std::cerr << "Not enough points for ransac\n";
-            transform_out = Eigen::Affine3d::Identity();
-            num_inliers_out = 0;
             return;
         }
 
+        std::mt19937 seeded(params.seed);
+        std::mt19937& rng = params.seed != 0 ? seeded : threadGenerator();
+        std::uniform_int_distribution<int> pick(0, n-1);
+        const float threshold2 = inlier_threshold*inlier_threshold;
+        const int threads = threadCount(params.numThreads);
+        //single threaded, hypotheses are scored one at a time so termination is checked after each
+        const int batchSize = threads > 1 ? 4*threads : 1;
+        const int preemptiveTests = std::max(params.preemptiveTests, 0);
+
         //Used for storing the best iteration result
-        int best_inliers = 0;           
+        int best_inliers = 0;
         Eigen::Affine3d best_transform = Eigen::Affine3d::Identity();
-
-        //This will be for transforming cloud
-        //I think using PCL transform cloud will be faster than 
-        //Applying transform to each point individually, despite extra memory usage
-        //Should test eventually though, similarly using Eigen to store clouds may be faster
-        CloudPtr temp_cloud( new pcl::PointCloud<PointT>);
-
-
-        //Run RANSAC the specified number of times 
-        for ( int r = 0; r< num_iterations; r++){
-            //Choose random points
-            std::vector<Eigen::Vector3d> s_points(num_samples);
-            std::vector<Eigen::Vector3d> t_points(num_samples);
-            bool valid =true;
-            for( int i = 0; i<num_samples; i++){
-
-                int index(rand()%src->size());
-                if(correspondences[index]<0){
-                    valid =false;
-                    break;
+        double required = num_iterations;
+        int iterations = 0;
+        std::vector<Hypothesis, Eigen::aligned_allocator<Hypothesis>> hypotheses;
+        std::vector<int> sample(num_samples);
+
+        while(iterations < num_iterations && iterations < required){
+            const int count = std::min(batchSize, num_iterations - iterations);
+            hypotheses.resize(count);
+            for(int h = 0; h<count; h++){
+                //distinct random correspondences
+                for(int i = 0; i<num_samples; i++){
+                    do{
+                        sample[i] = pick(rng);
+                    }while(std::find(sample.begin(), sample.begin()+i, sample[i]) != sample.begin()+i);
                 }
-                s_points[i] <<  (double)(src->points[index].x),
-                                (double)(src->points[index].y),
-                                (double)(src->points[index].z);
-                t_points[i] <<  (double)(tgt->points[correspondences[index]].x),
-                                (double)(tgt->points[correspondences[index]].y),
-                                (double)(tgt->points[correspondences[index]].z);
+                hypotheses[h].transform = estimateTransform(points, sample);
+                hypotheses[h].tests.resize(preemptiveTests);
+                for(int i = 0; i<preemptiveTests; i++)
+                    hypotheses[h].tests[i] = pick(rng);
+            }
+            iterations += count;
+
+            //score against the best hypothesis of the previous batches
+            const int toBeat = best_inliers;
+#ifdef USE_OPENMP
+#pragma omp parallel for num_threads(threads) if(count > 1) schedule(dynamic)
+#endif
+            for(int h = 0; h<count; h++){
+                Hypothesis& hypothesis = hypotheses[h];
+                const Eigen::Matrix3f R = hypothesis.transform.linear().template cast<float>();
+                const Eigen::Vector3f t = hypothesis.transform.translation().template cast<float>();
+                hypothesis.inliers = passesTests(points, hypothesis.tests, R, t, threshold2) ?
+                    countInliers(points, R, t, threshold2, toBeat) : 0;
             }
-            if(!valid)
-                continue;
-
-
-            Eigen::Matrix3d W(Eigen::Matrix3d::Zero()); //point correspondence matrix used to compute R
 
-            //compute mean points
-            Eigen::Vector3d s_mu(Eigen::Vector3d::Zero()), t_mu(Eigen::Vector3d::Zero());
-            for( int i = 0; i<num_samples; i++){
-                s_mu+=s_points[i];
-                t_mu+=t_points[i];
+            //save best result (in order, so the result does not depend on thread timing)
+            for(int h = 0; h<count; h++){
+                if(hypotheses[h].inliers>best_inliers){
+                    best_inliers=hypotheses[h].inliers;
+                    best_transform = hypotheses[h].transform;
+                }
             }
-            s_mu/=num_samples;
-            t_mu/=num_samples;
+            if(best_inliers>0)
+                required = requiredIterations((double)best_inliers/n, num_samples+preemptiveTests, params.confidence);
+        }
 
+        //Fill in output with best result
+        transform_out = best_transform;
+        const Eigen::Matrix3f R = best_transform.linear().template cast<float>();
+        const Eigen::Vector3f t = best_transform.translation().template cast<float>();
+        for(int i = 0; i<n; i++){
+            if(points.residual2(i, R, t)<threshold2){
+                inliers_out[points.index[i]] = true;
+                num_inliers_out++;
+            }
+        }
+    }
 
+private:
 
-            //compute W as W = sum(s_x*t_x.transpose())
-            for( int i = 0; i<num_samples; i++){
-                //std::cout<< (s_points[i]-s_mu)*(t_points[i]-t_mu).transpose() << '\n';
-                W+=(s_points[i]-s_mu)*(t_points[i]-t_mu).transpose();
+    /** Points of the existing correspondences, float structure-of-arrays */
+    struct Points {
+        Points(const CloudPtr& src, const CloudPtr& tgt, const std::vector<int>& correspondences){
+            for(size_t i = 0; i<correspondences.size(); i++){
+                if(correspondences[i]>=0)
+                    index.push_back((int)i);
+            }
+            const int n = (int)index.size();
+            sx.resize(n); sy.resize(n); sz.resize(n);
+            tx.resize(n); ty.resize(n); tz.resize(n);
+            for(int i = 0; i<n; i++){
+                const PointT& s = src->points[index[i]];
+                const PointT& t = tgt->points[correspondences[index[i]]];
+                sx[i] = s.x; sy[i] = s.y; sz[i] = s.z;
+                tx[i] = t.x; ty[i] = t.y; tz[i] = t.z;
             }
-            //std::cout << "W:= " << W << '\n';
-            //compute transform from SVD
-            Eigen::JacobiSVD<Eigen::Matrix3d> svd(W, Eigen::ComputeFullU | Eigen::ComputeFullV);
-            //std::cout << "rank: " << svd.rank() << '\n';
-            //ensure W was full rank
-            //if(svd.rank()<3)
-            //  continue;
-            Eigen::Quaterniond R((svd.matrixU()*svd.matrixV().transpose()).transpose());
-            Eigen::Translation3d t(t_mu - R*s_mu);
-            Eigen::Affine3d transform = t*R;
+        }
 
+        int size() const {
+            return (int)index.size();
+        }
 
+        /** Squared distance between the i-th transformed src point and its tgt point */
+        float residual2(int i, const Eigen::Matrix3f& R, const Eigen::Vector3f& t) const {
+            const float dx = R(0,0)*sx[i] + R(0,1)*sy[i] + R(0,2)*sz[i] + t[0] - tx[i];
+            const float dy = R(1,0)*sx[i] + R(1,1)*sy[i] + R(1,2)*sz[i] + t[1] - ty[i];
+            const float dz = R(2,0)*sx[i] + R(2,1)*sy[i] + R(2,2)*sz[i] + t[2] - tz[i];
+            return dx*dx + dy*dy + dz*dz;
+        }
 
-            //apply transform to cloud
-            pcl::transformPointCloud(*src,*temp_cloud,transform);
+        /** index of the src point of each entry */
+        std::vector<int> index;
+        Eigen::ArrayXf sx, sy, sz, tx, ty, tz;
+    };
+
+    struct Hypothesis {
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+        Eigen::Affine3d transform;
+        std::vector<int> tests;
+        int inliers;
+    };
+
+    /** Inliers of a hypothesis; stops early (returning at most toBeat) once it cannot exceed toBeat */
+    static int countInliers(const Points& p, const Eigen::Matrix3f& R, const Eigen::Vector3f& t,
+            float threshold2, int toBeat){
+        //points scored per block before checking whether the hypothesis can still win
+        const int blockSize = 64;
+        const int n = p.size();
+        int inliers = 0;
+        for(int start = 0; start<n; start += blockSize){
+            const int len = std::min(blockSize, n-start);
+            inliers += (
+                (R(0,0)*p.sx.segment(start,len) + R(0,1)*p.sy.segment(start,len) + R(0,2)*p.sz.segment(start,len)
+                    + t[0] - p.tx.segment(start,len)).square() +
+                (R(1,0)*p.sx.segment(start,len) + R(1,1)*p.sy.segment(start,len) + R(1,2)*p.sz.segment(start,len)
+                    + t[1] - p.ty.segment(start,len)).square() +
+                (R(2,0)*p.sx.segment(start,len) + R(2,1)*p.sy.segment(start,len) + R(2,2)*p.sz.segment(start,len)
+                    + t[2] - p.tz.segment(start,len)).square()
+                < threshold2).count();
+            if(inliers + (n-start-len) <= toBeat)
+                return inliers;
+        }
+        return inliers;
+    }
 
+    /** T(d,d) test: all pre-test correspondences must be inliers */
+    static bool passesTests(const Points& p, const std::vector<int>& tests, const Eigen::Matrix3f& R,
+            const Eigen::Vector3f& t, float threshold2){
+        for(size_t i = 0; i<tests.size(); i++){
+            if(p.residual2(tests[i], R, t)>=threshold2)
+                return false;
+        }
+        return true;
+    }
 
-            //count inliers
-            int inliers=0; 
-            for (size_t i = 0; i < src->size(); ++i)
-            {
-                if(correspondences[i]>=0)
-                    inliers+=checkThreshold(temp_cloud->points[i],tgt->points[correspondences[i]],inlier_threshold);
-            }
+    /** Rigid transform src -> tgt fitting the sampled correspondences */
+    static Eigen::Affine3d estimateTransform(const Points& p, const std::vector<int>& sample){
+        const int num_samples = (int)sample.size();
+        std::vector<Eigen::Vector3d> s_points(num_samples);
+        std::vector<Eigen::Vector3d> t_points(num_samples);
+        for(int i = 0; i<num_samples; i++){
+            const int k = sample[i];
+            s_points[i] << p.sx[k], p.sy[k], p.sz[k];
+            t_points[i] << p.tx[k], p.ty[k], p.tz[k];
+        }
 
-            //save best result
-            if(inliers>best_inliers){
-                best_inliers=inliers;
-                best_transform = transform;
-            }        
+        Eigen::Matrix3d W(Eigen::Matrix3d::Zero()); //point correspondence matrix used to compute R
 
+        //compute mean points
+        Eigen::Vector3d s_mu(Eigen::Vector3d::Zero()), t_mu(Eigen::Vector3d::Zero());
+        for( int i = 0; i<num_samples; i++){
+            s_mu+=s_points[i];
+            t_mu+=t_points[i];
         }
-        //Fill in output with best result
-        transform_out = best_transform;
-        pcl::transformPointCloud(*src,*temp_cloud,best_transform);
-        num_inliers_out= 0;
-        for (size_t i = 0; i < src->size(); ++i)
-        {
-            if(correspondences[i]>=0)
-                num_inliers_out+=inliers_out[i] = checkThreshold(temp_cloud->points[i],tgt->points[correspondences[i]],inlier_threshold);
-        }
-
+        s_mu/=num_samples;
+        t_mu/=num_samples;
 
+        //compute W as W = sum(s_x*t_x.transpose())
+        for( int i = 0; i<num_samples; i++){
+            W+=(s_points[i]-s_mu)*(t_points[i]-t_mu).transpose();
+        }
+        //compute transform from SVD
+        Eigen::JacobiSVD<Eigen::Matrix3d> svd(W, Eigen::ComputeFullU | Eigen::ComputeFullV);
+        Eigen::Quaterniond R((svd.matrixU()*svd.matrixV().transpose()).transpose());
+        Eigen::Translation3d t(t_mu - R*s_mu);
+        return Eigen::Affine3d(t*R);
+    }
 
-    }   
+    /** Hypotheses needed to draw an all-inlier sample of the given size with the given confidence */
+    static double requiredIterations(double inlierRatio, int sampleSize, double confidence){
+        if(confidence>=1.0)
+            return std::numeric_limits<double>::infinity();
+        const double allInliers = std::pow(inlierRatio, sampleSize);
+        if(allInliers>=1.0)
+            return 1.0;
+        if(allInliers<=std::numeric_limits<double>::epsilon())
+            return std::numeric_limits<double>::infinity();
+        return std::ceil(std::log(1.0-confidence)/std::log(1.0-allInliers));
+    }
 
-private:
+    static int threadCount(int requested){
+#ifdef USE_OPENMP
+        return requested > 0 ? requested : omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
 
-    //Checks transformed points against threshold
-    static bool checkThreshold(const PointT& p1, const PointT& p2, float inlier_threshold){
-        return ((p1.x-p2.x)*(p1.x-p2.x)+
-                (p1.y-p2.y)*(p1.y-p2.y)+
-                (p1.z-p2.z)*(p1.z-p2.z))<
-                (inlier_threshold*inlier_threshold);
+    /** Random generator of the calling thread */
+    static std::mt19937& threadGenerator(){
+        thread_local std::mt19937 generator(std::random_device{}());
+        return generator;
     }
 
     CorrespondenceRansac(){}
@@ -178,4 +322,3 @@ private:
 
 
 }//namespace ICP
-
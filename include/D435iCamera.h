@@ -64,9 +64,6 @@ namespace ark {
 
     protected:
 
-        /** Converts an D435 raw depth image to an ordered point cloud based on the current camera's intrinsics */
-        void project(const rs2::frame & depth_frame, cv::Mat & xyz_map);
-
         /**
         * Reads data from the imu
         */
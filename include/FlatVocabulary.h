@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <DBoW2.h>
+#include "MappedFile.h"
+
+namespace ark {
+    /**
+     * BRISK vocabulary tree in a flat, memory mappable layout.
+     *
+     * Nodes are stored in breadth first order, so the children of a node are consecutive
+     * records and their descriptors consecutive rows of one contiguous array. Loading maps the
+     * file and validates its header; nothing is parsed, unlike the text and binary DBoW2 formats.
+     * transform() walks the arrays in place and gives the same words, weights and feature vector
+     * node ids as DBoW2's TemplatedVocabulary (OpenARK_vocab_converter checks this).
+     *
+     * DLoopDetector needs a TemplatedVocabulary, so OkvisSLAMSystem fills one with toVocabulary()
+     * and drops the mapping. That still allocates a node and a descriptor per vocabulary node;
+     * what is saved at startup is the parsing, not the allocations.
+     *
+     * Files are produced from an existing DBoW2 vocabulary by save() (see OpenARK_vocab_converter).
+     */
+    class FlatVocabulary {
+    public:
+        typedef std::shared_ptr<FlatVocabulary> Ptr;
+        typedef DBoW2::TemplatedVocabulary<DBoW2::FBRISK::TDescriptor, DBoW2::FBRISK> Vocabulary;
+
+        /** Bump when the layout changes; files with another version are rejected */
+        static const uint32_t kVersion = 1;
+
+        /** Map a file written by save(); nullptr (with a message on std::cerr) on error */
+        static Ptr load(const std::string & path);
+
+        /** True if the file starts with the flat vocabulary signature */
+        static bool isFlatFile(const std::string & path);
+
+        /** Flatten a DBoW2 vocabulary into a file */
+        static bool save(const Vocabulary & vocabulary, const std::string & path);
+
+        /** Fill a DBoW2 vocabulary (e.g. for DLoopDetector) from the arrays, copying every node and descriptor */
+        void toVocabulary(Vocabulary & out) const;
+
+        /** Bag of words and feature vector of an image's descriptors (one CV_8U row each),
+         *  same as Vocabulary::transform */
+        void transform(const std::vector<cv::Mat> & features, DBoW2::BowVector & v,
+            DBoW2::FeatureVector & fv, int levelsup) const;
+
+        void transform(const std::vector<cv::Mat> & features, DBoW2::BowVector & v) const;
+
+        /**
+         * Word and weight of a single descriptor.
+         * @param nid if not null, set to the node levelsup levels above the word
+         */
+        void transform(const uint8_t * feature, DBoW2::WordId & id, DBoW2::WordValue & weight,
+            DBoW2::NodeId * nid = nullptr, int levelsup = 0) const;
+
+        /** Number of words */
+        unsigned int size() const;
+
+        bool empty() const {
+            return size() == 0;
+        }
+
+        int getBranchingFactor() const;
+        int getDepthLevels() const;
+        int getDescriptorBytes() const;
+
+    private:
+        struct Header;
+        struct Node;
+        class Access;
+
+        explicit FlatVocabulary(std::unique_ptr<MappedFile> file);
+
+        /** Word weighting applied per feature and the normalization of the bag of words */
+        void finishBowVector(DBoW2::BowVector & v) const;
+
+        std::unique_ptr<MappedFile> file_;
+        const Header * header_;
+        const Node * nodes_;
+        const uint8_t * descriptors_;
+    };
+}
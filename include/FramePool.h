@@ -0,0 +1,76 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <cstddef>
+#include <unordered_map>
+#include <opencv2/core.hpp>
+
+namespace ark {
+    /**
+     * Process-wide pool of image buffers shared by cameras and frames.
+     *
+     * Images are ordinary reference counted cv::Mats whose memory comes from the pool's
+     * cv::MatAllocator: when the last Mat referring to a buffer (the frame, a handler's copy,
+     * an ROI...) is released, the buffer goes back to a free list for its byte size instead
+     * of being freed, and the next image of that size reuses it. At most maxFreePerSize
+     * buffers are kept per size, so once the pipeline reaches steady state no allocation
+     * happens and memory use stays fixed.
+     */
+    class FramePool {
+    public:
+        struct Stats {
+            /** buffers obtained from the system allocator */
+            size_t allocations;
+            /** buffers handed out again from a free list */
+            size_t reuses;
+            /** buffers currently referenced by some Mat */
+            size_t outstanding;
+            /** buffers waiting in the free lists, and their total size */
+            size_t cachedBuffers;
+            size_t cachedBytes;
+        };
+
+        /** The pool used by all cameras and frames. Never destroyed, so images released
+         *  during static destruction still find their allocator. */
+        static FramePool & instance();
+
+        /** A pooled image of the given size and type (contents are uninitialized) */
+        cv::Mat acquire(cv::Size size, int type);
+
+        /** Allocator to assign to cv::Mat::allocator so that later create() calls use the pool */
+        cv::MatAllocator * allocator() const;
+
+        /** Fill the free list for this size and type with count buffers ahead of time */
+        void reserve(cv::Size size, int type, int count);
+
+        /** Maximum number of free buffers kept per byte size (8 by default); extra ones are freed */
+        void setMaxFreePerSize(size_t count);
+
+        /** Free all cached buffers (outstanding ones return to the pool as usual) */
+        void trim();
+
+        Stats getStats() const;
+
+    private:
+        FramePool();
+        ~FramePool();
+        FramePool(const FramePool &) = delete;
+        FramePool & operator=(const FramePool &) = delete;
+
+        class Allocator;
+        friend class Allocator;
+
+        /** Buffer of the given size, from the free list if possible */
+        unsigned char * take(size_t bytes);
+        /** Return a buffer to its free list (or free it if the list is full) */
+        void give(unsigned char * data, size_t bytes);
+
+        mutable std::mutex mutex_;
+        std::unordered_map<size_t, std::vector<unsigned char *>> free_;
+        size_t maxFreePerSize_;
+        Stats stats_;
+        std::unique_ptr<Allocator> allocator_;
+    };
+}
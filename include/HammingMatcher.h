@@ -0,0 +1,72 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <opencv2/core.hpp>
+
+namespace ark {
+    /**
+     * Brute force matcher for binary descriptors (BRISK, ORB, ...) under the Hamming norm.
+     *
+     * Descriptors are packed into zero-padded rows of 256-bit lanes so the distance kernel can
+     * use AVX2 or POPCNT when the CPU has them (detected at runtime, scalar fallback otherwise).
+     * Matching computes the full distance table once, in parallel across query rows when
+     * OpenMP is available, and filters it with Lowe's ratio test and a mutual consistency check.
+     */
+    class HammingMatcher {
+    public:
+        /** Distance kernels, fastest last */
+        enum class Kernel { Scalar, Popcnt, AVX2 };
+
+        struct Params {
+            Params(float ratio = 0.8f, bool mutual = true, int maxDistance = -1, int numThreads = 0) :
+                ratio(ratio), mutual(mutual), maxDistance(maxDistance), numThreads(numThreads) {}
+            /** best match is kept only if its distance is below ratio * second best (1 disables the test) */
+            float ratio;
+            /** keep a match only if the query is also the best match of its train descriptor */
+            bool mutual;
+            /** reject matches farther than this many bits (-1 disables) */
+            int maxDistance;
+            /** threads used for the distance table (0: OpenMP default, 1: single threaded) */
+            int numThreads;
+        };
+
+        explicit HammingMatcher(const Params & params = Params());
+
+        /**
+         * Find the best train descriptor for each query descriptor, filtered by the ratio test,
+         * the mutual check and the distance limit. Descriptors are CV_8U, one per row.
+         */
+        void match(const cv::Mat & query, const cv::Mat & train, std::vector<cv::DMatch> & matches) const;
+
+        /** The k nearest train descriptors of every query descriptor, closest first (no filtering) */
+        void knnMatch(const cv::Mat & query, const cv::Mat & train,
+            std::vector<std::vector<cv::DMatch> > & matches, int k) const;
+
+        /** Hamming distance between two descriptors of the given length */
+        static int distance(const uint8_t * a, const uint8_t * b, int bytes);
+
+        /** Fastest kernel supported by this CPU */
+        static Kernel bestKernel();
+
+        /** Override the kernel (e.g. for benchmarking); falls back to the best supported one */
+        void setKernel(Kernel kernel);
+
+        Kernel getKernel() const {
+            return kernel_;
+        }
+
+        Params params;
+
+    private:
+        /** Number of 64 bit words per packed descriptor (multiple of 4 for 256-bit lanes) */
+        static int packedWords(int bytes);
+
+        static void pack(const cv::Mat & descriptors, int words, std::vector<uint64_t> & out);
+
+        /** Row-major query x train table of distances */
+        void computeDistances(const cv::Mat & query, const cv::Mat & train, std::vector<uint16_t> & table) const;
+
+        Kernel kernel_;
+    };
+}
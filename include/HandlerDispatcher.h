@@ -0,0 +1,172 @@
+#pragma once
+
+#include <functional>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <memory>
+
+namespace ark {
+
+    /** How a SLAM handler is invoked */
+    enum class DispatchPolicy {
+        /** Run inline on the SLAM consumer thread (legacy behavior) */
+        Synchronous,
+        /** Run on the handler's own worker; every event is delivered, the SLAM thread waits if the queue is full */
+        MustDeliver,
+        /** Run on the handler's own worker; only the newest pending event is kept */
+        LatestOnly,
+        /** Run on the handler's own worker; events arriving while the worker is busy are discarded */
+        DropIfBusy
+    };
+
+    /** Delivery statistics of one asynchronously dispatched handler */
+    struct HandlerStats {
+        DispatchPolicy policy = DispatchPolicy::Synchronous;
+        /** number of events handed to the handler */
+        size_t delivered = 0;
+        /** number of events discarded because of the policy */
+        size_t dropped = 0;
+        /** events currently waiting in the queue */
+        size_t queued = 0;
+        /** time from the SLAM system posting an event to the handler starting to run (ms) */
+        double lastLatencyMs = 0.0;
+        double meanLatencyMs = 0.0;
+        double maxLatencyMs = 0.0;
+        /** time spent inside the handler (ms) */
+        double meanRunMs = 0.0;
+        double maxRunMs = 0.0;
+    };
+
+    /** Type-erased interface to a handler worker, so workers for all handler signatures can share a container */
+    class HandlerWorker {
+    public:
+        virtual ~HandlerWorker() = default;
+        virtual HandlerStats stats() = 0;
+    };
+
+    /**
+     * Runs a single handler on its own thread, fed by a bounded queue.
+     * post() is called from the SLAM consumer thread and never runs the handler itself.
+     */
+    template<class... Args>
+    class AsyncHandler : public HandlerWorker {
+    public:
+        typedef std::function<void(Args...)> Function;
+
+        AsyncHandler(Function handler, DispatchPolicy policy, size_t capacity = 8) :
+            handler_(handler), policy_(policy), capacity_(std::max<size_t>(capacity, 1)),
+            busy_(false), stop_(false) {
+            if (policy_ == DispatchPolicy::LatestOnly) capacity_ = 1;
+            stats_.policy = policy_;
+            worker_ = std::thread(&AsyncHandler::run, this);
+        }
+
+        /** Stops the worker. Pending events are still delivered for MustDeliver handlers. */
+        ~AsyncHandler() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+                if (policy_ != DispatchPolicy::MustDeliver) {
+                    stats_.dropped += queue_.size();
+                    queue_.clear();
+                }
+            }
+            cv_.notify_all();
+            if (worker_.joinable()) worker_.join();
+        }
+
+        /** Queue an event for the handler according to the dispatch policy */
+        void post(Args... args) {
+            Event event;
+            event.posted = std::chrono::steady_clock::now();
+            event.call = [this, args...]() { handler_(args...); };
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (stop_) return;
+            switch (policy_) {
+            case DispatchPolicy::DropIfBusy:
+                if (busy_ || !queue_.empty()) {
+                    stats_.dropped++;
+                    return;
+                }
+                break;
+            case DispatchPolicy::LatestOnly:
+                if (!queue_.empty()) {
+                    stats_.dropped += queue_.size();
+                    queue_.clear();
+                }
+                break;
+            default:
+                // MustDeliver: apply back-pressure to the producer
+                spaceCv_.wait(lock, [this]() { return queue_.size() < capacity_ || stop_; });
+                if (stop_) return;
+                break;
+            }
+            queue_.push_back(std::move(event));
+            lock.unlock();
+            cv_.notify_one();
+        }
+
+        HandlerStats stats() override {
+            std::lock_guard<std::mutex> lock(mutex_);
+            HandlerStats out = stats_;
+            out.queued = queue_.size();
+            return out;
+        }
+
+    private:
+        struct Event {
+            std::function<void()> call;
+            std::chrono::steady_clock::time_point posted;
+        };
+
+        void run() {
+            while (true) {
+                Event event;
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    cv_.wait(lock, [this]() { return !queue_.empty() || stop_; });
+                    if (queue_.empty()) return;
+                    event = std::move(queue_.front());
+                    queue_.pop_front();
+                    busy_ = true;
+                }
+                spaceCv_.notify_one();
+
+                const auto start = std::chrono::steady_clock::now();
+                event.call();
+                const auto end = std::chrono::steady_clock::now();
+
+                std::lock_guard<std::mutex> lock(mutex_);
+                busy_ = false;
+                const double latencyMs = std::chrono::duration<double, std::milli>(start - event.posted).count();
+                const double runMs = std::chrono::duration<double, std::milli>(end - start).count();
+                stats_.delivered++;
+                stats_.lastLatencyMs = latencyMs;
+                stats_.meanLatencyMs += (latencyMs - stats_.meanLatencyMs) / stats_.delivered;
+                stats_.maxLatencyMs = std::max(stats_.maxLatencyMs, latencyMs);
+                stats_.meanRunMs += (runMs - stats_.meanRunMs) / stats_.delivered;
+                stats_.maxRunMs = std::max(stats_.maxRunMs, runMs);
+            }
+        }
+
+        Function handler_;
+        DispatchPolicy policy_;
+        size_t capacity_;
+
+        std::deque<Event> queue_;
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        std::condition_variable spaceCv_;
+        bool busy_;
+        bool stop_;
+        HandlerStats stats_;
+
+        std::thread worker_;
+    };
+
+}
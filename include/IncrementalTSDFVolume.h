@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cmath>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <Eigen/Core>
+#include "Open3D/Integration/ScalableTSDFVolume.h"
+#include "Open3D/geometry/TriangleMesh.h"
+#include "Open3D/geometry/RGBDImage.h"
+#include "Open3D/camera/PinholeCameraIntrinsic.h"
+
+namespace ark {
+	/**
+	 * ScalableTSDFVolume that keeps a triangle mesh per volume unit and remembers which units were
+	 * integrated since the last extraction. ExtractTriangleMesh runs marching cubes only on those units,
+	 * and on the neighbors whose boundary cubes read their voxels, then stitches the cached meshes of all
+	 * units, so extraction cost follows what changed rather than the mapped area.
+	 *
+	 * The triangles are those of ScalableTSDFVolume::ExtractTriangleMesh; vertices on the boundary
+	 * between two units appear once in each unit's mesh.
+	 *
+	 * Reset keeps up to SetUnitPoolSize freed units and reuses them for the next units opened, so a
+	 * volume that is reset and refilled block after block does not reallocate its voxels.
+	 */
+	class IncrementalTSDFVolume : public open3d::integration::ScalableTSDFVolume {
+	public:
+		typedef std::unordered_set<Eigen::Vector3i, open3d::utility::hash_eigen::hash<Eigen::Vector3i>> UnitSet;
+		typedef std::unordered_map<Eigen::Vector3i, std::shared_ptr<const open3d::geometry::TriangleMesh>,
+			open3d::utility::hash_eigen::hash<Eigen::Vector3i>> UnitMeshMap;
+
+		IncrementalTSDFVolume(double voxel_length, double sdf_trunc,
+			open3d::integration::TSDFVolumeColorType color_type,
+			int volume_unit_resolution = 16, int depth_sampling_stride = 4);
+
+		/** Clear the volume; its units go to the unit pool */
+		void Reset() override;
+
+		/** The same integration as ScalableTSDFVolume; the units written to are marked dirty */
+		void Integrate(const open3d::geometry::RGBDImage &image,
+			const open3d::camera::PinholeCameraIntrinsic &intrinsic,
+			const Eigen::Matrix4d &extrinsic) override;
+
+		/** Re-mesh the dirty units, then stitch the meshes of all units into one */
+		std::shared_ptr<open3d::geometry::TriangleMesh> ExtractTriangleMesh() override;
+
+		/** Re-mesh the dirty units without stitching. Returns the number of units re-meshed */
+		size_t UpdateUnitMeshes();
+
+		/** Cached mesh of every unit containing surface, as of the last UpdateUnitMeshes */
+		const UnitMeshMap &GetUnitMeshes() const {
+			return unit_meshes_;
+		}
+
+		size_t NumDirtyUnits() const {
+			return dirty_units_.size();
+		}
+
+		/** Incremented whenever the unit meshes change (by UpdateUnitMeshes or Reset), so a mesh
+		 *  extracted earlier is current while the generation it was extracted at still matches */
+		size_t MeshGeneration() const {
+			return mesh_generation_;
+		}
+
+		/** Most units kept for reuse after Reset; extra units are freed. Defaults to 0 (no pool).
+		 *  Each pooled unit keeps its voxels allocated, volume_unit_resolution^3 of them */
+		void SetUnitPoolSize(size_t max_units);
+
+		size_t NumPooledUnits() const {
+			return unit_pool_.size();
+		}
+
+	private:
+		/** Marching cubes over the cubes whose first corner lies in the unit (ScalableTSDFVolume's
+		 *  extraction restricted to one unit) */
+		std::shared_ptr<open3d::geometry::TriangleMesh> ExtractUnitMesh(const Eigen::Vector3i &index) const;
+
+		std::shared_ptr<open3d::integration::UniformTSDFVolume> OpenUnit(const Eigen::Vector3i &index);
+
+		Eigen::Vector3i LocateUnit(const Eigen::Vector3d &point) const {
+			return Eigen::Vector3i((int)std::floor(point(0) / volume_unit_length_),
+				(int)std::floor(point(1) / volume_unit_length_),
+				(int)std::floor(point(2) / volume_unit_length_));
+		}
+
+		/** units integrated, or next to one, since their mesh was last extracted */
+		UnitSet dirty_units_;
+		UnitMeshMap unit_meshes_;
+		size_t mesh_generation_ = 0;
+
+		/** units freed by Reset, reset again and moved when reused */
+		std::vector<std::shared_ptr<open3d::integration::UniformTSDFVolume>> unit_pool_;
+		size_t max_pooled_units_ = 0;
+
+		/** depth to camera distance multipliers, recomputed only when the intrinsics change */
+		std::shared_ptr<open3d::geometry::Image> depth_to_camera_distance_;
+		Eigen::Matrix3d cached_intrinsic_matrix_;
+		int cached_width_ = -1, cached_height_ = -1;
+	};
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+namespace ark {
+    /**
+     * Lightweight latency and queue depth instrumentation for the SLAM pipeline.
+     *
+     * Always compiled in; every recording call first checks one relaxed atomic flag, so
+     * the cost while disabled is a load and a branch (timers do not even read the clock).
+     * When enabled, latencies go into lock-free log2 histograms (1us .. ~16s) per stage
+     * and queue depths into per-queue gauges. Results can be written as CSV or JSON, or
+     * summarized to a stream periodically by a reporter thread.
+     *
+     * Typical use:
+     *     Instrumentation::setEnabled(true);
+     *     Instrumentation::startPeriodicLog(5.0);
+     *     ...
+     *     Instrumentation::writeJSON("slam_timing.json");
+     */
+    class Instrumentation {
+    public:
+        /** Timed pipeline stages */
+        enum class Stage {
+            CameraUpdate,           //!< camera driver filling a frame
+            PushFrame,              //!< OkvisSLAMSystem::PushFrame (handing images to OKVIS)
+            EstimatorOutput,        //!< OKVIS output waiting in the queue before it is consumed
+            KeyframeConstruction,   //!< building a MapKeyFrame and adding it to the map
+            LoopDetection,          //!< BoW query and geometric verification of a candidate
+            MapUpdate,              //!< applying loop closures and optimized poses to a SparseMap
+            PoseGraphOptimization,  //!< one SimplePoseGraphSolver solve
+            HandlerExecution,       //!< all handlers called for one frame
+            TSDFIntegration,        //!< converting one RGBD frame and integrating it into the TSDF volume
+            NumStages
+        };
+
+        /** Sampled queues */
+        enum class Queue {
+            Frames,                 //!< frames waiting for OKVIS output
+            EstimatorOutput,        //!< OKVIS output waiting for the consumer thread
+            LoopCandidates,         //!< keyframes waiting for loop detection
+            LoopResults,            //!< verified loop closures waiting to be applied
+            PendingConstraints,     //!< pose graph constraints not yet in the incremental problem
+            TSDFIntegration,        //!< RGBD frames waiting for TSDF integration
+            NumQueues
+        };
+
+        static const int kNumBuckets = 25;
+
+        struct StageSummary {
+            uint64_t count;
+            double meanMs, maxMs, p50Ms, p90Ms, p99Ms;
+            /** samples whose latency is below 2^(i+1) microseconds (and above the previous bucket) */
+            uint64_t buckets[kNumBuckets];
+        };
+
+        struct QueueSummary {
+            uint64_t samples;
+            double mean;
+            uint64_t max, last;
+        };
+
+        static bool enabled() {
+            return enabled_.load(std::memory_order_relaxed);
+        }
+
+        static void setEnabled(bool enabled);
+
+        /** Record one latency sample of a stage */
+        static void recordLatency(Stage stage, std::chrono::steady_clock::duration latency) {
+            if (enabled()) record(stage, latency);
+        }
+
+        /** Record the current depth of a queue */
+        static void recordQueueDepth(Queue queue, size_t depth) {
+            if (enabled()) record(queue, depth);
+        }
+
+        /** Times the enclosing scope as one sample of a stage */
+        class ScopedTimer {
+        public:
+            explicit ScopedTimer(Stage stage) : stage_(stage), active_(Instrumentation::enabled()) {
+                if (active_) start_ = std::chrono::steady_clock::now();
+            }
+            ~ScopedTimer() {
+                if (active_) Instrumentation::record(stage_, std::chrono::steady_clock::now() - start_);
+            }
+        private:
+            ScopedTimer(const ScopedTimer &) = delete;
+            ScopedTimer & operator=(const ScopedTimer &) = delete;
+            Stage stage_;
+            bool active_;
+            std::chrono::steady_clock::time_point start_;
+        };
+
+        static StageSummary getStageSummary(Stage stage);
+        static QueueSummary getQueueSummary(Queue queue);
+
+        static const char * stageName(Stage stage);
+        static const char * queueName(Queue queue);
+
+        /** Clear all histograms and gauges */
+        static void reset();
+
+        /** One row per stage (count, mean/max/percentiles in ms, bucket counts), then one per queue */
+        static bool writeCSV(const std::string & path);
+
+        static bool writeJSON(const std::string & path);
+
+        /** Human readable table of all stages and queues that have samples */
+        static void logSummary(std::ostream & os = std::cout);
+
+        /**
+         * Print a summary every intervalSeconds from a background thread, and rewrite
+         * jsonPath with the full statistics if it is not empty. Enables recording.
+         */
+        static void startPeriodicLog(double intervalSeconds, const std::string & jsonPath = "");
+
+        /** Stop the reporter thread; also done at exit if it is still running */
+        static void stopPeriodicLog();
+
+    private:
+        static void record(Stage stage, std::chrono::steady_clock::duration latency);
+        static void record(Queue queue, size_t depth);
+
+        static std::atomic<bool> enabled_;
+    };
+}
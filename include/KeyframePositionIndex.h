@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cmath>
+#include <mutex>
+#include <unordered_map>
+#include <Eigen/Core>
+
+namespace ark {
+    /**
+     * Keyframe positions and odometry path lengths, used to discard loop closure candidates
+     * that cannot be reached from a keyframe given the drift of the odometry.
+     *
+     * Each keyframe carries the distance travelled since the start of its segment (a chain of
+     * keyframes linked by odometry). Two keyframes of a segment that are d metres apart
+     * along the trajectory can be at most minRadius + driftPerMeter * d apart in the map
+     * before the pose estimate would have to be wrong by more than the drift allows.
+     * Keyframes of different segments (merged or preloaded maps) are not related by
+     * odometry, so nothing is assumed about them.
+     *
+     * Candidates come from the BoW database one at a time, so this is a plain
+     * id -> (segment, path length, position) map: a check is two lookups and a distance.
+     *
+     * Thread safe: written by the map thread, queried by the loop closure thread.
+     */
+    class KeyframePositionIndex {
+    public:
+        KeyframePositionIndex(double minRadius = 1.0, double driftPerMeter = 0.05) :
+            minRadius_(minRadius), driftPerMeter_(driftPerMeter) {
+        }
+
+        /** Radius allowed between two keyframes of a segment: minRadius + driftPerMeter * path length */
+        void setUncertainty(double minRadius, double driftPerMeter) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            minRadius_ = minRadius;
+            driftPerMeter_ = driftPerMeter;
+        }
+
+        /**
+         * Index a new keyframe.
+         * @param previousFrameId keyframe it follows in the odometry chain (-1 or unknown starts a new segment)
+         * @param odometryStep distance travelled since previousFrameId
+         */
+        void add(int frameId, const Eigen::Vector3d & position, int previousFrameId, double odometryStep) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            Entry entry;
+            entry.position = position;
+            auto previous = entries_.find(previousFrameId);
+            if (previous != entries_.end()) {
+                entry.segment = previous->second.segment;
+                entry.pathLength = previous->second.pathLength + odometryStep;
+            } else {
+                entry.segment = numSegments_++;
+                entry.pathLength = 0.0;
+            }
+            entries_[frameId] = entry;
+        }
+
+        /**
+         * Move an indexed keyframe (e.g. after poses were optimized); its segment and path length,
+         * which come from the odometry, stay the same.
+         * @return false if frameId is not indexed
+         */
+        bool setPosition(int frameId, const Eigen::Vector3d & position) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = entries_.find(frameId);
+            if (it == entries_.end())
+                return false;
+            it->second.position = position;
+            return true;
+        }
+
+        /** Remove a keyframe; keyframes chained to it keep their path lengths */
+        void remove(int frameId) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            entries_.erase(frameId);
+        }
+
+        /** Remove all keyframes and start over */
+        void clear() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            entries_.clear();
+            numSegments_ = 0;
+        }
+
+        size_t size() const {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return entries_.size();
+        }
+
+        /** True unless both keyframes are indexed in the same segment and too far apart for the drift between them */
+        bool isPlausible(int frameId, int candidateId) const {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto a = entries_.find(frameId), b = entries_.find(candidateId);
+            if (a == entries_.end() || b == entries_.end())
+                return true;
+            const Entry & ea = a->second, & eb = b->second;
+            if (ea.segment != eb.segment)
+                return true;
+            const double radius = minRadius_ + driftPerMeter_ * std::abs(ea.pathLength - eb.pathLength);
+            return (ea.position - eb.position).squaredNorm() <= radius * radius;
+        }
+
+    private:
+        struct Entry {
+            int segment;
+            double pathLength;
+            Eigen::Vector3d position;
+        };
+
+        mutable std::mutex mutex_;
+        double minRadius_;
+        double driftPerMeter_;
+        int numSegments_ = 0;
+        std::unordered_map<int, Entry> entries_;
+    };
+}
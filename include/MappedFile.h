@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <fstream>
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace ark {
+    /**
+     * Read-only view of a whole file: memory mapped where mmap is available (pages are
+     * shared between processes mapping the same file), read into memory otherwise.
+     */
+    class MappedFile {
+    public:
+        explicit MappedFile(const std::string & path) : data_(nullptr), size_(0) {
+#ifdef _WIN32
+            std::ifstream file(path, std::ios::binary);
+            if (!file.is_open()) return;
+            buffer_.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+            data_ = reinterpret_cast<const uint8_t *>(buffer_.data());
+            size_ = buffer_.size();
+#else
+            const int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) return;
+            struct stat st;
+            if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+                void * mapped = ::mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+                if (mapped != MAP_FAILED) {
+                    data_ = static_cast<const uint8_t *>(mapped);
+                    size_ = (size_t)st.st_size;
+                }
+            }
+            ::close(fd);
+#endif
+        }
+
+        ~MappedFile() {
+#ifndef _WIN32
+            if (data_ != nullptr) ::munmap(const_cast<uint8_t *>(data_), size_);
+#endif
+        }
+
+        bool valid() const {
+            return data_ != nullptr;
+        }
+
+        size_t size() const {
+            return size_;
+        }
+
+        /** Hint that the whole file is about to be read front to back */
+        void adviseSequential() const {
+#ifndef _WIN32
+            if (data_ == nullptr) return;
+            ::madvise(const_cast<uint8_t *>(data_), size_, MADV_SEQUENTIAL);
+            ::madvise(const_cast<uint8_t *>(data_), size_, MADV_WILLNEED);
+#endif
+        }
+
+        /** Pointer to count elements of T at offset, or nullptr if that range is outside the file */
+        template<class T>
+        const T * at(uint64_t offset, uint64_t count = 1) const {
+            if (data_ == nullptr || offset > size_ || count > (size_ - offset) / sizeof(T)) return nullptr;
+            return reinterpret_cast<const T *>(data_ + offset);
+        }
+
+    private:
+        MappedFile(const MappedFile &) = delete;
+        MappedFile & operator=(const MappedFile &) = delete;
+
+        const uint8_t * data_;
+        size_t size_;
+#ifdef _WIN32
+        std::vector<char> buffer_;
+#endif
+    };
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "Open3D/geometry/TriangleMesh.h"
+
+namespace ark {
+	/**
+	 * Memory budget for the meshes of completed reconstruction blocks, with a disk cache for the
+	 * blocks that do not fit. The owner registers each resident mesh and touches it when it is used;
+	 * while the resident meshes exceed the budget it spills the least recently used ones, which
+	 * writes them to one binary file per block in the cache directory, and loads them back later.
+	 *
+	 * Block file layout (little endian): BlockHeader | vertices (3 doubles each)
+	 *     | vertex colors (3 doubles each) | triangles (3 int32 each)
+	 * Completed meshes do not change, so a block spilled again after being loaded keeps its file.
+	 * Files are written to a temporary path and renamed into place, and removed with the cache.
+	 *
+	 * Not thread safe; SegmentedMesh calls it with its meshLock held.
+	 */
+	class MeshBlockCache {
+	public:
+		/** Bump when the layout changes; files with another version are rejected */
+		static const uint32_t kVersion = 1;
+
+		/** @param budget_bytes resident mesh memory above which blocks should be spilled, 0 for no limit */
+		MeshBlockCache(const std::string & directory, size_t budget_bytes);
+		/** Removes the files written by this cache */
+		~MeshBlockCache();
+
+		MeshBlockCache(const MeshBlockCache &) = delete;
+		MeshBlockCache & operator=(const MeshBlockCache &) = delete;
+
+		/** Memory held by a mesh's vertices, colors and triangles */
+		static size_t MeshBytes(const open3d::geometry::TriangleMesh & mesh);
+
+		/** Count block id as resident and the most recently used */
+		void SetResident(int id, const open3d::geometry::TriangleMesh & mesh);
+
+		/** Make a resident block the most recently used */
+		void Touch(int id);
+
+		bool IsResident(int id) const {
+			return resident_.count(id) != 0;
+		}
+
+		/** Whether the resident meshes exceed the budget */
+		bool OverBudget() const {
+			return budget_bytes_ != 0 && resident_bytes_ > budget_bytes_;
+		}
+
+		/** Resident blocks, least recently used first */
+		std::vector<int> LeastRecentlyUsed() const {
+			return std::vector<int>(lru_.rbegin(), lru_.rend());
+		}
+
+		/**
+		 * Write block id to the cache (unless it is there already) and stop counting it as resident.
+		 * @return false (with a message on std::cerr) if the file could not be written; the block stays resident
+		 */
+		bool Spill(int id, const open3d::geometry::TriangleMesh & mesh);
+
+		/**
+		 * Read a spilled block. Does not count it as resident, call SetResident to keep it.
+		 * @return nullptr (with a message on std::cerr) if it was never spilled or the file is unreadable
+		 */
+		std::shared_ptr<open3d::geometry::TriangleMesh> Load(int id) const;
+
+		struct Stats {
+			size_t resident = 0;
+			size_t residentBytes = 0;
+			/** blocks with a file in the cache */
+			size_t cached = 0;
+			size_t spills = 0;
+			size_t loads = 0;
+		};
+
+		Stats GetStats() const;
+
+	private:
+		std::string PathOf(int id) const;
+
+		struct Entry {
+			std::list<int>::iterator position;
+			size_t bytes;
+		};
+
+		std::string directory_;
+		size_t budget_bytes_;
+		/** resident blocks, most recently used first */
+		std::list<int> lru_;
+		std::unordered_map<int, Entry> resident_;
+		size_t resident_bytes_ = 0;
+		/** blocks with a file in the cache */
+		std::unordered_set<int> cached_;
+		size_t spills_ = 0;
+		mutable size_t loads_ = 0;
+	};
+}
@@ -52,8 +52,6 @@ namespace ark {
         */
         void update(MultiCameraFrame & frame) override;
 
-        void project(const cv::Mat &depth_frame, cv::Mat &xyz_map);
-
         bool getImuToTime(double timestamp, std::vector<ImuPair>& data_out);
 
         std::vector<ImuPair> getAllImu();
@@ -5,37 +5,69 @@
 #include <okvis/VioParametersReader.hpp>
 #include <okvis/ThreadedKFVio.hpp>
 #include <thread>
+#include <chrono>
+#include <mutex>
 #include <opencv2/core/eigen.hpp>
-#include "SingleConsumerPriorityQueue.h"
+#include "SPSCRingBuffer.h"
+#include "HammingMatcher.h"
 #include <atomic>
 #include <brisk/brisk.h>
 #include <vector>
 #include <memory>
+#include <deque>
+#include <unordered_map>
 
 namespace ark {
     /** Okvis-based SLAM system */
     class OkvisSLAMSystem : public SLAMSystem {
 
-        struct WrappedMultiCameraFrame {
-            MultiCameraFrame::Ptr frame;
-            bool operator<(const WrappedMultiCameraFrame& right) const
-            {
-                return frame->timestamp_ > right.frame->timestamp_;
-            }
-        };
-
         struct StampedFrameData {
             okvis::OutFrameData::Ptr data;
             okvis::Time timestamp;
-            bool operator<(const StampedFrameData& right) const
-            {
-                return timestamp > right.timestamp;
-            }
+            /** Time at which OKVIS published the data, used to measure queue wait */
+            std::chrono::steady_clock::time_point published;
+        };
+
+        /** A keyframe waiting for loop detection and the map it was added to */
+        struct LoopCandidate {
+            MapKeyFrame::Ptr kf;
+            std::shared_ptr<SparseMap<DBoW2::FBRISK::TDescriptor, DBoW2::FBRISK>> map;
+        };
+
+        /** A loop closure verified by the loop closure thread, waiting to be applied to the map */
+        struct LoopClosureResult {
+            MapKeyFrame::Ptr kf;
+            MapKeyFrame::Ptr loop_kf;
+            /** unaligned so the result can sit in a ring buffer slot */
+            Eigen::Transform<double, 3, Eigen::Affine, Eigen::DontAlign> transformEstimate;
         };
 
     public:
         EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
+        /** Time spent by OKVIS output in the queue before the consumer picked it up (milliseconds) */
+        struct QueueWaitStats {
+            size_t count = 0;
+            double lastMs = 0.0;
+            double meanMs = 0.0;
+            double maxMs = 0.0;
+        };
+
+        /** Work done by the loop closure thread */
+        struct LoopClosureStats {
+            /** keyframe candidate queue occupancy; dropped counts keyframes evicted unprocessed */
+            SPSCRingBuffer<LoopCandidate>::Stats candidates;
+            /** BoW detections whose geometric verification was skipped because the queue was saturated */
+            size_t skippedVerifications;
+            /** BoW detections rejected without verification because the match is too far away given the odometry drift */
+            size_t implausible;
+            /** BoW detections of keyframes that have been culled since they were added */
+            size_t culledMatches;
+            /** detections accepted / rejected by geometric verification */
+            size_t verified;
+            size_t rejected;
+        };
+
         OkvisSLAMSystem(const std::string &strVocFile, const std::string &strSettingsFile);
 
         //void PushFrame(const std::vector<cv::Mat>& images, const double &timestamp);
@@ -64,12 +96,54 @@ namespace ark {
 
         void getTrajectory(std::vector<Eigen::Matrix4d>& trajOut);
 
+        /**
+         * Keyframe poses of the active map; lock free, safe to call from render threads (see
+         * SparseMap::getTrajectorySnapshot). Empty until the first map is created.
+         */
+        TrajectorySnapshot::ConstPtr getTrajectorySnapshot();
+
 		void getMappedTrajectory(std::vector<int>& frameIdOut, std::vector<Eigen::Matrix4d>& trajOut);
         
         ~OkvisSLAMSystem();
 
         std::shared_ptr<SparseMap<DBoW2::FBRISK::TDescriptor, DBoW2::FBRISK>> getActiveMap();
 
+        /** Latency between OKVIS publishing a frame and the consumer thread starting to process it */
+        QueueWaitStats getQueueWaitStats();
+
+        /** Occupancy and drop counters of the queue of frames waiting for OKVIS output */
+        SPSCRingBuffer<MultiCameraFrame::Ptr>::Stats getFrameQueueStats() const {
+            return frame_queue_.stats();
+        }
+
+        /** Occupancy and drop counters of the queue of OKVIS output waiting for the consumer */
+        SPSCRingBuffer<StampedFrameData>::Stats getFrameDataQueueStats() const {
+            return frame_data_queue_.stats();
+        }
+
+        LoopClosureStats getLoopClosureStats() const;
+
+        /**
+         * Bound the keyframes kept by the active map (by count and/or memory). Redundant keyframes
+         * are marginalized out of the pose graph and forgotten by the loop closure database.
+         * Culling is off by default (an empty budget).
+         */
+        void setKeyframeCulling(const KeyframeCullingOptions& options);
+
+        /**
+         * Save a map (the active one by default) together with the order of its keyframes in
+         * the loop closure BoW database. Waits for the frame being processed to finish updating the maps.
+         */
+        bool SaveMap(const std::string& path, int mapIndex = -1);
+
+        /**
+         * Preload a map written by SaveMap as an inactive map. A loop closure against one of its
+         * keyframes merges it with the live map, relocalizing the session in the saved map.
+         * Its keyframes are added to the BoW database on the loop closure thread, so this
+         * returns as soon as the file is read. Fails once frames have been pushed.
+         */
+        bool LoadMap(const std::string& path);
+
 
         int getActiveMapIndex() {
             return active_map_index;
@@ -89,13 +163,36 @@ namespace ark {
 
         void FrameConsumerLoop();
 
+        /** Runs loop detection and geometric verification for queued keyframes */
+        void LoopClosureLoop();
+
+        /** Applies the loop closures verified since the last call, merging maps where needed.
+         *  @param deleted_map_index set to the id of the map absorbed by a merge
+         *  @return true if maps were merged */
+        bool applyLoopClosureResults(int& deleted_map_index);
+
+        /** Handles estimator resets (map creation and queue flushing).
+         *  @param haveFrameData true if the consumer currently holds OKVIS output to process
+         *  @return true if the estimator is currently reset */
+        bool checkEstimatorReset(bool haveFrameData);
+
+        void recordQueueWait(const std::chrono::steady_clock::time_point& published);
+
         void createNewMap();
 
         void setEnableLoopClosure(bool enableUseLoopClosures, std::string vocabPath,
                 bool binaryVocab, cv::DescriptorMatcher* matcher);
 
-        bool detectLoopClosure(MapKeyFrame::Ptr kf, MapKeyFrame::Ptr &loop_kf,
-                Eigen::Affine3d &transformEstimate);
+        /** Stops loop closure from returning culled keyframes and releases them */
+        void forgetCulledKeyframes(const std::vector<int>& frameIds);
+
+        /** Adds the keyframes of maps preloaded by LoadMap to the BoW database (loop closure thread) */
+        void replayLoadedKeyframes();
+
+        /** @param verify if false, a BoW detection is not geometrically verified and is reported as no loop
+         *  @param candidate keyframe and its map, whose keyframe positions rule out implausible matches */
+        bool detectLoopClosure(const LoopCandidate &candidate, MapKeyFrame::Ptr &loop_kf,
+                Eigen::Affine3d &transformEstimate, bool verify = true);
 
         std::shared_ptr<SparseMap<DBoW2::FBRISK::TDescriptor, DBoW2::FBRISK>> mergeMaps(
                 std::shared_ptr<SparseMap<DBoW2::FBRISK::TDescriptor, DBoW2::FBRISK>> olderMap,
@@ -107,9 +204,17 @@ namespace ark {
         okvis::Time t_imu_;
         okvis::Duration deltaT_;
         okvis::VioParameters parameters_;
-        SingleConsumerPriorityQueue<WrappedMultiCameraFrame> frame_queue_;
-        SingleConsumerPriorityQueue<StampedFrameData> frame_data_queue_;
+        // frames pushed by the camera thread, keyed by timestamp (ns) so OKVIS output can be paired directly
+        SPSCRingBuffer<MultiCameraFrame::Ptr> frame_queue_;
+        // OKVIS output, keyed by timestamp (ns)
+        SPSCRingBuffer<StampedFrameData> frame_data_queue_;
+        // keyframes waiting for loop detection, and the verified closures coming back
+        SPSCRingBuffer<LoopCandidate> loop_candidate_queue_;
+        SPSCRingBuffer<LoopClosureResult> loop_result_queue_;
         std::thread frameConsumerThread_;
+        std::thread loopClosureThread_;
+        std::mutex queueWaitMutex_;
+        QueueWaitStats queueWaitStats_;
         int num_frames_;
         std::atomic<bool> kill;
         std::map<int, std::shared_ptr<SparseMap<DBoW2::FBRISK::TDescriptor, DBoW2::FBRISK>>> sparse_maps_;
@@ -122,16 +227,51 @@ namespace ark {
         bool useLoopClosures_;
         std::shared_ptr<DLoopDetector::TemplatedLoopDetector<DBoW2::FBRISK::TDescriptor, DBoW2::FBRISK> >detector_;
         std::shared_ptr<DBoW2::TemplatedVocabulary<DBoW2::FBRISK::TDescriptor, DBoW2::FBRISK> >vocab_;
+        // optional OpenCV matcher; when null, hammingMatcher_ is used
         std::shared_ptr<cv::DescriptorMatcher> matcher_;
+        HammingMatcher hammingMatcher_;
+        // bowFrameMap_ and bowId_ are written by the loop closure thread; bowMutex_ lets SaveMap read them
+        // and the consumer thread drop culled keyframes
+        std::mutex bowMutex_;
         std::map<int, MapKeyFrame::Ptr> bowFrameMap_;
+        // BoW entry id of each keyframe in bowFrameMap_
+        std::unordered_map<int, int> bowIdOfFrame_;
         int bowId_;
+        std::mutex cullingMutex_;
+        KeyframeCullingOptions cullingOptions_;
+        // keyframes of preloaded maps waiting to be added to the BoW database
+        std::deque<MapKeyFrame::Ptr> bowReplay_;
+        // added to OKVIS frame ids so that they do not collide with the ids of preloaded maps
+        int frameIdOffset_;
+        // set by the first PushFrame, after which LoadMap refuses to change frameIdOffset_
+        std::atomic<bool> framesPushed_;
+        // guards sparse_maps_, active_map_index and map_id_counter_: held by the frame consumer
+        // while it updates the maps and by SaveMap / LoadMap
+        std::mutex mapsMutex_;
+        // the active map, republished by the consumer whenever it changes, for getTrajectorySnapshot
+        std::shared_ptr<SparseMap<DBoW2::FBRISK::TDescriptor, DBoW2::FBRISK>> publishedActiveMap_;
         double lastLoopClosureTimestamp_;
+        std::atomic<size_t> loopVerificationsSkipped_;
+        std::atomic<size_t> loopClosuresImplausible_;
+        std::atomic<size_t> loopMatchesCulled_;
+        std::atomic<size_t> loopClosuresVerified_;
+        std::atomic<size_t> loopClosuresRejected_;
         // correction for convert an obj coordinate in other's map 
         // because reset okvis estimator also reset coordinate system
         Eigen::Matrix4d correction_{Eigen::Matrix4d::Identity()};
 
         static const int kMapCreationCooldownFrames_ = 15;
         static const int kMinimumKeyframes_ = 20;
+        // how long the consumer sleeps without OKVIS output before re-checking for estimator resets
+        static const int kResetCheckIntervalMs_ = 50;
+        static const size_t kFrameQueueCapacity_ = 64;
+        static const size_t kFrameDataQueueCapacity_ = 64;
+        // maximum difference between a frame's timestamp and the OKVIS output timestamp (ns)
+        static const int64_t kTimestampToleranceNs_ = 1000;
+        static const size_t kLoopCandidateQueueCapacity_ = 8;
+        // queue occupancy from which BoW detections are no longer geometrically verified
+        static const size_t kLoopCandidateSaturation_ = 4;
+        static const size_t kLoopResultQueueCapacity_ = 16;
 
     }; // OkvisSLAMSystem
 
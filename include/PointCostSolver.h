@@ -4,6 +4,7 @@
 #include <Eigen/Core>
 #include "ceres/ceres.h"
 #include "pcl/point_cloud.h"
+#include "RigidAlignmentSolver.h"
 
 namespace ark{
 
@@ -67,6 +68,7 @@ template <typename PointT>
 class PointCostSolver{
     using CloudPtr = typename pcl::PointCloud<PointT>::Ptr;
 public:
+    /** Least squares alignment of the inlier correspondences (see RigidAlignmentSolver) */
     static Eigen::Affine3d solve(
             const CloudPtr src,
             const CloudPtr tgt, 
@@ -74,6 +76,18 @@ public:
             const std::vector<bool>& inliers,
             Eigen::Affine3d initial_pose_estimate,
             int max_num_iterations = 20){
+        return RigidAlignmentSolver<PointT>::solve(src, tgt, correspondences, inliers,
+            initial_pose_estimate, max_num_iterations);
+    }
+
+    /** Previous solver: one auto-differentiated residual block over every correspondence, solved by Ceres */
+    static Eigen::Affine3d solveCeres(
+            const CloudPtr src,
+            const CloudPtr tgt, 
+            const std::vector<int>& correspondences, 
+            const std::vector<bool>& inliers,
+            Eigen::Affine3d initial_pose_estimate,
+            int max_num_iterations = 20){
 
         ceres::Problem problem;
         Eigen::Quaterniond ceres_rotation(initial_pose_estimate.rotation());
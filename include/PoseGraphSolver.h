@@ -8,8 +8,18 @@
 #include <DBoW2.h>
 #include <DLoopDetector.h>
 #include <Eigen/Geometry>
+#include <Eigen/Cholesky>
 #include "ceres/ceres.h"
+#include "Instrumentation.h"
 #include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
 
 namespace ark{
 
@@ -29,6 +39,13 @@ EIGEN_MAKE_ALIGNED_OPERATOR_NEW
         Q_WA = Eigen::Quaterniond(T_WA.block<3,3>(0,0));
     }
 
+    Eigen::Matrix4d T_WA() const {
+        Eigen::Matrix4d outMat = Eigen::Matrix4d::Identity();
+        outMat.block<3,1>(0,3)=P_WA;
+        outMat.block<3,3>(0,0)=Q_WA.toRotationMatrix();
+        return outMat;
+    }
+
     Eigen::Vector3d P_WA;
     Eigen::Quaterniond Q_WA;
 };
@@ -49,7 +66,7 @@ EIGEN_MAKE_ALIGNED_OPERATOR_NEW
             const Eigen::Quaterniond& Q_AB,
             const Eigen::Matrix<double, 6, 6>& sqrt_information =
                 Eigen::Matrix<double, 6, 6>::Identity()):
-        id_A(id_A),id_B(id_B),P_AB(P_AB),Q_AB(Q_AB){
+        id_A(id_A),id_B(id_B),P_AB(P_AB),Q_AB(Q_AB),sqrt_information(sqrt_information){
     }
 
     int id_A, id_B;
@@ -132,13 +149,204 @@ private:
     const Eigen::Matrix<double, 6, 6> sqrt_information_;
 }; //PoseConstraint
 
+/**
+ * PoseError with analytic Jacobians; the residual is the same. Jacobians are derived for a left
+ * perturbation of each quaternion, q <- [1, delta] * q, which is how EigenQuaternionParameterization
+ * updates it, and lifted to the 4 quaternion coefficients with the transpose of that
+ * parameterization's Jacobian (whose columns are orthonormal for a unit quaternion).
+ */
+class AnalyticPoseError : public ::ceres::SizedCostFunction<6, 3, 4, 3, 4> {
+public:
+EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    AnalyticPoseError(const PoseConstraint& C_AB):
+        p_ab_measured_(C_AB.P_AB), q_ab_measured_(C_AB.Q_AB),
+        sqrt_information_(C_AB.sqrt_information) {}
+
+    bool Evaluate(double const* const* parameters, double* residuals_ptr, double** jacobians) const override {
+        Eigen::Map<const Eigen::Vector3d> p_a(parameters[0]);
+        Eigen::Map<const Eigen::Quaterniond> q_a(parameters[1]);
+        Eigen::Map<const Eigen::Vector3d> p_b(parameters[2]);
+        Eigen::Map<const Eigen::Quaterniond> q_b(parameters[3]);
+
+        // r_p = R_a^T (p_b - p_a) - p_ab, r_q = 2 vec(q_ab * q_b^-1 * q_a)
+        const Eigen::Matrix3d R_a_inverse = q_a.conjugate().toRotationMatrix();
+        const Eigen::Vector3d d = p_b - p_a;
+        const Eigen::Quaterniond Q = q_ab_measured_ * q_b.conjugate();
+        const Eigen::Quaterniond delta_q = Q * q_a;
+
+        Eigen::Matrix<double, 6, 1> residuals;
+        residuals.head<3>() = R_a_inverse * d - p_ab_measured_;
+        residuals.tail<3>() = 2.0 * delta_q.vec();
+        Eigen::Map<Eigen::Matrix<double, 6, 1> > weighted_residuals(residuals_ptr);
+        weighted_residuals = sqrt_information_ * residuals;
+        if(jacobians == NULL)
+            return true;
+
+        // q_a <- e q_a turns delta_q into (Q e Q^-1) delta_q; vec([1,u] * [w,v]) = (w I - [v]x) u + v
+        const Eigen::Matrix3d dRotation = 2.0 *
+            (delta_q.w() * Eigen::Matrix3d::Identity() - skew(delta_q.vec())) * Q.toRotationMatrix();
+
+        if(jacobians[0] != NULL){
+            Eigen::Matrix<double, 6, 3> J = Eigen::Matrix<double, 6, 3>::Zero();
+            J.topRows<3>() = -R_a_inverse;
+            Eigen::Map<Eigen::Matrix<double, 6, 3, Eigen::RowMajor> > jacobian(jacobians[0]);
+            jacobian = sqrt_information_ * J;
+        }
+        if(jacobians[1] != NULL){
+            Eigen::Matrix<double, 6, 3> J;
+            // the rotation vector of [1, delta] is 2 delta
+            J.topRows<3>() = 2.0 * R_a_inverse * skew(d);
+            J.bottomRows<3>() = dRotation;
+            Eigen::Map<Eigen::Matrix<double, 6, 4, Eigen::RowMajor> > jacobian(jacobians[1]);
+            jacobian = sqrt_information_ * J * liftJacobian(q_a).transpose();
+        }
+        if(jacobians[2] != NULL){
+            Eigen::Matrix<double, 6, 3> J = Eigen::Matrix<double, 6, 3>::Zero();
+            J.topRows<3>() = R_a_inverse;
+            Eigen::Map<Eigen::Matrix<double, 6, 3, Eigen::RowMajor> > jacobian(jacobians[2]);
+            jacobian = sqrt_information_ * J;
+        }
+        if(jacobians[3] != NULL){
+            Eigen::Matrix<double, 6, 3> J = Eigen::Matrix<double, 6, 3>::Zero();
+            J.bottomRows<3>() = -dRotation;
+            Eigen::Map<Eigen::Matrix<double, 6, 4, Eigen::RowMajor> > jacobian(jacobians[3]);
+            jacobian = sqrt_information_ * J * liftJacobian(q_b).transpose();
+        }
+        return true;
+    }
+
+    static ::ceres::CostFunction* Create(const PoseConstraint& C_AB) {
+        return new AnalyticPoseError(C_AB);
+    }
+
+    /** Jacobian of the coefficients (x, y, z, w) of [1, delta] * q with respect to delta */
+    static Eigen::Matrix<double, 4, 3> liftJacobian(const Eigen::Quaterniond& q) {
+        Eigen::Matrix<double, 4, 3> P;
+        P.topRows<3>() = q.w() * Eigen::Matrix3d::Identity() - skew(q.vec());
+        P.bottomRows<1>() = -q.vec().transpose();
+        return P;
+    }
+
+    /** [v]x, the cross product with v as a matrix */
+    static Eigen::Matrix3d skew(const Eigen::Vector3d& v) {
+        Eigen::Matrix3d m;
+        m <<     0.0, -v.z(),  v.y(),
+               v.z(),    0.0, -v.x(),
+              -v.y(),  v.x(),    0.0;
+        return m;
+    }
+
+private:
+
+    const Eigen::Vector3d p_ab_measured_;
+    const Eigen::Quaterniond q_ab_measured_;
+    const Eigen::Matrix<double, 6, 6> sqrt_information_;
+}; //AnalyticPoseError
+
 class SimplePoseGraphSolver{
 public:
+    /** An immutable set of optimized poses published by the optimizer.
+     *  The version increases by one with every successful solve. */
+    struct OptimizedPoses {
+        typedef std::shared_ptr<const OptimizedPoses> ConstPtr;
+        size_t version;
+        std::map<int, GraphPose> poses;
+    };
+
+    /** Full: rebuild and solve the whole graph on every call.
+     *  Incremental: keep one problem alive, only add new blocks, and re-optimize a bounded
+     *  neighborhood around the newest constraints with a periodic global pass. */
+    enum class SolveMode { Full, Incremental };
+
+    struct IncrementalOptions {
+        IncrementalOptions(int neighborhoodHops = 25, int globalEvery = 10, int maxIterations = 10):
+            neighborhoodHops(neighborhoodHops), globalEvery(globalEvery), maxIterations(maxIterations){}
+        /** graph distance (number of constraints) from the newest constraints that is re-optimized */
+        int neighborhoodHops;
+        /** run a global pass every this many local solves (0 to never run one automatically) */
+        int globalEvery;
+        int maxIterations;
+    };
+
+    /** Robust loss applied to every constraint; the scale is in units of the whitened
+     *  residual, i.e. standard deviations of the constraint's information */
+    enum class Loss { None, Huber, Cauchy };
+
+    /** Ceres configuration of every solve. The defaults are the previous fixed setup. */
+    struct SolverOptions {
+        SolverOptions():
+            linearSolver(::ceres::SPARSE_SCHUR), trustRegion(::ceres::DOGLEG),
+            sparseLibrary(::ceres::Solver::Options().sparse_linear_algebra_library_type),
+            numThreads(2), maxIterations(10), maxSolverTimeSeconds(0.0),
+            loss(Loss::None), lossScale(1.0), analyticJacobians(false){}
+        ::ceres::LinearSolverType linearSolver;
+        ::ceres::TrustRegionStrategyType trustRegion;
+        /** backend of the sparse linear solvers, e.g. SUITE_SPARSE (CHOLMOD) or EIGEN_SPARSE;
+         *  defaults to the best one ceres was built with */
+        ::ceres::SparseLinearAlgebraLibraryType sparseLibrary;
+        int numThreads;
+        /** iterations of whole-graph solves (Full mode and incremental global passes) */
+        int maxIterations;
+        /** wall time limit of each solve in seconds, 0 for none */
+        double maxSolverTimeSeconds;
+        Loss loss;
+        double lossScale;
+        /** AnalyticPoseError (same residual, closed form Jacobians) instead of the automatically
+         *  differentiated PoseError */
+        bool analyticJacobians;
+    };
+
     SimplePoseGraphSolver():
-    optimizing(false), loopQueued(false){
+    loopQueued(false), topologyChanged_(false), stopOptimizer_(false), solveCount_(0),
+    requestedMode_(SolveMode::Full), optionsChanged_(false), globalPassRequested_(false),
+    mode_(SolveMode::Full), syncedConstraints_(0), localSolves_(0), globalPassQueued_(true), anchored_(false), anchorId_(-1){
         //set map pointer
     }
 
+    /** Switch solve mode, from the next solve on. Switching resets the incremental state;
+     *  it is rebuilt on the next solve. Does not wait for a running solve. */
+    void setSolveMode(SolveMode mode, const IncrementalOptions& options = IncrementalOptions()){
+        std::lock_guard<std::mutex> optionsLock(optionsMutex_);
+        requestedMode_ = mode;
+        requestedIncrementalOptions_ = options;
+        optionsChanged_ = true;
+    }
+
+    SolveMode getSolveMode(){
+        std::lock_guard<std::mutex> optionsLock(optionsMutex_);
+        return requestedMode_;
+    }
+
+    /** Change the solver configuration, from the next solve on. Resets the incremental state;
+     *  it is rebuilt on the next solve. Does not wait for a running solve. */
+    void setSolverOptions(const SolverOptions& options){
+        std::lock_guard<std::mutex> optionsLock(optionsMutex_);
+        requestedSolverOptions_ = options;
+        optionsChanged_ = true;
+    }
+
+    SolverOptions getSolverOptions(){
+        std::lock_guard<std::mutex> optionsLock(optionsMutex_);
+        return requestedSolverOptions_;
+    }
+
+    /** Force the next incremental solve to optimize the whole graph */
+    void requestGlobalPass(){
+        std::lock_guard<std::mutex> optionsLock(optionsMutex_);
+        globalPassRequested_ = true;
+    }
+
+    ~SimplePoseGraphSolver(){
+        {
+            std::lock_guard<std::mutex> lock(optimizerMutex_);
+            stopOptimizer_ = true;
+        }
+        optimizerCv_.notify_all();
+        if(optimizerThread_.joinable())
+            optimizerThread_.join();
+    }
+
     void AddConstraint(const PoseConstraint& constraint){
         constraintMutex.lock();
         constraints_.push_back(constraint);
@@ -166,26 +374,457 @@ public:
 
     }
 
-    void optimize(){
-        if(optimizing){
-            loopQueued=true;
+    /**
+     * Remove poses that sit in the middle of an odometry chain (exactly one constraint into
+     * the pose and one out of it), replacing each pair of constraints A->K, K->B by their
+     * composition A->B. Covariances are propagated to first order through the composition.
+     * Poses with any other
+     * constraints (e.g. loop closures), or whose neighbors are also listed, are kept.
+     * @param removed set to the ids that were actually removed
+     */
+    void marginalizePoses(const std::vector<int>& ids, std::vector<int>& removed){
+        removed.clear();
+        std::lock_guard<std::mutex> lock(constraintMutex);
+        const std::unordered_set<int> candidates(ids.begin(), ids.end());
+        std::unordered_map<int, std::vector<size_t>> incident;
+        for(size_t i=0; i<constraints_.size(); i++){
+            if(candidates.count(constraints_[i].id_A))
+                incident[constraints_[i].id_A].push_back(i);
+            if(candidates.count(constraints_[i].id_B))
+                incident[constraints_[i].id_B].push_back(i);
+        }
+
+        std::vector<bool> erased(constraints_.size(), false);
+        std::vector<PoseConstraint> composed;
+        for(size_t i=0; i<ids.size(); i++){
+            const std::vector<size_t>& edges = incident[ids[i]];
+            if(edges.size() != 2)
+                continue;
+            const PoseConstraint* in = &constraints_[edges[0]];
+            const PoseConstraint* out = &constraints_[edges[1]];
+            if(in->id_B != ids[i])
+                std::swap(in, out);
+            if(in->id_B != ids[i] || out->id_A != ids[i] || in->id_A == out->id_B ||
+                    candidates.count(in->id_A) || candidates.count(out->id_B))
+                continue;
+
+            // T_AB = T_AK * T_KB, with errors [dp; dtheta] as in PoseError: translation in the
+            // first frame, rotation as a perturbation on the left. Then
+            //   dp_AB = dp_AK + [R_AK * P_KB]x dtheta_AK + R_AK * dp_KB
+            //   dtheta_AB = dtheta_AK + R_AK * dtheta_KB
+            const Eigen::Matrix3d R_AK = in->Q_AB.toRotationMatrix();
+            Eigen::Matrix<double, 6, 6> J_AK = Eigen::Matrix<double, 6, 6>::Identity();
+            J_AK.block<3,3>(0,3) = AnalyticPoseError::skew(R_AK * out->P_AB);
+            Eigen::Matrix<double, 6, 6> J_KB = Eigen::Matrix<double, 6, 6>::Zero();
+            J_KB.block<3,3>(0,0) = R_AK;
+            J_KB.block<3,3>(3,3) = R_AK;
+            const Eigen::Matrix<double, 6, 6> cov_AK = (in->sqrt_information.transpose() * in->sqrt_information).inverse();
+            const Eigen::Matrix<double, 6, 6> cov_KB = (out->sqrt_information.transpose() * out->sqrt_information).inverse();
+            const Eigen::Matrix<double, 6, 6> information =
+                    (J_AK * cov_AK * J_AK.transpose() + J_KB * cov_KB * J_KB.transpose()).inverse();
+            const Eigen::Matrix<double, 6, 6> sqrt_information = information.llt().matrixU();
+
+            composed.push_back(PoseConstraint(in->id_A, out->id_B, in->P_AB + in->Q_AB * out->P_AB,
+                    (in->Q_AB * out->Q_AB).normalized(), sqrt_information));
+            erased[edges[0]] = erased[edges[1]] = true;
+            poses_.erase(ids[i]);
+            removed.push_back(ids[i]);
+        }
+        if(removed.empty())
             return;
+
+        size_t kept = 0;
+        for(size_t i=0; i<constraints_.size(); i++){
+            if(!erased[i])
+                constraints_[kept++] = constraints_[i];
+        }
+        constraints_.resize(kept, PoseConstraint(0, 0, Eigen::Matrix4d::Identity()));
+        constraints_.insert(constraints_.end(), composed.begin(), composed.end());
+        // indices into constraints_ held by the incremental state are stale now
+        topologyChanged_ = true;
+    }
+
+    /**
+     * Absorb another graph whose poses are expressed in a frame T_this_other away from this
+     * one. Constant time: the other graph's poses and constraints are copied in by joinMerged(),
+     * which the optimizer thread runs before its next solve. The other graph must outlive this one.
+     */
+    void merge(SimplePoseGraphSolver* other, const Eigen::Matrix4d& T_this_other){
+        std::lock_guard<std::mutex> lock(constraintMutex);
+        pendingMerges_.push_back(PendingMerge(other, T_this_other));
+    }
+
+    /** Copy the graphs queued by merge() into this one.
+     *  @return true if anything was joined */
+    bool joinMerged(){
+        std::vector<PendingMerge> merges;
+        {
+            std::lock_guard<std::mutex> lock(constraintMutex);
+            merges.swap(pendingMerges_);
+        }
+        for(size_t i=0; i<merges.size(); i++){
+            SimplePoseGraphSolver* other = merges[i].graph;
+            const Eigen::Matrix4d T_this_other(merges[i].T_this_other);
+            other->joinMerged();
+            std::vector<PoseConstraint> constraints;
+            std::map<int, GraphPose> poses;
+            other->constraintMutex.lock();
+            constraints = other->constraints_;
+            poses = other->poses_;
+            other->constraintMutex.unlock();
+
+            // constraints are relative and carry over as they are, poses move into this frame
+            std::lock_guard<std::mutex> lock(constraintMutex);
+            constraints_.insert(constraints_.end(), constraints.begin(), constraints.end());
+            for(std::map<int, GraphPose>::iterator pose = poses.begin(); pose != poses.end(); pose++){
+                poses_.insert(std::pair<int,GraphPose>(pose->first, GraphPose(T_this_other * pose->second.T_WA())));
+            }
+        }
+        return !merges.empty();
+    }
+
+    /** Queue a solve on the optimizer thread and return immediately.
+     *  Requests arriving while a solve is running are coalesced into a single follow-up solve. */
+    void requestOptimization(){
+        {
+            std::lock_guard<std::mutex> lock(optimizerMutex_);
+            if(stopOptimizer_)
+                return;
+            loopQueued=true;
+            if(!optimizerThread_.joinable())
+                optimizerThread_ = std::thread(&SimplePoseGraphSolver::optimizerLoop, this);
         }
-        //optimizing=true;
+        optimizerCv_.notify_one();
+    }
+
+    /** Solve the pose graph on the calling thread and publish the result */
+    void optimize(){
+        solveAndPublish();
+    }
+
+    /** The most recently published solution (nullptr until the first solve finishes).
+     *  Safe to call from any thread without blocking on the solver. */
+    OptimizedPoses::ConstPtr getOptimizedPoses() const {
+        return std::atomic_load(&published_);
+    }
+
+    Eigen::Matrix4d getTransformById(int id){
+        std::lock_guard<std::mutex> lock(constraintMutex);
+        return poses_[id].T_WA();
+    }
+
+    std::vector<PoseConstraint> constraints_;
+    std::atomic<bool> loopQueued;
+    std::mutex constraintMutex;
+    std::map<int, GraphPose> poses_;
+
+private:
+    /** Aborts a running solve when the solver is being destroyed */
+    class StopCallback : public ::ceres::IterationCallback {
+    public:
+        explicit StopCallback(const std::atomic<bool>& stop): stop_(stop){}
+        ::ceres::CallbackReturnType operator()(const ::ceres::IterationSummary&) override {
+            return stop_ ? ::ceres::SOLVER_ABORT : ::ceres::SOLVER_CONTINUE;
+        }
+    private:
+        const std::atomic<bool>& stop_;
+    };
+
+    void optimizerLoop(){
+        while(true){
+            {
+                std::unique_lock<std::mutex> lock(optimizerMutex_);
+                optimizerCv_.wait(lock, [this]() { return loopQueued || stopOptimizer_; });
+                if(stopOptimizer_)
+                    return;
+            }
+            solveAndPublish();
+        }
+    }
+
+    /** Solve according to the current mode, write the solution back (warm start for
+     *  the next solve) and publish it as a new version */
+    void solveAndPublish(){
+        std::lock_guard<std::mutex> solveLock(solveMutex_);
+        Instrumentation::ScopedTimer timer(Instrumentation::Stage::PoseGraphOptimization);
         loopQueued=false;
-        ::ceres::Problem problem;
-        ::ceres::LossFunction* lossFunction = NULL;
+        applyRequestedOptions();
+        // merged graphs add poses all over the graph, not just around the newest constraints
+        if(joinMerged())
+            globalPassQueued_ = true;
+
+        std::map<int, GraphPose> poses;
+        bool solved;
+        if(mode_ == SolveMode::Incremental){
+            solved = solveIncremental();
+            if(solved)
+                poses = solverPoses_;
+        }else{
+            // snapshot the graph and solve the copy without holding constraintMutex
+            std::vector<PoseConstraint> constraints;
+            constraintMutex.lock();
+            constraints = constraints_;
+            poses = poses_;
+            constraintMutex.unlock();
+            solved = !poses.empty() && solve(constraints, poses);
+        }
+
+        if(!solved)
+            return;
+
+        // marginalizePoses may have removed poses while the solve ran: those are neither
+        // written back nor published
+        constraintMutex.lock();
+        for(std::map<int, GraphPose>::iterator pose = poses.begin(); pose != poses.end();){
+            std::map<int, GraphPose>::iterator current = poses_.find(pose->first);
+            if(current == poses_.end()){
+                pose = poses.erase(pose);
+                continue;
+            }
+            current->second = pose->second;
+            pose++;
+        }
+        constraintMutex.unlock();
+
+        std::shared_ptr<OptimizedPoses> result = std::make_shared<OptimizedPoses>();
+        result->version = ++solveCount_;
+        result->poses.swap(poses);
+        std::atomic_store(&published_, OptimizedPoses::ConstPtr(result));
+    }
+
+    /** Take over the mode and options set since the last solve (called under solveMutex_, so the
+     *  loss function and the incremental problem are not replaced while a solve uses them) */
+    void applyRequestedOptions(){
+        std::lock_guard<std::mutex> optionsLock(optionsMutex_);
+        if(globalPassRequested_){
+            globalPassQueued_ = true;
+            globalPassRequested_ = false;
+        }
+        if(!optionsChanged_)
+            return;
+        optionsChanged_ = false;
+        resetIncremental();
+        mode_ = requestedMode_;
+        incrementalOptions_ = requestedIncrementalOptions_;
+        solverOptions_ = requestedSolverOptions_;
+        switch(solverOptions_.loss){
+        case Loss::Huber:
+            lossFunction_.reset(new ::ceres::HuberLoss(solverOptions_.lossScale));
+            break;
+        case Loss::Cauchy:
+            lossFunction_.reset(new ::ceres::CauchyLoss(solverOptions_.lossScale));
+            break;
+        default:
+            lossFunction_.reset();
+        }
+    }
+
+    void resetIncremental(){
+        incrementalProblem_.reset();
+        solverPoses_.clear();
+        solverConstraints_.clear();
+        costFunctions_.clear();
+        poseConstraints_.clear();
+        pendingConstraints_.clear();
+        syncedConstraints_ = 0;
+        localSolves_ = 0;
+        globalPassQueued_ = true;
+        anchored_ = false;
+    }
+
+    /** Adds the poses and constraints created since the last incremental solve to the
+     *  persistent problem. Returns the ids touched by the new constraints. */
+    std::vector<int> syncIncremental(){
+        constraintMutex.lock();
+        const bool topologyChanged = topologyChanged_;
+        topologyChanged_ = false;
+        constraintMutex.unlock();
+        if(topologyChanged)
+            resetIncremental();
+
+        if(incrementalProblem_ == nullptr){
+            ::ceres::Problem::Options problemOptions;
+            problemOptions.local_parameterization_ownership = ::ceres::DO_NOT_TAKE_OWNERSHIP;
+            problemOptions.loss_function_ownership = ::ceres::DO_NOT_TAKE_OWNERSHIP;
+            incrementalProblem_.reset(new ::ceres::Problem(problemOptions));
+            if(quaternionParameterization_ == nullptr)
+                quaternionParameterization_.reset(new ::ceres::EigenQuaternionParameterization);
+        }
+
+        constraintMutex.lock();
+        // poses are only ever inserted, so a size mismatch means there is something new
+        if(poses_.size() != solverPoses_.size()){
+            for(std::map<int, GraphPose>::iterator pose = poses_.begin(); pose != poses_.end(); pose++){
+                solverPoses_.insert(*pose);
+            }
+        }
+        for(; syncedConstraints_ < constraints_.size(); syncedConstraints_++){
+            pendingConstraints_.push_back(constraints_[syncedConstraints_]);
+        }
+        constraintMutex.unlock();
+
+        std::vector<int> touched;
+        // constraints whose poses do not exist yet stay pending until they do
+        std::deque<PoseConstraint> waiting;
+        for(size_t i=0; i<pendingConstraints_.size(); i++){
+            const PoseConstraint& constraint = pendingConstraints_[i];
+            std::map<int, GraphPose>::iterator pose_A = solverPoses_.find(constraint.id_A);
+            std::map<int, GraphPose>::iterator pose_B = solverPoses_.find(constraint.id_B);
+            if(pose_A == solverPoses_.end() || pose_B == solverPoses_.end()){
+                waiting.push_back(constraint);
+                continue;
+            }
+
+            ::ceres::CostFunction* costFunction = createCostFunction(constraint);
+            addResidual(*incrementalProblem_, costFunction, pose_A->second, pose_B->second);
+
+            const size_t index = solverConstraints_.size();
+            solverConstraints_.push_back(constraint);
+            costFunctions_.push_back(costFunction);
+            poseConstraints_[constraint.id_A].push_back(index);
+            poseConstraints_[constraint.id_B].push_back(index);
+            touched.push_back(constraint.id_A);
+            touched.push_back(constraint.id_B);
+        }
+        pendingConstraints_.swap(waiting);
+        Instrumentation::recordQueueDepth(Instrumentation::Queue::PendingConstraints, pendingConstraints_.size());
+
+        //Set start pose as known
+        if(!anchored_){
+            for(std::map<int, GraphPose>::iterator pose = solverPoses_.begin(); pose != solverPoses_.end(); pose++){
+                if(incrementalProblem_->HasParameterBlock(pose->second.P_WA.data())){
+                    anchorId_ = pose->first;
+                    incrementalProblem_->SetParameterBlockConstant(pose->second.P_WA.data());
+                    incrementalProblem_->SetParameterBlockConstant(pose->second.Q_WA.coeffs().data());
+                    anchored_ = true;
+                    break;
+                }
+            }
+        }
+        return touched;
+    }
+
+    bool solveIncremental(){
+        std::vector<int> touched = syncIncremental();
+        if(!anchored_ || incrementalProblem_->NumResidualBlocks() == 0)
+            return false;
+
+        const bool global = globalPassQueued_ || touched.empty() ||
+            (incrementalOptions_.globalEvery > 0 && localSolves_ >= incrementalOptions_.globalEvery);
+        if(global){
+            localSolves_ = 0;
+            globalPassQueued_ = false;
+            return runSolver(*incrementalProblem_, solverOptions_.maxIterations);
+        }
+        localSolves_++;
+
+        // breadth-first search from the new constraints, bounded by neighborhoodHops
+        std::unordered_map<int, int> depth;
+        std::deque<int> frontier;
+        for(size_t i=0; i<touched.size(); i++){
+            if(depth.insert(std::make_pair(touched[i], 0)).second)
+                frontier.push_back(touched[i]);
+        }
+        while(!frontier.empty()){
+            const int id = frontier.front();
+            frontier.pop_front();
+            const int d = depth[id];
+            if(d >= incrementalOptions_.neighborhoodHops)
+                continue;
+            const std::vector<size_t>& incident = poseConstraints_[id];
+            for(size_t i=0; i<incident.size(); i++){
+                const PoseConstraint& constraint = solverConstraints_[incident[i]];
+                const int other = constraint.id_A == id ? constraint.id_B : constraint.id_A;
+                if(depth.insert(std::make_pair(other, d+1)).second)
+                    frontier.push_back(other);
+            }
+        }
+
+        // local problem over the neighborhood, sharing the parameter memory and cost
+        // functions of the persistent problem; poses just outside it are held constant
+        ::ceres::Problem::Options problemOptions;
+        problemOptions.local_parameterization_ownership = ::ceres::DO_NOT_TAKE_OWNERSHIP;
+        problemOptions.cost_function_ownership = ::ceres::DO_NOT_TAKE_OWNERSHIP;
+        problemOptions.loss_function_ownership = ::ceres::DO_NOT_TAKE_OWNERSHIP;
+        ::ceres::Problem local(problemOptions);
+        std::unordered_set<size_t> added;
+        for(std::unordered_map<int, int>::iterator active = depth.begin(); active != depth.end(); active++){
+            const std::vector<size_t>& incident = poseConstraints_[active->first];
+            for(size_t i=0; i<incident.size(); i++){
+                if(!added.insert(incident[i]).second)
+                    continue;
+                const PoseConstraint& constraint = solverConstraints_[incident[i]];
+                addResidual(local, costFunctions_[incident[i]],
+                        solverPoses_[constraint.id_A], solverPoses_[constraint.id_B]);
+            }
+        }
+        for(std::unordered_set<size_t>::iterator index = added.begin(); index != added.end(); index++){
+            const PoseConstraint& constraint = solverConstraints_[*index];
+            const int ids[2] = { constraint.id_A, constraint.id_B };
+            for(int k=0; k<2; k++){
+                if(depth.count(ids[k]) && ids[k] != anchorId_)
+                    continue;
+                GraphPose& pose = solverPoses_[ids[k]];
+                local.SetParameterBlockConstant(pose.P_WA.data());
+                local.SetParameterBlockConstant(pose.Q_WA.coeffs().data());
+            }
+        }
+        return runSolver(local, incrementalOptions_.maxIterations);
+    }
+
+    void addResidual(::ceres::Problem& problem, ::ceres::CostFunction* costFunction,
+            GraphPose& pose_A, GraphPose& pose_B){
+        const bool newA = !problem.HasParameterBlock(pose_A.Q_WA.coeffs().data());
+        const bool newB = !problem.HasParameterBlock(pose_B.Q_WA.coeffs().data());
+        problem.AddResidualBlock(costFunction, lossFunction_.get(),
+                pose_A.P_WA.data(), pose_A.Q_WA.coeffs().data(),
+                pose_B.P_WA.data(), pose_B.Q_WA.coeffs().data());
+        //Ensure proper quaternion parameterization
+        if(newA)
+            problem.SetParameterization(pose_A.Q_WA.coeffs().data(), quaternionParameterization_.get());
+        if(newB && &pose_A != &pose_B)
+            problem.SetParameterization(pose_B.Q_WA.coeffs().data(), quaternionParameterization_.get());
+    }
+
+    ::ceres::CostFunction* createCostFunction(const PoseConstraint& constraint) const {
+        if(solverOptions_.analyticJacobians)
+            return AnalyticPoseError::Create(constraint);
+        return PoseError::Create(constraint);
+    }
+
+    bool runSolver(::ceres::Problem& problem, int maxIterations){
+        StopCallback stopCallback(stopOptimizer_);
+        ::ceres::Solver::Options options;
+        options.max_num_iterations = maxIterations;
+        options.linear_solver_type = solverOptions_.linearSolver;
+        options.trust_region_strategy_type = solverOptions_.trustRegion;
+        options.sparse_linear_algebra_library_type = solverOptions_.sparseLibrary;
+        options.num_threads = solverOptions_.numThreads;
+        if(solverOptions_.maxSolverTimeSeconds > 0.0)
+            options.max_solver_time_in_seconds = solverOptions_.maxSolverTimeSeconds;
+        options.callbacks.push_back(&stopCallback);
+
+        ::ceres::Solver::Summary summary;
+        ::ceres::Solve(options, &problem, &summary);
+        return summary.termination_type != ::ceres::USER_FAILURE;
+    }
+
+    bool solve(const std::vector<PoseConstraint>& constraints, std::map<int, GraphPose>& poses){
+        ::ceres::Problem::Options problemOptions;
+        problemOptions.loss_function_ownership = ::ceres::DO_NOT_TAKE_OWNERSHIP;
+        ::ceres::Problem problem(problemOptions);
+        ::ceres::LossFunction* lossFunction = lossFunction_.get();
         ::ceres::LocalParameterization* quaternion_local_parameterization =
             new ::ceres::EigenQuaternionParameterization;
         //add constraints from all keyframes
-        constraintMutex.lock();
-        for(size_t i=0; i<constraints_.size(); i++){
-            ::ceres::CostFunction* costFunction =
-                PoseError::Create(constraints_[i]);
-
+        for(size_t i=0; i<constraints.size(); i++){
             //Get Poses
-            std::map<int, GraphPose>::iterator pose_A = poses_.find(constraints_[i].id_A);
-            std::map<int, GraphPose>::iterator pose_B = poses_.find(constraints_[i].id_B);
+            std::map<int, GraphPose>::iterator pose_A = poses.find(constraints[i].id_A);
+            std::map<int, GraphPose>::iterator pose_B = poses.find(constraints[i].id_B);
+            if(pose_A == poses.end() || pose_B == poses.end())
+                continue;
+
+            ::ceres::CostFunction* costFunction = createCostFunction(constraints[i]);
 
             //Add residuals
             problem.AddResidualBlock(costFunction, lossFunction,
@@ -199,54 +838,72 @@ public:
                     quaternion_local_parameterization);
         }
 
+        if(problem.NumResidualBlocks() == 0){
+            delete quaternion_local_parameterization;
+            return false;
+        }
+
         //Set start pose as known
-        std::map<int, GraphPose>::iterator poseStart = poses_.begin();
+        std::map<int, GraphPose>::iterator poseStart = poses.begin();
+        while(!problem.HasParameterBlock(poseStart->second.P_WA.data()))
+            poseStart++;
         problem.SetParameterBlockConstant(poseStart->second.P_WA.data());
         problem.SetParameterBlockConstant(poseStart->second.Q_WA.coeffs().data());
 
-        ::ceres::Solver::Options options;
-        options.max_num_iterations = 10;
-        //options.linear_solver_type = ::ceres::SPARSE_NORMAL_CHOLESKY;
-        options.linear_solver_type = ::ceres::SPARSE_SCHUR;
-        options.trust_region_strategy_type = ::ceres::DOGLEG;
-        options.num_threads = 2;
-
-        ::ceres::Solver::Summary summary;
-        ::ceres::Solve(options, &problem, &summary);
-        constraintMutex.unlock();
-
-        //std::cout << summary.FullReport() << '\n';
-
-
-    }
-
-    Eigen::Matrix4d getTransformById(int id){
-        //Eigen::Affine3d outT = poses_[id].Q_WA*Eigen::Translation3d(poses_[id].P_WA);
-        //return outT.matrix();
-        Eigen::Matrix4d outMat = Eigen::Matrix4d::Identity();
-        outMat.block<3,1>(0,3)=poses_[id].P_WA;
-        outMat.block<3,3>(0,0)=poses_[id].Q_WA.toRotationMatrix();
-        return outMat;
+        return runSolver(problem, solverOptions_.maxIterations);
     }
 
-    std::vector<PoseConstraint> constraints_;
-    std::atomic<bool> optimizing;
-    std::atomic<bool> loopQueued;
-    std::mutex constraintMutex;
-    std::map<int, GraphPose> poses_;
-
-
-    //re-build optimization problem
-    //solve optimization problem
-    //optimization loop
-    //notify when done
-    //map pointer
-    //updatemap
-        //recursively update remiander of map
-
-
-
-    
+    struct PendingMerge {
+        PendingMerge(SimplePoseGraphSolver* graph, const Eigen::Matrix4d& T_this_other):
+            graph(graph), T_this_other(T_this_other){}
+        SimplePoseGraphSolver* graph;
+        Eigen::Matrix<double, 4, 4, Eigen::DontAlign> T_this_other;
+    };
+    /** graphs absorbed by merge() and not joined yet (guarded by constraintMutex) */
+    std::vector<PendingMerge> pendingMerges_;
+    /** set by marginalizePoses, which removes constraints (guarded by constraintMutex) */
+    bool topologyChanged_;
+
+    std::thread optimizerThread_;
+    std::mutex optimizerMutex_;
+    std::condition_variable optimizerCv_;
+    std::atomic<bool> stopOptimizer_;
+    /** Serializes solves between optimize() and the optimizer thread */
+    std::mutex solveMutex_;
+    size_t solveCount_;
+    OptimizedPoses::ConstPtr published_;
+
+    /** Configuration set by the public setters, guarded by optionsMutex_ (held only briefly, never
+     *  during a solve). Each solve copies it into the members below at its start. */
+    std::mutex optionsMutex_;
+    SolveMode requestedMode_;
+    IncrementalOptions requestedIncrementalOptions_;
+    SolverOptions requestedSolverOptions_;
+    bool optionsChanged_;
+    bool globalPassRequested_;
+
+    /** Configuration of the current solve, guarded by solveMutex_ */
+    SolveMode mode_;
+    IncrementalOptions incrementalOptions_;
+    SolverOptions solverOptions_;
+    /** shared by every residual; problems do not take ownership */
+    std::unique_ptr<::ceres::LossFunction> lossFunction_;
+    /** Incremental mode: the persistent problem and the pose memory its parameter blocks point into */
+    std::unique_ptr<::ceres::LocalParameterization> quaternionParameterization_;
+    std::unique_ptr<::ceres::Problem> incrementalProblem_;
+    std::map<int, GraphPose> solverPoses_;
+    std::vector<PoseConstraint> solverConstraints_;
+    /** cost function of each constraint in solverConstraints_, owned by incrementalProblem_ */
+    std::vector<::ceres::CostFunction*> costFunctions_;
+    /** indices into solverConstraints_ of the constraints attached to each pose */
+    std::unordered_map<int, std::vector<size_t>> poseConstraints_;
+    std::deque<PoseConstraint> pendingConstraints_;
+    size_t syncedConstraints_;
+    int localSolves_;
+    /** set after a reset so the first incremental solve covers the whole graph */
+    bool globalPassQueued_;
+    bool anchored_;
+    int anchorId_;
 
 };//PoseGraphSolver
 
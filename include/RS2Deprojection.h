@@ -0,0 +1,68 @@
+#pragma once
+
+#include <vector>
+#include <cstring>
+#include <opencv2/core.hpp>
+#include <librealsense2/rsutil.h>
+#include "Types.h"
+
+namespace ark {
+    namespace rs2util {
+        /** Deproject a whole depth image (CV_16UC1, depth units) into an XYZ map (CV_32FC3, meters) */
+        inline void deprojectDepth(const cv::Mat & depth, const rs2_intrinsics & intrin, double scale, cv::Mat & xyz_map) {
+            xyz_map.create(depth.size(), CV_32FC3);
+            float srcPixel[2], destXYZ[3];
+            for (int r = 0; r < depth.rows; ++r)
+            {
+                const uint16_t * srcPtr = depth.ptr<uint16_t>(r);
+                cv::Vec3f * destPtr = xyz_map.ptr<cv::Vec3f>(r);
+                srcPixel[1] = r;
+
+                for (int c = 0; c < depth.cols; ++c)
+                {
+                    if (srcPtr[c] == 0) {
+                        destPtr[c] = cv::Vec3f(0, 0, 0);
+                        continue;
+                    }
+                    srcPixel[0] = c;
+                    rs2_deproject_pixel_to_point(destXYZ, &intrin, srcPixel, srcPtr[c]);
+                    destPtr[c] = cv::Vec3f(destXYZ[0], destXYZ[1], destXYZ[2]) * (float)scale;
+                }
+            }
+        }
+
+        /** Deproject only the given pixels (nearest integer pixel, same result as the XYZ map) */
+        inline void deprojectPixels(const cv::Mat & depth, const rs2_intrinsics & intrin, double scale,
+                const std::vector<cv::Point2f> & pixels, std::vector<cv::Vec3f> & out) {
+            out.resize(pixels.size());
+            float srcPixel[2], destXYZ[3];
+            for (size_t i = 0; i < pixels.size(); ++i) {
+                const int r = (int)std::round(pixels[i].y), c = (int)std::round(pixels[i].x);
+                if (r < 0 || r >= depth.rows || c < 0 || c >= depth.cols || depth.at<uint16_t>(r, c) == 0) {
+                    out[i] = cv::Vec3f(0, 0, 0);
+                    continue;
+                }
+                srcPixel[0] = c;
+                srcPixel[1] = r;
+                rs2_deproject_pixel_to_point(destXYZ, &intrin, srcPixel, depth.at<uint16_t>(r, c));
+                out[i] = cv::Vec3f(destXYZ[0], destXYZ[1], destXYZ[2]) * (float)scale;
+            }
+        }
+
+        /**
+         * Make images_[xyzIndex] of the frame a lazily built XYZ map of the depth image, and
+         * install a sparse deprojector working on the same depth image.
+         * The depth image must not be modified afterwards.
+         */
+        inline void attachLazyXYZMap(MultiCameraFrame & frame, size_t xyzIndex, const cv::Mat & depth,
+                const rs2_intrinsics & intrin, double scale) {
+            frame.setLazyImage(xyzIndex, [depth, intrin, scale](cv::Mat & xyz_map) {
+                deprojectDepth(depth, intrin, scale, xyz_map);
+            });
+            frame.setDeprojector([depth, intrin, scale](const std::vector<cv::Point2f> & pixels,
+                    std::vector<cv::Vec3f> & out) {
+                deprojectPixels(depth, intrin, scale, pixels, out);
+            });
+        }
+    }
+}
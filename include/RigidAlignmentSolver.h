@@ -0,0 +1,175 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+#include <Eigen/SVD>
+#include <Eigen/Cholesky>
+#include "pcl/point_cloud.h"
+
+namespace ark{
+
+/**
+ * Rigid transform between two point clouds from 3D-3D correspondences, src -> tgt.
+ *
+ * Seeds from the closed form least squares solution (Umeyama, without scale) over the inliers,
+ * then refines with Gauss-Newton on SE(3) using analytic Jacobians, reweighting the residuals
+ * (IRLS) when a robust loss is selected. Without a robust loss the closed form solution is
+ * already optimal and the refinement stops after one step.
+ */
+template <typename PointT>
+class RigidAlignmentSolver{
+    using CloudPtr = typename pcl::PointCloud<PointT>::Ptr;
+public:
+    enum class Loss { Squared, Huber, Cauchy };
+
+    struct Params {
+        Params(Loss loss = Loss::Squared, double lossScale = 0.05, int maxIterations = 20, double tolerance = 1e-10) :
+            loss(loss), lossScale(lossScale), maxIterations(maxIterations), tolerance(tolerance) {}
+        Loss loss;
+        /** residual norm (m) where the robust loss starts to down-weight */
+        double lossScale;
+        int maxIterations;
+        /** stop once the squared norm of the update falls below this */
+        double tolerance;
+    };
+
+    /**
+     * Same interface as PointCostSolver::solve: align the inlier correspondences
+     * (src point i with tgt point correspondences[i]). The initial estimate is returned
+     * when there are fewer than 3 inliers.
+     */
+    static Eigen::Affine3d solve(
+            const CloudPtr src,
+            const CloudPtr tgt,
+            const std::vector<int>& correspondences,
+            const std::vector<bool>& inliers,
+            Eigen::Affine3d initial_pose_estimate,
+            int max_num_iterations = 20){
+        Params params;
+        params.maxIterations = max_num_iterations;
+        return solve(src, tgt, correspondences, inliers, initial_pose_estimate, params);
+    }
+
+    static Eigen::Affine3d solve(
+            const CloudPtr src,
+            const CloudPtr tgt,
+            const std::vector<int>& correspondences,
+            const std::vector<bool>& inliers,
+            const Eigen::Affine3d& initial_pose_estimate,
+            const Params& params){
+        Eigen::Matrix3Xd p, q;
+        gatherInliers(src, tgt, correspondences, inliers, p, q);
+        if(p.cols()<3)
+            return initial_pose_estimate;
+
+        Eigen::Matrix3d R;
+        Eigen::Vector3d t;
+        umeyama(p, q, Eigen::VectorXd::Ones(p.cols()), R, t);
+        refine(p, q, params, R, t);
+
+        Eigen::Affine3d out = Eigen::Affine3d::Identity();
+        out.linear() = R;
+        out.translation() = t;
+        return out;
+    }
+
+    /**
+     * Weighted closed form alignment minimizing sum w_i |q_i - (R p_i + t)|^2
+     * (Umeyama 1991, without scale; the reflection case is corrected).
+     */
+    static void umeyama(const Eigen::Matrix3Xd& p, const Eigen::Matrix3Xd& q, const Eigen::VectorXd& w,
+            Eigen::Matrix3d& R, Eigen::Vector3d& t){
+        const double totalWeight = w.sum();
+        const Eigen::Vector3d p_mu = p * w / totalWeight;
+        const Eigen::Vector3d q_mu = q * w / totalWeight;
+        const Eigen::Matrix3d sigma = (q.colwise() - q_mu) * w.asDiagonal() * (p.colwise() - p_mu).transpose();
+        Eigen::JacobiSVD<Eigen::Matrix3d> svd(sigma, Eigen::ComputeFullU | Eigen::ComputeFullV);
+        Eigen::Matrix3d S = Eigen::Matrix3d::Identity();
+        if(svd.matrixU().determinant()*svd.matrixV().determinant()<0)
+            S(2,2) = -1;
+        R = svd.matrixU() * S * svd.matrixV().transpose();
+        t = q_mu - R * p_mu;
+    }
+
+private:
+
+    static void gatherInliers(const CloudPtr& src, const CloudPtr& tgt, const std::vector<int>& correspondences,
+            const std::vector<bool>& inliers, Eigen::Matrix3Xd& p, Eigen::Matrix3Xd& q){
+        int n = 0;
+        for(size_t i = 0; i<src->size() && i<correspondences.size() && i<inliers.size(); i++){
+            if(inliers[i] && correspondences[i]>=0)
+                n++;
+        }
+        p.resize(3, n);
+        q.resize(3, n);
+        int k = 0;
+        for(size_t i = 0; k<n; i++){
+            if(!inliers[i] || correspondences[i]<0)
+                continue;
+            const PointT& s = src->points[i];
+            const PointT& d = tgt->points[correspondences[i]];
+            p.col(k) << s.x, s.y, s.z;
+            q.col(k) << d.x, d.y, d.z;
+            k++;
+        }
+    }
+
+    /** IRLS weight of a residual of the given norm */
+    static double weight(const Params& params, double norm){
+        switch(params.loss){
+        case Loss::Huber:
+            return norm <= params.lossScale ? 1.0 : params.lossScale / norm;
+        case Loss::Cauchy:
+            return 1.0 / (1.0 + (norm / params.lossScale) * (norm / params.lossScale));
+        default:
+            return 1.0;
+        }
+    }
+
+    /**
+     * Gauss-Newton on r_i = q_i - (R p_i + t) with a left perturbation T <- exp(xi) T, xi = (omega, v):
+     * with y_i = R p_i + t, dr_i/dxi = [ [y_i]x  -I ].
+     */
+    static void refine(const Eigen::Matrix3Xd& p, const Eigen::Matrix3Xd& q, const Params& params,
+            Eigen::Matrix3d& R, Eigen::Vector3d& t){
+        for(int iteration = 0; iteration<params.maxIterations; iteration++){
+            Eigen::Matrix<double,6,6> H = Eigen::Matrix<double,6,6>::Zero();
+            Eigen::Matrix<double,6,1> g = Eigen::Matrix<double,6,1>::Zero();
+            for(int i = 0; i<p.cols(); i++){
+                const Eigen::Vector3d y = R * p.col(i) + t;
+                const Eigen::Vector3d r = q.col(i) - y;
+                const double w = weight(params, r.norm());
+                Eigen::Matrix3d y_x;
+                y_x <<    0.0, -y.z(),  y.y(),
+                        y.z(),    0.0, -y.x(),
+                       -y.y(),  y.x(),    0.0;
+                // J = [y_x, -I]: accumulate J^T W J and J^T W r blockwise
+                H.template block<3,3>(0,0) += w * y_x.transpose() * y_x;
+                H.template block<3,3>(0,3) -= w * y_x.transpose();
+                H.template block<3,3>(3,3) += w * Eigen::Matrix3d::Identity();
+                g.template head<3>() += w * y_x.transpose() * r;
+                g.template tail<3>() -= w * r;
+            }
+            H.template block<3,3>(3,0) = H.template block<3,3>(0,3).transpose();
+            const Eigen::Matrix<double,6,1> xi = H.ldlt().solve(-g);
+            if(!xi.allFinite())
+                break;
+            const double angle = xi.template head<3>().norm();
+            const Eigen::Matrix3d dR = angle > 0 ?
+                Eigen::AngleAxisd(angle, xi.template head<3>() / angle).toRotationMatrix() : Eigen::Matrix3d::Identity();
+            R = dR * R;
+            t = dR * t + xi.template tail<3>();
+            if(xi.squaredNorm()<params.tolerance)
+                break;
+        }
+        // re-orthonormalize after the incremental updates
+        R = Eigen::Quaterniond(R).normalized().toRotationMatrix();
+    }
+
+    RigidAlignmentSolver(){}
+};
+
+
+}//namespace ark
@@ -6,8 +6,11 @@
 #include <functional>
 #include <iostream>
 #include <unordered_map>
+#include <map>
+#include <memory>
 #include <opencv2/opencv.hpp>
 #include "Types.h"
+#include "HandlerDispatcher.h"
 
 
 namespace ark {
@@ -44,6 +47,14 @@ namespace ark {
         /** Add a handler that will be called each time a KEYframe becomes available. */
         virtual void AddKeyFrameAvailableHandler(KeyFrameAvailableHandler handler, std::string handlerName) {
             mMapKeyFrameAvailableHandler[handlerName] = handler;
+            removeHandlerWorker("KeyFrameAvailable", handlerName);
+        }
+
+        /** Add a keyframe available handler that runs on its own worker thread according to the given dispatch policy.
+         *  @param queueSize maximum number of pending events (ignored for LatestOnly) */
+        virtual void AddKeyFrameAvailableHandler(KeyFrameAvailableHandler handler, std::string handlerName,
+                DispatchPolicy policy, size_t queueSize = kDefaultHandlerQueueSize) {
+            mMapKeyFrameAvailableHandler[handlerName] = makeDispatched<MultiCameraFrame::Ptr>("KeyFrameAvailable", handler, handlerName, policy, queueSize);
         }
 
         /** Remove a keyframe available handler with the specified name. */
@@ -51,11 +62,20 @@ namespace ark {
             auto handler = mMapKeyFrameAvailableHandler.find(handlerName);
             if (handler != mMapKeyFrameAvailableHandler.end())
                 mMapKeyFrameAvailableHandler.erase(handler);
+            removeHandlerWorker("KeyFrameAvailable", handlerName);
         }
 
         /** Add a handler that will be called each time a frame becomes available. */
         virtual void AddFrameAvailableHandler(FrameAvailableHandler handler, std::string handlerName) {
             mMapFrameAvailableHandler[handlerName] = handler;
+            removeHandlerWorker("FrameAvailable", handlerName);
+        }
+
+        /** Add a frame available handler that runs on its own worker thread according to the given dispatch policy.
+         *  @param queueSize maximum number of pending events (ignored for LatestOnly) */
+        virtual void AddFrameAvailableHandler(FrameAvailableHandler handler, std::string handlerName,
+                DispatchPolicy policy, size_t queueSize = kDefaultHandlerQueueSize) {
+            mMapFrameAvailableHandler[handlerName] = makeDispatched<MultiCameraFrame::Ptr>("FrameAvailable", handler, handlerName, policy, queueSize);
         }
 
         /** Remove a frame available handler with the specified name. */
@@ -63,11 +83,20 @@ namespace ark {
             auto handler = mMapFrameAvailableHandler.find(handlerName);
             if (handler != mMapFrameAvailableHandler.end())
                 mMapFrameAvailableHandler.erase(handler);
+            removeHandlerWorker("FrameAvailable", handlerName);
         }
 
         /** Add a handler that will be called each time a loop closure occurs. */
         virtual void AddLoopClosureDetectedHandler(LoopClosureDetectedHandler handler, std::string handlerName) {
             mMapLoopClosureHandler[handlerName] = handler;
+            removeHandlerWorker("LoopClosureDetected", handlerName);
+        }
+
+        /** Add a loop closure handler that runs on its own worker thread according to the given dispatch policy.
+         *  @param queueSize maximum number of pending events (ignored for LatestOnly) */
+        virtual void AddLoopClosureDetectedHandler(LoopClosureDetectedHandler handler, std::string handlerName,
+                DispatchPolicy policy, size_t queueSize = kDefaultHandlerQueueSize) {
+            mMapLoopClosureHandler[handlerName] = makeDispatched<>("LoopClosureDetected", handler, handlerName, policy, queueSize);
         }
 
         /** Remove a loop closure handler with the specified name. */
@@ -75,11 +104,20 @@ namespace ark {
             auto handler = mMapLoopClosureHandler.find(handlerName);
             if (handler != mMapLoopClosureHandler.end())
                 mMapLoopClosureHandler.erase(handler);
+            removeHandlerWorker("LoopClosureDetected", handlerName);
         }
 
         /** Add a handler that will be called each time two sparse maps are merged. */
         virtual void AddSparseMapMergeHandler(SparseMapMergeHandler handler, std::string handlerName) {
              mMapSparseMapMergeHandler[handlerName] = handler;
+            removeHandlerWorker("SparseMapMerge", handlerName);
+        }
+
+        /** Add a sparse map merge handler that runs on its own worker thread according to the given dispatch policy.
+         *  @param queueSize maximum number of pending events (ignored for LatestOnly) */
+        virtual void AddSparseMapMergeHandler(SparseMapMergeHandler handler, std::string handlerName,
+                DispatchPolicy policy, size_t queueSize = kDefaultHandlerQueueSize) {
+             mMapSparseMapMergeHandler[handlerName] = makeDispatched<int, int>("SparseMapMerge", handler, handlerName, policy, queueSize);
         }
 
         /** Remove a sparse map merge handler with the specified name. */
@@ -87,11 +125,20 @@ namespace ark {
             auto handler =  mMapSparseMapMergeHandler.find(handlerName);
             if (handler !=  mMapSparseMapMergeHandler.end())
                  mMapSparseMapMergeHandler.erase(handler);
+            removeHandlerWorker("SparseMapMerge", handlerName);
         }
 
         /** Add a handler that will be called each time a sparse map is created. */
         virtual void AddSparseMapCreationHandler(SparseMapCreationHandler handler, std::string handlerName) {
              mMapSparseMapCreationHandler[handlerName] = handler;
+            removeHandlerWorker("SparseMapCreation", handlerName);
+        }
+
+        /** Add a sparse map creation handler that runs on its own worker thread according to the given dispatch policy.
+         *  @param queueSize maximum number of pending events (ignored for LatestOnly) */
+        virtual void AddSparseMapCreationHandler(SparseMapCreationHandler handler, std::string handlerName,
+                DispatchPolicy policy, size_t queueSize = kDefaultHandlerQueueSize) {
+             mMapSparseMapCreationHandler[handlerName] = makeDispatched<int>("SparseMapCreation", handler, handlerName, policy, queueSize);
         }
 
         /** Remove a sparse map creation handler with the specified name. */
@@ -99,16 +146,50 @@ namespace ark {
             auto handler =  mMapSparseMapCreationHandler.find(handlerName);
             if (handler !=  mMapSparseMapCreationHandler.end())
                  mMapSparseMapCreationHandler.erase(handler);
+            removeHandlerWorker("SparseMapCreation", handlerName);
+        }
+
+        /** Delivery statistics of all handlers running on their own worker,
+         *  keyed by "<HandlerType>/<handlerName>" (e.g. "KeyFrameAvailable/saveframe") */
+        std::map<std::string, HandlerStats> GetHandlerStats() {
+            std::map<std::string, HandlerStats> out;
+            for (auto& worker : mHandlerWorkers) {
+                out[worker.first] = worker.second->stats();
+            }
+            return out;
         }
 
         /** Destructor for the SLAM system. */
         virtual ~SLAMSystem() = default;
 
     protected:
+        static const size_t kDefaultHandlerQueueSize = 8;
+
+        /** Creates the worker for an asynchronous handler and returns the function
+         *  the SLAM thread calls to post events to it */
+        template<class... Args>
+        std::function<void(Args...)> makeDispatched(const std::string& handlerType,
+                std::function<void(Args...)> handler, const std::string& handlerName,
+                DispatchPolicy policy, size_t queueSize) {
+            removeHandlerWorker(handlerType, handlerName);
+            if (policy == DispatchPolicy::Synchronous) {
+                return handler;
+            }
+            auto worker = std::make_shared<AsyncHandler<Args...>>(handler, policy, queueSize);
+            mHandlerWorkers[handlerType + "/" + handlerName] = worker;
+            return [worker](Args... args) { worker->post(args...); };
+        }
+
+        void removeHandlerWorker(const std::string& handlerType, const std::string& handlerName) {
+            mHandlerWorkers.erase(handlerType + "/" + handlerName);
+        }
+
         MapKeyFrameAvailableHandler mMapKeyFrameAvailableHandler;
         MapFrameAvailableHandler mMapFrameAvailableHandler;
         MapLoopClosureDetectedHandler mMapLoopClosureHandler;
         MapSparseMapCreationHandler mMapSparseMapCreationHandler;
         MapSparseMapMergeHandler mMapSparseMapMergeHandler;
+        /** Workers of the handlers that are not dispatched synchronously */
+        std::map<std::string, std::shared_ptr<HandlerWorker>> mHandlerWorkers;
     };
 }
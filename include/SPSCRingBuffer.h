@@ -0,0 +1,301 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <thread>
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+
+namespace ark {
+
+    /** What a producer does when it pushes into a full ring buffer */
+    enum class OverflowPolicy {
+        /** Evict the oldest queued item to make room (counted in Stats::dropped) */
+        DropOldest,
+        /** Wait until the consumer frees a slot (or the buffer is closed) */
+        Block,
+        /** Refuse the new item (counted in Stats::rejected) */
+        Reject
+    };
+
+    /**
+     * Bounded, lock-free ring buffer for one producer thread and one consumer thread.
+     *
+     * Every item is stored with an integer key (usually a timestamp in nanoseconds).
+     * Keys must be non-decreasing in push order, which lets the consumer jump straight
+     * to the item with a given key (dequeueKey) instead of draining the queue one by one.
+     *
+     * Slots carry sequence numbers (Vyukov style) and removal from the front is done with
+     * a CAS on the tail index. This is what allows the producer to evict the oldest item
+     * under OverflowPolicy::DropOldest, and also makes clear() safe to call from any thread.
+     *
+     * The consumer may block in waitDequeue() and the producer in enqueue() under
+     * OverflowPolicy::Block; each side only touches the mutex when the other one is actually
+     * sleeping, so the fast path never locks.
+     */
+    template<class T>
+    class SPSCRingBuffer {
+    public:
+        typedef int64_t Key;
+
+        /** Occupancy and overflow counters */
+        struct Stats {
+            size_t capacity;
+            size_t size;
+            size_t highWaterMark;
+            size_t pushed;
+            size_t dropped;
+            size_t rejected;
+        };
+
+        /**
+         * @param capacity minimum number of slots (rounded up to a power of two)
+         * @param policy behavior when pushing into a full buffer
+         */
+        explicit SPSCRingBuffer(size_t capacity = 64, OverflowPolicy policy = OverflowPolicy::DropOldest) :
+            policy_(policy), head_(0), tail_(0), closed_(false), consumerWaiting_(false), producerWaiting_(false),
+            highWaterMark_(0), pushed_(0), dropped_(0), rejected_(0) {
+            capacity_ = 1;
+            while (capacity_ < capacity) capacity_ <<= 1;
+            mask_ = capacity_ - 1;
+            cells_.reset(new Cell[capacity_]);
+            for (size_t i = 0; i < capacity_; ++i) {
+                cells_[i].seq.store(i, std::memory_order_relaxed);
+                cells_[i].key.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        SPSCRingBuffer(const SPSCRingBuffer&) = delete;
+        SPSCRingBuffer& operator=(const SPSCRingBuffer&) = delete;
+
+        /**
+         * Push an item (producer thread only).
+         * @return false if the item was rejected or the buffer is closed
+         */
+        bool enqueue(T item, Key key = 0) {
+            const size_t pos = head_.load(std::memory_order_relaxed);
+            Cell& cell = cells_[pos & mask_];
+            while (cell.seq.load(std::memory_order_acquire) != pos) {
+                // buffer is full
+                if (closed_.load(std::memory_order_relaxed)) return false;
+                if (policy_ == OverflowPolicy::Reject) {
+                    rejected_.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                // if the tail already moved the consumer is mid-pop and the slot frees up momentarily
+                if (policy_ == OverflowPolicy::DropOldest &&
+                        pos - tail_.load(std::memory_order_acquire) >= capacity_) {
+                    T evicted;
+                    if (popFront(&evicted, nullptr)) {
+                        dropped_.fetch_add(1, std::memory_order_relaxed);
+                        continue;
+                    }
+                }
+                if (policy_ == OverflowPolicy::Block) {
+                    std::unique_lock<std::mutex> lock(waitMutex_);
+                    producerWaiting_.store(true, std::memory_order_seq_cst);
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    spaceCv_.wait(lock, [this, &cell, pos]() {
+                        return cell.seq.load(std::memory_order_acquire) == pos || closed_.load(std::memory_order_relaxed);
+                    });
+                    producerWaiting_.store(false, std::memory_order_relaxed);
+                    continue;
+                }
+                std::this_thread::yield();
+            }
+
+            cell.item = std::move(item);
+            cell.key.store(key, std::memory_order_relaxed);
+            cell.seq.store(pos + 1, std::memory_order_release);
+            head_.store(pos + 1, std::memory_order_seq_cst);
+            pushed_.fetch_add(1, std::memory_order_relaxed);
+
+            const size_t occupancy = pos + 1 - tail_.load(std::memory_order_relaxed);
+            if (occupancy > highWaterMark_.load(std::memory_order_relaxed))
+                highWaterMark_.store(occupancy, std::memory_order_relaxed);
+
+            if (consumerWaiting_.load(std::memory_order_seq_cst)) {
+                std::lock_guard<std::mutex> lock(waitMutex_);
+                waitCv_.notify_one();
+            }
+            return true;
+        }
+
+        /** Pop the oldest item without blocking. */
+        bool tryDequeue(T* item, Key* key = nullptr) {
+            return popFront(item, key);
+        }
+
+        /**
+         * Pop the oldest item, blocking until one is available, close() is called
+         * or the timeout expires.
+         */
+        template<class Rep, class Period>
+        bool waitDequeue(T* item, const std::chrono::duration<Rep, Period>& timeout, Key* key = nullptr) {
+            if (popFront(item, key)) return true;
+            {
+                std::unique_lock<std::mutex> lock(waitMutex_);
+                consumerWaiting_.store(true, std::memory_order_seq_cst);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                waitCv_.wait_for(lock, timeout, [this]() {
+                    return !empty() || closed_.load(std::memory_order_relaxed);
+                });
+                consumerWaiting_.store(false, std::memory_order_relaxed);
+            }
+            return popFront(item, key);
+        }
+
+        /**
+         * Look up the item whose key matches (within tolerance) and pop it, discarding
+         * every older item in front of it. Items newer than the key are left in place.
+         * The position is found by binary search over the queued keys.
+         * @return false if no queued item matches
+         */
+        bool dequeueKey(Key key, Key tolerance, T* item) {
+            const Key lowest = key - tolerance;
+            size_t tail = tail_.load(std::memory_order_acquire);
+            const size_t head = head_.load(std::memory_order_acquire);
+            if (head == tail) return false;
+
+            // first slot whose key is >= lowest
+            size_t lo = tail, hi = head;
+            while (lo < hi) {
+                const size_t mid = lo + (hi - lo) / 2;
+                if (cells_[mid & mask_].key.load(std::memory_order_relaxed) < lowest) lo = mid + 1;
+                else hi = mid;
+            }
+
+            // everything before it is stale
+            T stale;
+            while (tail < lo) {
+                if (!popFront(&stale, nullptr)) return false;
+                tail = tail_.load(std::memory_order_acquire);
+            }
+
+            // the producer may evict the front meanwhile, so the key is checked as the slot is
+            // claimed: a newer item stays queued, an older one is discarded like the stale ones
+            while (true) {
+                Key frontKey;
+                if (!popFront(item, &frontKey, key + tolerance)) return false;
+                if (frontKey >= lowest) return true;
+            }
+        }
+
+        /** Key of the oldest queued item */
+        bool peekKey(Key* key) const {
+            const size_t pos = tail_.load(std::memory_order_acquire);
+            const Cell& cell = cells_[pos & mask_];
+            if (cell.seq.load(std::memory_order_acquire) != pos + 1) return false;
+            *key = cell.key.load(std::memory_order_relaxed);
+            return true;
+        }
+
+        /** Discard every queued item */
+        void clear() {
+            T item;
+            while (popFront(&item, nullptr));
+        }
+
+        /** Wake up a blocked consumer or producer and make full-buffer pushes fail instead of blocking */
+        void close() {
+            closed_.store(true);
+            std::lock_guard<std::mutex> lock(waitMutex_);
+            waitCv_.notify_all();
+            spaceCv_.notify_all();
+        }
+
+        bool empty() const {
+            return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+        }
+
+        size_t size() const {
+            const size_t tail = tail_.load(std::memory_order_acquire);
+            const size_t head = head_.load(std::memory_order_acquire);
+            return head >= tail ? head - tail : 0;
+        }
+
+        size_t capacity() const {
+            return capacity_;
+        }
+
+        Stats stats() const {
+            Stats s;
+            s.capacity = capacity_;
+            s.size = size();
+            s.highWaterMark = highWaterMark_.load(std::memory_order_relaxed);
+            s.pushed = pushed_.load(std::memory_order_relaxed);
+            s.dropped = dropped_.load(std::memory_order_relaxed);
+            s.rejected = rejected_.load(std::memory_order_relaxed);
+            return s;
+        }
+
+    private:
+        struct Cell {
+            std::atomic<size_t> seq;
+            std::atomic<Key> key;
+            T item;
+        };
+
+        /**
+         * Claims the front slot with a CAS so the consumer and an evicting producer never collide.
+         * The front item is left in place if its key is above maxKey.
+         */
+        bool popFront(T* item, Key* key, Key maxKey = std::numeric_limits<Key>::max()) {
+            size_t pos = tail_.load(std::memory_order_relaxed);
+            while (true) {
+                Cell& cell = cells_[pos & mask_];
+                const size_t seq = cell.seq.load(std::memory_order_acquire);
+                const ptrdiff_t dif = (ptrdiff_t)seq - (ptrdiff_t)(pos + 1);
+                if (dif == 0) {
+                    // the slot cannot be refilled while tail_ is still pos, so if the CAS
+                    // succeeds this is the key of the item claimed
+                    const Key cellKey = cell.key.load(std::memory_order_relaxed);
+                    if (cellKey > maxKey) return false;
+                    if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_acq_rel)) {
+                        if (key != nullptr) *key = cellKey;
+                        *item = std::move(cell.item);
+                        cell.item = T();
+                        cell.seq.store(pos + capacity_, std::memory_order_release);
+                        if (policy_ == OverflowPolicy::Block) {
+                            std::atomic_thread_fence(std::memory_order_seq_cst);
+                            if (producerWaiting_.load(std::memory_order_seq_cst)) {
+                                std::lock_guard<std::mutex> lock(waitMutex_);
+                                spaceCv_.notify_one();
+                            }
+                        }
+                        return true;
+                    }
+                } else if (dif < 0) {
+                    return false;
+                } else {
+                    pos = tail_.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        OverflowPolicy policy_;
+        size_t capacity_;
+        size_t mask_;
+        std::unique_ptr<Cell[]> cells_;
+
+        std::atomic<size_t> head_;
+        std::atomic<size_t> tail_;
+        std::atomic<bool> closed_;
+
+        std::atomic<bool> consumerWaiting_;
+        std::atomic<bool> producerWaiting_;
+        std::mutex waitMutex_;
+        std::condition_variable waitCv_;
+        /** signalled when a slot is freed while a producer waits under OverflowPolicy::Block */
+        std::condition_variable spaceCv_;
+
+        std::atomic<size_t> highWaterMark_;
+        std::atomic<size_t> pushed_;
+        std::atomic<size_t> dropped_;
+        std::atomic<size_t> rejected_;
+    };
+
+}
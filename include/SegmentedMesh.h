@@ -3,40 +3,126 @@
 #include "CameraSetup.h"
 #include "OkvisSLAMSystem.h"
 #include "Open3D/Integration/ScalableTSDFVolume.h"
+#include "IncrementalTSDFVolume.h"
+#include "MeshBlockCache.h"
 #include "Open3D/Visualization/Utility/DrawGeometry.h"
 #include "Open3D/IO/ClassIO/TriangleMeshIO.h"
 #include "Open3D/IO/ClassIO/ImageIO.h"
 #include "Open3D/geometry/PointCloud.h"
 #include "Open3D/geometry/TriangleMesh.h"
+#include "Open3D/geometry/RGBDImage.h"
 #include "Open3D/camera/PinholeCameraIntrinsic.h"
 #include "Types.h"
 #include "SaveFrame.h"
+#include "SPSCRingBuffer.h"
 #include <map>
+#include <memory>
+#include <vector>
 #include <set>
 #include <unordered_map>
 #include <mutex>
+#include <thread>
+#include <atomic>
 #include <chrono>
 #include <sys/stat.h>
 
 namespace ark {
 
-	std::shared_ptr<open3d::geometry::RGBDImage> generateRGBDImageFromCV(cv::Mat color_mat, cv::Mat depth_mat, double max_depth);
+	/**
+	 * Convert a color (CV_8UC3) and depth (CV_16UC1, mm) image into rgbd_image, reusing its buffers
+	 * when the size does not change. Rows are copied with memcpy and depth is converted to float meters,
+	 * zeroed at or beyond max_depth, in one pass; the result matches RGBDImage::CreateFromColorAndDepth.
+	 * @return false if the images do not have the expected types or sizes
+	 */
+	bool generateRGBDImageFromCV(const cv::Mat& color_mat, const cv::Mat& depth_mat, double max_depth,
+		open3d::geometry::RGBDImage& rgbd_image);
+
+	/** Allocating version: converts the top-left width x height pixels into a new RGBD image */
+	std::shared_ptr<open3d::geometry::RGBDImage> generateRGBDImageFromCV(cv::Mat color_mat, cv::Mat depth_mat, double max_depth, int width, int height);
+
+	/**
+	 * Immutable set of meshes published by SegmentedMesh for renderers: the mesh of each completed
+	 * block, then the active volume's, each in its block's local frame. Meshes that did not change
+	 * since the previous snapshot are the same objects, shared rather than copied.
+	 */
+	struct MeshSnapshot {
+		typedef std::shared_ptr<const MeshSnapshot> ConstPtr;
+		/** Increases by one with every snapshot published */
+		size_t version;
+		std::vector<std::shared_ptr<const open3d::geometry::TriangleMesh>> meshes;
+		/** local to world transform of each mesh */
+		std::vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d>> transforms;
+		/** whether each mesh belongs to the active map (the active volume always does) */
+		std::vector<int> enabled;
+
+		MeshSnapshot() : version(0) {}
+
+		size_t size() const {
+			return meshes.size();
+		}
+	};
 
 	class SegmentedMesh {
 
+	private:
+		/** A frame waiting for the integration worker */
+		struct IntegrationItem {
+			cv::Mat color;
+			cv::Mat depth;
+			/** camera pose, T_WC(3).inverse(); unaligned so the item can sit in a ring buffer slot */
+			Eigen::Matrix<double, 4, 4, Eigen::DontAlign> extrinsic;
+			int frame_id = -1;
+			std::chrono::steady_clock::time_point queued;
+		};
+
 	public:
+		/**
+		 * Attach to a SLAM system: frames are integrated by a worker thread owned by this object, fed by a
+		 * bounded queue, so TSDF integration and mesh extraction never run on the SLAM consumer thread.
+		 */
 		SegmentedMesh(std::string& recon_config, OkvisSLAMSystem& slam, CameraSetup* camera, bool blocking = true);
 		SegmentedMesh(std::string& recon_config);
 		SegmentedMesh();
 
-		//~SegmentedMesh();
+		/** Stops the integration worker; frames still queued are discarded */
+		~SegmentedMesh();
+
+		/** Work done by the integration worker */
+		struct IntegrationStats {
+			/** queue of frames waiting for integration; dropped counts frames evicted unintegrated */
+			SPSCRingBuffer<IntegrationItem>::Stats queue;
+			/** frames seen while integration was enabled, and those skipped by the stride */
+			size_t offered = 0;
+			size_t skipped = 0;
+			size_t integrated = 0;
+			/** integrated frames per second over the last full second */
+			double integrationRate = 0.0;
+			double meanIntegrationMs = 0.0;
+			double maxIntegrationMs = 0.0;
+			/** time from queuing a frame to the end of its integration, last frame */
+			double lastLatencyMs = 0.0;
+			/** current stride: one in every stride frames is queued */
+			int stride = 0;
+			/** mesh snapshots published */
+			size_t extractions = 0;
+		};
 
 	public:
 		struct MeshUnit {
 		public:
 			MeshUnit() {}
+			/** keyframe is pinned while the block is anchored to it */
+			~MeshUnit() {
+				if (keyframe) {
+					keyframe->unpin();
+				}
+			}
+			MeshUnit(const MeshUnit &) = delete;
+			MeshUnit &operator=(const MeshUnit &) = delete;
 
 		public:
+			/** not modified once the block is completed: mesh snapshots share it.
+			 *  nullptr while the block is spilled to the block cache */
 			std::shared_ptr<open3d::geometry::TriangleMesh> mesh;
 			MapKeyFrame::Ptr keyframe;
 			int mesh_map_index;
@@ -59,20 +145,30 @@ namespace ark {
 		void StartNewBlock();
 		void SetActiveMapIndex(int map_index);
 
-		std::tuple<std::shared_ptr<std::vector<std::vector<Eigen::Vector3d>>>, 
-			std::shared_ptr<std::vector<std::vector<Eigen::Vector3d>>>,
-			std::shared_ptr<std::vector<std::vector<Eigen::Vector3i>>>, 
-			std::shared_ptr<std::vector<Eigen::Matrix4d>>, std::shared_ptr<std::vector<int>>> GetOutputVectors();
+		/**
+		 * Newest published meshes. Safe to call from any thread, lock free and O(1); the snapshot is
+		 * immutable, keep it for as long as it is drawn rather than copying out of it.
+		 */
+		MeshSnapshot::ConstPtr GetMeshSnapshot() const {
+			return std::atomic_load(&mesh_snapshot_);
+		}
 
-		void AddRenderMutex(std::mutex* render_mutex, std::string render_mutex_key);
-		void RemoveRenderMutex(std::string render_mutex_key);
 		void WriteMeshes();
 
 		void SetIntegrationEnabled(bool enabled);
 
+		IntegrationStats GetIntegrationStats();
+
+		/** Completed block meshes in memory and in the disk cache */
+		MeshBlockCache::Stats GetBlockCacheStats();
+
 	public:
 		open3d::integration::TSDFVolumeColorType color_type_ = open3d::integration::TSDFVolumeColorType::RGB8;
+		/** initial stride of the integration worker; it adapts between the min and max strides,
+		 *  queuing fewer frames while the worker has a backlog and more while it is idle */
 		int integration_frame_stride_ = 3;
+		int integration_min_stride_ = 1;
+		int integration_max_stride_ = 15;
 		int extraction_frame_stride_ = 60;
 
 		int camera_height_, camera_width_;
@@ -85,6 +181,17 @@ namespace ark {
 		//setup sets up all callbacks
 		void Setup(OkvisSLAMSystem& slam, CameraSetup* camera);
 
+		/** Integration worker: integrates queued frames and extracts the mesh when requested */
+		void IntegrationLoop();
+
+		/** Producer side (frame handler): apply the adaptive stride and queue the frame */
+		void QueueFrame(MultiCameraFrame::Ptr frame);
+
+		/** Integrate with meshLock held */
+		void IntegrateLocked(const open3d::geometry::RGBDImage &image,
+			const open3d::camera::PinholeCameraIntrinsic &intrinsic,
+			const Eigen::Matrix4d &extrinsic);
+
 		Eigen::Vector3i LocateBlock(const Eigen::Vector3d &point) {
 			return Eigen::Vector3i((int)std::floor(point(0) / block_length_),
 				(int)std::floor(point(1) / block_length_),
@@ -92,17 +199,37 @@ namespace ark {
 		}
 
 		void readConfig(std::string& recon_config);
+
+		/** Anchor the active volume to kf, moving the pin from the previous keyframe */
+		void SetActiveVolumeKeyframe(MapKeyFrame::Ptr kf);
 		void UpdateActiveVolume(Eigen::Matrix4d extrinsic);
+
+		/** Append a completed block and keep the resident meshes within the budget */
+		void AddCompletedBlock(std::shared_ptr<open3d::geometry::TriangleMesh> mesh);
+
+		/** Load the spilled blocks next to block_loc and make them the most recently used */
+		void PageInBlocks(const Eigen::Vector3i &block_loc);
+
+		/** Spill least recently used blocks, except those next to the current block, until within the budget */
+		void EnforceMeshBudget();
+
+		/** Mesh of completed block i, read from the block cache without keeping it if it is spilled */
+		std::shared_ptr<open3d::geometry::TriangleMesh> BlockMesh(size_t i);
 		void CombineMeshes(std::shared_ptr<open3d::geometry::TriangleMesh>& output_mesh, std::shared_ptr<open3d::geometry::TriangleMesh> mesh_to_combine);
-		void UpdateOutputVectors();
+		/** Extract the active volume if it changed and publish a new mesh snapshot; meshLock held */
+		void PublishMeshSnapshot();
 
 
 		//stores triangles meshes of completed reconstructed blocks
 		std::vector<std::shared_ptr<MeshUnit>> completed_meshes;
 
 
-		//stores current scalable tsdf volume
-		open3d::integration::ScalableTSDFVolume * active_volume;
+		//stores current scalable tsdf volume; re-meshes only the units integrated since the last extraction.
+		//reset and reused for each new block
+		std::unique_ptr<IncrementalTSDFVolume> active_volume;
+
+		std::unique_ptr<MeshBlockCache> block_cache_;
+		/** pinned so the active block's anchor is not culled (see SetActiveVolumeKeyframe) */
 		MapKeyFrame::Ptr active_volume_keyframe;
 		int active_volume_map_index = 0;
 
@@ -124,18 +251,48 @@ namespace ark {
 		double voxel_length_;
 		bool blocking_;
 		double max_depth_;
-		bool do_integration_;
-
-		std::shared_ptr<std::vector<std::vector<Eigen::Vector3d>>> mesh_vertices;
-		std::shared_ptr<std::vector<std::vector<Eigen::Vector3d>>> mesh_colors;
-		std::shared_ptr<std::vector<std::vector<Eigen::Vector3i>>> mesh_triangles;
-		std::shared_ptr<std::vector<Eigen::Matrix4d>> mesh_transforms;
-		std::shared_ptr<std::vector<int>> mesh_enabled;
-
-		std::unordered_map<std::string, std::mutex *> render_mutexes;
+		/** completed block meshes above this size are spilled to mesh_cache_dir_, least recently
+		 *  used first, and loaded back when the camera returns next to their block; 0 for no limit.
+		 *  Covers the block meshes only: the active volume and its unit pool are bounded separately */
+		double mesh_memory_budget_mb_;
+		std::string mesh_cache_dir_;
+		/** TSDF volume units kept by the active volume when it is recycled for the next block, on top
+		 *  of mesh_memory_budget_mb_: each holds volume_unit_resolution^3 voxels of tsdf, weight and
+		 *  color (about 80 KB at the default resolution of 16), so the default of 512 is about 40 MB */
+		int volume_pool_units_;
+		std::atomic<bool> do_integration_;
+
+		/** conversion target of the integration worker, reused between frames */
+		open3d::geometry::RGBDImage rgbd_image_;
+
+		open3d::camera::PinholeCameraIntrinsic intrinsic_;
+		SPSCRingBuffer<IntegrationItem> integration_queue_{ 4, OverflowPolicy::DropOldest };
+		std::thread integration_thread_;
+		std::atomic<bool> stop_integration_{ false };
+		std::atomic<bool> integration_busy_{ false };
+		/** set by the frame handler every extraction_frame_stride_ frames, served by the worker */
+		std::atomic<bool> extraction_requested_{ false };
+		/** producer side of the adaptive stride */
+		std::atomic<int> integration_stride_{ 0 };
+		int frames_since_queued_ = 0;
+
+		std::mutex stats_mutex_;
+		IntegrationStats stats_;
+		std::chrono::steady_clock::time_point rate_window_start_;
+		size_t rate_window_count_ = 0;
+
+		/** Newest published meshes, swapped atomically (see GetMeshSnapshot) */
+		MeshSnapshot::ConstPtr mesh_snapshot_ = std::make_shared<const MeshSnapshot>();
+		/** active volume mesh of the last snapshot, reused while no volume unit is dirty and the
+		 *  volume's mesh generation is still active_mesh_generation_ (other extractions re-mesh
+		 *  the dirty units too); cleared whenever the active volume is replaced or reset */
+		std::shared_ptr<const open3d::geometry::TriangleMesh> active_mesh_;
+		size_t active_mesh_generation_ = 0;
 
 	protected:
 		std::mutex keyFrameLock;
+		/** guards the volumes, completed meshes and output vectors, shared by the SLAM handlers,
+		 *  the integration worker and callers of the public methods */
 		std::mutex meshLock;
 	};
 }
\ No newline at end of file
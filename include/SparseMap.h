@@ -4,6 +4,8 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <set>
+#include <algorithm>
 #include <opencv2/core/eigen.hpp>
 #include <DBoW2.h>
 #include <DLoopDetector.h>
@@ -11,9 +13,30 @@
 #include "CorrespondenceRansac.h"
 #include "Util.h"
 #include "PointCostSolver.h"
+#include "Instrumentation.h"
+#include "SparseMapIO.h"
+#include "KeyframePositionIndex.h"
 
 namespace ark{
 
+/** Budget and redundancy policy for SparseMap::cullKeyframes */
+struct KeyframeCullingOptions {
+  KeyframeCullingOptions(size_t maxKeyframes = 0, size_t maxBytes = 0, double hysteresis = 0.1,
+      int protectRecent = 20, double metersPerRadian = 1.0):
+    maxKeyframes(maxKeyframes), maxBytes(maxBytes), hysteresis(hysteresis),
+    protectRecent(protectRecent), metersPerRadian(metersPerRadian){}
+  /** keep at most this many keyframes in a map (0: no limit) */
+  size_t maxKeyframes;
+  /** keep the keyframe data (see MapKeyFrame::memoryUsage) of a map under this many bytes (0: no limit) */
+  size_t maxBytes;
+  /** once a budget is exceeded, cull down to (1 - hysteresis) of it, so culling runs in batches */
+  double hysteresis;
+  /** number of newest keyframes that are never culled */
+  int protectRecent;
+  /** metres of translation worth one radian of rotation when scoring redundancy */
+  double metersPerRadian;
+};
+
 /**
  * @brief This class 
  */
@@ -21,37 +44,67 @@ template<class TDescriptor, class F>
 class SparseMap {
  public:
 
+  typedef std::shared_ptr<SparseMap<TDescriptor, F>> Ptr;
+
   SparseMap():
-  currentKeyframeId(-1)
+  anchor_(std::make_shared<MapAnchor>()), currentKeyframeId(-1), numMergedKeyframes_(0), keyframeBytes_(0), appliedPosesVersion_(0),
+  snapshot_(std::make_shared<const TrajectorySnapshot>())
   {
 
   }
 
   void getFrames(std::vector<int>& frame_ids){
-    for (auto frame : frameMap_) {
-      frame_ids.push_back(frame.first);
+    TrajectorySnapshot::ConstPtr snapshot = getTrajectorySnapshot();
+    for(size_t i=0; i<snapshot->size(); i++){
+      frame_ids.push_back(snapshot->frameId(i));
     }
   }
 
+  /** Copy of the keyframe poses of the current snapshot (see getTrajectorySnapshot) */
   void getTrajectory(std::vector<Eigen::Matrix4d>& trajOut){
-    trajOut.resize(frameMap_.size());
-    size_t i=0;
-    for(std::map<int, MapKeyFrame::Ptr>::iterator frame = frameMap_.begin(); 
-        frame!=frameMap_.end(); frame++, i++){
-      trajOut[i] = frame->second->T_WS();
+    TrajectorySnapshot::ConstPtr snapshot = getTrajectorySnapshot();
+    trajOut.clear();
+    trajOut.reserve(snapshot->size());
+    for(size_t i=0; i<snapshot->size(); i++){
+      trajOut.push_back(snapshot->T_WS(i));
     }
   }
 
   void getMappedTrajectory(std::vector<int>& frameIdOut, std::vector<Eigen::Matrix4d>& trajOut){
-    for(std::map<int, MapKeyFrame::Ptr>::iterator frame = frameMap_.begin(); 
-        frame!=frameMap_.end(); frame++){
-      frameIdOut.push_back(frame->first);
-      trajOut.push_back(frame->second->T_WC(3));
+    TrajectorySnapshot::ConstPtr snapshot = getTrajectorySnapshot();
+    for(size_t i=0; i<snapshot->size(); i++){
+      frameIdOut.push_back(snapshot->frameId(i));
+      trajOut.push_back(snapshot->T_WC(i, 3));
     }
   }
 
+  /**
+   * Newest published keyframe poses. Safe to call from any thread, lock free and O(1);
+   * the snapshot is immutable, keep it rather than copying out of it.
+   */
+  TrajectorySnapshot::ConstPtr getTrajectorySnapshot() const {
+    return std::atomic_load(&snapshot_);
+  }
+
+  /** Number of keyframes, including those of merged maps */
   int getNumKeyframes() {
-    return frameMap_.size();
+    return frameMap_.size() + numMergedKeyframes_;
+  }
+
+  /**
+   * Call f on every keyframe: those of each merged map, then this map's, in frame id order.
+   * A keyframe added to this map may follow one of a merged map, so merged maps come first.
+   * Keyframes of merged maps are not copied into frameMap_.
+   */
+  template<class Function>
+  void forEachKeyframe(Function f){
+    for(size_t i=0; i<mergedMaps_.size(); i++){
+      mergedMaps_[i]->forEachKeyframe(f);
+    }
+    for(std::map<int, MapKeyFrame::Ptr>::iterator frame = frameMap_.begin();
+        frame!=frameMap_.end(); frame++){
+      f(frame->second);
+    }
   }
 
   MapKeyFrame::Ptr getCurrentKeyframe(){
@@ -61,21 +114,29 @@ class SparseMap {
     std::map<int,MapKeyFrame::Ptr>::iterator it = frameMap_.find(frameId);
     if(it!=frameMap_.end()){
       return it->second;
-    }else{
-      return MapKeyFrame::Ptr(nullptr);
     }
+    for(size_t i=0; i<mergedMaps_.size(); i++){
+      MapKeyFrame::Ptr kf = mergedMaps_[i]->getKeyframe(frameId);
+      if(kf != nullptr)
+        return kf;
+    }
+    return MapKeyFrame::Ptr(nullptr);
   }
   
+  /** Add a keyframe whose T_WS_ is expressed in this map's frame */
   bool addKeyframe(MapKeyFrame::Ptr kf, MapKeyFrame::Ptr &loop_kf, Eigen::Affine3d &transformEstimate) {
     //std::cout << "PROCESS KEYFRAME: " << kf->frameId_ << std::endl;
 
     frameMap_[kf->frameId_]=kf;
+    keyframeBytes_ += kf->memoryUsage();
+    kf->anchor_ = anchor_;
     kf->previousKeyframeId_ = currentKeyframeId;
     kf->previousKeyframe_ = getCurrentKeyframe();
 
     Eigen::Matrix4d T_K1K2; 
     if(kf->previousKeyframe_.get()!=nullptr){
-      T_K1K2 = kf->previousKeyframe_->T_WS_.inverse()*kf->T_WS_;
+      // the previous keyframe may belong to a merged map, compare in the world frame
+      T_K1K2 = kf->previousKeyframe_->T_WS_Odometry().inverse()*kf->T_WS_Odometry();
       graph_.AddConstraint(kf->previousKeyframeId_,kf->frameId_,T_K1K2);
       kf->setOptimizedTransform(kf->previousKeyframe_->T_WS()*T_K1K2);
     }else 
@@ -83,32 +144,300 @@ class SparseMap {
 
     currentKeyframeId = kf->frameId_;
     graph_.AddPose(kf->frameId_,kf->T_WS());
+    positionIndex_.add(kf->frameId_, kf->T_WS().block<3,1>(0,3), kf->previousKeyframeId_,
+        kf->previousKeyframe_ == nullptr ? 0.0 :
+        T_K1K2.block<3,1>(0,3).norm());
+    publishKeyframe(kf);
 
     if(loop_kf != nullptr) {
-      //TODO: Try refining pose estimate in image space, image space is really the proper way to do this
-      //TODO: Reduced pose graph and ISAM methods will allow a longer runtime
-      graph_.AddConstraint(kf->frameId_,loop_kf->frameId_, kf->T_SC_[2]*transformEstimate.inverse().matrix()*kf->T_SC_[2].inverse());
-      graph_.optimize();
-      for(std::map<int, MapKeyFrame::Ptr>::iterator frame=frameMap_.begin();
-        frame!=frameMap_.end(); frame++){
-        frame->second->setOptimizedTransform(graph_.getTransformById(frame->first));
-      }
-      return true;
+      return addLoopClosure(kf, loop_kf, transformEstimate);
     }
     return false;
   }
 
+  /**
+   * Add a verified loop closure between two keyframes that are already part of this map
+   * and queue a pose graph solve.
+   * @return false if either keyframe is not in this map
+   */
+  bool addLoopClosure(MapKeyFrame::Ptr kf, MapKeyFrame::Ptr loop_kf, const Eigen::Affine3d &transformEstimate) {
+    if(getKeyframe(kf->frameId_)==nullptr || getKeyframe(loop_kf->frameId_)==nullptr)
+      return false;
+    //TODO: Try refining pose estimate in image space, image space is really the proper way to do this
+    //TODO: Reduced pose graph and ISAM methods will allow a longer runtime
+    graph_.AddConstraint(kf->frameId_,loop_kf->frameId_, kf->T_SC_[2]*transformEstimate.inverse().matrix()*kf->T_SC_[2].inverse());
+    // solved on the optimizer thread, picked up later by applyOptimizedPoses()
+    graph_.requestOptimization();
+    return true;
+  }
+
+  /**
+   * Remove redundant keyframes while this map's own keyframes (merged maps are left alone)
+   * exceed the budget of options. A keyframe is redundant when its neighbors in the odometry
+   * chain are close to each other: it is scored by the distance between its previous and
+   * next keyframe (rotation weighted by metersPerRadian) and the lowest scores go first.
+   * Culled keyframes are marginalized out of the pose graph, their two odometry constraints
+   * replaced by one; keyframes with loop closures, pinned keyframes (see MapKeyFrame::pin),
+   * the first and the newest are kept. Must be called from the thread that adds keyframes.
+   * @param culled set to the frame ids of the removed keyframes
+   * @return number of keyframes removed
+   */
+  size_t cullKeyframes(const KeyframeCullingOptions& options, std::vector<int>& culled) {
+    culled.clear();
+    const bool overKeyframes = options.maxKeyframes > 0 && frameMap_.size() > options.maxKeyframes;
+    const bool overBytes = options.maxBytes > 0 && keyframeBytes_ > options.maxBytes;
+    if(!overKeyframes && !overBytes)
+      return 0;
+    const size_t targetKeyframes = options.maxKeyframes > 0 ?
+        (size_t)(options.maxKeyframes * (1.0 - options.hysteresis)) : frameMap_.size();
+    const size_t targetBytes = options.maxBytes > 0 ?
+        (size_t)(options.maxBytes * (1.0 - options.hysteresis)) : keyframeBytes_;
+
+    struct Candidate {
+      double score;
+      MapKeyFrame::Ptr kf;
+      MapKeyFrame::Ptr next;
+      bool operator<(const Candidate& other) const { return score < other.score; }
+    };
+    // keyframes the pose graph refused to marginalize (loop closures)
+    std::set<int> kept;
+    while(frameMap_.size() > targetKeyframes || keyframeBytes_ > targetBytes){
+      std::vector<Candidate> candidates;
+      const int numCandidates = (int)frameMap_.size() - std::max(options.protectRecent, 1);
+      std::map<int, MapKeyFrame::Ptr>::iterator frame = frameMap_.begin();
+      for(int i=0; i<numCandidates; i++, frame++){
+        MapKeyFrame::Ptr kf = frame->second;
+        std::map<int, MapKeyFrame::Ptr>::iterator next = std::next(frame);
+        if(kf->previousKeyframe_ == nullptr || next->second->previousKeyframe_ != kf || kept.count(kf->frameId_) ||
+            kf->isPinned())
+          continue;
+        const Eigen::Matrix4d T_PN = kf->previousKeyframe_->T_WS().inverse() * next->second->T_WS();
+        Candidate candidate;
+        candidate.score = T_PN.block<3,1>(0,3).norm() +
+            options.metersPerRadian * Eigen::AngleAxisd(Eigen::Matrix3d(T_PN.block<3,3>(0,0))).angle();
+        candidate.kf = kf;
+        candidate.next = next->second;
+        candidates.push_back(candidate);
+      }
+      std::sort(candidates.begin(), candidates.end());
+
+      // pick the most redundant keyframes, never two neighbors in one pass
+      size_t remainingKeyframes = frameMap_.size(), remainingBytes = keyframeBytes_;
+      std::set<int> chosen;
+      std::map<int, Candidate> chosenCandidates;
+      for(size_t i=0; i<candidates.size(); i++){
+        if(remainingKeyframes <= targetKeyframes && remainingBytes <= targetBytes)
+          break;
+        const Candidate& candidate = candidates[i];
+        if(chosen.count(candidate.kf->previousKeyframeId_) || chosen.count(candidate.next->frameId_))
+          continue;
+        chosen.insert(candidate.kf->frameId_);
+        chosenCandidates[candidate.kf->frameId_] = candidate;
+        remainingKeyframes--;
+        remainingBytes -= std::min(remainingBytes, candidate.kf->memoryUsage());
+      }
+      if(chosen.empty())
+        break;
+
+      std::vector<int> removed;
+      graph_.marginalizePoses(std::vector<int>(chosen.begin(), chosen.end()), removed);
+      for(std::set<int>::iterator id = chosen.begin(); id != chosen.end(); id++)
+        kept.insert(*id);
+      for(size_t i=0; i<removed.size(); i++){
+        const Candidate& candidate = chosenCandidates[removed[i]];
+        candidate.next->previousKeyframe_ = candidate.kf->previousKeyframe_;
+        candidate.next->previousKeyframeId_ = candidate.kf->previousKeyframeId_;
+        keyframeBytes_ -= std::min(keyframeBytes_, candidate.kf->memoryUsage());
+        frameMap_.erase(removed[i]);
+        positionIndex_.remove(removed[i]);
+        culled.push_back(removed[i]);
+      }
+    }
+    if(!culled.empty())
+      publishTrajectory();
+    return culled.size();
+  }
+
+  /** Approximate memory held by this map's own keyframes (bytes) */
+  size_t getKeyframeBytes() const {
+    return keyframeBytes_;
+  }
+
+  /**
+   * Absorb other (a map that is not merged into another one) in constant time: its frame is
+   * anchored to this map's with T_this_other, its keyframes stay where they are and are found
+   * through this map, and its pose graph is joined into this one before the next solve.
+   * Must be called from the thread that adds keyframes.
+   */
+  void merge(const Ptr& other, const Eigen::Matrix4d& T_this_other) {
+    other->anchor_->attach(anchor_, T_this_other);
+    mergedMaps_.push_back(other);
+    numMergedKeyframes_ += other->getNumKeyframes();
+    graph_.merge(&other->graph_, T_this_other);
+    publishTrajectory();
+  }
+
+  /**
+   * Apply the newest solution published by the pose graph optimizer, if it has not been applied yet.
+   * Keyframes added after that solve started are re-chained onto their optimized predecessor
+   * using their odometry. Must be called from the thread that adds keyframes.
+   * @return true if keyframe transforms were updated
+   */
+  bool applyOptimizedPoses() {
+    SimplePoseGraphSolver::OptimizedPoses::ConstPtr result = graph_.getOptimizedPoses();
+    if(result == nullptr || result->version == appliedPosesVersion_)
+      return false;
+    appliedPosesVersion_ = result->version;
+    Instrumentation::ScopedTimer timer(Instrumentation::Stage::MapUpdate);
+
+    // merged maps are visited first and each map in frame id order, so predecessors are updated first
+    forEachKeyframe([this, &result](const MapKeyFrame::Ptr& kf){
+      std::map<int, GraphPose>::const_iterator pose = result->poses.find(kf->frameId_);
+      if(pose != result->poses.end()){
+        kf->setOptimizedTransform(pose->second.T_WA());
+      }else if(kf->previousKeyframe_ != nullptr && getKeyframe(kf->previousKeyframeId_) == kf->previousKeyframe_){
+        kf->setOptimizedTransform(kf->previousKeyframe_->T_WS() *
+            kf->previousKeyframe_->T_WS_Odometry().inverse() * kf->T_WS_Odometry());
+      }
+      // keyframes of maps merged since the last solve are not indexed yet
+      if(!positionIndex_.setPosition(kf->frameId_, kf->T_WS().block<3,1>(0,3)))
+        indexKeyframe(kf);
+    });
+    publishTrajectory();
+    return true;
+  }
+
+  /**
+   * Index kf at its current (optimized) position. It is chained to its previous keyframe
+   * when that is in this map, and the odometry (T_WS_) between them gives the distance travelled.
+   */
+  void indexKeyframe(const MapKeyFrame::Ptr& kf) {
+    MapKeyFrame::Ptr prev = kf->previousKeyframe_;
+    const bool chained = prev != nullptr && getKeyframe(kf->previousKeyframeId_) == prev;
+    positionIndex_.add(kf->frameId_, kf->T_WS().block<3,1>(0,3), chained ? kf->previousKeyframeId_ : -1,
+        chained ? (kf->T_WS_Odometry().block<3,1>(0,3) - prev->T_WS_Odometry().block<3,1>(0,3)).norm() : 0.0);
+  }
+
+  /** Re-index all keyframes; call after keyframes were added in bulk (e.g. loaded) */
+  void rebuildPositionIndex() {
+    positionIndex_.clear();
+    forEachKeyframe([this](const MapKeyFrame::Ptr& kf){
+      indexKeyframe(kf);
+    });
+  }
+
+  /**
+   * Whether loop_kf is close enough to kf, given the odometry drift accumulated between
+   * them, to be worth verifying as a loop closure. Safe to call from the loop closure thread.
+   */
+  bool isPlausibleLoopClosure(MapKeyFrame::Ptr kf, MapKeyFrame::Ptr loop_kf) const {
+    return positionIndex_.isPlausible(kf->frameId_, loop_kf->frameId_);
+  }
+
+
+  /**
+   * Write the keyframes and pose graph of this map to a binary file (see SparseMapIO).
+   * Must not run concurrently with addKeyframe.
+   * @param bowFrameIds frame ids of this map's keyframes in BoW database order, kept for relocalization
+   */
+  bool save(const std::string& path, const std::vector<int>& bowFrameIds = std::vector<int>()) {
+    std::map<int, MapKeyFrame::Ptr> keyframes;
+    forEachKeyframe([&keyframes](const MapKeyFrame::Ptr& kf){
+      keyframes[kf->frameId_] = kf;
+    });
+    std::vector<PoseConstraint> constraints;
+    std::map<int, GraphPose> poses;
+    graph_.joinMerged();
+    graph_.constraintMutex.lock();
+    constraints = graph_.constraints_;
+    poses = graph_.poses_;
+    graph_.constraintMutex.unlock();
+    return SparseMapIO::write(path, keyframes, constraints, poses, currentKeyframeId, bowFrameIds);
+  }
+
+  /**
+   * Fill this (empty) map with a map written by save().
+   * @param bowFrameIds set to the frame ids stored for the BoW database
+   */
+  bool load(const std::string& path, std::vector<int>& bowFrameIds) {
+    SparseMapIO::Contents contents;
+    if(!SparseMapIO::read(path, contents))
+      return false;
+    frameMap_.swap(contents.keyframes);
+    keyframeBytes_ = 0;
+    for(std::map<int, MapKeyFrame::Ptr>::iterator frame=frameMap_.begin();
+      frame!=frameMap_.end(); frame++){
+      frame->second->anchor_ = anchor_;
+      keyframeBytes_ += frame->second->memoryUsage();
+    }
+    currentKeyframeId = contents.currentKeyframeId;
+    graph_.constraintMutex.lock();
+    graph_.constraints_.swap(contents.constraints);
+    graph_.poses_.swap(contents.poses);
+    graph_.constraintMutex.unlock();
+    bowFrameIds.swap(contents.bowFrameIds);
+    rebuildPositionIndex();
+    publishTrajectory();
+    return true;
+  }
 
+  /** keyframes added to this map (see forEachKeyframe for those of merged maps) */
   std::map<int, MapKeyFrame::Ptr> frameMap_;
+  /** frame of this map; attached to the absorbing map's anchor when this map is merged */
+  MapAnchor::Ptr anchor_;
 
   DBoW2::EntryId lastEntry_;
   int currentKeyframeId;
 
+  /** maps absorbed by merge(); declared before graph_ since graph_ reads their pose graphs */
+  std::vector<Ptr> mergedMaps_;
   SimplePoseGraphSolver graph_;
+  /** keyframe positions, for geometric pre-filtering of loop closure candidates */
+  KeyframePositionIndex positionIndex_;
   static constexpr double LOOP_CLOSURE_DISTANCE_THRESHOLD = 0.0;
 
 
 private: 
+  /**
+   * Publish the current keyframe poses as a new snapshot, copying the pose of every keyframe.
+   * Used when existing poses changed (optimization, culling, merge, load). Keyframes of merged
+   * maps come first, so that a keyframe added to this map is always the last one.
+   */
+  void publishTrajectory() {
+    TrajectorySnapshot::ConstPtr previous = getTrajectorySnapshot();
+    std::shared_ptr<TrajectorySnapshot> snapshot = std::make_shared<TrajectorySnapshot>();
+    snapshot->version = previous->version + 1;
+    forEachKeyframe([&snapshot](const MapKeyFrame::Ptr& kf){
+      snapshot->push_back(kf, kf->T_WS());
+    });
+    std::atomic_store(&snapshot_, TrajectorySnapshot::ConstPtr(snapshot));
+  }
+
+  /**
+   * Publish a snapshot with kf, just added, appended to the previous one; the other poses did not
+   * change, so their chunks are shared (see TrajectorySnapshot).
+   */
+  void publishKeyframe(const MapKeyFrame::Ptr& kf) {
+    TrajectorySnapshot::ConstPtr previous = getTrajectorySnapshot();
+    // only the newest keyframe of this map goes last in publishTrajectory's order
+    if(frameMap_.rbegin()->first != kf->frameId_ || previous->size() + 1 != (size_t)getNumKeyframes()){
+      publishTrajectory();
+      return;
+    }
+    std::shared_ptr<TrajectorySnapshot> snapshot = std::make_shared<TrajectorySnapshot>(*previous);
+    snapshot->version = previous->version + 1;
+    snapshot->push_back(kf, kf->T_WS());
+    std::atomic_store(&snapshot_, TrajectorySnapshot::ConstPtr(snapshot));
+  }
+
+  /** keyframes of merged maps at the time they were merged */
+  int numMergedKeyframes_;
+  /** memory held by the keyframes in frameMap_ */
+  size_t keyframeBytes_;
+  /** Version of the last optimizer solution applied to the keyframes */
+  size_t appliedPosesVersion_;
+  /** Newest published keyframe poses, swapped atomically (see getTrajectorySnapshot) */
+  TrajectorySnapshot::ConstPtr snapshot_;
 
  };//class SparseMap
 
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "Types.h"
+#include "PoseGraphSolver.h"
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace ark {
+    /**
+     * Versioned binary file format for the contents of a SparseMap: keyframes (poses, sensor
+     * transforms, keypoints, 3D keypoints, descriptors), the pose graph (poses and constraints)
+     * and the order in which keyframes were added to the loop closure BoW database.
+     *
+     * Layout (little endian, every section 8 byte aligned, matrices column major):
+     *     FileHeader | KeyframeRecord[numKeyframes] | ConstraintRecord[numConstraints]
+     *     | PoseRecord[numPoses] | int32 bowFrameIds[numBowEntries] | keyframe data blob
+     * Each KeyframeRecord points into the blob, where its T_SC matrices are followed, per image,
+     * by an ImageRecord, its KeypointRecords, 3D keypoints (4 doubles each) and descriptor rows.
+     *
+     * All records are fixed size, so the reader maps the file (mmap) and copies arrays straight
+     * out of it without parsing. Files are written to a temporary path and renamed into place.
+     */
+    class SparseMapIO {
+    public:
+        /** Bump when the layout changes; files with another version are rejected */
+        static const uint32_t kVersion = 1;
+
+        struct Contents {
+            std::map<int, MapKeyFrame::Ptr> keyframes;
+            std::vector<PoseConstraint> constraints;
+            std::map<int, GraphPose> poses;
+            int currentKeyframeId = -1;
+            /** frame ids of the keyframes in the BoW database, in insertion order */
+            std::vector<int> bowFrameIds;
+        };
+
+        /** @return false (with a message on std::cerr) if the file could not be written */
+        static bool write(const std::string & path, const std::map<int, MapKeyFrame::Ptr> & keyframes,
+            const std::vector<PoseConstraint> & constraints, const std::map<int, GraphPose> & poses,
+            int currentKeyframeId, const std::vector<int> & bowFrameIds);
+
+        /** Read a map written by write(). Keyframes are linked to their previous keyframe.
+         *  @return false (with a message on std::cerr) if the file is missing, truncated or of another version */
+        static bool read(const std::string & path, Contents & out);
+    };
+}
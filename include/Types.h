@@ -5,8 +5,16 @@
 
 #include <opencv2/opencv.hpp>
 #include <pcl/point_types.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
 #include "Hand.h"
 #include "FramePlane.h"
+#include "FramePool.h"
+#include "CompactKeyframeFeatures.h"
 
 namespace ark{
 
@@ -103,6 +111,55 @@ namespace ark{
 
     };//CameraCalibration
 
+    /**
+     * Frame of a map, expressed relative to the map that absorbed it (union-find over maps).
+     * Merging two maps links the root anchor of one to the other with the transform between
+     * them, so a merge is constant time; keyframes compose their anchor's transform on read.
+     * Links are immutable snapshots swapped atomically, so reads never block.
+     */
+    class MapAnchor {
+    public:
+        typedef std::shared_ptr<MapAnchor> Ptr;
+
+        /** Transform from this map's frame to the frame of the root map */
+        Eigen::Matrix4d T_WM() const {
+            std::shared_ptr<const Link> link = std::atomic_load(&link_);
+            if (link == nullptr)
+                return Eigen::Matrix4d::Identity();
+            const Eigen::Matrix4d composed = link->parent->T_WM() * Eigen::Matrix4d(link->T_PM);
+            // path compression: point straight at the root
+            if (!link->parent->isRoot())
+                std::atomic_store(&link_, std::shared_ptr<const Link>(new Link(link->parent->root(), composed)));
+            return composed;
+        }
+
+        Ptr root() const {
+            std::shared_ptr<const Link> link = std::atomic_load(&link_);
+            if (link == nullptr)
+                return nullptr;
+            Ptr parentRoot = link->parent->root();
+            return parentRoot != nullptr ? parentRoot : link->parent;
+        }
+
+        bool isRoot() const {
+            return std::atomic_load(&link_) == nullptr;
+        }
+
+        /** Make this (root) anchor a child of parent, T_PM taking this map's frame to parent's */
+        void attach(const Ptr& parent, const Eigen::Matrix4d& T_PM) {
+            std::atomic_store(&link_, std::shared_ptr<const Link>(new Link(parent, T_PM)));
+        }
+
+    private:
+        struct Link {
+            Link(const Ptr& parent, const Eigen::Matrix4d& T_PM): parent(parent), T_PM(T_PM) {}
+            Ptr parent;
+            /** unaligned so the link can be allocated without an aligned operator new */
+            Eigen::Matrix<double, 4, 4, Eigen::DontAlign> T_PM;
+        };
+        mutable std::shared_ptr<const Link> link_;
+    };
+
     /** A paired down MultiCameraFrame, only containing information necessary to be stored by the map */
     class MapKeyFrame{
     public:
@@ -112,65 +169,109 @@ namespace ark{
         int frameId_;
         /** Timestamp */
         double timestamp_;
-        /** Original world position of the Keyframe */
+        /** Original position of the Keyframe in the frame of the map it was created in (see anchor_) */
         Eigen::Matrix4d T_WS_; 
-        /** Optimized world position of the Keyframe */
+        /** Optimized position of the Keyframe in the frame of the map it was created in */
         Eigen::Matrix4d T_WS_Optimized_; 
         /** Bool checking whether the frame has been optimized */
         bool optimized_;
-        /** Keypoints and Descriptors extracted by the SLAM System 
-         ** A vector of keypoints is kept for each image
-         ** A cv::Mat of all descriptors is kept for each image */
-        std::vector<std::vector<cv::KeyPoint > > keypoints_; 
-        std::vector<cv::Mat> descriptors_;
-        /** Estimated 3D feature positions of all keypoints in each image */
-        std::vector<std::vector<Eigen::Vector4d, Eigen::aligned_allocator<Eigen::Vector4d>>> keypoints3dh_C; 
+        /** Keypoints and descriptors extracted by the SLAM System and the estimated 3D positions
+         ** of the keypoints, for each image, packed in a single allocation */
+        CompactKeyframeFeatures features_;
         /** ID of the previous keyframe (may be -1 if not available) */
         int previousKeyframeId_;
         /** Pointer to the keyframe (may be nullptr if not available) */
         MapKeyFrame::Ptr previousKeyframe_;
 
-        std::vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d>> T_SC_; 
+        std::vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d>> T_SC_;
+        /** Frame of the map the keyframe was created in; world poses are composed with it on read
+         ** (nullptr: T_WS_ is already in the world frame) */
+        MapAnchor::Ptr anchor_; 
+        /** Number of objects anchored to the keyframe (see pin()) */
+        std::atomic<int> pins_;
 
         MapKeyFrame():
-        frameId_(-1),optimized_(false),previousKeyframeId_(-1){
+        frameId_(-1),optimized_(false),previousKeyframeId_(-1),pins_(0){
+
+        }
+
+        /**
+         * Mark the keyframe as anchoring something placed relative to it (a mesh block, AR content),
+         * which keeps SparseMap::cullKeyframes from removing it so its pose keeps being optimized.
+         * Balance every pin() with an unpin() once the anchored object is gone.
+         */
+        void pin() {
+            pins_.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void unpin() {
+            pins_.fetch_sub(1, std::memory_order_relaxed);
+        }
 
+        bool isPinned() const {
+            return pins_.load(std::memory_order_relaxed) > 0;
         }
 
-        const std::vector<cv::KeyPoint>& keypoints(int cameraIdx){
-            return keypoints_[cameraIdx];
+        int numKeypoints(int cameraIdx) const {
+            return features_.numKeypoints(cameraIdx);
         }
 
-        const cv::Mat& descriptors(int cameraIdx){
-            return descriptors_[cameraIdx];
+        /** Keypoints of an image (decoded copy, see CompactKeyframeFeatures for the precision kept) */
+        std::vector<cv::KeyPoint> keypoints(int cameraIdx) const {
+            std::vector<cv::KeyPoint> out;
+            features_.keypoints(cameraIdx, out);
+            return out;
         }
 
-        const std::vector<Eigen::Vector4d, Eigen::aligned_allocator<Eigen::Vector4d>> & homogeneousKeypoints3d(int cameraIdx){ 
-            return keypoints3dh_C[cameraIdx];
+        /** Descriptors of an image, one row per keypoint (shares the keyframe's storage) */
+        cv::Mat descriptors(int cameraIdx) const {
+            return features_.descriptors(cameraIdx);
         }
 
-        void descriptorsAsVec(int cameraIdx, std::vector<cv::Mat>& out){
+        /** Estimated 3D position of a keypoint in the camera frame (w = 0 if unknown) */
+        Eigen::Vector4d homogeneousKeypoint3d(int cameraIdx, int i) const {
+            return features_.homogeneousPoint(cameraIdx, i);
+        }
+
+        /** Approximate heap memory held by the keyframe's features and descriptors (bytes) */
+        size_t memoryUsage() const {
+            return sizeof(MapKeyFrame) + T_SC_.size() * sizeof(Eigen::Matrix4d) + features_.memoryUsage();
+        }
+
+        void descriptorsAsVec(int cameraIdx, std::vector<cv::Mat>& out) const {
+            const cv::Mat descriptors = features_.descriptors(cameraIdx);
             out.clear();
-            out.reserve(descriptors_[cameraIdx].rows);
-            for(int i=0; i<descriptors_[cameraIdx].rows; i++){
-              out.emplace_back(descriptors_[cameraIdx].row(i));
+            out.reserve(descriptors.rows);
+            for(int i=0; i<descriptors.rows; i++){
+              out.emplace_back(descriptors.row(i));
             } 
         }
 
+        /** Set the optimized world pose */
         void setOptimizedTransform(const Eigen::Matrix4d& T_WS_in){
-
-            T_WS_Optimized_ = T_WS_in;
+            if(anchor_ != nullptr && !anchor_->isRoot())
+                T_WS_Optimized_ = anchor_->T_WM().inverse() * T_WS_in;
+            else
+                T_WS_Optimized_ = T_WS_in;
             optimized_ = true;
         }
 
-        Eigen::Matrix4d T_WS(){
-            if(optimized_){
-                return T_WS_Optimized_;
-            }else
-                return T_WS_;
+        /** World pose (optimized if available) */
+        Eigen::Matrix4d T_WS() const {
+            const Eigen::Matrix4d& T_MS = optimized_ ? T_WS_Optimized_ : T_WS_;
+            if(anchor_ != nullptr && !anchor_->isRoot())
+                return anchor_->T_WM() * T_MS;
+            return T_MS;
         }
 
-        Eigen::Matrix4d T_WC(int index)
+        /** Original (odometry) pose in the world frame */
+        Eigen::Matrix4d T_WS_Odometry() const {
+            if(anchor_ != nullptr && !anchor_->isRoot())
+                return anchor_->T_WM() * T_WS_;
+            return T_WS_;
+        }
+
+        Eigen::Matrix4d T_WC(int index) const
         {
             if(index>=0 && index<T_SC_.size()){
                 return T_WS()*T_SC_[index];
@@ -180,6 +281,104 @@ namespace ark{
 
     };
 
+    /**
+     * Immutable copy of the keyframe poses of a map, published by the SLAM thread whenever they
+     * change (new keyframe, optimization, culling, merge). Readers (GUI, reconstruction) get the
+     * newest one in O(1) without locking and may keep it as long as they like; unlike
+     * MapKeyFrame::T_WS(), it is never modified while being read.
+     *
+     * Keyframes are stored in chunks of kChunkSize. A snapshot built by copying the previous one
+     * shares its chunks, and push_back only copies the last, partially filled one, so publishing
+     * a new keyframe costs O(kChunkSize + size() / kChunkSize) instead of a copy of every pose.
+     */
+    struct TrajectorySnapshot {
+        typedef std::shared_ptr<const TrajectorySnapshot> ConstPtr;
+        static const size_t kChunkSize = 64;
+        /** Increases by one with every snapshot published by a map */
+        size_t version;
+
+        TrajectorySnapshot() : version(0), size_(0), lastChunkOwned_(false) {}
+
+        /** Shares the chunks of other; the first push_back copies its last chunk */
+        TrajectorySnapshot(const TrajectorySnapshot& other) :
+            version(other.version), chunks_(other.chunks_), size_(other.size_), lastChunkOwned_(false) {}
+
+        TrajectorySnapshot& operator=(const TrajectorySnapshot&) = delete;
+
+        size_t size() const {
+            return size_;
+        }
+
+        /** i-th keyframe in map order (its pose must be read from T_WS below) */
+        const MapKeyFrame::Ptr& keyframe(size_t i) const {
+            return chunks_[i / kChunkSize]->keyframes[i % kChunkSize];
+        }
+
+        int frameId(size_t i) const {
+            return chunks_[i / kChunkSize]->frameIds[i % kChunkSize];
+        }
+
+        /** World pose of the i-th keyframe (optimized if available) */
+        const Eigen::Matrix4d& T_WS(size_t i) const {
+            return chunks_[i / kChunkSize]->T_WS[i % kChunkSize];
+        }
+
+        /** Index of a keyframe in this snapshot, -1 if it is not part of it */
+        int find(int frameId) const {
+            // newest keyframes are looked up the most
+            for (size_t c = chunks_.size(); c-- > 0;) {
+                std::unordered_map<int, int>::const_iterator it = chunks_[c]->indexOf.find(frameId);
+                if (it != chunks_[c]->indexOf.end())
+                    return (int)(c * kChunkSize) + it->second;
+            }
+            return -1;
+        }
+
+        /** World pose of camera cameraIdx of the i-th keyframe */
+        Eigen::Matrix4d T_WC(size_t i, int cameraIdx) const {
+            const std::vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d>>& T_SC = keyframe(i)->T_SC_;
+            if(cameraIdx>=0 && cameraIdx<(int)T_SC.size())
+                return T_WS(i)*T_SC[cameraIdx];
+            return T_WS(i);
+        }
+
+        /** Append a keyframe at pose T_WS_in */
+        void push_back(const MapKeyFrame::Ptr& kf, const Eigen::Matrix4d& T_WS_in) {
+            if (size_ % kChunkSize == 0) {
+                chunks_.push_back(std::make_shared<Chunk>());
+                chunks_.back()->keyframes.reserve(kChunkSize);
+                chunks_.back()->frameIds.reserve(kChunkSize);
+                chunks_.back()->T_WS.reserve(kChunkSize);
+                lastChunkOwned_ = true;
+            } else if (!lastChunkOwned_) {
+                // the last chunk belongs to the snapshot this one was copied from
+                chunks_.back() = std::make_shared<Chunk>(*chunks_.back());
+                lastChunkOwned_ = true;
+            }
+            Chunk& chunk = *chunks_.back();
+            chunk.indexOf[kf->frameId_] = (int)chunk.frameIds.size();
+            chunk.keyframes.push_back(kf);
+            chunk.frameIds.push_back(kf->frameId_);
+            chunk.T_WS.push_back(T_WS_in);
+            size_++;
+        }
+
+    private:
+        struct Chunk {
+            std::vector<MapKeyFrame::Ptr> keyframes;
+            std::vector<int> frameIds;
+            std::vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d>> T_WS;
+            /** index within the chunk of each frame id */
+            std::unordered_map<int, int> indexOf;
+        };
+
+        /** full chunks and the last one are shared with later snapshots, never modified once published */
+        std::vector<std::shared_ptr<Chunk>> chunks_;
+        size_t size_;
+        /** whether the last chunk was created or copied by this snapshot, so push_back may modify it */
+        bool lastChunkOwned_;
+    };
+
     enum class FrameType { Depth, IR, RGB, XYZMap };
 
     /** A set of images taken on the same frame, possibly by multiple instruments/cameras */
@@ -198,11 +397,17 @@ namespace ark{
         /** Mat format */
         std::vector<int> image_mat_format_;
 
+        /** Builds a derived image (e.g. the XYZ map) the first time it is requested */
+        typedef std::function<void(cv::Mat&)> ImageGenerator;
+        /** Deprojects pixel positions to 3D points in the camera frame; pixels without depth map to (0,0,0) */
+        typedef std::function<void(const std::vector<cv::Point2f>&, std::vector<cv::Vec3f>&)> PixelDeprojector;
+
         bool getImageByType(FrameType type, cv::Mat& out, int num=0 ){
             int found =0;
             for(size_t i=0; i<images_.size(); i++){
                 if(image_types_[i] == type){
                     if(found==num){
+                        ensureImage(i);
                         out = images_[i];
                         return true;
                     }else{
@@ -215,12 +420,74 @@ namespace ark{
 
         bool getImage(cv::Mat& out, int num){
             if(num<images_.size()){
+                ensureImage(num);
                 out=images_[num];
                 return true;
             }
             return false;
         }
 
+        /** Leave images_[num] empty and build it with the generator when it is first requested
+         *  through getImage, getImageByType or ensureImage */
+        void setLazyImage(size_t num, ImageGenerator generator){
+            if(images_.size() <= num) images_.resize(num+1);
+            images_[num].release();
+            std::lock_guard<std::mutex> lock(lazy_->mutex);
+            lazy_->generators[num] = generator;
+        }
+
+        /** Build images_[num] now if it is generated lazily (safe to call from several threads) */
+        void ensureImage(size_t num){
+            std::lock_guard<std::mutex> lock(lazy_->mutex);
+            std::map<size_t, ImageGenerator>::iterator it = lazy_->generators.find(num);
+            if(it == lazy_->generators.end()) return;
+            ImageGenerator generator = it->second;
+            lazy_->generators.erase(it);
+            images_[num].allocator = FramePool::instance().allocator();
+            generator(images_[num]);
+        }
+
+        /** Make images_[num] a pooled image of the given size and type and return it. The current
+         *  image is kept if it already matches and nothing else refers to it; otherwise a buffer is
+         *  taken from the FramePool, leaving any consumer of the old image untouched. */
+        cv::Mat& allocateImage(size_t num, cv::Size size, int type){
+            if(images_.size() <= num) images_.resize(num+1);
+            cv::Mat& img = images_[num];
+            if(img.empty() || img.size() != size || img.type() != type || !img.u || img.u->refcount > 1
+                    || img.allocator != FramePool::instance().allocator()){
+                img = FramePool::instance().acquire(size, type);
+            }
+            return img;
+        }
+
+        void setDeprojector(PixelDeprojector deprojector){
+            std::lock_guard<std::mutex> lock(lazy_->mutex);
+            lazy_->deprojector = deprojector;
+        }
+
+        /** 3D position (camera frame, meters) of each pixel, looked up at the nearest integer pixel.
+         *  Uses the camera's deprojector when set, so the full XYZ map (images_[2]) is not built. */
+        void deprojectPixels(const std::vector<cv::Point2f>& pixels, std::vector<cv::Vec3f>& out){
+            PixelDeprojector deprojector;
+            {
+                std::lock_guard<std::mutex> lock(lazy_->mutex);
+                deprojector = lazy_->deprojector;
+            }
+            if(deprojector){
+                deprojector(pixels, out);
+                return;
+            }
+
+            out.assign(pixels.size(), cv::Vec3f(0,0,0));
+            cv::Mat xyz;
+            if(!getImage(xyz, 2) || xyz.empty()) return;
+            for(size_t i=0; i<pixels.size(); i++){
+                const int r = (int)std::round(pixels[i].y), c = (int)std::round(pixels[i].x);
+                if(r >= 0 && r < xyz.rows && c >= 0 && c < xyz.cols)
+                    out[i] = xyz.at<cv::Vec3f>(r, c);
+            }
+        }
+
         /** Transformation matrix of the sensor body in keyframe coordinates 
          ** This may be Identity if transforms not available
          ** This should be set to world coordinates if keyframeId is -1 */
@@ -240,6 +507,16 @@ namespace ark{
         std::vector<Hand::Ptr> hands_;
         std::vector<FramePlane::Ptr> planes_;
 
+    private:
+        struct LazyImages {
+            std::mutex mutex;
+            std::map<size_t, ImageGenerator> generators;
+            PixelDeprojector deprojector;
+        };
+        std::shared_ptr<LazyImages> lazy_ = std::make_shared<LazyImages>();
+
+    public:
+
 
         /** Construct an empty MultiCameraFrame with the given ID (default -1) */
         explicit MultiCameraFrame(int frame_id = -1)
@@ -267,6 +544,36 @@ namespace ark{
             keyframeId_ = keyframe_id;
         }
 
+        /** Copies share the images built so far but not the lazy state: each copy gets its own
+         *  generators, so building an image in one copy does not leave it empty in the other */
+        MultiCameraFrame(const MultiCameraFrame& other){
+            *this = other;
+        }
+
+        MultiCameraFrame& operator=(const MultiCameraFrame& other){
+            if(this == &other) return *this;
+            std::shared_ptr<LazyImages> lazy = std::make_shared<LazyImages>();
+            {
+                // images_ and the generators change together in ensureImage
+                std::lock_guard<std::mutex> lock(other.lazy_->mutex);
+                lazy->generators = other.lazy_->generators;
+                lazy->deprojector = other.lazy_->deprojector;
+                images_ = other.images_;
+            }
+            lazy_ = lazy;
+            timestamp_ = other.timestamp_;
+            image_types_ = other.image_types_;
+            image_mat_format_ = other.image_mat_format_;
+            T_KS_ = other.T_KS_;
+            T_SC_ = other.T_SC_;
+            frameId_ = other.frameId_;
+            keyframeId_ = other.keyframeId_;
+            keyframe_ = other.keyframe_;
+            hands_ = other.hands_;
+            planes_ = other.planes_;
+            return *this;
+        }
+
         //make threadsafe setting of transform
 
         //make threadsafe
@@ -365,12 +365,6 @@ public:
 
 	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
-	std::shared_ptr<std::vector<std::vector<Eigen::Vector3d>>> mesh_vertices;
-    std::shared_ptr<std::vector<std::vector<Eigen::Vector3d>>> mesh_colors;
-    std::shared_ptr<std::vector<std::vector<Eigen::Vector3i>>> mesh_triangles;
-    std::shared_ptr<std::vector<Eigen::Matrix4d>> mesh_transforms;
-    std::shared_ptr<std::vector<int>> mesh_enabled;
-
 	// //threadsafe?
 	// int current_active_map;
 	// int archive_index;
@@ -378,27 +372,14 @@ public:
 
 	ark::SegmentedMesh * mesh_;
 
+	/** Draws the newest mesh snapshot published by mesh_ */
 	void draw_obj();
 
 	Mesh(std::string name, ark::SegmentedMesh * mesh)
 	: Object(name) {
 		mesh_ = mesh;
-
-		mesh_->AddRenderMutex(&meshLock_, "mesh visualizer");
-
-		auto mesh_output = mesh_->GetOutputVectors();
-
-		mesh_vertices = std::get<0>(mesh_output);
-		mesh_colors = std::get<1>(mesh_output);
-		mesh_triangles = std::get<2>(mesh_output);
-		mesh_transforms = std::get<3>(mesh_output);
-		mesh_enabled = std::get<4>(mesh_output);
 	}
 
-
-protected:
-	std::mutex meshLock_;
-
 };
 
 